@@ -0,0 +1,143 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Many asynchronous operations in flight from one thread, built against each
+ * of the libraries as for bz2-stream-check.  It starts a compression of each
+ * sample file, over and over, all at once; waits for their eventfds with
+ * epoll; and checks every output against the reference .bz2.  Then it does
+ * the same with decompressions of the references.  Exits non-zero on any
+ * failure. */
+
+#define _GNU_SOURCE
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+#define IN_FLIGHT 100
+
+struct Op {
+  BZASYNC *h;
+  int ofd;       /* memfd holding the output */
+  int sample;    /* Which sample file, 1-3 */
+  int finished;
+};
+
+static char *ReadFd(int fd, size_t *len) {
+  char *data = NULL;
+  char buf[65536];
+  ssize_t n;
+  *len = 0;
+  while ((n = pread(fd, buf, sizeof(buf), *len)) > 0) {
+    data = realloc(data, *len + n);
+    if (data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    memcpy(data + *len, buf, n);
+    *len += n;
+  }
+  return data;
+}
+
+static char *ReadFile(const char *filename, size_t *len) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    exit(1);
+  }
+  char *data = ReadFd(fd, len);
+  close(fd);
+  return data;
+}
+
+/* Start IN_FLIGHT operations at once, wait for them all through epoll, and
+ * check their outputs against the files named by expect_fmt */
+static void RunAll(int compress, const char *in_fmt, const char *expect_fmt) {
+  static struct Op ops[IN_FLIGHT];
+  char filename[64];
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (int ii = 0; ii < IN_FLIGHT; ii++) {
+    struct Op *op = &ops[ii];
+    op->sample = 1 + ii % 3;
+    op->finished = 0;
+    snprintf(filename, sizeof(filename), in_fmt, op->sample);
+    int ifd = open(filename, O_RDONLY);
+    op->ofd = memfd_create("bz2-async-check", MFD_CLOEXEC);
+    if (ifd < 0 || op->ofd < 0) {
+      perror(filename);
+      exit(1);
+    }
+    op->h = compress ? BZ2_bzCompressStreamAsync(ifd, op->ofd, op->sample, 0, 0)
+                     : BZ2_bzDecompressStreamAsync(ifd, op->ofd, 0, 0);
+    close(ifd);
+    if (op->h == NULL) {
+      fprintf(stderr, "operation %d failed to start, errno=%d\n", ii, errno);
+      exit(1);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = ii;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, BZ2_bzAsyncFd(op->h), &ev) < 0) {
+      perror("epoll_ctl");
+      exit(1);
+    }
+  }
+
+  int remaining = IN_FLIGHT;
+  while (remaining > 0) {
+    struct epoll_event events[16];
+    int n = epoll_wait(epfd, events, 16, 60 * 1000);
+    if (n == 0) {
+      fprintf(stderr, "%d operations still running after a minute\n", remaining);
+      exit(1);
+    }
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+    for (int ii = 0; ii < n; ii++) {
+      struct Op *op = &ops[events[ii].data.u32];
+      if (op->finished) continue;
+      epoll_ctl(epfd, EPOLL_CTL_DEL, BZ2_bzAsyncFd(op->h), NULL);
+      int rc = BZ2_bzAsyncFinish(op->h);
+      op->finished = 1;
+      remaining--;
+
+      size_t len, expect_len;
+      char *data = ReadFd(op->ofd, &len);
+      snprintf(filename, sizeof(filename), expect_fmt, op->sample);
+      char *expect = ReadFile(filename, &expect_len);
+      if (rc != BZ_OK || len != expect_len || memcmp(data, expect, len) != 0) {
+        fprintf(stderr, "operation %u returned %d with %zu bytes, expected %zu like %s\n",
+                events[ii].data.u32, rc, len, expect_len, filename);
+        exit(1);
+      }
+      free(expect);
+      free(data);
+      close(op->ofd);
+    }
+  }
+  close(epfd);
+}
+
+int main(void) {
+  RunAll(1, "sample%d.ref", "sample%d.bz2");
+  RunAll(0, "sample%d.bz2", "sample%d.ref");
+  printf("%d compressions and %d decompressions in flight at once\n", IN_FLIGHT, IN_FLIGHT);
+  return 0;
+}
@@ -0,0 +1,174 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Asynchronous versions of the stream entrypoints.  Operations are queued and
+ * run by a small set of worker threads, each of which just makes the normal
+ * blocking call; so when linked into a stub library, the work is done by a
+ * remoted driver, and when linked into libbz2.a it is done locally.
+ * Completion is signalled on a per-operation eventfd, so a caller can keep
+ * many operations in flight from a single poll()/epoll() loop.
+ *
+ * The number of worker threads is BZ2_ASYNC_THREADS, defaulting to the
+ * number of CPUs (which is also the default driver pool size). */
+
+#define _GNU_SOURCE
+#include <sys/eventfd.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+struct bzAsync {
+  int efd;  /* eventfd, written when the operation completes */
+  int compress;
+  int ifd;
+  int ofd;
+  int blockSize100k;
+  int verbosity;
+  int workFactor;
+  int small;
+  int result;
+  struct bzAsync *next;  /* Queue link */
+};
+
+static pthread_mutex_t g_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_cv = PTHREAD_COND_INITIALIZER;
+static struct bzAsync *g_head = NULL;
+static struct bzAsync *g_tail = NULL;
+static int g_threads = 0;  /* Worker threads started */
+static int g_idle = 0;     /* Worker threads waiting for work */
+static int g_wakeups = 0;  /* Signals sent to idle workers that haven't woken yet */
+
+static int MaxThreads(void) {
+  const char *str = getenv("BZ2_ASYNC_THREADS");
+  int max = str ? atoi(str) : 0;
+  if (max <= 0) max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  return (max > 0) ? max : 1;
+}
+
+static void *AsyncWorker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&g_mu);
+  while (1) {
+    while (g_head == NULL) {
+      g_idle++;
+      pthread_cond_wait(&g_cv, &g_mu);
+      g_idle--;
+      if (g_wakeups > 0) g_wakeups--;
+    }
+    struct bzAsync *h = g_head;
+    g_head = h->next;
+    if (g_head == NULL) g_tail = NULL;
+    pthread_mutex_unlock(&g_mu);
+
+    if (h->compress) {
+      h->result = BZ2_bzCompressStream(h->ifd, h->ofd, h->blockSize100k, h->verbosity, h->workFactor);
+    } else {
+      h->result = BZ2_bzDecompressStream(h->ifd, h->ofd, h->verbosity, h->small);
+    }
+    close(h->ifd);
+    close(h->ofd);
+    /* The write hands h back to the caller, who may free it (and close the
+       eventfd) straight away, so nothing here may touch h after it. */
+    int efd = h->efd;
+    uint64_t one = 1;
+    while (write(efd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+
+    pthread_mutex_lock(&g_mu);
+  }
+  return NULL;
+}
+
+static BZASYNC *AsyncSubmit(struct bzAsync *h, int ifd, int ofd) {
+  h->efd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  h->ifd = fcntl(ifd, F_DUPFD_CLOEXEC, 0);
+  h->ofd = fcntl(ofd, F_DUPFD_CLOEXEC, 0);
+  if (h->efd < 0 || h->ifd < 0 || h->ofd < 0) {
+    int err = errno;
+    if (h->efd >= 0) close(h->efd);
+    if (h->ifd >= 0) close(h->ifd);
+    if (h->ofd >= 0) close(h->ofd);
+    free(h);
+    errno = err;
+    return NULL;
+  }
+
+  pthread_mutex_lock(&g_mu);
+  /* An idle worker already signalled is spoken for until it wakes, so
+     start another thread unless one is idle and unclaimed. */
+  if (g_idle > g_wakeups) {
+    g_wakeups++;
+    pthread_cond_signal(&g_cv);
+  } else if (g_threads < MaxThreads()) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, AsyncWorker, NULL);
+    if (rc == 0) {
+      pthread_detach(thread);
+      g_threads++;
+    } else if (g_threads == 0) {
+      /* Nothing would ever run it */
+      pthread_mutex_unlock(&g_mu);
+      close(h->efd);
+      close(h->ifd);
+      close(h->ofd);
+      free(h);
+      errno = rc;
+      return NULL;
+    }
+  }
+  if (g_tail) {
+    g_tail->next = h;
+  } else {
+    g_head = h;
+  }
+  g_tail = h;
+  pthread_mutex_unlock(&g_mu);
+  return h;
+}
+
+BZASYNC* BZ_API(BZ2_bzCompressStreamAsync)(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
+  struct bzAsync *h = calloc(1, sizeof(*h));
+  if (h == NULL) return NULL;
+  h->compress = 1;
+  h->blockSize100k = blockSize100k;
+  h->verbosity = verbosity;
+  h->workFactor = workFactor;
+  return AsyncSubmit(h, ifd, ofd);
+}
+
+BZASYNC* BZ_API(BZ2_bzDecompressStreamAsync)(int ifd, int ofd, int verbosity, int small) {
+  struct bzAsync *h = calloc(1, sizeof(*h));
+  if (h == NULL) return NULL;
+  h->verbosity = verbosity;
+  h->small = small;
+  return AsyncSubmit(h, ifd, ofd);
+}
+
+int BZ_API(BZ2_bzAsyncFd)(BZASYNC *h) {
+  return h ? h->efd : -1;
+}
+
+int BZ_API(BZ2_bzAsyncFinish)(BZASYNC *h) {
+  if (h == NULL) return BZ_PARAM_ERROR;
+  /* Only the worker's write makes the eventfd count nonzero, and it is the
+     worker's last use of h. */
+  uint64_t count = 0;
+  while (read(h->efd, &count, sizeof(count)) != sizeof(count) || count == 0) {
+    if (errno != EAGAIN && errno != EINTR) return BZ_IO_ERROR;
+    struct pollfd pfd = {h->efd, POLLIN, 0};
+    poll(&pfd, 1, -1);
+  }
+  int result = h->result;
+  close(h->efd);
+  free(h);
+  return result;
+}
@@ -0,0 +1,302 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Latency benchmark for the stream entrypoints, built against each of the
+ * libraries (bz2-bench for libbz2.a, bz2-bench-<transport> for the stubs).
+ * For each payload size it makes a number of calls and reports latency
+ * percentiles, overall and for each phase of the remoted call (as recorded
+ * by rpc-util).  It also reports, per call, the socket syscalls and bytes on
+ * the wire (by interposing on the socket calls, so the transport libraries'
+ * traffic is included) and the read/write-class syscalls and bytes from
+ * /proc/self/io (which also covers any drivers reaped during the call).
+ *
+ * Drivers are pooled by default, so fork/exec/bootstrap/teardown only show
+ * up for the first call; run with RPC_POOL_SIZE=0 to start a fresh driver for
+ * every call, or RPC_ZYGOTE=1 to compare zygote spawning. */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rpc-util.h"
+#include "bzlib.h"
+
+/* The phase accounting lives in rpc-util, which only the stub libraries
+ * contain; against plain libbz2.a these stay NULL. */
+#pragma weak RpcStatsEnable
+#pragma weak RpcStatsGet
+#pragma weak RpcPhaseName
+
+#define PHASE_TOTAL RPC_PHASE_COUNT  /* Extra slot for the whole call */
+
+/* Socket syscalls made by the whole process */
+static uint64_t g_sock_calls = 0;
+static uint64_t g_sock_bytes = 0;
+
+static ssize_t CountSocket(ssize_t rc) {
+  __atomic_add_fetch(&g_sock_calls, 1, __ATOMIC_RELAXED);
+  if (rc > 0) __atomic_add_fetch(&g_sock_bytes, rc, __ATOMIC_RELAXED);
+  return rc;
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+  return CountSocket(syscall(SYS_sendmsg, fd, msg, flags));
+}
+
+ssize_t recvmsg(int fd, struct msghdr *msg, int flags) {
+  return CountSocket(syscall(SYS_recvmsg, fd, msg, flags));
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+               const struct sockaddr *addr, socklen_t addrlen) {
+  return CountSocket(syscall(SYS_sendto, fd, buf, len, flags, addr, addrlen));
+}
+
+ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+                 struct sockaddr *addr, socklen_t *addrlen) {
+  return CountSocket(syscall(SYS_recvfrom, fd, buf, len, flags, addr, addrlen));
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+  return sendto(fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+  return recvfrom(fd, buf, len, flags, NULL, NULL);
+}
+
+struct IoCounts {
+  uint64_t rchar;
+  uint64_t wchar;
+  uint64_t syscr;
+  uint64_t syscw;
+};
+
+static int ReadIoCounts(struct IoCounts *io) {
+  char buf[512];
+  memset(io, 0, sizeof(*io));
+  int fd = open("/proc/self/io", O_RDONLY|O_CLOEXEC);
+  if (fd < 0) return -1;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return -1;
+  buf[len] = '\0';
+  char *line;
+  for (line = buf; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+    unsigned long long value;
+    if (sscanf(line, "rchar: %llu", &value) == 1) io->rchar = value;
+    else if (sscanf(line, "wchar: %llu", &value) == 1) io->wchar = value;
+    else if (sscanf(line, "syscr: %llu", &value) == 1) io->syscr = value;
+    else if (sscanf(line, "syscw: %llu", &value) == 1) io->syscw = value;
+  }
+  return 0;
+}
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void GetTotals(struct RpcPhaseTotal totals[RPC_PHASE_COUNT]) {
+  if (RpcStatsGet) {
+    RpcStatsGet(totals);
+  } else {
+    memset(totals, 0, RPC_PHASE_COUNT * sizeof(struct RpcPhaseTotal));
+  }
+}
+
+/* Sizes like 4096, 64K, 16M or 2G */
+static uint64_t ParseSize(const char *str) {
+  char *end;
+  uint64_t size = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': size <<= 10; break;
+  case 'm': case 'M': size <<= 20; break;
+  case 'g': case 'G': size <<= 30; break;
+  case '\0': break;
+  default:
+    fprintf(stderr, "bad size '%s'\n", str);
+    exit(1);
+  }
+  return size;
+}
+
+/* A memfd holding size bytes of word-like text, which compresses at roughly
+ * the rate of real text; generated a chunk at a time so that multi-GB
+ * payloads are possible. */
+static int MakePayload(uint64_t size) {
+  static const char *words[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ",
+    "block ", "sorting ", "compressor ", "stream ", "remote ", "driver ", "\n", "bzip2 "
+  };
+  int fd = memfd_create("bz2-bench", MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("memfd_create");
+    exit(1);
+  }
+  char *chunk = malloc(1 << 20);
+  uint32_t seed = 12345;
+  uint64_t done = 0;
+  while (done < size) {
+    size_t len = 0;
+    while (len < (1 << 20) - 16) {
+      seed = seed * 1103515245 + 12345;
+      const char *word = words[(seed >> 16) & 15];
+      size_t wlen = strlen(word);
+      memcpy(chunk + len, word, wlen);
+      len += wlen;
+    }
+    if (len > size - done) len = size - done;
+    if (write(fd, chunk, len) != (ssize_t)len) {
+      perror("write payload");
+      exit(1);
+    }
+    done += len;
+  }
+  free(chunk);
+  return fd;
+}
+
+static int CompareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double Percentile(const uint64_t *sorted, int count, int pct) {
+  return sorted[((count - 1) * pct) / 100] / 1000.0;
+}
+
+static void Report(const char *name, uint64_t *samples, int count) {
+  if (count == 0) return;
+  qsort(samples, count, sizeof(uint64_t), CompareU64);
+  printf("  %-10s %6d %11.1f %11.1f %11.1f %11.1f\n", name, count,
+         Percentile(samples, count, 50), Percentile(samples, count, 90),
+         Percentile(samples, count, 99), samples[count - 1] / 1000.0);
+}
+
+static void Usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n calls] [-b blockSize100k] [-d] [size ...]\n", prog);
+  fprintf(stderr, "  -n calls   calls per payload size (default 20)\n");
+  fprintf(stderr, "  -b size    blockSize100k for compression (default 9)\n");
+  fprintf(stderr, "  -d         time BZ2_bzDecompressStream instead of BZ2_bzCompressStream\n");
+  fprintf(stderr, "  size ...   payload sizes, with optional K/M/G suffix (default 0 1K 64K 1M 16M)\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *default_sizes[] = {"0", "1K", "64K", "1M", "16M"};
+  int calls = 20;
+  int blockSize100k = 9;
+  int decompress = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:b:d")) != -1) {
+    switch (opt) {
+    case 'n': calls = atoi(optarg); break;
+    case 'b': blockSize100k = atoi(optarg); break;
+    case 'd': decompress = 1; break;
+    default: Usage(argv[0]);
+    }
+  }
+  if (calls <= 0 || blockSize100k < 1 || blockSize100k > 9) Usage(argv[0]);
+  const char **sizes = (const char **)&argv[optind];
+  int nsizes = argc - optind;
+  if (nsizes == 0) {
+    sizes = default_sizes;
+    nsizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+  }
+
+  if (RpcStatsEnable) RpcStatsEnable();
+  int null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+  uint64_t *samples[PHASE_TOTAL + 1];
+  int counts[PHASE_TOTAL + 1];
+  int ii, jj;
+  for (ii = 0; ii <= PHASE_TOTAL; ii++) samples[ii] = calloc(calls, sizeof(uint64_t));
+
+  /* Reading /proc/self/io costs a read itself; measure that to remove it */
+  struct IoCounts io0, io1;
+  ReadIoCounts(&io0);
+  ReadIoCounts(&io1);
+  uint64_t io_syscr = io1.syscr - io0.syscr;
+  uint64_t io_rchar = io1.rchar - io0.rchar;
+
+  printf("# %s: %d calls of %s per size, library %s\n", argv[0], calls,
+         decompress ? "BZ2_bzDecompressStream" : "BZ2_bzCompressStream", BZ2_bzlibVersion());
+  int ss;
+  for (ss = 0; ss < nsizes; ss++) {
+    uint64_t size = ParseSize(sizes[ss]);
+    int ifd = MakePayload(size);
+    if (decompress) {
+      /* Time decompressing the compressed payload */
+      int zfd = memfd_create("bz2-bench-z", MFD_CLOEXEC);
+      lseek(ifd, 0, SEEK_SET);
+      int rc = BZ2_bzCompressStream(ifd, zfd, blockSize100k, 0, 0);
+      if (rc != BZ_OK) {
+        fprintf(stderr, "failed to compress payload, rc=%d\n", rc);
+        exit(1);
+      }
+      close(ifd);
+      ifd = zfd;
+    }
+    memset(counts, 0, sizeof(counts));
+    uint64_t syscr = 0, syscw = 0, rchar = 0, wchar = 0;
+    uint64_t sock_calls = 0, sock_bytes = 0;
+
+    for (jj = 0; jj < calls; jj++) {
+      struct RpcPhaseTotal before[RPC_PHASE_COUNT], after[RPC_PHASE_COUNT];
+      lseek(ifd, 0, SEEK_SET);
+      GetTotals(before);
+      ReadIoCounts(&io0);
+      uint64_t sock_calls0 = __atomic_load_n(&g_sock_calls, __ATOMIC_RELAXED);
+      uint64_t sock_bytes0 = __atomic_load_n(&g_sock_bytes, __ATOMIC_RELAXED);
+      uint64_t start = NowNs();
+      int rc = decompress ? BZ2_bzDecompressStream(ifd, null_fd, 0, 0)
+                          : BZ2_bzCompressStream(ifd, null_fd, blockSize100k, 0, 0);
+      uint64_t elapsed = NowNs() - start;
+      sock_calls += __atomic_load_n(&g_sock_calls, __ATOMIC_RELAXED) - sock_calls0;
+      sock_bytes += __atomic_load_n(&g_sock_bytes, __ATOMIC_RELAXED) - sock_bytes0;
+      ReadIoCounts(&io1);
+      GetTotals(after);
+      if (rc != BZ_OK) {
+        fprintf(stderr, "call failed, rc=%d\n", rc);
+        exit(1);
+      }
+      samples[PHASE_TOTAL][counts[PHASE_TOTAL]++] = elapsed;
+      for (ii = 0; ii < RPC_PHASE_COUNT; ii++) {
+        if (after[ii].count > before[ii].count) {
+          samples[ii][counts[ii]++] = after[ii].ns - before[ii].ns;
+        }
+      }
+      syscr += io1.syscr - io0.syscr - io_syscr;
+      syscw += io1.syscw - io0.syscw;
+      rchar += io1.rchar - io0.rchar - io_rchar;
+      wchar += io1.wchar - io0.wchar;
+    }
+    close(ifd);
+
+    printf("size=%llu calls=%d\n", (unsigned long long)size, calls);
+    printf("  %-10s %6s %11s %11s %11s %11s\n", "phase", "calls", "p50 us", "p90 us", "p99 us", "max us");
+    for (ii = 0; ii < RPC_PHASE_COUNT; ii++) {
+      Report(RpcPhaseName ? RpcPhaseName(ii) : "?", samples[ii], counts[ii]);
+    }
+    Report("total", samples[PHASE_TOTAL], counts[PHASE_TOTAL]);
+    printf("  per call: %.1f socket syscalls, %.0f bytes on the wire\n",
+           (double)sock_calls / calls, (double)sock_bytes / calls);
+    printf("  per call: %.1f read + %.1f write syscalls, %.0f bytes read + %.0f written\n",
+           (double)syscr / calls, (double)syscw / calls, (double)rchar / calls, (double)wchar / calls);
+  }
+  return 0;
+}
@@ -23,6 +23,7 @@
 #include "rpc-util.h"
 
 #include <memory>
+#include <vector>
 #include <capnp/ez-rpc.h>
 
 #include "bzlib.capnp.h"
@@ -32,14 +33,16 @@
 int _rpc_verbose = 4;
 int _rpc_indent = 4;
 
-namespace bz2 {
+namespace bz2capnp {
 
 class Bz2Impl final : public Bz2::Server {
 public:
   Bz2Impl(int sock_fd) : Bz2::Server(), sock_fd_(sock_fd) {}
   kj::Promise<void> compressStream(CompressStreamContext context) override {
     static const char *method = "BZ2_bzCompressStream";
+    RpcTraceBegin(method);
     auto msg = context.getParams();
+    uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
     int ifd_nonce = msg.getIfd();
     int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
     int ofd_nonce = msg.getOfd();
@@ -50,15 +53,50 @@ public:
     api_("=> %s(%d, %d, %d, %d, %d)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
     int retval = BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
     api_("=> %s(%d, %d, %d, %d, %d) return %d", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+    RpcTraceResult(retval);
+    RpcTraceEnd(request_bytes, 0);
     auto rsp = context.getResults();
     rsp.setResult(retval);
     close(ifd);
     close(ofd);
     return kj::READY_NOW;
   }
+  kj::Promise<void> compressStreams(CompressStreamsContext context) override {
+    static const char *method = "BZ2_bzCompressStreams";
+    RpcTraceBegin(method);
+    auto msg = context.getParams();
+    uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
+    int nstreams = msg.getCount();
+    auto rsp = context.getResults();
+    if (nstreams <= 0) {
+      rsp.setResult(nstreams < 0 ? BZ_PARAM_ERROR : BZ_OK);
+      RpcTraceResult(nstreams < 0 ? BZ_PARAM_ERROR : BZ_OK);
+      RpcTraceEnd(request_bytes, 0);
+      return kj::READY_NOW;
+    }
+    std::vector<int> fds(2 * nstreams);
+    GetTransferredFds(sock_fd_, msg.getNonce(), fds.size(), fds.data());
+    std::vector<int> results(nstreams);
+    int blockSize100k = msg.getBlockSize100k();
+    int verbosity = msg.getVerbosity();
+    int workFactor = msg.getWorkFactor();
+    api_("=> %s(%d, ..., %d, %d, %d)", method, nstreams, blockSize100k, verbosity, workFactor);
+    int retval = BZ2_bzCompressStreams(nstreams, &fds[0], &fds[nstreams], results.data(),
+                                       blockSize100k, verbosity, workFactor);
+    api_("=> %s(%d, ..., %d, %d, %d) return %d", method, nstreams, blockSize100k, verbosity, workFactor, retval);
+    RpcTraceResult(retval);
+    RpcTraceEnd(request_bytes, 0);
+    auto values = rsp.initResults(nstreams);
+    for (int ii = 0; ii < nstreams; ii++) values.set(ii, results[ii]);
+    rsp.setResult(retval);
+    for (int fd : fds) close(fd);
+    return kj::READY_NOW;
+  }
   kj::Promise<void> decompressStream(DecompressStreamContext context) override {
     static const char *method = "BZ2_bzDecompressStream";
+    RpcTraceBegin(method);
     auto msg = context.getParams();
+    uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
     int ifd_nonce = msg.getIfd();
     int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
     int ofd_nonce = msg.getOfd();
@@ -68,6 +106,8 @@ public:
     api_("=> %s(%d, %d, %d, %d)", method, ifd, ofd, verbosity, small);
     int retval = BZ2_bzDecompressStream(ifd, ofd, verbosity, small);
     api_("=> %s(%d, %d, %d, %d) return %d", method, ifd, ofd, verbosity, small, retval);
+    RpcTraceResult(retval);
+    RpcTraceEnd(request_bytes, 0);
     auto rsp = context.getResults();
     rsp.setResult(retval);
     close(ifd);
@@ -76,7 +116,9 @@ public:
   }
   kj::Promise<void> testStream(TestStreamContext context) override {
     static const char *method = "BZ2_bzTestStream";
+    RpcTraceBegin(method);
     auto msg = context.getParams();
+    uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
     int ifd_nonce = msg.getIfd();
     int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
     int verbosity = msg.getVerbosity();
@@ -84,6 +126,8 @@ public:
     api_("=> %s(%d, %d, %d)", method, ifd, verbosity, small);
     int retval = BZ2_bzTestStream(ifd, verbosity, small);
     api_("=> %s(%d, %d, %d) return %d", method, ifd, verbosity, small, retval);
+    RpcTraceResult(retval);
+    RpcTraceEnd(request_bytes, 0);
     auto rsp = context.getResults();
     rsp.setResult(retval);
     close(ifd);
@@ -103,22 +147,21 @@ private:
   int sock_fd_;
 };
 
-}  // namespace bz2
+}  // namespace bz2capnp
 
 int main(int argc, char *argv[]) {
   signal(SIGSEGV, CrashHandler);
   signal(SIGABRT, CrashHandler);
-  const char *fd_str = getenv("API_NONCE_FD");
-  assert (fd_str != NULL);
-  int sock_fd = atoi(fd_str);
+  int sock_fd = DriverSocket();
   api_("'%s' program start, parent socket %d", argv[0], sock_fd);
+  ExitOnHangup(sock_fd);
 
   // Build the address of a UNIX socket for the service.
   const char *sockfile = tempnam(nullptr, "gsck");
   std::string server_address = "unix:";
   server_address += sockfile;
   log_("listening on %s", server_address.c_str());
-  capnp::EzRpcServer server(kj::heap<bz2::Bz2Impl>(sock_fd), server_address);
+  capnp::EzRpcServer server(kj::heap<bz2capnp::Bz2Impl>(sock_fd), server_address);
 
   // Tell the parent the address we're listening on.
   uint32_t len = server_address.size() + 1;
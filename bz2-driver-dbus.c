@@ -5,11 +5,13 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -26,100 +28,321 @@
 int _rpc_verbose = 4;
 int _rpc_indent = 4;
 
-static int pollfd_size = 0;  /* Num allocated */
-static int pollfd_count = 0;  /* Num used */
-static struct pollfd *pollfds = NULL;
-static DBusWatch **watches = NULL;
+/* Main loop state.  Watches are registered with epoll per file descriptor
+ * (libdbus may put separate read and write watches on the same fd), timeouts
+ * live on a hashed timer wheel, and only connections that have been flagged
+ * as ready get dispatched. */
+static int epoll_fd = -1;
+
+typedef struct ConnEntry {
+  DBusConnection *conn;  /* NULL once dropped */
+  int queued;  /* on the ready list */
+  struct ConnEntry *next_ready;
+} ConnEntry;
+
+typedef struct WatchEntry {
+  DBusWatch *watch;
+  ConnEntry *owner;  /* NULL for the server's own watches */
+  int fd;
+  struct WatchEntry *next;  /* other watches on the same fd */
+} WatchEntry;
+
+typedef struct FdSlot {
+  WatchEntry *watches;
+  uint32_t events;  /* as registered with epoll; 0 => not registered */
+} FdSlot;
+
+static int fd_slot_size = 0;  /* Num allocated, indexed by fd */
+static FdSlot *fd_slots = NULL;
+
+static int conn_count = 0;  /* Num live connections */
+static ConnEntry *ready_head = NULL;
+static ConnEntry *ready_tail = NULL;
+
+#define TIMER_TICK_MS 10
+#define TIMER_SLOTS 256
+
+typedef struct TimeoutEntry {
+  DBusTimeout *timeout;
+  uint64_t expiry;  /* in ticks */
+  struct TimeoutEntry *next;
+  struct TimeoutEntry **pprev;  /* NULL when not armed */
+} TimeoutEntry;
+
+static TimeoutEntry *timer_wheel[TIMER_SLOTS];
+static uint64_t timer_tick = 0;  /* Last tick processed */
+static int timer_count = 0;  /* Num armed */
+
+static uint64_t MessageSize(DBusMessage *msg) {
+  char *data = NULL;
+  int len = 0;
+  if (msg == NULL || !dbus_message_marshal(msg, &data, &len)) return 0;
+  dbus_free(data);
+  return len;
+}
 
-static int conn_size = 0;  /* Num allocated */
-static int conn_count = 0;  /* Num used */
-static DBusConnection **conns = NULL;
+static uint64_t NowMicros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-static int FindWatch(DBusWatch *watch) {
-  int ii;
-  for (ii = 0; ii < pollfd_count; ii++) {
-    if (watches[ii] == watch) return ii;
+static uint64_t NowTicks(void) {
+  return NowMicros() / (1000 * TIMER_TICK_MS);
+}
+
+static void QueueConnection(ConnEntry *entry) {
+  if (entry == NULL || entry->queued) return;
+  entry->queued = 1;
+  entry->next_ready = NULL;
+  if (ready_tail) {
+    ready_tail->next_ready = entry;
+  } else {
+    ready_head = entry;
   }
-  return -1;
+  ready_tail = entry;
 }
 
-static int FlagsToEvents(int flags) {
-  int events = POLLERR | POLLHUP;
-  if (flags & DBUS_WATCH_READABLE) events |= POLLIN;
-  if (flags & DBUS_WATCH_WRITABLE) events |= POLLOUT;
+static ConnEntry *NextReadyConnection(void) {
+  ConnEntry *entry = ready_head;
+  if (entry) {
+    ready_head = entry->next_ready;
+    if (ready_head == NULL) ready_tail = NULL;
+    entry->queued = 0;
+  }
+  return entry;
+}
+
+static uint32_t FlagsToEvents(int flags) {
+  uint32_t events = 0;
+  if (flags & DBUS_WATCH_READABLE) events |= EPOLLIN;
+  if (flags & DBUS_WATCH_WRITABLE) events |= EPOLLOUT;
   return events;
 }
 
+/* Bring the epoll registration for an fd into line with its enabled watches */
+static void UpdateFd(int fd) {
+  FdSlot *slot = &(fd_slots[fd]);
+  uint32_t events = 0;
+  WatchEntry *entry;
+  for (entry = slot->watches; entry; entry = entry->next) {
+    if (dbus_watch_get_enabled(entry->watch)) {
+      events |= FlagsToEvents(dbus_watch_get_flags(entry->watch));
+    }
+  }
+  if (events == slot->events) return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  int op = (events == 0) ? EPOLL_CTL_DEL : (slot->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(epoll_fd, op, fd, &ev) < 0 && op != EPOLL_CTL_DEL) {
+    warning_("epoll_ctl(%d, fd=%d) failed, errno=%d (%s)", op, fd, errno, strerror(errno));
+    return;
+  }
+  verbose_("Update fd=%d events=%s%s", fd,
+           (events & EPOLLIN) ? "R" : "",
+           (events & EPOLLOUT) ? "W" : "");
+  slot->events = events;
+}
+
 static dbus_bool_t AddWatch(DBusWatch *watch, void *data) {
-  if (pollfd_count == pollfd_size) {
-    pollfd_size *= 2;
-    struct pollfd *p = realloc(pollfds, pollfd_size*sizeof(struct pollfd));
-    DBusWatch **w = realloc(watches, pollfd_size*sizeof(DBusWatch*));
-    if (p == NULL || w == NULL) {
+  int fd = dbus_watch_get_unix_fd(watch);
+  if (fd >= fd_slot_size) {
+    int size = fd_slot_size;
+    while (size <= fd) size *= 2;
+    FdSlot *s = realloc(fd_slots, size*sizeof(FdSlot));
+    if (s == NULL) {
       error_("!!! failed to alloc extra space for watches");
-      free(p);
-      free(w);
       return FALSE;
     }
-    watches = w;
-    pollfds = p;
-  }
-  watches[pollfd_count] = watch;
-  struct pollfd *pdf = &(pollfds[pollfd_count]);
-  pollfd_count++;
-  pdf->fd = dbus_watch_get_unix_fd(watch);
-  pdf->events = (dbus_watch_get_enabled(watch) ?
-                 FlagsToEvents(dbus_watch_get_flags(watch)): 0);
-  verbose_("Add watch on watch=%p fd=%d events=%s%s", watch, pdf->fd,
-           (pdf->events & POLLIN) ? "R" : "",
-           (pdf->events & POLLOUT) ? "W" : "");
+    memset(&(s[fd_slot_size]), 0, (size - fd_slot_size)*sizeof(FdSlot));
+    fd_slots = s;
+    fd_slot_size = size;
+  }
+  WatchEntry *entry = malloc(sizeof(WatchEntry));
+  if (entry == NULL) {
+    error_("!!! failed to alloc watch entry");
+    return FALSE;
+  }
+  entry->watch = watch;
+  entry->owner = (ConnEntry *)data;
+  entry->fd = fd;
+  entry->next = fd_slots[fd].watches;
+  fd_slots[fd].watches = entry;
+  dbus_watch_set_data(watch, entry, NULL);
+  verbose_("Add watch on watch=%p fd=%d", watch, fd);
+  UpdateFd(fd);
   return TRUE;
 }
 
 static void RemoveWatch(DBusWatch *watch, void *data) {
   verbose_("Remove watch on watch=%p", watch);
-  int ii = FindWatch(watch);
-  if (ii == -1) {
+  WatchEntry *entry = dbus_watch_get_data(watch);
+  if (entry == NULL) {
     warning_("Failed to find removed watch %p", watch);
     return;
   }
-  /* Move up */
-  pollfd_count--;
-  if (ii < pollfd_count) {
-    memmove(&(pollfds[ii]), &(pollfds[ii+1]),
-            (pollfd_count - ii)*sizeof(struct pollfd));
-    memmove(&(watches[ii]), &(watches[ii+1]),
-            (pollfd_count - ii)*sizeof(DBusWatch *));
-  }
+  WatchEntry **pp = &(fd_slots[entry->fd].watches);
+  while (*pp != entry) pp = &((*pp)->next);
+  *pp = entry->next;
+  dbus_watch_set_data(watch, NULL, NULL);
+  UpdateFd(entry->fd);
+  free(entry);
 }
 
 static void ToggleWatch(DBusWatch *watch, void *data) {
-  int ii = FindWatch(watch);
-  struct pollfd *pdf = &(pollfds[ii]);
-  if (ii == -1) {
+  WatchEntry *entry = dbus_watch_get_data(watch);
+  if (entry == NULL) {
     warning_("Failed to find toggled watch %p", watch);
     return;
   }
-  pdf->events = (dbus_watch_get_enabled(watch) ?
-                 FlagsToEvents(dbus_watch_get_flags(watch)): 0);
-  verbose_("Toggle watch on watch=%p fd=%d events=%s%s", watch, pdf->fd,
-           (pdf->events & POLLIN) ? "R" : "",
-           (pdf->events & POLLOUT) ? "W" : "");
+  verbose_("Toggle watch on watch=%p fd=%d", watch, entry->fd);
+  UpdateFd(entry->fd);
 }
 
+/* Handle readiness on an fd for each of its watches that wants it.  Handling
+ * one watch can remove others, so work from a snapshot and re-check that each
+ * watch is still present before handling it. */
+#define MAX_WATCHES_PER_FD 8
+static void HandleFd(int fd, uint32_t revents) {
+  unsigned int ready = 0;
+  if (revents & EPOLLIN)  ready |= DBUS_WATCH_READABLE;
+  if (revents & EPOLLOUT) ready |= DBUS_WATCH_WRITABLE;
+  if (revents & EPOLLERR) ready |= DBUS_WATCH_ERROR;
+  if (revents & EPOLLHUP) ready |= DBUS_WATCH_HANGUP;
+  verbose_("fd=%d event=%s%s%s%s", fd,
+           (ready & DBUS_WATCH_READABLE) ? "R" : "",
+           (ready & DBUS_WATCH_WRITABLE) ? "W" : "",
+           (ready & DBUS_WATCH_ERROR) ? "!" : "",
+           (ready & DBUS_WATCH_HANGUP) ? "0" : "");
+
+  DBusWatch *snapshot[MAX_WATCHES_PER_FD];
+  int count = 0;
+  WatchEntry *entry;
+  for (entry = fd_slots[fd].watches; entry && count < MAX_WATCHES_PER_FD; entry = entry->next) {
+    snapshot[count++] = entry->watch;
+  }
+  int ii;
+  for (ii = 0; ii < count; ii++) {
+    for (entry = fd_slots[fd].watches; entry; entry = entry->next) {
+      if (entry->watch == snapshot[ii]) break;
+    }
+    if (entry == NULL || !dbus_watch_get_enabled(entry->watch)) continue;
+    unsigned int flags = ready & (dbus_watch_get_flags(entry->watch) | DBUS_WATCH_ERROR | DBUS_WATCH_HANGUP);
+    if (flags == 0) continue;
+    ConnEntry *owner = entry->owner;
+    if (!dbus_watch_handle(entry->watch, flags)) {
+      warning_("dbus_watch_handle failed");
+    }
+    QueueConnection(owner);
+  }
+}
+
+static void ArmTimeout(TimeoutEntry *entry, uint64_t now) {
+  int interval = dbus_timeout_get_interval(entry->timeout);
+  uint64_t ticks = (interval + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+  entry->expiry = now + (ticks ? ticks : 1);
+  TimeoutEntry **head = &(timer_wheel[entry->expiry % TIMER_SLOTS]);
+  entry->next = *head;
+  if (*head) (*head)->pprev = &(entry->next);
+  entry->pprev = head;
+  *head = entry;
+  timer_count++;
+}
+
+static void DisarmTimeout(TimeoutEntry *entry) {
+  if (entry->pprev == NULL) return;
+  *(entry->pprev) = entry->next;
+  if (entry->next) entry->next->pprev = entry->pprev;
+  entry->next = NULL;
+  entry->pprev = NULL;
+  timer_count--;
+}
 
-/* @@@ do something with timeouts */
 static dbus_bool_t AddTimeout(DBusTimeout *timeout, void *data) {
-  warning_("Add timeout");
+  TimeoutEntry *entry = calloc(1, sizeof(TimeoutEntry));
+  if (entry == NULL) {
+    error_("!!! failed to alloc timeout entry");
+    return FALSE;
+  }
+  entry->timeout = timeout;
+  dbus_timeout_set_data(timeout, entry, NULL);
+  verbose_("Add timeout=%p interval=%dms enabled=%d", timeout,
+           dbus_timeout_get_interval(timeout), dbus_timeout_get_enabled(timeout));
+  if (dbus_timeout_get_enabled(timeout)) ArmTimeout(entry, NowTicks());
   return TRUE;
 }
 
 static void RemoveTimeout(DBusTimeout *timeout, void *data) {
-  warning_("Remove timeout");
+  verbose_("Remove timeout=%p", timeout);
+  TimeoutEntry *entry = dbus_timeout_get_data(timeout);
+  if (entry == NULL) {
+    warning_("Failed to find removed timeout %p", timeout);
+    return;
+  }
+  DisarmTimeout(entry);
+  dbus_timeout_set_data(timeout, NULL, NULL);
+  free(entry);
 }
 
 static void ToggleTimeout(DBusTimeout *timeout, void *data) {
-  warning_("Toggle timeout");
+  TimeoutEntry *entry = dbus_timeout_get_data(timeout);
+  if (entry == NULL) {
+    warning_("Failed to find toggled timeout %p", timeout);
+    return;
+  }
+  verbose_("Toggle timeout=%p enabled=%d", timeout, dbus_timeout_get_enabled(timeout));
+  DisarmTimeout(entry);
+  if (dbus_timeout_get_enabled(timeout)) ArmTimeout(entry, NowTicks());
+}
+
+/* Fire everything that has expired by now.  D-Bus timeouts repeat until they
+ * are disabled or removed, so each one is re-armed before its handler runs
+ * (which may then remove it). */
+static void RunTimers(void) {
+  uint64_t now = NowTicks();
+  if (timer_count == 0) {
+    timer_tick = now;
+    return;
+  }
+  TimeoutEntry *expired = NULL;
+  int steps = 0;
+  while (timer_tick < now && steps < TIMER_SLOTS) {
+    timer_tick++;
+    steps++;
+    TimeoutEntry *entry = timer_wheel[timer_tick % TIMER_SLOTS];
+    while (entry) {
+      TimeoutEntry *next = entry->next;
+      if (entry->expiry <= now) {
+        DisarmTimeout(entry);
+        entry->next = expired;
+        if (expired) expired->pprev = &(entry->next);
+        entry->pprev = &expired;
+        expired = entry;
+        timer_count++;  /* still counted while on the expired list */
+      }
+      entry = next;
+    }
+  }
+  timer_tick = now;
+  while (expired) {
+    TimeoutEntry *entry = expired;
+    DisarmTimeout(entry);
+    ArmTimeout(entry, now);
+    verbose_("Timeout fired timeout=%p", entry->timeout);
+    dbus_timeout_handle(entry->timeout);
+  }
+}
+
+/* Milliseconds until the next occupied wheel slot comes round, or -1 */
+static int NextTimerWait(void) {
+  if (timer_count == 0) return -1;
+  int ii;
+  for (ii = 1; ii <= TIMER_SLOTS; ii++) {
+    if (timer_wheel[(timer_tick + ii) % TIMER_SLOTS]) break;
+  }
+  return ii * TIMER_TICK_MS;
 }
 
 static void DispatchStatus(DBusConnection *conn, DBusDispatchStatus status, void *data) {
@@ -128,8 +351,152 @@ static void DispatchStatus(DBusConnection *conn, DBusDispatchStatus status, void
            status == DBUS_DISPATCH_COMPLETE ? "COMPLETE" :
            status == DBUS_DISPATCH_NEED_MEMORY ? "NEED_MEMORY" : "<unknown>");
   if (status == DBUS_DISPATCH_DATA_REMAINS) {
-    /* Can't do dbus_connection_dispatch(conn); here! */
-    /* Flag that this conn needs dispatch in main loop */
+    /* Can't do dbus_connection_dispatch(conn); here, so flag that this conn
+     * needs dispatch in the main loop. */
+    QueueConnection((ConnEntry *)data);
+  }
+}
+
+/* Proxied calls run on worker threads, so that a long call on one connection
+ * does not hold up the others.  A job holds references to its connection and
+ * request message; the worker builds the reply, and the main loop sends it
+ * once the job is back on the done list (signalled through an eventfd).
+ *
+ * The number of worker threads is BZ2_DBUS_WORKERS, defaulting to the
+ * number of CPUs. */
+typedef DBusMessage *(*ProxiedCall)(DBusMessage *msg);
+
+typedef struct Job {
+  const char *method;
+  ProxiedCall call;
+  DBusConnection *conn;
+  DBusMessage *msg;
+  DBusMessage *rsp;  /* NULL if the call failed */
+  uint64_t queued_at;  /* microseconds */
+  uint64_t queued_us;
+  uint64_t run_us;
+  struct Job *next;
+} Job;
+
+static pthread_mutex_t job_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cv = PTHREAD_COND_INITIALIZER;
+static Job *job_head = NULL;  /* Waiting for a worker */
+static Job *job_tail = NULL;
+static Job *done_head = NULL;  /* Waiting for the main loop */
+static Job *done_tail = NULL;
+static int job_threads = 0;  /* Worker threads started */
+static int job_idle = 0;     /* Worker threads waiting for work */
+static int done_fd = -1;     /* eventfd, written when a job is done */
+
+/* Cumulative queueing times, only touched by the main loop thread */
+static unsigned long job_calls = 0;
+static uint64_t job_queued_us = 0;
+static uint64_t job_max_queued_us = 0;
+
+static int MaxWorkers(void) {
+  const char *str = getenv("BZ2_DBUS_WORKERS");
+  int max = str ? atoi(str) : 0;
+  if (max <= 0) max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  return (max > 0) ? max : 1;
+}
+
+static void *JobWorker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&job_mu);
+  while (1) {
+    while (job_head == NULL) {
+      job_idle++;
+      pthread_cond_wait(&job_cv, &job_mu);
+      job_idle--;
+    }
+    Job *job = job_head;
+    job_head = job->next;
+    if (job_head == NULL) job_tail = NULL;
+    pthread_mutex_unlock(&job_mu);
+
+    uint64_t start = NowMicros();
+    job->queued_us = start - job->queued_at;
+    RpcTraceBegin(job->method);
+    job->rsp = job->call(job->msg);
+    if (RpcTracing()) RpcTraceEnd(MessageSize(job->msg), MessageSize(job->rsp));
+    job->run_us = NowMicros() - start;
+
+    pthread_mutex_lock(&job_mu);
+    job->next = NULL;
+    if (done_tail) {
+      done_tail->next = job;
+    } else {
+      done_head = job;
+    }
+    done_tail = job;
+    pthread_mutex_unlock(&job_mu);
+    uint64_t one = 1;
+    while (write(done_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+    pthread_mutex_lock(&job_mu);
+  }
+  return NULL;
+}
+
+static void SubmitJob(const char *method, ProxiedCall call, DBusConnection *conn, DBusMessage *msg) {
+  Job *job = calloc(1, sizeof(Job));
+  assert (job != NULL);
+  job->method = method;
+  job->call = call;
+  job->conn = dbus_connection_ref(conn);
+  job->msg = dbus_message_ref(msg);
+  job->queued_at = NowMicros();
+
+  pthread_mutex_lock(&job_mu);
+  if (job_tail) {
+    job_tail->next = job;
+  } else {
+    job_head = job;
+  }
+  job_tail = job;
+  if (job_idle == 0 && job_threads < MaxWorkers()) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, JobWorker, NULL) == 0) {
+      pthread_detach(thread);
+      job_threads++;
+    } else if (job_threads == 0) {
+      fatal_("failed to start a worker thread, errno=%d (%s)", errno, strerror(errno));
+    }
+  }
+  pthread_cond_signal(&job_cv);
+  pthread_mutex_unlock(&job_mu);
+}
+
+/* On the main loop thread: send the replies for all finished jobs */
+static void CompleteJobs(void) {
+  uint64_t count;
+  while (read(done_fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+  }
+  pthread_mutex_lock(&job_mu);
+  Job *job = done_head;
+  done_head = done_tail = NULL;
+  pthread_mutex_unlock(&job_mu);
+
+  while (job) {
+    Job *next = job->next;
+    job_calls++;
+    job_queued_us += job->queued_us;
+    if (job->queued_us > job_max_queued_us) job_max_queued_us = job->queued_us;
+    log_("%s: queued %lu us, ran %lu us (%lu calls, mean queue %lu us, max %lu us)",
+         job->method, (unsigned long)job->queued_us, (unsigned long)job->run_us, job_calls,
+         (unsigned long)(job_queued_us / job_calls), (unsigned long)job_max_queued_us);
+    DBusMessage *rsp = job->rsp;
+    if (rsp == NULL) rsp = dbus_message_new_error(job->msg, DBUS_ERROR_FAILED, job->method);
+    if (!dbus_connection_get_is_connected(job->conn)) {
+      warning_("connection conn=%p gone before %s reply", job->conn, job->method);
+    } else if (rsp == NULL || !dbus_connection_send(job->conn, rsp, NULL)) {
+      warning_("dbus_connection_send failed for reply");
+    }
+    if (rsp) dbus_message_unref(rsp);
+    dbus_message_unref(job->msg);
+    dbus_connection_unref(job->conn);
+    free(job);
+    job = next;
   }
 }
 
@@ -153,8 +520,8 @@ static DBusHandlerResult NoopHandler(DBusConnection *conn, DBusMessage *msg) {
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-/* API-specfic message handler prototype */
-DBusHandlerResult APIMessageHandler(const char *method, DBusConnection *conn, DBusMessage *msg, void *data);
+/* API-specfic method lookup prototype */
+ProxiedCall APIMethod(const char *method);
 
 static DBusHandlerResult MessageHandler(DBusConnection *conn, DBusMessage *msg, void *data) {
   const char *objpath = (const char *)data;
@@ -171,7 +538,12 @@ static DBusHandlerResult MessageHandler(DBusConnection *conn, DBusMessage *msg,
   if (strcmp(method, "__noop") == 0) {
     return NoopHandler(conn, msg);
   }
-  return APIMessageHandler(method, conn, msg, data);
+  ProxiedCall call = APIMethod(method);
+  if (call == NULL) {
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+  SubmitJob(method, call, conn, msg);
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 static DBusObjectPathVTable vt = {
@@ -180,59 +552,63 @@ static DBusObjectPathVTable vt = {
 };
 
 
+static void DropConnection(ConnEntry *entry) {
+  DBusConnection *conn = entry->conn;
+  warning_("Drop connection conn=%p", conn);
+  /* Clearing the callbacks removes the connection's watches and timeouts. */
+  dbus_connection_set_dispatch_status_function(conn, NULL, NULL, NULL);
+  dbus_connection_set_watch_functions(conn, NULL, NULL, NULL, NULL, NULL);
+  dbus_connection_set_timeout_functions(conn, NULL, NULL, NULL, NULL, NULL);
+  dbus_connection_unref(conn);
+  entry->conn = NULL;
+  conn_count--;
+  if (!entry->queued) free(entry);  /* else freed when it comes off the list */
+}
+
+#define MAX_EVENTS 64
 static void MainLoop(const char *objpath) {
+  struct epoll_event events[MAX_EVENTS];
   int rc;
   int ii;
-  for (ii = 0; ii < pollfd_count; ii++) pollfds[ii].revents = 0;
 
   while (1) {
-    verbose_("poll on fds: ");
-    for (ii = 0; ii < pollfd_count; ii++) {
-      verbose_("  %d%s%s", pollfds[ii].fd,
-               (pollfds[ii].events & POLLIN) ? "R" : "",
-               (pollfds[ii].events & POLLOUT) ? "W" : "");
-    }
-    rc = poll(pollfds, pollfd_count, -1);
+    RunTimers();
+    int wait_ms = ready_head ? 0 : NextTimerWait();
+    verbose_("epoll_wait(timeout=%d)", wait_ms);
+    rc = epoll_wait(epoll_fd, events, MAX_EVENTS, wait_ms);
     if (rc < 0) {
-      warning_("poll() failed with errno=%d", errno);
+      if (errno == EINTR) continue;
+      warning_("epoll_wait() failed with errno=%d", errno);
       return;
     }
-    if (rc > 0) {
-      for (ii = 0; ii < pollfd_count; ii++) {
-        if (pollfds[ii].revents) {
-          verbose_("[%d] fd=%d event=%s%s%s%s watch=%p",
-                   ii, pollfds[ii].fd,
-                   (pollfds[ii].revents & POLLIN) ? "R" : "",
-                   (pollfds[ii].revents & POLLOUT) ? "W" : "",
-                   (pollfds[ii].revents & POLLERR) ? "!" : "",
-                   (pollfds[ii].revents & POLLHUP) ? "0" : "",
-                   watches[ii]);
-          unsigned int flags = 0;
-          if (pollfds[ii].revents & POLLIN)  flags |= DBUS_WATCH_READABLE;
-          if (pollfds[ii].revents & POLLOUT) flags |= DBUS_WATCH_WRITABLE;
-          if (pollfds[ii].revents & POLLERR) flags |= DBUS_WATCH_ERROR;
-          if (pollfds[ii].revents & POLLHUP) flags |= DBUS_WATCH_HANGUP;
-          if (!dbus_watch_handle(watches[ii], flags)) {
-            warning_("dbus_watch_handle failed");
-          }
-        }
+    for (ii = 0; ii < rc; ii++) {
+      if (events[ii].data.fd == done_fd) {
+        CompleteJobs();
+      } else {
+        HandleFd(events[ii].data.fd, events[ii].events);
       }
-      for (ii = 0; ii < conn_count; ii++) {
-        if (!dbus_connection_get_is_connected(conns[ii])) {
-          warning_("Drop connection [%d] conn=%p", ii, conns[ii]);
-          dbus_connection_unref(conns[ii]);
-          conn_count--;
-          if (ii < conn_count) {
-            memmove(&(conns[ii]), &(conns[ii+1]),
-                    (conn_count - ii)*sizeof(DBusConnection *));
-          }
-          ii--;
-        } else {
-          verbose_("Dispatch connection [%d] conn=%p", ii, conns[ii]);
-          while (dbus_connection_dispatch(conns[ii]) == DBUS_DISPATCH_DATA_REMAINS)
-            ;
+    }
+
+    ConnEntry *entry;
+    while ((entry = NextReadyConnection()) != NULL) {
+      if (entry->conn == NULL) {
+        free(entry);
+        continue;
+      }
+      if (!dbus_connection_get_is_connected(entry->conn)) {
+        DropConnection(entry);
+        if (conn_count == 0) {
+          /* The stub that started us has gone away */
+          log_("last connection dropped; exiting");
+          return;
         }
+        continue;
       }
+      verbose_("Dispatch connection conn=%p", entry->conn);
+      while (dbus_connection_dispatch(entry->conn) == DBUS_DISPATCH_DATA_REMAINS)
+        ;
+      /* Dispatching may have delivered the disconnect */
+      if (!dbus_connection_get_is_connected(entry->conn)) QueueConnection(entry);
     }
   }
 }
@@ -240,26 +616,25 @@ static void MainLoop(const char *objpath) {
 /* Callback for a new connection being accepted on the listening socket */
 static void NewConnection(DBusServer *server, DBusConnection *conn, void *data) {
   const char *objpath = (const char *)data;
-  if (conn_count == conn_size) {
-    conn_size *= 2;
-    DBusConnection **c = realloc(watches, pollfd_size*sizeof(DBusConnection*));
-    if (c == NULL) {
-      error_("!!! failed to alloc extra space for connections");
-      dbus_connection_close(conn);
-      return;
-    }
-    conns = c;
+  ConnEntry *entry = calloc(1, sizeof(ConnEntry));
+  if (entry == NULL) {
+    error_("!!! failed to alloc extra space for connections");
+    dbus_connection_close(conn);
+    return;
   }
   log_("New connection [%d] conn=%p", conn_count, conn);
-  conns[conn_count++] = conn;
+  entry->conn = conn;
+  conn_count++;
   dbus_connection_ref(conn);
 
   dbus_connection_set_allow_anonymous(conn, FALSE);
-  dbus_connection_set_dispatch_status_function(conn, DispatchStatus, NULL, NULL);
-  if (!dbus_connection_set_watch_functions(conn, AddWatch, RemoveWatch, ToggleWatch, NULL, NULL)) {
+  /* Allow batched calls more than the default (16) fds per message. */
+  dbus_connection_set_max_message_unix_fds(conn, MAX_FDS_PER_MSG);
+  dbus_connection_set_dispatch_status_function(conn, DispatchStatus, entry, NULL);
+  if (!dbus_connection_set_watch_functions(conn, AddWatch, RemoveWatch, ToggleWatch, entry, NULL)) {
     error_("!!! failed to set watch functions");
   }
-  if (!dbus_connection_set_timeout_functions(conn, AddTimeout, RemoveTimeout, ToggleTimeout, NULL, NULL)) {
+  if (!dbus_connection_set_timeout_functions(conn, AddTimeout, RemoveTimeout, ToggleTimeout, entry, NULL)) {
     error_("!!! failed to set timeout functions");
   }
 
@@ -273,28 +648,34 @@ static void NewConnection(DBusServer *server, DBusConnection *conn, void *data)
            dbus_connection_get_is_anonymous(conn) ? "Y" : "N");
 
   if (dbus_connection_get_dispatch_status(conn) != DBUS_DISPATCH_COMPLETE) {
-    verbose_("Dispatch connection %p", conn);
-    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS)
-      ;
+    QueueConnection(entry);
   }
 }
 
 int main(int argc, char *argv[]) {
   signal(SIGSEGV, CrashHandler);
   signal(SIGABRT, CrashHandler);
-  const char *fd_str = getenv("API_NONCE_FD");
-  assert (fd_str != NULL);
-  int sock_fd = atoi(fd_str);
+  int sock_fd = DriverSocket();
   api_("'%s' program start, parent socket %d", argv[0], sock_fd);
-  pollfd_size = 4;
-  pollfds = calloc(pollfd_size, sizeof(struct pollfd));
-  watches = calloc(pollfd_size, sizeof(DBusWatch*));
-  conn_size = 2;
-  conns = calloc(conn_size, sizeof(DBusConnection*));
-  if (!pollfds || !watches || !conns) {
+  fd_slot_size = 16;
+  fd_slots = calloc(fd_slot_size, sizeof(FdSlot));
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (!fd_slots || epoll_fd < 0 || done_fd < 0) {
     error_("!!! failed to get initial memory");
     exit(1);
   }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = done_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev) < 0) {
+    error_("!!! failed to watch job completions, errno=%d (%s)", errno, strerror(errno));
+    exit(1);
+  }
+  /* Worker threads build messages concurrently with the main loop. */
+  dbus_threads_init_default();
+  timer_tick = NowTicks();
 
   /* Listen on a UNIX socket in /tmp */
   DBusError err;
@@ -312,7 +693,7 @@ int main(int argc, char *argv[]) {
   /* Tell the parent the address we're listening on, plus a nonce that is only
    * known to us and the parent. */
   uint32_t len = strlen(server_address) + 1;
-  srand(time(NULL));
+  srand(time(NULL) ^ getpid());  /* zygote children share a start time */
   uint64_t nonce = rand();
   verbose_("len=%d, addr='%s', nonce='%ld'", len, server_address, nonce);
 
@@ -339,202 +720,49 @@ int main(int argc, char *argv[]) {
 }
 
 
-/*****************************************************************************/
-/* Everything above here is generic, and would be useful for any remoted API */
-/*****************************************************************************/
-
-static DBusHandlerResult proxied_BZ2_bzCompressStream(DBusConnection *conn, DBusMessage *msg) {
-  static const char *method = "BZ2_bzCompressStream";
-  DBusMessage *rsp = dbus_message_new_method_return(msg);
-  if (!rsp) {
-    warning_("failed to get response message");
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init_append(rsp, &rsp_it);
-
-  int ifd;
-  int ofd;
-  int blockSize100k;
-  int verbosity;
-  int workFactor;
-  DBusMessageIter msg_it;
-  dbus_message_iter_init(msg, &msg_it);
-  dbus_int32_t vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_UNIX_FD);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  ifd = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_UNIX_FD);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  ofd = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  blockSize100k = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  verbosity = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  workFactor = vx;
-
-  api_("=> %s(%d, %d, %d, %d, %d)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
-  int retval = BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
-
-  api_("=> %s(%d, %d, %d, %d, %d) return %d", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
-  vx = retval;
-  dbus_message_iter_append_basic(&rsp_it, DBUS_TYPE_INT32, &vx);
-
-  if (!dbus_connection_send(conn, rsp, NULL)) {
-    warning_("dbus_connection_send failed for reply");
-    dbus_message_unref(rsp);
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  dbus_connection_flush(conn);
-  dbus_message_unref(rsp);
-  return DBUS_HANDLER_RESULT_HANDLED;
+/* Read the next argument of a request, which must have the given basic type
+ * (for UNIX_FD, the value is a dup-ed fd, which the caller must close) */
+static int IterGetBasic(DBusMessageIter *it, int type, void *value) {
+  if (dbus_message_iter_get_arg_type(it) != type) return 0;
+  dbus_message_iter_get_basic(it, value);
+  dbus_message_iter_next(it);
+  return 1;
 }
 
-static DBusHandlerResult proxied_BZ2_bzDecompressStream(DBusConnection *conn, DBusMessage *msg) {
-  static const char *method = "BZ2_bzDecompressStream";
-  DBusMessage *rsp = dbus_message_new_method_return(msg);
-  if (!rsp) {
-    warning_("failed to get response message");
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init_append(rsp, &rsp_it);
-
-  int ifd;
-  int ofd;
-  int verbosity;
-  int small;
-  DBusMessageIter msg_it;
-  dbus_message_iter_init(msg, &msg_it);
-  dbus_int32_t vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_UNIX_FD);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  ifd = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_UNIX_FD);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  ofd = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  verbosity = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  small = vx;
-
-  api_("=> %s(%d, %d, %d, %d)", method, ifd, ofd, verbosity, small);
-  int retval = BZ2_bzDecompressStream(ifd, ofd, verbosity, small);
-
-  api_("=> %s(%d, %d, %d, %d) return %d", method, ifd, ofd, verbosity, small, retval);
-  vx = retval;
-  dbus_message_iter_append_basic(&rsp_it, DBUS_TYPE_INT32, &vx);
-
-  if (!dbus_connection_send(conn, rsp, NULL)) {
-    warning_("dbus_connection_send failed for reply");
-    dbus_message_unref(rsp);
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  dbus_connection_flush(conn);
-  dbus_message_unref(rsp);
-  return DBUS_HANDLER_RESULT_HANDLED;
+/* Read the next argument of a request, which must be an array of the given
+ * fixed type; *value is left pointing into the message */
+static int IterGetFixedArray(DBusMessageIter *it, int type, void *value, int *count) {
+  DBusMessageIter arr_it;
+  if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(it) != type) return 0;
+  dbus_message_iter_recurse(it, &arr_it);
+  dbus_message_iter_get_fixed_array(&arr_it, value, count);
+  dbus_message_iter_next(it);
+  return 1;
 }
 
-static DBusHandlerResult proxied_BZ2_bzTestStream(DBusConnection *conn, DBusMessage *msg) {
-  static const char *method = "BZ2_bzTestStream";
-  DBusMessage *rsp = dbus_message_new_method_return(msg);
-  if (!rsp) {
-    warning_("failed to get response message");
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init_append(rsp, &rsp_it);
-
-  int ifd;
-  int verbosity;
-  int small;
-  DBusMessageIter msg_it;
-  dbus_message_iter_init(msg, &msg_it);
+/* Collect the (dup-ed) fds from an array of UNIX_FD into a new array */
+static int IterGetFdArray(DBusMessageIter *it, int **fds, int *count) {
+  DBusMessageIter arr_it;
   dbus_int32_t vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_UNIX_FD);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  ifd = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  verbosity = vx;
-  assert (dbus_message_iter_get_arg_type(&msg_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&msg_it, &vx);
-  dbus_message_iter_next(&msg_it);
-  small = vx;
-
-  api_("=> %s(%d, %d, %d)", method, ifd, verbosity, small);
-  int retval = BZ2_bzTestStream(ifd, verbosity, small);
-
-  api_("=> %s(%d, %d, %d) return %d", method, ifd, verbosity, small, retval);
-  vx = retval;
-  dbus_message_iter_append_basic(&rsp_it, DBUS_TYPE_INT32, &vx);
-
-  if (!dbus_connection_send(conn, rsp, NULL)) {
-    warning_("dbus_connection_send failed for reply");
-    dbus_message_unref(rsp);
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(it) != DBUS_TYPE_UNIX_FD) return 0;
+  int max = dbus_message_iter_get_element_count(it);
+  *fds = calloc(max + 1, sizeof(int));
+  if (*fds == NULL) return 0;
+  *count = 0;
+  dbus_message_iter_recurse(it, &arr_it);
+  while (*count < max && dbus_message_iter_get_arg_type(&arr_it) == DBUS_TYPE_UNIX_FD) {
+    dbus_message_iter_get_basic(&arr_it, &vx);
+    (*fds)[(*count)++] = vx;
+    dbus_message_iter_next(&arr_it);
   }
-  dbus_connection_flush(conn);
-  dbus_message_unref(rsp);
-  return DBUS_HANDLER_RESULT_HANDLED;
+  dbus_message_iter_next(it);
+  return 1;
 }
-static DBusHandlerResult proxied_BZ2_bzlibVersion(DBusConnection *conn, DBusMessage *msg) {
-  static const char *method = "BZ2_bzlibVersion";
-  DBusMessage *rsp = dbus_message_new_method_return(msg);
-  if (!rsp) {
-    warning_("failed to get response message");
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init_append(rsp, &rsp_it);
 
-  DBusMessageIter msg_it;
-  dbus_message_iter_init(msg, &msg_it);
-
-  api_("=> %s()", method);
-  const char * retval = BZ2_bzlibVersion();
-
-  api_("<= %s() return '%s'", method, retval);
-  dbus_message_iter_append_basic(&rsp_it, DBUS_TYPE_STRING, &retval);
-
-  if (!dbus_connection_send(conn, rsp, NULL)) {
-    warning_("dbus_connection_send failed for reply");
-    dbus_message_unref(rsp);
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-  dbus_connection_flush(conn);
-  dbus_message_unref(rsp);
-  return DBUS_HANDLER_RESULT_HANDLED;
-}
+/*****************************************************************************/
+/* Everything above here is generic, and would be useful for any remoted API */
+/*****************************************************************************/
 
-/* This is the general entrypoint for this specific API */
-DBusHandlerResult APIMessageHandler(const char *method, DBusConnection *conn, DBusMessage *msg, void *data) {
-  if (strcmp(method, "BZ2_bzCompressStream") == 0) {
-    return proxied_BZ2_bzCompressStream(conn, msg);
-  } else if (strcmp(method, "BZ2_bzDecompressStream") == 0) {
-    return proxied_BZ2_bzDecompressStream(conn, msg);
-  } else if (strcmp(method, "BZ2_bzTestStream") == 0) {
-    return proxied_BZ2_bzTestStream(conn, msg);
-  } else if (strcmp(method, "BZ2_bzlibVersion") == 0) {
-    return proxied_BZ2_bzlibVersion(conn, msg);
-  } else {
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  }
-}
+#include "bz2-driver-dbus.inc"
@@ -22,8 +22,17 @@
 
 #include "rpc-util.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <grpc++/grpc++.h>
+#include <grpc++/server_posix.h>
 
 #include "bzlib.grpc.pb.h"
 #include "bzlib.h"
@@ -33,61 +42,46 @@ int _rpc_indent = 4;
 
 namespace bz2 {
 
-class Bz2ServiceImpl final : public Bz2::Service {
+// Size of the DataChunk messages sent back for chunked calls.
+static const size_t kChunkSize = 64 * 1024;
+
+// Accumulates bz_stream output for a chunked call, sending it to the client
+// a buffer at a time.
+template <typename Stream>
+class ChunkOutput {
 public:
-  Bz2ServiceImpl(int sock_fd) : Service(), sock_fd_(sock_fd) {}
-  grpc::Status CompressStream(grpc::ServerContext* context,
-                              const CompressStreamRequest* msg,
-                              CompressStreamReply* rsp) {
-    static const char *method = "BZ2_bzCompressStream";
-    int ifd_nonce = msg->ifd();
-    int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
-    int ofd_nonce = msg->ofd();
-    int ofd = GetTransferredFd(sock_fd_, ofd_nonce);
-    int blockSize100k = msg->blocksize100k();
-    int verbosity = msg->verbosity();
-    int workFactor = msg->workfactor();
-    api_("=> %s(%d, %d, %d, %d, %d)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
-    int retval = BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
-    api_("=> %s(%d, %d, %d, %d, %d) return %d", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
-    rsp->set_result(retval);
-    close(ifd);
-    close(ofd);
-    return grpc::Status::OK;
+  ChunkOutput(Stream *stream, bz_stream *strm, bool discard = false)
+    : stream_(stream), strm_(strm), discard_(discard) {
+    Reset();
   }
-  grpc::Status DecompressStream(grpc::ServerContext* context,
-                                const DecompressStreamRequest* msg,
-                                DecompressStreamReply* rsp) {
-    static const char *method = "BZ2_bzDecompressStream";
-    int ifd_nonce = msg->ifd();
-    int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
-    int ofd_nonce = msg->ofd();
-    int ofd = GetTransferredFd(sock_fd_, ofd_nonce);
-    int verbosity = msg->verbosity();
-    int small = msg->small();
-    api_("=> %s(%d, %d, %d, %d)", method, ifd, ofd, verbosity, small);
-    int retval = BZ2_bzDecompressStream(ifd, ofd, verbosity, small);
-    api_("=> %s(%d, %d, %d, %d) return %d", method, ifd, ofd, verbosity, small, retval);
-    rsp->set_result(retval);
-    close(ifd);
-    close(ofd);
-    return grpc::Status::OK;
+  // Send the output so far (if any) along with the ack count.
+  bool Send(uint64_t acked, bool done = false, int result = BZ_OK) {
+    size_t len = discard_ ? 0 : kChunkSize - strm_->avail_out;
+    rsp_.mutable_data()->resize(len);
+    rsp_.set_acked(acked);
+    rsp_.set_done(done);
+    rsp_.set_result(result);
+    bool ok = stream_->Write(rsp_);
+    Reset();
+    return ok;
   }
-  grpc::Status TestStream(grpc::ServerContext* context,
-                          const TestStreamRequest* msg,
-                          TestStreamReply* rsp) {
-    static const char *method = "BZ2_bzTestStream";
-    int ifd_nonce = msg->ifd();
-    int ifd = GetTransferredFd(sock_fd_, ifd_nonce);
-    int verbosity = msg->verbosity();
-    int small = msg->small();
-    api_("=> %s(%d, %d, %d)", method, ifd, verbosity, small);
-    int retval = BZ2_bzTestStream(ifd, verbosity, small);
-    api_("=> %s(%d, %d, %d) return %d", method, ifd, verbosity, small, retval);
-    rsp->set_result(retval);
-    close(ifd);
-    return grpc::Status::OK;
+
+private:
+  void Reset() {
+    rsp_.mutable_data()->resize(kChunkSize);
+    strm_->next_out = &(*rsp_.mutable_data())[0];
+    strm_->avail_out = kChunkSize;
   }
+  Stream *stream_;
+  bz_stream *strm_;
+  bool discard_;
+  DataChunk rsp_;
+};
+
+// Synchronous service for the calls that don't take fds.  (In a driver, the
+// fd-based calls are handled asynchronously; see AsyncCall below.)
+class Bz2ServiceImpl : public Bz2::Service {
+public:
   grpc::Status LibVersion(grpc::ServerContext* context,
                           const LibVersionRequest* msg,
                           LibVersionReply* rsp) {
@@ -99,43 +93,525 @@ public:
     return grpc::Status::OK;
   }
 
+  grpc::Status CompressChunks(grpc::ServerContext* context,
+                              grpc::ServerReaderWriter<DataChunk, CompressChunk>* stream) {
+    static const char *method = "BZ2_bzCompress(chunks)";
+    CompressChunk chunk;
+    if (!stream->Read(&chunk)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "no parameters");
+    }
+    int blockSize100k = chunk.blocksize100k();
+    int verbosity = chunk.verbosity();
+    int workFactor = chunk.workfactor();
+    api_("=> %s(%d, %d, %d)", method, blockSize100k, verbosity, workFactor);
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    ChunkOutput<grpc::ServerReaderWriter<DataChunk, CompressChunk>> out(stream, &strm);
+    int retval = BZ2_bzCompressInit(&strm, blockSize100k, verbosity, workFactor);
+    if (retval != BZ_OK) {
+      out.Send(0, true, retval);
+      return grpc::Status::OK;
+    }
+    uint64_t acked = 0;
+    do {
+      strm.next_in = const_cast<char *>(chunk.data().data());
+      strm.avail_in = chunk.data().size();
+      while (strm.avail_in > 0) {
+        retval = BZ2_bzCompress(&strm, BZ_RUN);
+        if (retval != BZ_RUN_OK) break;
+        if (strm.avail_out == 0 && !out.Send(acked)) break;
+      }
+      if (retval != BZ_RUN_OK) break;
+      acked += chunk.data().size();
+      if (!out.Send(acked)) break;
+    } while (stream->Read(&chunk));
+
+    if (retval == BZ_RUN_OK) {
+      do {
+        retval = BZ2_bzCompress(&strm, BZ_FINISH);
+        if (retval == BZ_FINISH_OK && !out.Send(acked)) break;
+      } while (retval == BZ_FINISH_OK);
+    }
+    BZ2_bzCompressEnd(&strm);
+    if (retval == BZ_STREAM_END) retval = BZ_OK;
+    api_("=> %s(%d, %d, %d) return %d in=%lu", method, blockSize100k, verbosity, workFactor, retval,
+         (unsigned long)acked);
+    out.Send(acked, true, retval);
+    return grpc::Status::OK;
+  }
+  grpc::Status DecompressChunks(grpc::ServerContext* context,
+                                grpc::ServerReaderWriter<DataChunk, DecompressChunk>* stream) {
+    static const char *method = "BZ2_bzDecompress(chunks)";
+    DecompressChunk chunk;
+    if (!stream->Read(&chunk)) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "no parameters");
+    }
+    int verbosity = chunk.verbosity();
+    int small = chunk.small();
+    bool discard = chunk.discard();
+    api_("=> %s(%d, %d, discard=%d)", method, verbosity, small, discard);
+    bz_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    ChunkOutput<grpc::ServerReaderWriter<DataChunk, DecompressChunk>> out(stream, &strm, discard);
+    uint64_t acked = 0;
+    int streams = 0;
+    bool in_stream = false;  // Between BZ2_bzDecompressInit and end of stream
+    bool trailing = false;   // Ignoring garbage after a complete stream
+    int retval = BZ_OK;
+    do {
+      strm.next_in = const_cast<char *>(chunk.data().data());
+      strm.avail_in = chunk.data().size();
+      // As for BZ2_bzDecompressStream(), handle concatenated streams.
+      while (!trailing && (strm.avail_in > 0 || in_stream)) {
+        if (!in_stream) {
+          retval = BZ2_bzDecompressInit(&strm, verbosity, small);
+          if (retval != BZ_OK) break;
+          in_stream = true;
+          streams++;
+        }
+        retval = BZ2_bzDecompress(&strm);
+        if (retval == BZ_STREAM_END) {
+          BZ2_bzDecompressEnd(&strm);
+          in_stream = false;
+          retval = BZ_OK;
+        } else if (retval == BZ_DATA_ERROR_MAGIC && streams > 1) {
+          BZ2_bzDecompressEnd(&strm);
+          in_stream = false;
+          trailing = true;
+          retval = BZ_OK;
+        } else if (retval != BZ_OK) {
+          break;
+        } else if (strm.avail_in == 0 && strm.avail_out > 0) {
+          break;  // Need more input
+        }
+        if (strm.avail_out == 0 && !out.Send(acked)) break;
+      }
+      if (retval != BZ_OK) break;
+      acked += chunk.data().size();
+      if (!out.Send(acked)) break;
+    } while (stream->Read(&chunk));
+
+    if (in_stream) {
+      BZ2_bzDecompressEnd(&strm);
+      if (retval == BZ_OK) retval = BZ_UNEXPECTED_EOF;
+    } else if (streams == 0 && retval == BZ_OK) {
+      retval = BZ_UNEXPECTED_EOF;
+    }
+    api_("=> %s(%d, %d, discard=%d) return %d in=%lu", method, verbosity, small, discard, retval,
+         (unsigned long)acked);
+    out.Send(acked, true, retval);
+    return grpc::Status::OK;
+  }
+};
+
+// Transferred fds arrive on the parent socket in the order the stub sent
+// them, which need not be the order in which concurrent calls ask for them.
+// Whichever call needs fds reads messages off the socket, and parks any fds
+// for other nonces here until their calls get to them.
+class FdInbox {
+public:
+  explicit FdInbox(int sock_fd) : sock_fd_(sock_fd), reading_(false) {}
+  void Take(int nonce, int count, int *fds) {
+    std::unique_lock<std::mutex> lock(mu_);
+    int got = 0;
+    while (got < count) {
+      auto it = parked_.find(nonce);
+      if (it != parked_.end()) {
+        std::deque<int> &queue = it->second;
+        while (got < count && !queue.empty()) {
+          fds[got++] = queue.front();
+          queue.pop_front();
+        }
+        if (queue.empty()) parked_.erase(it);
+        continue;
+      }
+      if (reading_) {
+        cv_.wait(lock);
+        continue;
+      }
+      reading_ = true;
+      lock.unlock();
+      int buf[MAX_FDS_PER_MSG];
+      int value = -1;
+      int rc = RecvTransferredFds(sock_fd_, buf, MAX_FDS_PER_MSG, &value);
+      if (rc <= 0) fatal_("no fds received across socket %d", sock_fd_);
+      log_("received %d fds across socket %d nonce=%d", rc, sock_fd_, value);
+      lock.lock();
+      reading_ = false;
+      parked_[value].insert(parked_[value].end(), buf, buf + rc);
+      cv_.notify_all();
+    }
+  }
+  int Take(int nonce) {
+    int fd;
+    Take(nonce, 1, &fd);
+    return fd;
+  }
+
 private:
   int sock_fd_;
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool reading_;  // Some thread is in RecvTransferredFds()
+  std::map<int, std::deque<int>> parked_;
 };
 
+// Cumulative queueing/run times over all asynchronous calls.
+struct CallStats {
+  std::atomic<unsigned long> calls{0};
+  std::atomic<unsigned long> cancelled{0};
+  std::atomic<unsigned long> queued_us{0};
+  std::atomic<unsigned long> max_queued_us{0};
+  std::atomic<unsigned long> run_us{0};
+};
+
+static unsigned long MicrosSince(std::chrono::steady_clock::time_point start) {
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+class WorkerPool;
+
+// One call of an asynchronous method, from being requested until gRPC has
+// finished with it.  Completion queue events for the call (its arrival, the
+// done notification and the completion of the reply) are all handled on the
+// single completion queue thread; the call's work runs on a pool thread.
+class AsyncCall {
+public:
+  enum Event { ARRIVED, DONE, FINISHED };
+  struct Tag {
+    AsyncCall *call;
+    Event event;
+  };
+
+  AsyncCall(const char *name, FdInbox *inbox, WorkerPool *pool, CallStats *stats)
+    : name_(name), inbox_(inbox), pool_(pool), stats_(stats), cancelled_(false),
+      done_(false), finished_(false), arrived_tag_{this, ARRIVED},
+      done_tag_{this, DONE}, finished_tag_{this, FINISHED} {
+    // Must precede the request.
+    ctx_.AsyncNotifyWhenDone(&done_tag_);
+  }
+  virtual ~AsyncCall() {}
+
+  void OnEvent(Event event, bool ok);
+  // On a pool thread: run the call and send the reply.
+  void Run() {
+    unsigned long queued_us = MicrosSince(queued_at_);
+    auto started_at = std::chrono::steady_clock::now();
+    Work();
+    unsigned long run_us = MicrosSince(started_at);
+    stats_->calls++;
+    stats_->queued_us += queued_us;
+    stats_->run_us += run_us;
+    unsigned long max = stats_->max_queued_us;
+    while (queued_us > max && !stats_->max_queued_us.compare_exchange_weak(max, queued_us)) {
+    }
+    log_("%s: queued %lu us, ran %lu us (%lu calls, mean queue %lu us, max %lu us)",
+         name_, queued_us, run_us, stats_->calls.load(),
+         stats_->queued_us.load() / stats_->calls.load(), stats_->max_queued_us.load());
+  }
+  FdInbox *inbox() {return inbox_;}
+  bool Cancelled() {
+    if (!cancelled_) return false;
+    stats_->cancelled++;
+    return true;
+  }
+
+protected:
+  // On the completion queue thread: ask for the next call of this method.
+  virtual void Request() = 0;
+  // A fresh call object for the same method.
+  virtual AsyncCall *Clone() = 0;
+  // Take the fds, make the call and Finish() the responder.
+  virtual void Work() = 0;
+
+  const char *name_;
+  FdInbox *inbox_;
+  WorkerPool *pool_;
+  CallStats *stats_;
+  grpc::ServerContext ctx_;
+  std::atomic<bool> cancelled_;
+  bool done_;
+  bool finished_;
+  std::chrono::steady_clock::time_point queued_at_;
+  Tag arrived_tag_;
+  Tag done_tag_;
+  Tag finished_tag_;
+};
+
+// Fixed set of threads that run calls in arrival order.
+class WorkerPool {
+public:
+  explicit WorkerPool(int size) {
+    for (int ii = 0; ii < size; ii++) {
+      std::thread([this]() { Loop(); }).detach();
+    }
+  }
+  void Submit(AsyncCall *call) {
+    std::lock_guard<std::mutex> lock(mu_);
+    queue_.push_back(call);
+    cv_.notify_one();
+  }
+
+private:
+  void Loop() {
+    while (true) {
+      AsyncCall *call;
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        cv_.wait(lock, [this]() { return !queue_.empty(); });
+        call = queue_.front();
+        queue_.pop_front();
+      }
+      call->Run();
+    }
+  }
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<AsyncCall *> queue_;
+};
+
+void AsyncCall::OnEvent(Event event, bool ok) {
+  switch (event) {
+  case ARRIVED:
+    if (!ok) {
+      delete this;  // Shutting down
+      return;
+    }
+    Clone()->Request();
+    queued_at_ = std::chrono::steady_clock::now();
+    pool_->Submit(this);
+    return;
+  case DONE:
+    // Before the reply is finished, this means the client has gone away.
+    done_ = true;
+    if (ctx_.IsCancelled()) cancelled_ = true;
+    break;
+  case FINISHED:
+    finished_ = true;
+    break;
+  }
+  if (done_ && finished_) delete this;
+}
+
+// The service as seen by gRPC: the fd-based calls are asynchronous, the rest
+// are handled by Bz2ServiceImpl on gRPC's own threads.
+typedef Bz2::WithAsyncMethod_CompressStream<
+        Bz2::WithAsyncMethod_DecompressStream<
+        Bz2::WithAsyncMethod_TestStream<
+        Bz2::WithAsyncMethod_CompressStreams<Bz2ServiceImpl>>>> Bz2DriverService;
+
+template <typename RequestMsg, typename ReplyMsg>
+class UnaryCall : public AsyncCall {
+public:
+  typedef void (Bz2DriverService::*RequestMethod)(grpc::ServerContext*, RequestMsg*,
+                                                  grpc::ServerAsyncResponseWriter<ReplyMsg>*,
+                                                  grpc::CompletionQueue*,
+                                                  grpc::ServerCompletionQueue*, void *);
+  typedef grpc::Status (*Handler)(AsyncCall *call, const RequestMsg &msg, ReplyMsg *rsp);
+
+  UnaryCall(const char *name, FdInbox *inbox, WorkerPool *pool, CallStats *stats,
+            Bz2DriverService *service, grpc::ServerCompletionQueue *cq,
+            RequestMethod request_method, Handler handler)
+    : AsyncCall(name, inbox, pool, stats), service_(service), cq_(cq),
+      request_method_(request_method), handler_(handler), responder_(&ctx_) {}
+
+  void Request() override {
+    (service_->*request_method_)(&ctx_, &msg_, &responder_, cq_, cq_, &arrived_tag_);
+  }
+
+protected:
+  AsyncCall *Clone() override {
+    return new UnaryCall(name_, inbox_, pool_, stats_, service_, cq_, request_method_, handler_);
+  }
+  void Work() override {
+    RpcTraceBegin(name_);
+    grpc::Status status = handler_(this, msg_, &rsp_);
+    if (RpcTracing()) RpcTraceEnd(msg_.ByteSizeLong(), rsp_.ByteSizeLong());
+    responder_.Finish(rsp_, status, &finished_tag_);
+  }
+
+private:
+  Bz2DriverService *service_;
+  grpc::ServerCompletionQueue *cq_;
+  RequestMethod request_method_;
+  Handler handler_;
+  RequestMsg msg_;
+  ReplyMsg rsp_;
+  grpc::ServerAsyncResponseWriter<ReplyMsg> responder_;
+};
+
+static grpc::Status CancelledStatus(const char *method, int count, const int *fds) {
+  for (int ii = 0; ii < count; ii++) close(fds[ii]);
+  log_("=> %s cancelled", method);
+  return grpc::Status(grpc::StatusCode::CANCELLED, "cancelled before start");
+}
+
+static grpc::Status CompressStream(AsyncCall *call, const CompressStreamRequest &msg,
+                                   CompressStreamReply *rsp) {
+  static const char *method = "BZ2_bzCompressStream";
+  int fds[2];
+  fds[0] = call->inbox()->Take(msg.ifd());
+  fds[1] = call->inbox()->Take(msg.ofd());
+  if (call->Cancelled()) return CancelledStatus(method, 2, fds);
+  int ifd = fds[0];
+  int ofd = fds[1];
+  int blockSize100k = msg.blocksize100k();
+  int verbosity = msg.verbosity();
+  int workFactor = msg.workfactor();
+  api_("=> %s(%d, %d, %d, %d, %d)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
+  int retval = BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
+  api_("=> %s(%d, %d, %d, %d, %d) return %d", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+  RpcTraceResult(retval);
+  rsp->set_result(retval);
+  close(ifd);
+  close(ofd);
+  return grpc::Status::OK;
+}
+
+static grpc::Status CompressStreams(AsyncCall *call, const CompressStreamsRequest &msg,
+                                    CompressStreamsReply *rsp) {
+  static const char *method = "BZ2_bzCompressStreams";
+  int nstreams = msg.count();
+  if (nstreams <= 0) {
+    rsp->set_result(nstreams < 0 ? BZ_PARAM_ERROR : BZ_OK);
+    return grpc::Status::OK;
+  }
+  std::vector<int> fds(2 * nstreams);
+  call->inbox()->Take(msg.nonce(), fds.size(), fds.data());
+  if (call->Cancelled()) return CancelledStatus(method, fds.size(), fds.data());
+  std::vector<int> results(nstreams);
+  int blockSize100k = msg.blocksize100k();
+  int verbosity = msg.verbosity();
+  int workFactor = msg.workfactor();
+  api_("=> %s(%d, ..., %d, %d, %d)", method, nstreams, blockSize100k, verbosity, workFactor);
+  int retval = BZ2_bzCompressStreams(nstreams, &fds[0], &fds[nstreams], results.data(),
+                                     blockSize100k, verbosity, workFactor);
+  api_("=> %s(%d, ..., %d, %d, %d) return %d", method, nstreams, blockSize100k, verbosity, workFactor, retval);
+  for (int result : results) rsp->add_results(result);
+  RpcTraceResult(retval);
+  rsp->set_result(retval);
+  for (int fd : fds) close(fd);
+  return grpc::Status::OK;
+}
+
+static grpc::Status DecompressStream(AsyncCall *call, const DecompressStreamRequest &msg,
+                                     DecompressStreamReply *rsp) {
+  static const char *method = "BZ2_bzDecompressStream";
+  int fds[2];
+  fds[0] = call->inbox()->Take(msg.ifd());
+  fds[1] = call->inbox()->Take(msg.ofd());
+  if (call->Cancelled()) return CancelledStatus(method, 2, fds);
+  int ifd = fds[0];
+  int ofd = fds[1];
+  int verbosity = msg.verbosity();
+  int small = msg.small();
+  api_("=> %s(%d, %d, %d, %d)", method, ifd, ofd, verbosity, small);
+  int retval = BZ2_bzDecompressStream(ifd, ofd, verbosity, small);
+  api_("=> %s(%d, %d, %d, %d) return %d", method, ifd, ofd, verbosity, small, retval);
+  RpcTraceResult(retval);
+  rsp->set_result(retval);
+  close(ifd);
+  close(ofd);
+  return grpc::Status::OK;
+}
+
+static grpc::Status TestStream(AsyncCall *call, const TestStreamRequest &msg,
+                               TestStreamReply *rsp) {
+  static const char *method = "BZ2_bzTestStream";
+  int ifd = call->inbox()->Take(msg.ifd());
+  if (call->Cancelled()) return CancelledStatus(method, 1, &ifd);
+  int verbosity = msg.verbosity();
+  int small = msg.small();
+  api_("=> %s(%d, %d, %d)", method, ifd, verbosity, small);
+  int retval = BZ2_bzTestStream(ifd, verbosity, small);
+  api_("=> %s(%d, %d, %d) return %d", method, ifd, verbosity, small, retval);
+  RpcTraceResult(retval);
+  rsp->set_result(retval);
+  close(ifd);
+  return grpc::Status::OK;
+}
+
+// Number of worker threads: BZ2_GRPC_WORKERS, defaulting to the CPU count.
+static int WorkerCount() {
+  const char *str = getenv("BZ2_GRPC_WORKERS");
+  int count = str ? atoi(str) : 0;
+  if (count <= 0) count = std::thread::hardware_concurrency();
+  return (count > 0) ? count : 1;
+}
+
+// Run the completion queue loop for the asynchronous calls (forever).
+static void ServeAsync(Bz2DriverService *service, grpc::ServerCompletionQueue *cq, int sock_fd) {
+  // These live as long as the process, as the workers never exit.
+  FdInbox *inbox = new FdInbox(sock_fd);
+  int workers = WorkerCount();
+  WorkerPool *pool = new WorkerPool(workers);
+  CallStats *stats = new CallStats;
+  log_("serving fd calls with %d workers", workers);
+
+  (new UnaryCall<CompressStreamRequest, CompressStreamReply>(
+    "BZ2_bzCompressStream", inbox, pool, stats, service, cq,
+    &Bz2DriverService::RequestCompressStream, CompressStream))->Request();
+  (new UnaryCall<CompressStreamsRequest, CompressStreamsReply>(
+    "BZ2_bzCompressStreams", inbox, pool, stats, service, cq,
+    &Bz2DriverService::RequestCompressStreams, CompressStreams))->Request();
+  (new UnaryCall<DecompressStreamRequest, DecompressStreamReply>(
+    "BZ2_bzDecompressStream", inbox, pool, stats, service, cq,
+    &Bz2DriverService::RequestDecompressStream, DecompressStream))->Request();
+  (new UnaryCall<TestStreamRequest, TestStreamReply>(
+    "BZ2_bzTestStream", inbox, pool, stats, service, cq,
+    &Bz2DriverService::RequestTestStream, TestStream))->Request();
+
+  void *tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    AsyncCall::Tag *call_tag = static_cast<AsyncCall::Tag *>(tag);
+    call_tag->call->OnEvent(call_tag->event, ok);
+  }
+  log_("completion queue shut down after %lu calls (%lu cancelled)",
+       stats->calls.load(), stats->cancelled.load());
+}
+
 }  // namespace bz2
 
 int main(int argc, char *argv[]) {
   signal(SIGSEGV, CrashHandler);
   signal(SIGABRT, CrashHandler);
-  const char *fd_str = getenv("API_NONCE_FD");
-  assert (fd_str != NULL);
-  int sock_fd = atoi(fd_str);
+  if (argc > 1) {
+    // Run as a stand-alone service listening on the given address (e.g.
+    // "localhost:50051"), for stubs with BZ2_GRPC_TARGET set.  There's no
+    // parent socket, so only the chunked calls work.
+    std::string server_address = argv[1];
+    api_("'%s' program start, stand-alone on %s", argv[0], server_address.c_str());
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    bz2::Bz2ServiceImpl service;
+    builder.RegisterService(&service);
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    if (!server) fatal_("failed to listen on %s", server_address.c_str());
+    server->Wait();
+    api_("'%s' program stop", argv[0]);
+    return 0;
+  }
+
+  int sock_fd = DriverSocket();
   api_("'%s' program start, parent socket %d", argv[0], sock_fd);
+  ExitOnHangup(sock_fd);
 
-  // Build the address of a UNIX socket for the service.
-  const char *sockfile = tempnam(nullptr, "gsck");
-  std::string server_address = "unix:";
-  server_address += sockfile;
-  log_("listening on %s", server_address.c_str());
+  // The stub sends over an already-connected socket for the gRPC channel.
+  int channel_fd = GetBootstrapFd(sock_fd);
 
   grpc::ServerBuilder builder;
-  // Listen on the given address without any authentication mechanism.
-  builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  bz2::Bz2ServiceImpl service(sock_fd);
+  bz2::Bz2DriverService service;
   builder.RegisterService(&service);
+  std::unique_ptr<grpc::ServerCompletionQueue> cq = builder.AddCompletionQueue();
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
-
-  // Tell the parent the address we're listening on.
-  uint32_t len = server_address.size() + 1;
-  int rc;
-  rc = write(sock_fd, &len, sizeof(len));
-  assert (rc == sizeof(len));
-  rc = write(sock_fd, server_address.c_str(), len);
-  assert ((uint32_t)rc == len);
+  if (!server) fatal_("failed to start server");
+  grpc::AddInsecureChannelFromFd(server.get(), channel_fd);
+  log_("serving on channel fd %d", channel_fd);
 
   // Main loop
-  server->Wait();
+  bz2::ServeAsync(&service, cq.get(), sock_fd);
 
   api_("'%s' program stop", argv[0]);
   return 0;
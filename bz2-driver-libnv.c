@@ -5,10 +5,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
@@ -18,25 +20,48 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <dnv.h>
 #include <nv.h>
 
 #include "rpc-util.h"
 #include "bzlib.h"
+#include "bz2-idl.h"
 
 int _rpc_verbose = 4;
 int _rpc_indent = 4;
 
 /* API-specfic message handler prototype */
 nvlist_t *APIMessageHandler(const nvlist_t *msg);
+/* API-specific name of a method, for tracing */
+const char *APIMethodName(uint64_t method);
 
+/* Each request and its response are built in one arena, which is reset once
+ * they have gone; async work on other threads allocates as usual. */
 static void MainLoop(int sock_fd) {
+  nv_arena_t *arena = nv_arena_create(0);
+  if (arena == NULL) {
+    fatal_("failed to allocate arena");
+  }
+  nv_arena_use(arena);
   while (1) {
     verbose_("blocking read from fd %d...", sock_fd);
     nvlist_t *msg = nvlist_recv(sock_fd, 0);
+    if (msg == NULL) {
+      /* Stub has closed its end of the socket (or sent garbage) */
+      log_("no request on fd %d, errno=%d; exiting", sock_fd, errno);
+      break;
+    }
     verbose_("handle incoming request on fd %d...", sock_fd);
+    uint64_t request_bytes = 0;
+    if (RpcTracing()) {
+      RpcTraceBegin(APIMethodName(dnvlist_get_number(msg, "method", 0)));
+      request_bytes = nvlist_size(msg);
+    }
     nvlist_t *rsp = APIMessageHandler(msg);
     nvlist_destroy(msg);
+    uint64_t reply_bytes = 0;
     if (rsp) {
+      if (RpcTracing()) reply_bytes = nvlist_size(rsp);
       verbose_("send response on fd %d", sock_fd);
       int rc = nvlist_send(sock_fd, rsp);
       if (rc != 0) {
@@ -44,15 +69,17 @@ static void MainLoop(int sock_fd) {
       }
       nvlist_destroy(rsp);
     }
+    RpcTraceEnd(request_bytes, reply_bytes);
+    nv_arena_reset(arena);
   }
+  nv_arena_use(NULL);
+  nv_arena_destroy(arena);
 }
 
 int main(int argc, char *argv[]) {
   signal(SIGSEGV, CrashHandler);
   signal(SIGABRT, CrashHandler);
-  const char *fd_str = getenv("API_NONCE_FD");
-  assert (fd_str != NULL);
-  int sock_fd = atoi(fd_str);
+  int sock_fd = DriverSocket();
   api_("'%s' program start, parent socket %d", argv[0], sock_fd);
 
   MainLoop(sock_fd);
@@ -66,76 +93,391 @@ int main(int argc, char *argv[]) {
 /* Everything above here is generic, and would be useful for any remoted API */
 /*****************************************************************************/
 
-static int proxied_BZ2_bzCompressStream(const nvlist_t *msg, nvlist_t *rsp) {
-  static const char *method = "BZ2_bzCompressStream";
-  int ifd = nvlist_get_descriptor(msg, "ifd");
-  int ofd = nvlist_get_descriptor(msg, "ofd");
+/* Handlers for the self-contained entrypoints, generated from the
+ * annotations in bzlib.h by idolize.py */
+#include "bz2-driver-libnv.inc"
+
+/* Low-level bz_stream entrypoints.  The stub shares a pair of rings with us
+ * (input, output); each call runs the real bz_stream over whatever is in the
+ * rings, working directly in the shared mapping.  BZFILEs share the handle
+ * table and the rings. */
+struct DriverStream {
+  bz_stream strm;
+  BZFILE *file;  /* Set for a BZFILE rather than a bz_stream */
+  FILE *fp;      /* The BZFILE's stream; owns the fd, closed by StreamFree() */
+  int compress;  /* Compressing (for a BZFILE, writing) */
+  int pending;  /* In the middle of a BZ_FLUSH/BZ_FINISH sequence */
+  void *shm;
+  size_t shm_len;
+  struct ShmRingView in;
+  struct ShmRingView out;
+};
+
+static struct DriverStream **g_streams = NULL;
+static size_t g_stream_count = 0;
+
+static uint64_t StreamAdd(struct DriverStream *s) {
+  size_t ii;
+  for (ii = 0; ii < g_stream_count; ii++) {
+    if (g_streams[ii] == NULL) break;
+  }
+  if (ii == g_stream_count) {
+    struct DriverStream **streams = realloc(g_streams, (g_stream_count + 1) * sizeof(*streams));
+    if (streams == NULL) return 0;
+    g_streams = streams;
+    g_stream_count++;
+  }
+  g_streams[ii] = s;
+  return ii + 1;
+}
+
+static struct DriverStream *StreamGet(uint64_t handle) {
+  if (handle == 0 || handle > g_stream_count) return NULL;
+  return g_streams[handle - 1];
+}
+
+static struct DriverStream *StreamOpen(const nvlist_t *msg, int compress) {
+  struct DriverStream *s = calloc(1, sizeof(*s));
+  if (s == NULL) return NULL;
+  s->compress = compress;
+  uint32_t ring_size;
+  s->shm = ShmRingsMap(nvlist_get_descriptor(msg, "shm"), &s->shm_len, &ring_size);
+  if (s->shm == NULL) {
+    free(s);
+    return NULL;
+  }
+  ShmRingAttach(&s->in, s->shm, ring_size, 0, 0);
+  ShmRingAttach(&s->out, s->shm, ring_size, 1, 1);
+  return s;
+}
+
+static void StreamFree(struct DriverStream *s) {
+  if (s->file) {
+    int bzerr;
+    if (s->compress) {
+      BZ2_bzWriteClose(&bzerr, s->file, 0, NULL, NULL);
+      if (bzerr != BZ_OK) BZ2_bzWriteClose(NULL, s->file, 1, NULL, NULL);
+    } else {
+      BZ2_bzReadClose(&bzerr, s->file);
+    }
+  }
+  if (s->fp) fclose(s->fp);
+  munmap(s->shm, s->shm_len);
+  free(s);
+}
+
+static void StreamClose(uint64_t handle) {
+  StreamFree(StreamGet(handle));
+  g_streams[handle - 1] = NULL;
+}
+
+/* Run one step of the stream over the current ring contents; returns the
+ * bzlib result and the number of bytes consumed plus produced. */
+static int StreamStep(struct DriverStream *s, int action, size_t *progress) {
+  unsigned char *iptr, *optr;
+  size_t ilen = ShmRingReadable(&s->in, &iptr);
+  size_t olen = ShmRingWritable(&s->out, &optr);
+  if (action != BZ_RUN) ilen = 0;
+  s->strm.next_in = (char *)iptr;
+  s->strm.avail_in = ilen;
+  s->strm.next_out = (char *)optr;
+  s->strm.avail_out = olen;
+  int rc = s->compress ? BZ2_bzCompress(&s->strm, action) : BZ2_bzDecompress(&s->strm);
+  size_t consumed = ilen - s->strm.avail_in;
+  size_t produced = olen - s->strm.avail_out;
+  ShmRingConsume(&s->in, consumed);
+  ShmRingProduce(&s->out, produced);
+  *progress = consumed + produced;
+  return rc;
+}
+
+static int proxied_BZ2_bzCompressInit(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzCompressInit";
   int blockSize100k = nvlist_get_number(msg, "blockSize100k");
   int verbosity = nvlist_get_number(msg, "verbosity");
   int workFactor = nvlist_get_number(msg, "workFactor");
+  uint64_t handle = 0;
+  int retval = BZ_MEM_ERROR;
+
+  api_("=> %s(%d, %d, %d)", method, blockSize100k, verbosity, workFactor);
+  struct DriverStream *s = StreamOpen(msg, 1);
+  if (s) {
+    retval = BZ2_bzCompressInit(&s->strm, blockSize100k, verbosity, workFactor);
+    if (retval == BZ_OK) handle = StreamAdd(s);
+    if (handle == 0) {
+      if (retval == BZ_OK) {
+        BZ2_bzCompressEnd(&s->strm);
+        retval = BZ_MEM_ERROR;
+      }
+      munmap(s->shm, s->shm_len);
+      free(s);
+    }
+  }
+  api_("=> %s(%d, %d, %d) return %d handle=%lu", method, blockSize100k, verbosity, workFactor,
+       retval, (unsigned long)handle);
+  nvlist_add_number(rsp, "retval", retval);
+  nvlist_add_number(rsp, "handle", handle);
+  return 0;
+}
 
-  api_("=> %s(%d, %d, %d, %d, %d)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
-  int retval = BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
+static int proxied_BZ2_bzCompress(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzCompress";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  int action = nvlist_get_number(msg, "action");
+  struct DriverStream *s = StreamGet(handle);
+  if (s == NULL || s->file || !s->compress) {
+    nvlist_add_number(rsp, "retval", BZ_PARAM_ERROR);
+    return 0;
+  }
+
+  verbose_("=> %s(%lu, %d) in=%zu", method, (unsigned long)handle, action, ShmRingUsed(&s->in));
+  int retval = BZ_RUN_OK;
+  size_t progress;
+  if (!s->pending) {
+    /* Feed everything the stub has queued up */
+    while (ShmRingUsed(&s->in) > 0 && ShmRingFree(&s->out) > 0) {
+      retval = StreamStep(s, BZ_RUN, &progress);
+      if (retval != BZ_RUN_OK || progress == 0) break;
+    }
+  }
+  if (retval == BZ_RUN_OK && action != BZ_RUN) {
+    if (ShmRingUsed(&s->in) > 0) {
+      retval = (action == BZ_FLUSH) ? BZ_FLUSH_OK : BZ_FINISH_OK;
+    } else {
+      while (ShmRingFree(&s->out) > 0) {
+        retval = StreamStep(s, action, &progress);
+        if (retval != BZ_FLUSH_OK && retval != BZ_FINISH_OK) break;
+        if (progress == 0) break;
+      }
+      s->pending = (retval == BZ_FLUSH_OK || retval == BZ_FINISH_OK);
+    }
+  }
+  verbose_("=> %s(%lu, %d) return %d out=%zu", method, (unsigned long)handle, action, retval,
+           ShmRingUsed(&s->out));
+  nvlist_add_number(rsp, "retval", retval);
+  return 0;
+}
 
-  api_("=> %s(%d, %d, %d, %d, %d) return %d", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+static int proxied_BZ2_bzCompressEnd(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzCompressEnd";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  int retval = BZ_PARAM_ERROR;
+  api_("=> %s(%lu)", method, (unsigned long)handle);
+  if (s && !s->file && s->compress) {
+    retval = BZ2_bzCompressEnd(&s->strm);
+    StreamClose(handle);
+  }
+  api_("=> %s(%lu) return %d", method, (unsigned long)handle, retval);
   nvlist_add_number(rsp, "retval", retval);
   return 0;
 }
 
-static int proxied_BZ2_bzDecompressStream(const nvlist_t *msg, nvlist_t *rsp) {
-  static const char *method = "BZ2_bzDecompressStream";
-  int ifd = nvlist_get_descriptor(msg, "ifd");
-  int ofd = nvlist_get_descriptor(msg, "ofd");
+static int proxied_BZ2_bzDecompressInit(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzDecompressInit";
   int verbosity = nvlist_get_number(msg, "verbosity");
   int small = nvlist_get_number(msg, "small");
+  uint64_t handle = 0;
+  int retval = BZ_MEM_ERROR;
+
+  api_("=> %s(%d, %d)", method, verbosity, small);
+  struct DriverStream *s = StreamOpen(msg, 0);
+  if (s) {
+    retval = BZ2_bzDecompressInit(&s->strm, verbosity, small);
+    if (retval == BZ_OK) handle = StreamAdd(s);
+    if (handle == 0) {
+      if (retval == BZ_OK) {
+        BZ2_bzDecompressEnd(&s->strm);
+        retval = BZ_MEM_ERROR;
+      }
+      munmap(s->shm, s->shm_len);
+      free(s);
+    }
+  }
+  api_("=> %s(%d, %d) return %d handle=%lu", method, verbosity, small, retval, (unsigned long)handle);
+  nvlist_add_number(rsp, "retval", retval);
+  nvlist_add_number(rsp, "handle", handle);
+  return 0;
+}
 
-  api_("=> %s(%d, %d, %d, %d)", method, ifd, ofd, verbosity, small);
-  int retval = BZ2_bzDecompressStream(ifd, ofd, verbosity, small);
+static int proxied_BZ2_bzDecompress(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzDecompress";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  if (s == NULL || s->file || s->compress) {
+    nvlist_add_number(rsp, "retval", BZ_PARAM_ERROR);
+    return 0;
+  }
 
-  api_("=> %s(%d, %d, %d, %d) return %d", method, ifd, ofd, verbosity, small, retval);
+  verbose_("=> %s(%lu) in=%zu", method, (unsigned long)handle, ShmRingUsed(&s->in));
+  int retval = BZ_OK;
+  size_t progress;
+  while (ShmRingFree(&s->out) > 0) {
+    retval = StreamStep(s, BZ_RUN, &progress);
+    if (retval != BZ_OK || progress == 0) break;
+  }
+  verbose_("=> %s(%lu) return %d out=%zu", method, (unsigned long)handle, retval, ShmRingUsed(&s->out));
   nvlist_add_number(rsp, "retval", retval);
   return 0;
 }
 
-static int proxied_BZ2_bzTestStream(const nvlist_t *msg, nvlist_t *rsp) {
-  static const char *method = "BZ2_bzTestStream";
-  int ifd = nvlist_get_descriptor(msg, "ifd");
-  int verbosity = nvlist_get_number(msg, "verbosity");
-  int small = nvlist_get_number(msg, "small");
+static int proxied_BZ2_bzDecompressEnd(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzDecompressEnd";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  int retval = BZ_PARAM_ERROR;
+  api_("=> %s(%lu)", method, (unsigned long)handle);
+  if (s && !s->file && !s->compress) {
+    retval = BZ2_bzDecompressEnd(&s->strm);
+    StreamClose(handle);
+  }
+  api_("=> %s(%lu) return %d", method, (unsigned long)handle, retval);
+  nvlist_add_number(rsp, "retval", retval);
+  return 0;
+}
 
-  api_("=> %s(%d, %d, %d)", method, ifd, verbosity, small);
-  int retval = BZ2_bzTestStream(ifd, verbosity, small);
+/* BZFILE entrypoints.  Each request just names the handle: a refill
+ * decompresses into the out ring until it is full, and a drain compresses
+ * what the in ring held when the request arrived, while the stub goes on
+ * reading (or writing) the other end of the ring.  The reply's retval is the
+ * BZFILE's last error. */
+static int proxied_BZ2_bzdopen(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzdopen";
+  const char *mode = nvlist_get_string(msg, "mode");
+  uint64_t handle = 0;
+  int retval = BZ_MEM_ERROR;
 
-  api_("=> %s(%d, %d, %d) return %d", method, ifd, verbosity, small, retval);
+  /* Parsed as BZ2_bzdopen() does, but the FILE is opened here so that the
+     stream records who owns the fd */
+  int writing = 0;
+  int small = 0;
+  int blockSize100k = 9;
+  const char *m;
+  for (m = mode; *m; m++) {
+    if (*m == 'r') writing = 0;
+    if (*m == 'w') writing = 1;
+    if (*m == 's') small = 1;
+    if (*m >= '0' && *m <= '9') blockSize100k = *m - '0';
+  }
+  if (blockSize100k < 1) blockSize100k = 1;
+  /* A copy, as the request's fd is closed with the request */
+  int fd = dup(nvlist_get_descriptor(msg, "fd"));
+  api_("=> %s(%d, '%s')", method, fd, mode);
+  struct DriverStream *s = StreamOpen(msg, writing);
+  if (s && fd >= 0) {
+    s->fp = fdopen(fd, writing ? "wb" : "rb");
+    if (s->fp == NULL) retval = BZ_IO_ERROR;
+  }
+  if (s == NULL || s->fp == NULL) {
+    /* Still ours: nothing took it over */
+    if (fd >= 0) close(fd);
+  } else {
+    int bzerr;
+    s->file = writing ? BZ2_bzWriteOpen(&bzerr, s->fp, blockSize100k, 0, 30)
+                      : BZ2_bzReadOpen(&bzerr, s->fp, 0, small, NULL, 0);
+    retval = bzerr;
+    if (s->file) {
+      handle = StreamAdd(s);
+      if (handle == 0) retval = BZ_MEM_ERROR;
+    }
+  }
+  if (s && handle == 0) StreamFree(s);
+  api_("=> %s(%d, '%s') return %d handle=%lu", method, fd, mode, retval, (unsigned long)handle);
   nvlist_add_number(rsp, "retval", retval);
+  nvlist_add_number(rsp, "handle", handle);
   return 0;
 }
 
-static int proxied_BZ2_bzlibVersion(const nvlist_t *msg, nvlist_t *rsp) {
-  static const char *method = "BZ2_bzlibVersion";
-  api_("=> %s()", method);
-  const char * retval = BZ2_bzlibVersion();
-  api_("=> %s()", method);
-  nvlist_add_string(rsp, "retval", retval);
+static int proxied_BZ2_bzread(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzread";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  if (s == NULL || s->file == NULL || s->compress) {
+    nvlist_add_number(rsp, "retval", BZ_PARAM_ERROR);
+    return 0;
+  }
+
+  int bzerr = BZ_OK;
+  while (bzerr == BZ_OK) {
+    unsigned char *optr;
+    size_t olen = ShmRingWritable(&s->out, &optr);
+    if (olen == 0) break;
+    int n = BZ2_bzRead(&bzerr, s->file, optr, olen > INT_MAX ? INT_MAX : (int)olen);
+    if (n > 0 && (bzerr == BZ_OK || bzerr == BZ_STREAM_END)) ShmRingProduce(&s->out, n);
+  }
+  verbose_("=> %s(%lu) return %d out=%zu", method, (unsigned long)handle, bzerr, ShmRingUsed(&s->out));
+  nvlist_add_number(rsp, "retval", bzerr);
+  return 0;
+}
+
+static int proxied_BZ2_bzwrite(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzwrite";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  if (s == NULL || s->file == NULL || !s->compress) {
+    nvlist_add_number(rsp, "retval", BZ_PARAM_ERROR);
+    return 0;
+  }
+
+  /* Just what was there on arrival, so that a busy writer can't hold us */
+  size_t want = ShmRingUsed(&s->in);
+  int bzerr = BZ_OK;
+  verbose_("=> %s(%lu) in=%zu", method, (unsigned long)handle, want);
+  while (want > 0 && bzerr == BZ_OK) {
+    unsigned char *iptr;
+    size_t ilen = ShmRingReadable(&s->in, &iptr);
+    if (ilen > want) ilen = want;
+    if (ilen > INT_MAX) ilen = INT_MAX;
+    BZ2_bzWrite(&bzerr, s->file, iptr, (int)ilen);
+    ShmRingConsume(&s->in, ilen);
+    want -= ilen;
+  }
+  verbose_("=> %s(%lu) return %d", method, (unsigned long)handle, bzerr);
+  nvlist_add_number(rsp, "retval", bzerr);
+  return 0;
+}
+
+static int proxied_BZ2_bzclose(const nvlist_t *msg, nvlist_t *rsp) {
+  static const char *method = "BZ2_bzclose";
+  uint64_t handle = nvlist_get_number(msg, "handle");
+  struct DriverStream *s = StreamGet(handle);
+  int retval = BZ_PARAM_ERROR;
+  api_("=> %s(%lu)", method, (unsigned long)handle);
+  if (s && s->file) {
+    StreamClose(handle);
+    retval = BZ_OK;
+  }
+  api_("=> %s(%lu) return %d", method, (unsigned long)handle, retval);
+  nvlist_add_number(rsp, "retval", retval);
   return 0;
 }
 
 /* This is the general entrypoint for this specific API */
 nvlist_t *APIMessageHandler(const nvlist_t *msg) {
   nvlist_t *rsp = nvlist_create(0);
-  const char *cmd = nvlist_get_string(msg, "cmd");
+  uint64_t method = dnvlist_get_number(msg, "method", IDL_NONE);
   int rc;
 
-  if (strcmp(cmd, "BZ2_bzCompressStream") == 0) {
-    rc = proxied_BZ2_bzCompressStream(msg, rsp);
-  } else if (strcmp(cmd, "BZ2_bzDecompressStream") == 0) {
-    rc = proxied_BZ2_bzDecompressStream(msg, rsp);
-  } else if (strcmp(cmd, "BZ2_bzTestStream") == 0) {
-    rc = proxied_BZ2_bzTestStream(msg, rsp);
-  } else if (strcmp(cmd, "BZ2_bzlibVersion") == 0) {
-    rc = proxied_BZ2_bzlibVersion(msg, rsp);
+  /* Generated handlers by table, then the hand-written ones */
+  if (method < IDL_METHOD_COUNT && idl_handlers[method] != NULL) {
+    rc = idl_handlers[method](msg, rsp);
   } else {
-    rc = -1;
+    switch (method) {
+    case IDL_BZ2_bzCompressInit: rc = proxied_BZ2_bzCompressInit(msg, rsp); break;
+    case IDL_BZ2_bzCompress: rc = proxied_BZ2_bzCompress(msg, rsp); break;
+    case IDL_BZ2_bzCompressEnd: rc = proxied_BZ2_bzCompressEnd(msg, rsp); break;
+    case IDL_BZ2_bzDecompressInit: rc = proxied_BZ2_bzDecompressInit(msg, rsp); break;
+    case IDL_BZ2_bzDecompress: rc = proxied_BZ2_bzDecompress(msg, rsp); break;
+    case IDL_BZ2_bzDecompressEnd: rc = proxied_BZ2_bzDecompressEnd(msg, rsp); break;
+    case IDL_BZ2_bzdopen: rc = proxied_BZ2_bzdopen(msg, rsp); break;
+    case IDL_BZ2_bzread: rc = proxied_BZ2_bzread(msg, rsp); break;
+    case IDL_BZ2_bzwrite: rc = proxied_BZ2_bzwrite(msg, rsp); break;
+    case IDL_BZ2_bzclose: rc = proxied_BZ2_bzclose(msg, rsp); break;
+    default:
+      error_("unknown method %lu", (unsigned long)method);
+      rc = -1;
+      break;
+    }
   }
   if (rc != 0) {
     nvlist_destroy(rsp);
@@ -143,3 +485,7 @@ nvlist_t *APIMessageHandler(const nvlist_t *msg) {
   }
   return rsp;
 }
+
+const char *APIMethodName(uint64_t method) {
+  return IdlMethodName((int)method);
+}
@@ -0,0 +1,192 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rpc-util.h"
+#include "bzlib.h"
+#include "bz2-idl.h"
+
+int _rpc_verbose = 4;
+int _rpc_indent = 4;
+
+/* Most fds accepted in one request */
+#define DRIVER_MAX_FDS 1024
+
+/* API-specfic message handler prototype; returns -1 to reject the request,
+ * otherwise it has sent the reply itself and returns the reply's size */
+ssize_t APIMessageHandler(int sock_fd, uint32_t method, const char *data, size_t len,
+                          const int *fds, int nfds);
+/* API-specific name of a method, for tracing */
+const char *APIMethodName(uint32_t method);
+/* API-specific estimate of a request's cost, for daemon scheduling */
+void APIRequestCost(uint32_t method, const char *data, size_t len,
+                    const int *fds, int nfds, struct RpcDaemonCost *cost);
+
+/* Run one request, replying with IDL_NONE if the handler rejects it */
+static ssize_t HandleRequest(int sock_fd, uint32_t method, const char *data, size_t len,
+                             const int *fds, int nfds) {
+  if (RpcTracing()) RpcTraceBegin(APIMethodName(method));
+  ssize_t sent = APIMessageHandler(sock_fd, method, data, len, fds, nfds);
+  if (sent < 0) {
+    error_("rejected request for method %u, %zu bytes, %d fds", method, len, nfds);
+    if (SeqPacketSend(sock_fd, IDL_NONE, NULL, 0, NULL, 0) < 0) {
+      error_("failed to send rejection, %d", errno);
+    }
+    sent = 0;
+  }
+  RpcTraceEnd(len, sent);
+  return sent;
+}
+
+static void MainLoop(int sock_fd) {
+  /* One buffer for all requests, grown to fit the largest */
+  struct iovec buf = { NULL, 0 };
+  int fds[DRIVER_MAX_FDS];
+  while (1) {
+    uint32_t method = IDL_NONE;
+    int nfds = 0;
+    verbose_("blocking read from fd %d...", sock_fd);
+    ssize_t len = SeqPacketRecv(sock_fd, &method, &buf, 1, 1, fds, DRIVER_MAX_FDS, &nfds);
+    if (len < 0) {
+      /* Stub has closed its end of the socket (or sent garbage) */
+      log_("no request on fd %d, errno=%d; exiting", sock_fd, errno);
+      break;
+    }
+    verbose_("handle incoming request on fd %d...", sock_fd);
+    HandleRequest(sock_fd, method, buf.iov_base, len, fds, nfds);
+    for (int ii = 0; ii < nfds; ii++) close(fds[ii]);
+  }
+  free(buf.iov_base);
+}
+
+int main(int argc, char *argv[]) {
+  signal(SIGSEGV, CrashHandler);
+  signal(SIGABRT, CrashHandler);
+  if (argc == 3 && strcmp(argv[1], "--daemon") == 0) {
+    /* Serve many clients from one process, rather than one stub connection */
+    static const struct RpcDaemonOps ops = { HandleRequest, APIRequestCost };
+    api_("'%s' daemon start on '%s'", argv[0], argv[2]);
+    return (RpcDaemonRun(argv[2], &ops) < 0) ? 1 : 0;
+  }
+  int sock_fd = DriverSocket();
+  api_("'%s' program start, parent socket %d", argv[0], sock_fd);
+
+  MainLoop(sock_fd);
+
+  api_("'%s' program stop", argv[0]);
+  return 0;
+}
+
+
+/*****************************************************************************/
+/* Everything above here is generic, and would be useful for any remoted API */
+/*****************************************************************************/
+
+/* Handlers for the self-contained entrypoints, generated from the
+ * annotations in bzlib.h by idolize.py */
+#include "bz2-driver-raw.inc"
+
+ssize_t APIMessageHandler(int sock_fd, uint32_t method, const char *data, size_t len,
+                          const int *fds, int nfds) {
+  if (method >= IDL_METHOD_COUNT || raw_handlers[method] == NULL) {
+    error_("unknown method %u", method);
+    return -1;
+  }
+  return raw_handlers[method](sock_fd, data, len, fds, nfds);
+}
+
+const char *APIMethodName(uint32_t method) {
+  return IdlMethodName(method);
+}
+
+/* Peak memory of libbz2 itself, per bzip2's manual (decompression assumes
+ * the largest block size, as the stream header hasn't been read yet) */
+static size_t CompressMemory(int blockSize100k) {
+  if (blockSize100k < 1 || blockSize100k > 9) return 0;  /* BZ_PARAM_ERROR */
+  return 400000 + 800000 * (size_t)blockSize100k;
+}
+static size_t DecompressMemory(int small) {
+  return 100000 + (small ? 250000 : 400000) * (size_t)9;
+}
+/* Work assumed when the input size can't be known (a pipe, say) */
+#define DEFAULT_WORK (1024 * 1024)
+#define MIN_WORK (64 * 1024)
+
+/* Bytes left to read from fd, or DEFAULT_WORK */
+static uint64_t InputWork(int fd) {
+  struct stat st;
+  off_t offset = lseek(fd, 0, SEEK_CUR);
+  if (offset < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) return DEFAULT_WORK;
+  return (st.st_size > offset) ? st.st_size - offset : 0;
+}
+
+void APIRequestCost(uint32_t method, const char *data, size_t len,
+                    const int *fds, int nfds, struct RpcDaemonCost *cost) {
+  cost->memory = DecompressMemory(0);
+  cost->work = DEFAULT_WORK;
+  /* A malformed request is rejected by its handler; it just needs a cost */
+  switch (method) {
+  case IDL_BZ2_bzCompressStream: {
+    const struct BZ2_bzCompressStreamRequest *req = (const void *)data;
+    if (len < sizeof(*req) || nfds < 1) break;
+    cost->memory = CompressMemory(req->blockSize100k);
+    cost->work = InputWork(fds[0]);
+    break;
+  }
+  case IDL_BZ2_bzDecompressStream: {
+    const struct BZ2_bzDecompressStreamRequest *req = (const void *)data;
+    if (len < sizeof(*req) || nfds < 1) break;
+    cost->memory = DecompressMemory(req->small);
+    cost->work = InputWork(fds[0]);
+    break;
+  }
+  case IDL_BZ2_bzTestStream: {
+    const struct BZ2_bzTestStreamRequest *req = (const void *)data;
+    if (len < sizeof(*req) || nfds < 1) break;
+    cost->memory = DecompressMemory(req->small);
+    cost->work = InputWork(fds[0]);
+    break;
+  }
+  case IDL_BZ2_bzCompressStreams: {
+    /* The streams are compressed one after another */
+    const struct BZ2_bzCompressStreamsRequest *req = (const void *)data;
+    if (len < sizeof(*req) || req->nstreams < 0 || nfds < req->nstreams) break;
+    cost->memory = CompressMemory(req->blockSize100k);
+    cost->work = 0;
+    for (int ii = 0; ii < req->nstreams; ii++) cost->work += InputWork(fds[ii]);
+    break;
+  }
+  case IDL_BZ2_bzBuffToBuffCompress: {
+    const struct BZ2_bzBuffToBuffCompressRequest *req = (const void *)data;
+    if (len < sizeof(*req)) break;
+    cost->memory = CompressMemory(req->blockSize100k) + req->sourceLen + req->destLen;
+    cost->work = req->sourceLen;
+    break;
+  }
+  case IDL_BZ2_bzBuffToBuffDecompress: {
+    const struct BZ2_bzBuffToBuffDecompressRequest *req = (const void *)data;
+    if (len < sizeof(*req)) break;
+    cost->memory = DecompressMemory(req->small) + req->sourceLen + req->destLen;
+    cost->work = req->sourceLen;
+    break;
+  }
+  default:
+    cost->memory = 0;
+    cost->work = 0;
+    break;
+  }
+  if (cost->work < MIN_WORK) cost->work = MIN_WORK;
+}
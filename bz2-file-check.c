@@ -0,0 +1,168 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Round trip through the BZFILE entrypoints (BZ2_bzdopen() and friends),
+ * built against each of the libraries as for bz2-stream-check.  Each case
+ * writes the input with BZ2_bzwrite() calls of one size and reads it back
+ * with BZ2_bzread() calls of the same size; then corrupted and non-bzip2
+ * files are read, and the error that BZ2_bzerror() reports is checked.  Any
+ * failure exits non-zero; otherwise one line per case describes the file
+ * written, and should match byte for byte across libraries. */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+#define SCRATCH "file-check.tmp"
+
+static const int kCallSizes[] = { 1, 7, 4096, 100000, 1 << 20 };
+
+static uint32_t Hash(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t ii = 0; ii < len; ii++) hash = (hash ^ (unsigned char)data[ii]) * 16777619u;
+  return hash;
+}
+
+static char *ReadAll(const char *filename, size_t *len) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  char *data = NULL;
+  char buf[65536];
+  size_t n;
+  *len = 0;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data = realloc(data, *len + n);
+    if (data == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    memcpy(data + *len, buf, n);
+    *len += n;
+  }
+  fclose(f);
+  return data;
+}
+
+static void WriteAll(const char *filename, const char *data, size_t len) {
+  FILE *f = fopen(filename, "wb");
+  if (f == NULL || fwrite(data, 1, len, f) != len || fclose(f) != 0) {
+    perror(filename);
+    exit(1);
+  }
+}
+
+static BZFILE *Open(const char *filename, const char *mode) {
+  int fd = (mode[0] == 'w') ? open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0644)
+                            : open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror(filename);
+    exit(1);
+  }
+  BZFILE *b = BZ2_bzdopen(fd, mode);
+  if (b == NULL) {
+    fprintf(stderr, "BZ2_bzdopen(%s, '%s') failed\n", filename, mode);
+    exit(1);
+  }
+  return b;
+}
+
+/* Read the whole file in calls of size bytes; returns the last BZ2_bzread()
+ * result, with the data in *out and the error code in *err */
+static int ReadFile(const char *filename, int size, char *out, size_t cap,
+                    size_t *outlen, int *err) {
+  BZFILE *b = Open(filename, "r");
+  int rc;
+  *outlen = 0;
+  do {
+    int want = (cap - *outlen < (size_t)size) ? (int)(cap - *outlen) : size;
+    rc = BZ2_bzread(b, out + *outlen, want);
+    if (rc > 0) *outlen += rc;
+  } while (rc > 0);
+  BZ2_bzerror(b, err);
+  BZ2_bzclose(b);
+  return rc;
+}
+
+/* Read a file that should fail partway, and check how */
+static void ExpectError(const char *what, const char *filename, int expected) {
+  char buf[4096];
+  int err;
+  int rc;
+  BZFILE *b = Open(filename, "r");
+  while ((rc = BZ2_bzread(b, buf, sizeof(buf))) > 0)
+    ;
+  BZ2_bzerror(b, &err);
+  BZ2_bzclose(b);
+  if (rc != -1 || err != expected) {
+    fprintf(stderr, "%s: BZ2_bzread returned %d with error %d, expected -1 with %d\n",
+            what, rc, err, expected);
+    exit(1);
+  }
+  printf("%s: error %d\n", what, err);
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = (argc > 1) ? argv[1] : "sample2.ref";
+  size_t len;
+  char *data = ReadAll(filename, &len);
+  size_t cap = len + 1;
+  char *back = malloc(cap);
+  if (back == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  char *compressed = NULL;
+  size_t clen = 0;
+  for (int ii = 0; ii < (int)(sizeof(kCallSizes) / sizeof(kCallSizes[0])); ii++) {
+    int size = kCallSizes[ii];
+    BZFILE *b = Open(SCRATCH, "w9");
+    for (size_t done = 0; done < len; done += size) {
+      int chunk = (len - done < (size_t)size) ? (int)(len - done) : size;
+      if (BZ2_bzwrite(b, data + done, chunk) != chunk) {
+        int err;
+        BZ2_bzerror(b, &err);
+        fprintf(stderr, "calls of %d: BZ2_bzwrite failed with error %d\n", size, err);
+        return 1;
+      }
+    }
+    BZ2_bzflush(b);
+    BZ2_bzclose(b);
+
+    size_t outlen;
+    int err;
+    int rc = ReadFile(SCRATCH, size, back, cap, &outlen, &err);
+    if (rc != 0 || err != BZ_OK || outlen != len || memcmp(back, data, len) != 0) {
+      fprintf(stderr, "calls of %d: read back %zu bytes, ending %d with error %d\n",
+              size, outlen, rc, err);
+      return 1;
+    }
+    free(compressed);
+    compressed = ReadAll(SCRATCH, &clen);
+    printf("calls of %d: %zu bytes to %zu compressed (%08x)\n", size, len, clen, Hash(compressed, clen));
+  }
+
+  /* A flipped byte in the middle of the stream fails its block CRC... */
+  compressed[clen / 2] ^= 0x55;
+  WriteAll(SCRATCH, compressed, clen);
+  ExpectError("corrupt", SCRATCH, BZ_DATA_ERROR);
+  /* ...and input that isn't bzip2 at all is refused from the start */
+  ExpectError("not bzip2", filename, BZ_DATA_ERROR_MAGIC);
+
+  unlink(SCRATCH);
+  free(compressed);
+  free(back);
+  free(data);
+  return 0;
+}
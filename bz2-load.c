@@ -0,0 +1,386 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Load generator for the stream entrypoints, built against each of the
+ * libraries (bz2-load for libbz2.a, bz2-load-<transport> for the stubs).
+ * For each concurrency level M it runs M clients (threads, or processes with
+ * -P) that compress a mix of payloads for a fixed time, then reports the
+ * aggregate throughput, latency percentiles and CPU time per MB.
+ *
+ * Each level runs in a freshly forked process, so it starts with an empty
+ * driver pool, and the CPU time of the clients and of their drivers (which
+ * are terminated and reaped when the level exits) is all accounted to it. */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+#define MAX_PAYLOADS 64
+#define MAX_LEVELS 32
+#define MAX_CLIENTS 1024
+#define MAX_SAMPLES (1 << 16)  /* Latency samples kept per client */
+
+struct Payload {
+  const char *name;
+  int fd;  /* memfd holding the data */
+  uint64_t size;
+};
+
+/* Per-client results, in memory shared with the level and client processes */
+struct ClientResult {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytes;  /* Uncompressed bytes processed */
+  int nsamples;
+  uint64_t samples[MAX_SAMPLES];  /* Call latencies in ns (a uniform sample) */
+};
+
+static struct Payload g_payloads[MAX_PAYLOADS];
+static int g_npayloads = 0;
+static int g_blockSize100k = 9;
+static double g_seconds = 5.0;
+static struct ClientResult *g_results = NULL;
+
+static uint64_t NowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int NewMemfd(const char *name) {
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if (fd < 0) {
+    perror("memfd_create");
+    exit(1);
+  }
+  return fd;
+}
+
+static void AddPayload(const char *name, int fd, uint64_t size) {
+  if (g_npayloads == MAX_PAYLOADS) {
+    fprintf(stderr, "too many payloads (max %d)\n", MAX_PAYLOADS);
+    exit(1);
+  }
+  g_payloads[g_npayloads].name = name;
+  g_payloads[g_npayloads].fd = fd;
+  g_payloads[g_npayloads].size = size;
+  g_npayloads++;
+}
+
+/* Copy a file into a memfd, so that clients don't measure the disk */
+static void AddFilePayload(const char *filename) {
+  int in = open(filename, O_RDONLY|O_CLOEXEC);
+  if (in < 0) {
+    fprintf(stderr, "skipping %s: %s\n", filename, strerror(errno));
+    return;
+  }
+  int fd = NewMemfd(filename);
+  char buf[65536];
+  uint64_t size = 0;
+  ssize_t len;
+  while ((len = read(in, buf, sizeof(buf))) > 0) {
+    if (write(fd, buf, len) != len) {
+      perror("write payload");
+      exit(1);
+    }
+    size += len;
+  }
+  close(in);
+  AddPayload(filename, fd, size);
+}
+
+/* Generated word-like text of the given size */
+static void AddGeneratedPayload(uint64_t size) {
+  static const char *words[] = {
+    "the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog ",
+    "block ", "sorting ", "compressor ", "stream ", "remote ", "driver ", "\n", "bzip2 "
+  };
+  int fd = NewMemfd("generated");
+  char *chunk = malloc(1 << 20);
+  uint32_t seed = (uint32_t)size;
+  uint64_t done = 0;
+  while (done < size) {
+    size_t len = 0;
+    while (len < (1 << 20) - 16) {
+      seed = seed * 1103515245 + 12345;
+      const char *word = words[(seed >> 16) & 15];
+      size_t wlen = strlen(word);
+      memcpy(chunk + len, word, wlen);
+      len += wlen;
+    }
+    if (len > size - done) len = size - done;
+    if (write(fd, chunk, len) != (ssize_t)len) {
+      perror("write payload");
+      exit(1);
+    }
+    done += len;
+  }
+  free(chunk);
+  char *name = malloc(32);
+  snprintf(name, 32, "generated-%llu", (unsigned long long)size);
+  AddPayload(name, fd, size);
+}
+
+/* Sizes like 4096, 64K, 16M or 2G */
+static uint64_t ParseSize(const char *str) {
+  char *end;
+  uint64_t size = strtoull(str, &end, 10);
+  switch (*end) {
+  case 'k': case 'K': size <<= 10; break;
+  case 'm': case 'M': size <<= 20; break;
+  case 'g': case 'G': size <<= 30; break;
+  case '\0': break;
+  default:
+    fprintf(stderr, "bad size '%s'\n", str);
+    exit(1);
+  }
+  return size;
+}
+
+/* One client: compress payloads round-robin (starting at its own index)
+ * until the deadline. */
+static void RunClient(int client, uint64_t deadline) {
+  struct ClientResult *result = &g_results[client];
+  unsigned int seed = client + 1;
+  int out = open("/dev/null", O_WRONLY|O_CLOEXEC);
+  int next = client % g_npayloads;
+  char path[64];
+  while (NowNs() < deadline) {
+    struct Payload *payload = &g_payloads[next];
+    next = (next + 1) % g_npayloads;
+    /* A separate open file description per call, for its own offset */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", payload->fd);
+    int in = open(path, O_RDONLY|O_CLOEXEC);
+    if (in < 0) {
+      perror("reopen payload");
+      exit(1);
+    }
+    uint64_t start = NowNs();
+    int rc = BZ2_bzCompressStream(in, out, g_blockSize100k, 0, 0);
+    uint64_t elapsed = NowNs() - start;
+    close(in);
+
+    result->calls++;
+    if (rc != BZ_OK) {
+      result->errors++;
+      continue;
+    }
+    result->bytes += payload->size;
+    if (result->nsamples < MAX_SAMPLES) {
+      result->samples[result->nsamples++] = elapsed;
+    } else {
+      uint64_t slot = rand_r(&seed) % result->calls;
+      if (slot < MAX_SAMPLES) result->samples[slot] = elapsed;
+    }
+  }
+  close(out);
+}
+
+struct ThreadArg {
+  int client;
+  uint64_t deadline;
+};
+
+static void *ClientThread(void *data) {
+  struct ThreadArg *arg = (struct ThreadArg *)data;
+  RunClient(arg->client, arg->deadline);
+  return NULL;
+}
+
+/* Body of the per-level process */
+static void RunLevel(int nclients, int use_processes) {
+  uint64_t deadline = NowNs() + (uint64_t)(g_seconds * 1e9);
+  int ii;
+  if (use_processes) {
+    for (ii = 0; ii < nclients; ii++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+        RunClient(ii, deadline);
+        exit(0);  /* not _exit(), so the stub's pool terminates its drivers */
+      }
+      if (pid < 0) {
+        perror("fork client");
+        exit(1);
+      }
+    }
+    while (wait(NULL) > 0 || errno == EINTR)
+      ;
+  } else {
+    pthread_t threads[MAX_CLIENTS];
+    struct ThreadArg args[MAX_CLIENTS];
+    for (ii = 0; ii < nclients; ii++) {
+      args[ii].client = ii;
+      args[ii].deadline = deadline;
+      if (pthread_create(&threads[ii], NULL, ClientThread, &args[ii]) != 0) {
+        fprintf(stderr, "failed to start client thread %d\n", ii);
+        exit(1);
+      }
+    }
+    for (ii = 0; ii < nclients; ii++) pthread_join(threads[ii], NULL);
+  }
+}
+
+static double CpuSeconds(const struct rusage *ru) {
+  return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6 +
+         ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+}
+
+static int CompareU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double PercentileMs(const uint64_t *sorted, int count, double pct) {
+  if (count == 0) return 0.0;
+  return sorted[(int)((count - 1) * pct / 100.0)] / 1e6;
+}
+
+/* Run one concurrency level and print its line of results */
+static void Level(int nclients, int use_processes) {
+  memset(g_results, 0, nclients * sizeof(struct ClientResult));
+  struct rusage before, after;
+  getrusage(RUSAGE_CHILDREN, &before);
+  fflush(stdout);  /* else the child's exit() flushes it again */
+  uint64_t start = NowNs();
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork level");
+    exit(1);
+  }
+  if (pid == 0) {
+    RunLevel(nclients, use_processes);
+    exit(0);
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+    ;
+  double wall = (NowNs() - start) / 1e9;
+  getrusage(RUSAGE_CHILDREN, &after);
+  double cpu = CpuSeconds(&after) - CpuSeconds(&before);
+
+  uint64_t calls = 0, errors = 0, bytes = 0;
+  int nsamples = 0;
+  int ii;
+  for (ii = 0; ii < nclients; ii++) nsamples += g_results[ii].nsamples;
+  uint64_t *samples = malloc((nsamples + 1) * sizeof(uint64_t));
+  nsamples = 0;
+  for (ii = 0; ii < nclients; ii++) {
+    struct ClientResult *result = &g_results[ii];
+    calls += result->calls;
+    errors += result->errors;
+    bytes += result->bytes;
+    memcpy(samples + nsamples, result->samples, result->nsamples * sizeof(uint64_t));
+    nsamples += result->nsamples;
+  }
+  qsort(samples, nsamples, sizeof(uint64_t), CompareU64);
+  double mb = bytes / 1e6;
+  printf("%7d %8llu %6llu %8.2f %9.2f %9.2f %9.2f %9.2f %9.2f %8.2f %9.2f\n",
+         nclients, (unsigned long long)calls, (unsigned long long)errors,
+         mb / wall,
+         PercentileMs(samples, nsamples, 50), PercentileMs(samples, nsamples, 90),
+         PercentileMs(samples, nsamples, 99), PercentileMs(samples, nsamples, 99.9),
+         nsamples ? samples[nsamples - 1] / 1e6 : 0.0,
+         cpu, mb > 0 ? cpu * 1000 / mb : 0.0);
+  fflush(stdout);
+  free(samples);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "level with %d clients failed, status=%x\n", nclients, status);
+  }
+}
+
+static void Usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-c levels] [-P] [-t seconds] [-b blockSize100k] [-g size]... [file ...]\n", prog);
+  fprintf(stderr, "  -c levels  comma-separated client counts (default 1,2,4,8,16)\n");
+  fprintf(stderr, "  -P         clients are processes rather than threads\n");
+  fprintf(stderr, "  -t secs    run time per level (default 5)\n");
+  fprintf(stderr, "  -b size    blockSize100k (default 9)\n");
+  fprintf(stderr, "  -g size    add a generated payload, with optional K/M/G suffix\n");
+  fprintf(stderr, "  file ...   payload files (default sample*.ref words*, plus -g 1M)\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  static const char *default_files[] = {
+    "sample1.ref", "sample2.ref", "sample3.ref", "words0", "words1", "words2", "words3"
+  };
+  const char *levels_str = "1,2,4,8,16";
+  int use_processes = 0;
+  int generated = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "c:Pt:b:g:")) != -1) {
+    switch (opt) {
+    case 'c': levels_str = optarg; break;
+    case 'P': use_processes = 1; break;
+    case 't': g_seconds = atof(optarg); break;
+    case 'b': g_blockSize100k = atoi(optarg); break;
+    case 'g': AddGeneratedPayload(ParseSize(optarg)); generated++; break;
+    default: Usage(argv[0]);
+    }
+  }
+  if (g_seconds <= 0 || g_blockSize100k < 1 || g_blockSize100k > 9) Usage(argv[0]);
+
+  int levels[MAX_LEVELS];
+  int nlevels = 0;
+  char *copy = strdup(levels_str);
+  char *token;
+  for (token = strtok(copy, ","); token && nlevels < MAX_LEVELS; token = strtok(NULL, ",")) {
+    levels[nlevels] = atoi(token);
+    if (levels[nlevels] < 1 || levels[nlevels] > MAX_CLIENTS) Usage(argv[0]);
+    nlevels++;
+  }
+  free(copy);
+  if (nlevels == 0) Usage(argv[0]);
+
+  int ii;
+  if (optind < argc) {
+    for (ii = optind; ii < argc; ii++) AddFilePayload(argv[ii]);
+  } else {
+    for (ii = 0; ii < (int)(sizeof(default_files) / sizeof(default_files[0])); ii++) {
+      AddFilePayload(default_files[ii]);
+    }
+    if (!generated) AddGeneratedPayload(1 << 20);
+  }
+  if (g_npayloads == 0) {
+    fprintf(stderr, "no payloads\n");
+    exit(1);
+  }
+
+  int max_clients = 0;
+  for (ii = 0; ii < nlevels; ii++) {
+    if (levels[ii] > max_clients) max_clients = levels[ii];
+  }
+  g_results = mmap(NULL, max_clients * sizeof(struct ClientResult), PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (g_results == MAP_FAILED) {
+    perror("mmap results");
+    exit(1);
+  }
+
+  uint64_t total = 0;
+  for (ii = 0; ii < g_npayloads; ii++) total += g_payloads[ii].size;
+  printf("# %s: %s, %.1fs per level, %d payloads (%llu bytes in all)\n", argv[0],
+         use_processes ? "processes" : "threads", g_seconds, g_npayloads,
+         (unsigned long long)total);
+  printf("%7s %8s %6s %8s %9s %9s %9s %9s %9s %8s %9s\n", "clients", "calls", "errors", "MB/s",
+         "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms", "cpu s", "cpu ms/MB");
+  for (ii = 0; ii < nlevels; ii++) Level(levels[ii], use_processes);
+  return 0;
+}
@@ -0,0 +1,57 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* libbz2 entrypoints for libbz2-remote.a, which holds several transports
+ * (each stub, plus the library itself as "direct") and forwards each call to
+ * the current one.  The transport is chosen by RPC_TRANSPORT, or by
+ * RpcTransportUse() at run time; a bz_stream or BZFILE stays with the
+ * transport it was opened on.  The transports built in are listed by
+ * BZ2_REMOTE_TRANSPORTS, as TRANSPORT(name) TRANSPORT(name) ... */
+#include "rpc-util.h"
+#include "bzlib.h"
+#include "bz2-transport.h"
+
+int _rpc_verbose = 4;  /* smaller number => more verbose */
+int _rpc_indent = 0;
+
+#ifndef BZ2_REMOTE_TRANSPORTS
+#error "bz2-remote.c must be built with -DBZ2_REMOTE_TRANSPORTS=..."
+#endif
+
+#define TRANSPORT(t) extern const struct Bz2Transport BZ2_TRANSPORT_NAME(t, transport);
+BZ2_REMOTE_TRANSPORTS
+#undef TRANSPORT
+
+/* Register the transports, and pick one now so that (as with a single-stub
+   library) its driver is opened before main(). */
+static void __attribute__((constructor)) _remote_construct(void) {
+#define TRANSPORT(t) RpcTransportRegister(&BZ2_TRANSPORT_NAME(t, transport).rpc);
+  BZ2_REMOTE_TRANSPORTS
+#undef TRANSPORT
+  RpcTransportCurrent();
+}
+
+static const struct Bz2Transport *CurrentTransport(void) {
+  return (const struct Bz2Transport *)RpcTransportCurrent();
+}
+
+static const struct Bz2Transport *HandleTransport(const void *handle) {
+  return (const struct Bz2Transport *)RpcHandleTransport(handle);
+}
+
+static void Unsupported(const struct Bz2Transport *transport, const char *method) {
+  error_("%s() is not available over transport '%s'", method, transport->rpc.name);
+}
+
+
+/*****************************************************************************/
+/* Everything above here is generic, and would be useful for any remoted API */
+/*****************************************************************************/
+
+
+
+/* Entrypoints dispatching to the current transport's table, generated from
+ * the annotations in bzlib.h by idolize.py */
+#include "bz2-remote.inc"
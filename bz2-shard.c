@@ -0,0 +1,239 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Parallel compression of one large file.  The input is split into ranges of
+ * whole blocks, and each range is compressed as a separate stream by an
+ * asynchronous BZ2_bzCompressStream() call; so when linked into a stub
+ * library, each range goes to its own driver (from the pool), and when linked
+ * into libbz2.a each goes to its own thread.  The streams are written out in
+ * order, giving a multi-stream .bz2 that BZ2_bzDecompressStream() (and stock
+ * bzip2) reads as a whole.
+ *
+ * Each driver reads its range from a pipe, which is filled with splice() so
+ * that the input isn't copied through this process.  The first range is
+ * compressed straight into the output; later ones go to memfds, which are
+ * copied out with sendfile() once the ranges before them are done.
+ *
+ * The number of ranges is at most BZ2_SHARDS, defaulting to the number of
+ * CPUs (which is also the default driver pool size). */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+
+#define MAX_SHARDS 64
+#define SHARD_PIPE_SIZE (1024 * 1024)
+
+struct Shard {
+  off_t offset;  /* Next input byte to feed */
+  off_t end;     /* End of this shard's range */
+  int pipe_fd;   /* Write end of the driver's input, -1 once all fed */
+  int out_fd;    /* Compressed output (memfd), or -1 for the real output */
+  BZASYNC *op;
+};
+
+static int MaxShards(void) {
+  const char *str = getenv("BZ2_SHARDS");
+  int max = str ? atoi(str) : 0;
+  if (max <= 0) max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (max > MAX_SHARDS) max = MAX_SHARDS;
+  return (max > 0) ? max : 1;
+}
+
+/* Move what input will fit into the shard's pipe; returns -1 on error */
+static int FeedShard(int ifd, struct Shard *s) {
+  size_t want = s->end - s->offset;
+  if (want > SHARD_PIPE_SIZE) want = SHARD_PIPE_SIZE;
+  ssize_t n = splice(ifd, &s->offset, s->pipe_fd, NULL, want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+  if (n < 0 && errno == EINVAL) {
+    /* Input can't be spliced from: copy it through a buffer instead */
+    char buf[64 * 1024];
+    if (want > sizeof(buf)) want = sizeof(buf);
+    n = pread(ifd, buf, want, s->offset);
+    if (n > 0) {
+      n = write(s->pipe_fd, buf, n);
+      if (n > 0) s->offset += n;
+    }
+  }
+  if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  if (n == 0) s->end = s->offset;  /* File shorter than it was */
+  if (s->offset >= s->end) {
+    close(s->pipe_fd);
+    s->pipe_fd = -1;
+  }
+  return 0;
+}
+
+/* Returns -1 on error */
+static int FeedShards(int ifd, struct Shard *shards, int nshards) {
+  struct pollfd pfds[MAX_SHARDS];
+  int map[MAX_SHARDS];
+  int rc = 0;
+  /* A driver that dies leaves a pipe with no reader */
+  sigset_t pipe_set, old_set;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+  sigset_t pending;
+  sigpending(&pending);
+  int pipe_pending = sigismember(&pending, SIGPIPE);
+
+  while (rc == 0) {
+    int count = 0;
+    int ii;
+    for (ii = 0; ii < nshards; ii++) {
+      if (shards[ii].pipe_fd < 0) continue;
+      pfds[count].fd = shards[ii].pipe_fd;
+      pfds[count].events = POLLOUT;
+      pfds[count].revents = 0;
+      map[count++] = ii;
+    }
+    if (count == 0) break;
+    if (poll(pfds, count, -1) < 0) {
+      if (errno != EINTR) rc = -1;
+      continue;
+    }
+    for (ii = 0; ii < count && rc == 0; ii++) {
+      if (pfds[ii].revents & (POLLERR|POLLHUP)) {
+        rc = -1;
+      } else if (pfds[ii].revents & POLLOUT) {
+        rc = FeedShard(ifd, &shards[map[ii]]);
+      }
+    }
+  }
+
+  if (!pipe_pending) {
+    struct timespec zero = {0, 0};
+    while (sigtimedwait(&pipe_set, NULL, &zero) == SIGPIPE)
+      ;
+  }
+  pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+  return rc;
+}
+
+/* Copy all of fd to ofd; returns -1 on error */
+static int AppendOutput(int ofd, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) return -1;
+  off_t offset = 0;
+  while (offset < st.st_size) {
+    ssize_t n = sendfile(ofd, fd, &offset, st.st_size - offset);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      char buf[64 * 1024];
+      size_t want = st.st_size - offset;
+      if (want > sizeof(buf)) want = sizeof(buf);
+      n = pread(fd, buf, want, offset);
+      if (n <= 0) return -1;
+      ssize_t done = 0;
+      while (done < n) {
+        ssize_t w = write(ofd, buf + done, n - done);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        done += w;
+      }
+      offset += n;
+      continue;
+    }
+    if (n <= 0) return -1;
+  }
+  return 0;
+}
+
+static void CloseShards(struct Shard *shards, int nshards) {
+  int ii;
+  for (ii = 0; ii < nshards; ii++) {
+    if (shards[ii].pipe_fd >= 0) close(shards[ii].pipe_fd);
+    if (shards[ii].out_fd >= 0) close(shards[ii].out_fd);
+    shards[ii].pipe_fd = shards[ii].out_fd = -1;
+  }
+}
+
+int BZ_API(BZ2_bzCompressStreamParallel)(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
+  struct Shard shards[MAX_SHARDS];
+  int read_fds[MAX_SHARDS];
+  struct stat st;
+  off_t block = (off_t)blockSize100k * 100000;
+  off_t start = lseek(ifd, 0, SEEK_CUR);
+  int nshards = MaxShards();
+  if (nshards < 2 || blockSize100k < 1 || blockSize100k > 9 || start < 0 ||
+      fstat(ifd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size - start < 2 * block) {
+    return BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
+  }
+
+  /* Whole blocks per shard, as evenly spread as possible */
+  off_t len = st.st_size - start;
+  off_t blocks = (len + block - 1) / block;
+  off_t per_shard = ((blocks + nshards - 1) / nshards) * block;
+  nshards = (len + per_shard - 1) / per_shard;
+
+  int ii;
+  for (ii = 0; ii < nshards; ii++) {
+    int fds[2] = {-1, -1};
+    shards[ii].offset = start + ii * per_shard;
+    shards[ii].end = shards[ii].offset + per_shard;
+    if (shards[ii].end > st.st_size) shards[ii].end = st.st_size;
+    shards[ii].op = NULL;
+    shards[ii].out_fd = (ii == 0) ? -1 : memfd_create("bz2-shard", MFD_CLOEXEC);
+    if (pipe2(fds, O_CLOEXEC) == 0) {
+      fcntl(fds[1], F_SETPIPE_SZ, SHARD_PIPE_SIZE);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    }
+    shards[ii].pipe_fd = fds[1];
+    read_fds[ii] = fds[0];
+    if (fds[0] < 0 || (ii > 0 && shards[ii].out_fd < 0)) {
+      /* Out of fds: just do it the ordinary way */
+      CloseShards(shards, ii + 1);
+      while (ii >= 0) {
+        if (read_fds[ii] >= 0) close(read_fds[ii]);
+        ii--;
+      }
+      return BZ2_bzCompressStream(ifd, ofd, blockSize100k, verbosity, workFactor);
+    }
+  }
+
+  int ret = BZ_OK;
+  for (ii = 0; ii < nshards; ii++) {
+    int out = (ii == 0) ? ofd : shards[ii].out_fd;
+    if (ret == BZ_OK) {
+      shards[ii].op = BZ2_bzCompressStreamAsync(read_fds[ii], out, blockSize100k, verbosity, workFactor);
+      if (shards[ii].op == NULL) ret = BZ_IO_ERROR;
+    }
+    close(read_fds[ii]);
+  }
+
+  if (ret == BZ_OK && FeedShards(ifd, shards, nshards) < 0) ret = BZ_IO_ERROR;
+  /* Any drivers still reading see end of file */
+  for (ii = 0; ii < nshards; ii++) {
+    if (shards[ii].pipe_fd >= 0) {
+      close(shards[ii].pipe_fd);
+      shards[ii].pipe_fd = -1;
+    }
+  }
+  lseek(ifd, st.st_size, SEEK_SET);
+
+  /* Streams go out in order, each once those before it are written */
+  for (ii = 0; ii < nshards; ii++) {
+    if (shards[ii].op == NULL) continue;
+    int rc = BZ2_bzAsyncFinish(shards[ii].op);
+    if (rc != BZ_OK && ret == BZ_OK) ret = rc;
+    if (ret == BZ_OK && ii > 0 && AppendOutput(ofd, shards[ii].out_fd) < 0) ret = BZ_IO_ERROR;
+  }
+  CloseShards(shards, nshards);
+  return ret;
+}
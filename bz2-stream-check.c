@@ -0,0 +1,194 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* Round trip through the low-level bz_stream entrypoints, built against each
+ * of the libraries (bz2-stream-check for libbz2.a, bz2-stream-check-<transport>
+ * for the stubs).  Each case feeds the input in avail_in chunks of one size
+ * and takes the output in avail_out chunks of another, then decompresses the
+ * result (followed by some trailing bytes) the same way.  Any round trip that
+ * fails exits non-zero; otherwise one line per case describes the compressed
+ * data and the totals the library reported, and should match byte for byte
+ * across libraries. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bzlib.h"
+
+static const char kTrailer[] = "trailing data after the stream";
+#define TRAILER_LEN (sizeof(kTrailer) - 1)
+
+struct Case {
+  size_t limit;      /* Bytes of input to use, 0 for all */
+  int blockSize100k;
+  size_t in_chunk;   /* avail_in per call */
+  size_t out_chunk;  /* avail_out per call */
+  int flush;         /* BZ_FLUSH halfway through */
+};
+
+static const struct Case kCases[] = {
+  { 20000, 1, 1, 1, 0 },
+  { 0, 9, 4096, 333, 1 },
+  { 0, 9, 1 << 20, 1 << 16, 0 },
+  { 0, 9, 0, 0, 0 },  /* Everything in one call */
+  { 0, 3, 17, 1 << 20, 0 },
+  { 0, 1, 65536, 7, 1 },
+};
+
+static void Fail(int index, const char *what, int rc) {
+  fprintf(stderr, "case %d: %s returned %d\n", index, what, rc);
+  exit(1);
+}
+
+static uint32_t Hash(const char *data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t ii = 0; ii < len; ii++) hash = (hash ^ (unsigned char)data[ii]) * 16777619u;
+  return hash;
+}
+
+static size_t Compress(int index, const struct Case *c, const char *in, size_t len,
+                       char *out, size_t cap) {
+  size_t in_chunk = c->in_chunk ? c->in_chunk : len;
+  size_t out_chunk = c->out_chunk ? c->out_chunk : cap;
+  bz_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  int rc = BZ2_bzCompressInit(&strm, c->blockSize100k, 0, 0);
+  if (rc != BZ_OK) Fail(index, "BZ2_bzCompressInit", rc);
+  size_t used = 0;
+  size_t done = 0;
+  int action = BZ_RUN;
+  int flushed = !c->flush;
+  do {
+    if (strm.avail_in == 0 && used < len) {
+      if (!flushed && used >= len / 2) {
+        action = BZ_FLUSH;
+      } else {
+        strm.next_in = (char *)in + used;
+        strm.avail_in = (len - used < in_chunk) ? len - used : in_chunk;
+        used += strm.avail_in;
+      }
+    }
+    if (strm.avail_in == 0 && used == len && action == BZ_RUN) action = BZ_FINISH;
+    strm.next_out = out + done;
+    strm.avail_out = (cap - done < out_chunk) ? cap - done : out_chunk;
+    if (strm.avail_out == 0) Fail(index, "output buffer full", 0);
+    rc = BZ2_bzCompress(&strm, action);
+    done = strm.next_out - out;
+    if (rc == BZ_RUN_OK && action == BZ_FLUSH) {
+      action = BZ_RUN;
+      flushed = 1;
+    } else if (rc != BZ_RUN_OK && rc != BZ_FLUSH_OK && rc != BZ_FINISH_OK && rc != BZ_STREAM_END) {
+      Fail(index, "BZ2_bzCompress", rc);
+    }
+  } while (rc != BZ_STREAM_END);
+  if (strm.total_in_lo32 != len || strm.total_out_lo32 != done ||
+      strm.total_in_hi32 != 0 || strm.total_out_hi32 != 0) {
+    fprintf(stderr, "case %d: compress totals %u/%u, expected %zu/%zu\n",
+            index, strm.total_in_lo32, strm.total_out_lo32, len, done);
+    exit(1);
+  }
+  rc = BZ2_bzCompressEnd(&strm);
+  if (rc != BZ_OK) Fail(index, "BZ2_bzCompressEnd", rc);
+  return done;
+}
+
+/* Decompress len bytes of a stream followed by the trailer; returns the
+ * input left over once the stream ended */
+static unsigned int Decompress(int index, const struct Case *c, const char *in, size_t len,
+                               char *out, size_t cap, size_t *outlen) {
+  size_t in_chunk = c->in_chunk ? c->in_chunk : len + TRAILER_LEN;
+  size_t out_chunk = c->out_chunk ? c->out_chunk : cap;
+  bz_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  int rc = BZ2_bzDecompressInit(&strm, 0, index & 1);
+  if (rc != BZ_OK) Fail(index, "BZ2_bzDecompressInit", rc);
+  size_t used = 0;
+  size_t done = 0;
+  do {
+    if (strm.avail_in == 0) {
+      if (used == len + TRAILER_LEN) Fail(index, "stream didn't end", 0);
+      strm.next_in = (char *)in + used;
+      strm.avail_in = (len + TRAILER_LEN - used < in_chunk) ? len + TRAILER_LEN - used : in_chunk;
+      used += strm.avail_in;
+    }
+    strm.next_out = out + done;
+    strm.avail_out = (cap - done < out_chunk) ? cap - done : out_chunk;
+    if (strm.avail_out == 0) Fail(index, "output buffer full", 0);
+    rc = BZ2_bzDecompress(&strm);
+    done = strm.next_out - out;
+    if (rc != BZ_OK && rc != BZ_STREAM_END) Fail(index, "BZ2_bzDecompress", rc);
+  } while (rc != BZ_STREAM_END);
+  unsigned int left = strm.avail_in + (len + TRAILER_LEN - used);
+  if (strm.total_in_lo32 != len || strm.total_out_lo32 != done || left != TRAILER_LEN ||
+      memcmp(strm.next_in, kTrailer, strm.avail_in) != 0) {
+    fprintf(stderr, "case %d: decompress totals %u/%u with %u left, expected %zu/%zu with %zu\n",
+            index, strm.total_in_lo32, strm.total_out_lo32, left, len, done, TRAILER_LEN);
+    exit(1);
+  }
+  rc = BZ2_bzDecompressEnd(&strm);
+  if (rc != BZ_OK) Fail(index, "BZ2_bzDecompressEnd", rc);
+  *outlen = done;
+  return left;
+}
+
+int main(int argc, char *argv[]) {
+  static const char *default_files[] = { "sample1.ref", "sample2.ref", "sample3.ref" };
+  const char **files = default_files;
+  int nfiles = sizeof(default_files) / sizeof(default_files[0]);
+  if (argc > 1) {
+    files = (const char **)argv + 1;
+    nfiles = argc - 1;
+  }
+  char *data = NULL;
+  size_t len = 0;
+  for (int ii = 0; ii < nfiles; ii++) {
+    FILE *f = fopen(files[ii], "rb");
+    if (f == NULL) {
+      perror(files[ii]);
+      return 1;
+    }
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+      data = realloc(data, len + n);
+      if (data == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+      }
+      memcpy(data + len, buf, n);
+      len += n;
+    }
+    fclose(f);
+  }
+
+  size_t cap = len + len / 100 + 600 + TRAILER_LEN;
+  char *compressed = malloc(cap);
+  char *back = malloc(len + 1);
+  if (compressed == NULL || back == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (int ii = 0; ii < (int)(sizeof(kCases) / sizeof(kCases[0])); ii++) {
+    const struct Case *c = &kCases[ii];
+    size_t in_len = (c->limit && c->limit < len) ? c->limit : len;
+    size_t clen = Compress(ii, c, data, in_len, compressed, cap - TRAILER_LEN);
+    memcpy(compressed + clen, kTrailer, TRAILER_LEN);
+    size_t dlen;
+    unsigned int left = Decompress(ii, c, compressed, clen, back, len + 1, &dlen);
+    if (dlen != in_len || memcmp(back, data, in_len) != 0) {
+      fprintf(stderr, "case %d: round trip gave %zu bytes, not the %zu in\n", ii, dlen, in_len);
+      return 1;
+    }
+    printf("case %d: %zu bytes at -%d, avail_in %zu, avail_out %zu%s: %zu compressed (%08x), %u left\n",
+           ii, in_len, c->blockSize100k, c->in_chunk, c->out_chunk, c->flush ? ", flushed" : "",
+           clen, Hash(compressed, clen), left);
+  }
+  free(back);
+  free(compressed);
+  free(data);
+  return 0;
+}
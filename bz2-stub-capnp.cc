@@ -19,60 +19,73 @@
 #include "rpc-util.h"
 
 #include <memory>
+#include <vector>
 #include <capnp/ez-rpc.h>
 
 #include "bzlib.capnp.h"
+#include "bzlib.h"
 
+#ifndef RPC_TRANSPORT  // else one of several, in libbz2-remote.a
 int _rpc_verbose = 4;  // smaller number => more verbose
 int _rpc_indent = 0;
+#endif
 
 static const char *g_exe_file = "./bz2-driver-capnp";
 static int g_exe_fd = -1;  // File descriptor to driver executable
 /* Before main(), get an FD for the driver program, so that it is still
    accessible even if the application enters a sandbox. */
-void __attribute__((constructor)) _stub_construct(void) {
+extern "C" void RPC_STUB_INIT _stub_construct(void) {
   g_exe_fd = OpenDriver(g_exe_file);
 }
 
+// Local to this file, as libbz2-remote.a links other stubs alongside it.
+namespace {
+
 class DriverConnection {
 public:
-  DriverConnection() : pid_(-1), server_address_(nullptr) {
+  // On failure, client() is null.
+  DriverConnection() : pid_(-1), sock_fd_(-1), server_address_(nullptr) {
     // Create socket for bootstrap communication with child.
     int socket_fds[2] = {-1, -1};
-    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds);
+    int rc = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, socket_fds);
     if (rc < 0) {
-      fatal_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+      error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+      return;
     }
     api_("DriverConnection(g_exe_fd=%d, '%s')", g_exe_fd, g_exe_file);
 
-    pid_ = fork();
-    if (pid_ < 0) {
-      fatal_("failed to fork, errno=%d (%s)", errno, strerror(errno));
-    }
-
-    if (pid_ == 0) {
-      // Child process: run the driver
-      close(socket_fds[0]);
-      RunDriver(g_exe_fd, g_exe_file, socket_fds[1]);
-    }
     sock_fd_ = socket_fds[0];
+    pid_ = SpawnDriver(g_exe_fd, g_exe_file, socket_fds[1]);
     close(socket_fds[1]);
+    if (pid_ < 0) {
+      error_("failed to start driver, errno=%d (%s)", errno, strerror(errno));
+      return;
+    }
+    uint64_t start = RpcNow();
 
     // Read bootstrap information back from the child:
     // uint32_t len, char server_addr[len]
-    uint32_t len;
+    uint32_t len = 0;
     rc = read(sock_fd_, &len, sizeof(len));
-    assert (rc == sizeof(len));
-    server_address_ = (char *)malloc(len);
-    rc = read(sock_fd_, server_address_, len);
-    assert (len == (uint32_t)rc);
+    if (rc == sizeof(len) && len > 0 && len <= 4096) {
+      server_address_ = (char *)malloc(len);
+    }
+    if (server_address_ == nullptr ||
+        read(sock_fd_, server_address_, len) != (ssize_t)len || server_address_[len - 1] != '\0') {
+      error_("no bootstrap address from driver pid=%d", pid_);
+      free(server_address_);
+      server_address_ = nullptr;
+      return;
+    }
 
     client_.reset(new capnp::EzRpcClient(server_address_));
+    RpcPhaseAdd(RPC_PHASE_BOOTSTRAP, start);
   }
 
   ~DriverConnection() {
     api_("~DriverConnection({pid=%d})", pid_);
-    close(sock_fd_);
+    client_.reset();
+    if (sock_fd_ >= 0) close(sock_fd_);
     if (pid_ > 0) {
       TerminateChild(pid_);
       pid_ = 0;
@@ -87,8 +100,17 @@ public:
   }
 
   capnp::EzRpcClient* client() {return client_.get();}
-  bz2::Bz2::Client cap() {return client_->getMain<bz2::Bz2>();}
+  bz2capnp::Bz2::Client cap() {return client_->getMain<bz2capnp::Bz2>();}
   int sock_fd() {return sock_fd_;}
+  pid_t pid() {return pid_;}
+
+  // Close a forked child's copy of the socket that keeps the driver alive,
+  // leaving the driver to the parent.
+  void Disown() {
+    if (sock_fd_ >= 0) close(sock_fd_);
+    sock_fd_ = -1;
+    pid_ = 0;
+  }
 
 private:
   pid_t pid_;  // Child process ID.
@@ -97,6 +119,63 @@ private:
   std::unique_ptr<capnp::EzRpcClient> client_;
 };
 
+static void *CreateConnection(pid_t *pid) {
+  DriverConnection *conn = new DriverConnection();
+  if (conn->client() == nullptr) {
+    delete conn;
+    return nullptr;
+  }
+  *pid = conn->pid();
+  return conn;
+}
+
+static void DestroyConnection(void *conn) {
+  delete static_cast<DriverConnection *>(conn);
+}
+
+// The rest of the connection is leaked: its destructor would remove the
+// parent's socket file.
+static void DisownConnection(void *conn) {
+  static_cast<DriverConnection *>(conn)->Disown();
+}
+
+// Cap'n Proto connections are tied to the event loop of the thread that made
+// them, so each thread checks drivers out of its own pool.
+class ThreadDriverPool {
+public:
+  ThreadDriverPool() {
+    DriverPoolInit(&pool_, CreateConnection, DestroyConnection);
+    pool_.disown = DisownConnection;
+  }
+  ~ThreadDriverPool() { DriverPoolDrain(&pool_); }
+  DriverPool *get() {return &pool_;}
+
+private:
+  DriverPool pool_;
+};
+static thread_local ThreadDriverPool g_pool;
+
+// Checks a driver out of the pool for the lifetime of this object.
+class PooledConnection {
+public:
+  PooledConnection() : slot_(DriverPoolAcquire(g_pool.get())), reusable_(true) {
+    if (slot_ == nullptr) error_("failed to get a driver connection");
+  }
+  ~PooledConnection() {
+    if (slot_ != nullptr) DriverPoolRelease(g_pool.get(), slot_, reusable_);
+  }
+  bool ok() {return slot_ != nullptr;}
+  // The call failed, and the driver may have gone with it: don't reuse it.
+  void Broken() {reusable_ = false;}
+  DriverConnection *operator->() {return static_cast<DriverConnection *>(slot_->conn);}
+
+private:
+  DriverPoolSlot *slot_;
+  bool reusable_;
+};
+
+}  // namespace
+
 //***************************************************************************
 //* Everything above here is generic, and would be useful for any remoted API
 //***************************************************************************
@@ -108,62 +187,179 @@ private:
 extern "C"
 int BZ2_bzCompressStream(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
   static const char *method = "BZ2_bzCompressStream";
-  DriverConnection conn;
-  auto& waitScope = conn.client()->getWaitScope();
-  bz2::Bz2::Client cap = conn.cap();
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  auto& waitScope = conn->client()->getWaitScope();
+  bz2capnp::Bz2::Client cap = conn->cap();
+  uint64_t start = RpcNow();
   auto msg = cap.compressStreamRequest();
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
   msg.setIfd(ifd_nonce);
-  int ofd_nonce = TransferFd(conn.sock_fd(), ofd);
+  int ofd_nonce = TransferFd(conn->sock_fd(), ofd);
   msg.setOfd(ofd_nonce);
   msg.setBlockSize100k(blockSize100k);
   msg.setVerbosity(verbosity);
   msg.setWorkFactor(workFactor);
   api_("%s(%d, %d, %d, %d, %d) =>", method, ifd, ofd, blockSize100k, verbosity, workFactor);
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
   auto promise = msg.send();
-  auto rsp = promise.wait(waitScope);  // blocks till reply arrives
-  int retval = rsp.getResult();
+  int retval = BZ_IO_ERROR;
+  uint64_t reply_bytes = 0;
+  try {
+    auto rsp = promise.wait(waitScope);  // blocks till reply arrives
+    retval = rsp.getResult();
+    if (RpcTracing()) reply_bytes = rsp.totalSize().wordCount * sizeof(capnp::word);
+  } catch (const kj::Exception& e) {
+    error_("%s failed: %s", method, e.getDescription().cStr());
+    conn.Broken();
+  }
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
   api_("%s(%d, %d, %d, %d, %d) return %d <=", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(request_bytes, reply_bytes);
+  return retval;
+}
+
+extern "C"
+int BZ2_bzCompressStreams(int nstreams, const int *ifds, const int *ofds, int *results,
+                          int blockSize100k, int verbosity, int workFactor) {
+  static const char *method = "BZ2_bzCompressStreams";
+  if (nstreams < 0) return BZ_PARAM_ERROR;
+  if (nstreams == 0) return BZ_OK;
+  if (ifds == nullptr || ofds == nullptr || results == nullptr) return BZ_PARAM_ERROR;
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    for (int ii = 0; ii < nstreams; ii++) results[ii] = BZ_IO_ERROR;
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  auto& waitScope = conn->client()->getWaitScope();
+  bz2capnp::Bz2::Client cap = conn->cap();
+  uint64_t start = RpcNow();
+  auto msg = cap.compressStreamsRequest();
+  std::vector<int> fds(ifds, ifds + nstreams);
+  fds.insert(fds.end(), ofds, ofds + nstreams);
+  int nonce = TransferFds(conn->sock_fd(), fds.size(), fds.data());
+  msg.setNonce(nonce);
+  msg.setCount(nstreams);
+  msg.setBlockSize100k(blockSize100k);
+  msg.setVerbosity(verbosity);
+  msg.setWorkFactor(workFactor);
+  api_("%s(%d, ..., %d, %d, %d) =>", method, nstreams, blockSize100k, verbosity, workFactor);
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
+  auto promise = msg.send();
+  int retval = BZ_IO_ERROR;
+  uint64_t reply_bytes = 0;
+  try {
+    auto rsp = promise.wait(waitScope);  // blocks till reply arrives
+    retval = rsp.getResult();
+    auto values = rsp.getResults();
+    for (int ii = 0; ii < nstreams; ii++) {
+      results[ii] = ((unsigned)ii < values.size()) ? values[ii] : BZ_IO_ERROR;
+    }
+    if (RpcTracing()) reply_bytes = rsp.totalSize().wordCount * sizeof(capnp::word);
+  } catch (const kj::Exception& e) {
+    error_("%s failed: %s", method, e.getDescription().cStr());
+    conn.Broken();
+    for (int ii = 0; ii < nstreams; ii++) results[ii] = BZ_IO_ERROR;
+  }
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
+  api_("%s(%d, ..., %d, %d, %d) return %d <=", method, nstreams, blockSize100k, verbosity, workFactor, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(request_bytes, reply_bytes);
   return retval;
 }
 
 extern "C"
 int BZ2_bzDecompressStream(int ifd, int ofd, int verbosity, int small) {
   static const char *method = "BZ2_bzDecompressStream";
-  DriverConnection conn;
-  auto& waitScope = conn.client()->getWaitScope();
-  bz2::Bz2::Client cap = conn.cap();
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  auto& waitScope = conn->client()->getWaitScope();
+  bz2capnp::Bz2::Client cap = conn->cap();
+  uint64_t start = RpcNow();
   auto msg = cap.decompressStreamRequest();
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
   msg.setIfd(ifd_nonce);
-  int ofd_nonce = TransferFd(conn.sock_fd(), ofd);
+  int ofd_nonce = TransferFd(conn->sock_fd(), ofd);
   msg.setOfd(ofd_nonce);
   msg.setVerbosity(verbosity);
   msg.setSmall(small);
   api_("%s(%d, %d, %d, %d) =>", method, ifd, ofd, verbosity, small);
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
   auto promise = msg.send();
-  auto rsp = promise.wait(waitScope);  // blocks till reply arrives
-  int retval = rsp.getResult();
+  int retval = BZ_IO_ERROR;
+  uint64_t reply_bytes = 0;
+  try {
+    auto rsp = promise.wait(waitScope);  // blocks till reply arrives
+    retval = rsp.getResult();
+    if (RpcTracing()) reply_bytes = rsp.totalSize().wordCount * sizeof(capnp::word);
+  } catch (const kj::Exception& e) {
+    error_("%s failed: %s", method, e.getDescription().cStr());
+    conn.Broken();
+  }
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
   api_("%s(%d, %d, %d, %d) return %d <=", method, ifd, ofd, verbosity, small, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(request_bytes, reply_bytes);
   return retval;
 }
 
 extern "C"
 int BZ2_bzTestStream(int ifd, int verbosity, int small) {
   static const char *method = "BZ2_bzTestStream";
-  DriverConnection conn;
-  auto& waitScope = conn.client()->getWaitScope();
-  bz2::Bz2::Client cap = conn.cap();
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  auto& waitScope = conn->client()->getWaitScope();
+  bz2capnp::Bz2::Client cap = conn->cap();
+  uint64_t start = RpcNow();
   auto msg = cap.testStreamRequest();
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
   msg.setIfd(ifd_nonce);
   msg.setVerbosity(verbosity);
   msg.setSmall(small);
   api_("%s(%d, %d, %d) =>", method, ifd, verbosity, small);
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  uint64_t request_bytes = RpcTracing() ? msg.totalSize().wordCount * sizeof(capnp::word) : 0;
   auto promise = msg.send();
-  auto rsp = promise.wait(waitScope);  // blocks till reply arrives
-  int retval = rsp.getResult();
+  int retval = BZ_IO_ERROR;
+  uint64_t reply_bytes = 0;
+  try {
+    auto rsp = promise.wait(waitScope);  // blocks till reply arrives
+    retval = rsp.getResult();
+    if (RpcTracing()) reply_bytes = rsp.totalSize().wordCount * sizeof(capnp::word);
+  } catch (const kj::Exception& e) {
+    error_("%s failed: %s", method, e.getDescription().cStr());
+    conn.Broken();
+  }
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
   api_("%s(%d, %d, %d) return %d <=", method, ifd, verbosity, small, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(request_bytes, reply_bytes);
   return retval;
 }
 
@@ -175,14 +371,22 @@ const char *BZ2_bzlibVersion(void) {
     api_("%s() return '%s' <= (saved)", method, saved_version);
     return saved_version;
   }
-  DriverConnection conn;
-  auto& waitScope = conn.client()->getWaitScope();
-  bz2::Bz2::Client cap = conn.cap();
+  PooledConnection conn;
+  if (!conn.ok()) return NULL;
+  auto& waitScope = conn->client()->getWaitScope();
+  bz2capnp::Bz2::Client cap = conn->cap();
   auto msg = cap.libVersionRequest();
   api_("%s() =>", method);
   auto promise = msg.send();
-  auto rsp = promise.wait(waitScope);  // blocks till reply arrives
-  std::string version = rsp.getVersion();
+  std::string version;
+  try {
+    auto rsp = promise.wait(waitScope);  // blocks till reply arrives
+    version = rsp.getVersion();
+  } catch (const kj::Exception& e) {
+    error_("%s failed: %s", method, e.getDescription().cStr());
+    conn.Broken();
+    return NULL;
+  }
   api_("%s() return '%s' <=", method, version.c_str());
   saved_version = strdup(version.c_str());
   return saved_version;
@@ -17,16 +17,21 @@
 #include <dbus/dbus.h>
 
 #include "rpc-util.h"
+#include "bzlib.h"
 
+#ifndef RPC_TRANSPORT  /* else one of several, in libbz2-remote.a */
 int _rpc_verbose = 4;  /* smaller number => more verbose */
 int _rpc_indent = 0;
+#endif
 
 static const char *g_exe_file = "./bz2-driver-dbus";
 static int g_exe_fd = -1;  /* File descriptor to driver executable */
 /* Before main(), get an FD for the driver program, so that it is still
    accessible even if the application enters a sandbox. */
-void __attribute__((constructor)) _stub_construct(void) {
+void RPC_STUB_INIT _stub_construct(void) {
   g_exe_fd = OpenDriver(g_exe_file);
+  /* Pooled connections get used from whichever thread checks them out */
+  dbus_threads_init_default();
 }
 
 #define DRIVER_OBJECT_PATH_PATTERN "/nonce/xxxxxxxxxxx"
@@ -38,25 +43,46 @@ struct DriverConnection {
   DBusConnection *dbus;
   /* DBus object path '/nonce/xxxxxxxxxxx' */
   char objpath[DRIVER_OBJECT_PATH_LEN];
-} g_conn;
+  /* Start of the current phase of the call in progress (see RpcNow()) */
+  uint64_t phase_start;
+  /* Sizes of the call in progress, if tracing (see RpcTraceEnd()) */
+  uint64_t request_bytes;
+  uint64_t reply_bytes;
+};
+
+static uint64_t MessageSize(DBusMessage *msg) {
+  char *data = NULL;
+  int len = 0;
+  if (!dbus_message_marshal(msg, &data, &len)) return 0;
+  dbus_free(data);
+  return len;
+}
 
 
 static DBusMessage *ConnectionNewRequest(struct DriverConnection *conn, const char *method) {
+  conn->phase_start = RpcNow();
   return dbus_message_new_method_call(NULL, conn->objpath, NULL, method);
 }
 
 static DBusMessage *ConnectionBlockingSendReply(struct DriverConnection *conn,
                                                 DBusMessage *req, DBusError *err) {
   DBusMessage *rsp = NULL;
+  conn->phase_start = RpcPhaseAdd(RPC_PHASE_MARSHAL, conn->phase_start);
+  conn->request_bytes = RpcTracing() ? MessageSize(req) : 0;
   if (!(rsp = dbus_connection_send_with_reply_and_block(conn->dbus, req, -1, err))) {
     error_("!!! send_with_reply_and_block failed: %s: %s", err->name, err->message);
+    dbus_error_free(err);
+    dbus_message_unref(req);
     return NULL;
   }
+  conn->phase_start = RpcPhaseAdd(RPC_PHASE_CALL, conn->phase_start);
+  conn->reply_bytes = RpcTracing() ? MessageSize(rsp) : 0;
   dbus_message_unref(req);
   return rsp;
 }
 
-static void DestroyConnection(struct DriverConnection *conn) {
+static void DestroyConnection(void *data) {
+  struct DriverConnection *conn = (struct DriverConnection *)data;
   api_("DestroyConnection(conn=%p {pid=%d dbus_conn=%p objpath='%s'})",
        conn, conn->pid, conn->dbus, conn->objpath);
 
@@ -70,49 +96,68 @@ static void DestroyConnection(struct DriverConnection *conn) {
     TerminateChild(conn->pid);
     conn->pid = 0;
   }
+  free(conn);
 }
 
-static struct DriverConnection *CreateConnection(void) {
-  struct DriverConnection *conn = &g_conn;
+static void *CreateConnection(pid_t *pid) {
+  struct DriverConnection *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL) {
+    error_("failed to allocate connection");
+    return NULL;
+  }
   /* Create socket for bootstrap communication with child */
   int socket_fds[2] = {-1, -1};
-  int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds);
+  int rc = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, socket_fds);
   if (rc < 0) {
     error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+    free(conn);
     return NULL;
   }
 
   api_("CreateConnection(g_exe_fd=%d, '%s')", g_exe_fd, g_exe_file);
 
-  conn->pid = fork();
+  conn->pid = SpawnDriver(g_exe_fd, g_exe_file, socket_fds[1]);
   if (conn->pid < 0) {
-    error_("failed to fork, errno=%d (%s)", errno, strerror(errno));
-    return NULL;
-  }
-
-  if (conn->pid == 0) {
-    /* Child process: run the driver */
+    error_("failed to start driver, errno=%d (%s)", errno, strerror(errno));
     close(socket_fds[0]);
-    RunDriver(g_exe_fd, g_exe_file, socket_fds[1]);
+    close(socket_fds[1]);
+    free(conn);
+    return NULL;
   }
+  /* Only the driver holds the other end now, so a driver that dies before
+     it is up is seen as EOF */
+  close(socket_fds[1]);
+  uint64_t start = RpcNow();
 
   /* Read bootstrap information back from the child */
   /* First: uint32_t len, char server_add[len] */
-  uint32_t len;
+  uint32_t len = 0;
+  char *server_address = NULL;
   rc = read(socket_fds[0], &len, sizeof(len));
-  assert (rc == sizeof(len));
-  char *server_address = (char *)malloc(len);
-  rc = read(socket_fds[0], server_address, len);
-  assert (rc == len);
+  if (rc == sizeof(len) && len > 0 && len <= 4096) {
+    server_address = (char *)malloc(len);
+  }
+  if (server_address == NULL ||
+      read(socket_fds[0], server_address, len) != (ssize_t)len || server_address[len - 1] != '\0') {
+    error_("no bootstrap address from driver pid=%d", conn->pid);
+    close(socket_fds[0]);
+    free(server_address);
+    DestroyConnection(conn);
+    return NULL;
+  }
   /* Second: uint64_t nonce (used to confirm that the D-Bus connection we set up
    * later is indeed to the child process */
   uint64_t nonce;
   rc = read(socket_fds[0], &nonce, sizeof(nonce));
-  assert (rc == sizeof(nonce));
+  close(socket_fds[0]);
+  if (rc != sizeof(nonce)) {
+    error_("no bootstrap nonce from driver pid=%d", conn->pid);
+    free(server_address);
+    DestroyConnection(conn);
+    return NULL;
+  }
   verbose_("started child process %d, read socket name '%s', nonce %ld",
            conn->pid, server_address, nonce);
-  close(socket_fds[0]);
-  close(socket_fds[1]);
   snprintf(conn->objpath, 20, "/nonce/%ld", nonce);
 
   /* Initialize D-Bus private connection; use the nonce as the object address */
@@ -130,158 +175,88 @@ static struct DriverConnection *CreateConnection(void) {
   free(server_address);
 
   /* Send a no-op message to work around a D-Bus problem (if the first message sent
-     includes a file descriptor, it fails). */
-  DBusMessage *req = ConnectionNewRequest(conn, "__noop");
-  DBusMessage *rsp = ConnectionBlockingSendReply(conn, req, &err);
+     includes a file descriptor, it fails).  This is part of the bootstrap, so
+     it bypasses the per-call accounting in ConnectionBlockingSendReply(). */
+  DBusMessage *req = dbus_message_new_method_call(NULL, conn->objpath, NULL, "__noop");
+  DBusMessage *rsp = dbus_connection_send_with_reply_and_block(conn->dbus, req, -1, &err);
+  dbus_message_unref(req);
   if (rsp == NULL) {
+    error_("!!! send_with_reply_and_block failed: %s: %s", err.name, err.message);
     DestroyConnection(conn);
     return NULL;
   }
   dbus_message_unref(rsp);
+  RpcPhaseAdd(RPC_PHASE_BOOTSTRAP, start);
 
+  *pid = conn->pid;
   return conn;
 }
 
+/* Drivers shared by all threads; each call checks one out for its duration */
+static struct DriverPool g_pool;
 
-/*****************************************************************************/
-/* Everything above here is generic, and would be useful for any remoted API */
-/*****************************************************************************/
-
-
-
-/* RPC-Forwarding versions of libbz2 entrypoints */
-
-int BZ2_bzCompressStream(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
-  static const char *method = "BZ2_bzCompressStream";
-  struct DriverConnection *conn = CreateConnection();
-  DBusMessage *msg = ConnectionNewRequest(conn, method);
-
-  DBusMessageIter msg_it;
-  dbus_message_iter_init_append(msg, &msg_it);
-  dbus_int32_t vx;
-  vx = ifd;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_UNIX_FD, &vx);
-  vx = ofd;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_UNIX_FD, &vx);
-  vx = blockSize100k;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-  vx = verbosity;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-  vx = workFactor;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-
-  DBusError err;
-  dbus_error_init(&err);
-  api_("%s(%d, %d, %d, %d, %d) =>", method, ifd, ofd, blockSize100k, verbosity, workFactor);
-  DBusMessage *rsp = ConnectionBlockingSendReply(conn, msg, &err);
-  assert (rsp != NULL);
-
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init(rsp, &rsp_it);
-  assert (dbus_message_iter_get_arg_type(&rsp_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&rsp_it, &vx);
-  dbus_message_iter_next(&rsp_it);
-  int retval = vx;
-  api_("%s(%d, %d, %d, %d, %d) return %d <=", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
-  dbus_message_unref(rsp);
-  DestroyConnection(conn);
-  return retval;
+static void __attribute__((constructor)) _pool_construct(void) {
+  DriverPoolInit(&g_pool, CreateConnection, DestroyConnection);
 }
 
-int BZ2_bzDecompressStream(int ifd, int ofd, int verbosity, int small) {
-  static const char *method = "BZ2_bzDecompressStream";
-  struct DriverConnection *conn = CreateConnection();
-  DBusMessage *msg = ConnectionNewRequest(conn, method);
-
-  DBusMessageIter msg_it;
-  dbus_message_iter_init_append(msg, &msg_it);
-  dbus_int32_t vx;
-  vx = ifd;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_UNIX_FD, &vx);
-  vx = ofd;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_UNIX_FD, &vx);
-  vx = verbosity;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-  vx = small;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-
-  DBusError err;
-  dbus_error_init(&err);
-  api_("%s(%d, %d, %d, %d) =>", method, ifd, ofd, verbosity, small);
-  DBusMessage *rsp = ConnectionBlockingSendReply(conn, msg, &err);
-  assert (rsp != NULL);
-
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init(rsp, &rsp_it);
-  assert (dbus_message_iter_get_arg_type(&rsp_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&rsp_it, &vx);
-  dbus_message_iter_next(&rsp_it);
-  int retval = vx;
-  api_("%s(%d, %d, %d, %d) return %d <=", method, ifd, ofd, verbosity, small, retval);
-  dbus_message_unref(rsp);
-  DestroyConnection(conn);
-  return retval;
+static void __attribute__((destructor)) _pool_destruct(void) {
+  DriverPoolDrain(&g_pool);
 }
 
-int BZ2_bzTestStream(int ifd, int verbosity, int small) {
-  static const char *method = "BZ2_bzTestStream";
-  struct DriverConnection *conn = CreateConnection();
-  DBusMessage *msg = ConnectionNewRequest(conn, method);
-
-  DBusMessageIter msg_it;
-  dbus_message_iter_init_append(msg, &msg_it);
-  dbus_int32_t vx;
-  vx = ifd;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_UNIX_FD, &vx);
-  vx = verbosity;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
-  vx = small;
-  dbus_message_iter_append_basic(&msg_it, DBUS_TYPE_INT32, &vx);
+/* Finish a call that got no usable reply.  The driver may have gone, so it
+ * is not reused. */
+static void ConnectionCallFailed(const char *method, struct DriverPoolSlot *slot, DBusMessage *rsp) {
+  struct DriverConnection *conn = (struct DriverConnection *)slot->conn;
+  error_("%s: no usable reply from driver pid=%d", method, conn->pid);
+  if (rsp != NULL) dbus_message_unref(rsp);
+  RpcTraceEnd(conn->request_bytes, 0);
+  DriverPoolRelease(&g_pool, slot, 0);
+}
 
-  DBusError err;
-  dbus_error_init(&err);
-  api_("%s(%d, %d, %d) =>", method, ifd, verbosity, small);
-  DBusMessage *rsp = ConnectionBlockingSendReply(conn, msg, &err);
-  assert (rsp != NULL);
 
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init(rsp, &rsp_it);
-  assert (dbus_message_iter_get_arg_type(&rsp_it) == DBUS_TYPE_INT32);
-  dbus_message_iter_get_basic(&rsp_it, &vx);
-  dbus_message_iter_next(&rsp_it);
-  int retval = vx;
-  api_("%s(%d, %d, %d) return %d <=", method, ifd, verbosity, small, retval);
-  dbus_message_unref(rsp);
-  DestroyConnection(conn);
-  return retval;
+/* Read the next argument of a reply, which must have the given basic type */
+static int IterGetBasic(DBusMessageIter *it, int type, void *value) {
+  if (dbus_message_iter_get_arg_type(it) != type) return 0;
+  dbus_message_iter_get_basic(it, value);
+  dbus_message_iter_next(it);
+  return 1;
 }
 
-const char *BZ2_bzlibVersion(void) {
-  static const char *method = "BZ2_bzlibVersion";
-  static const char *saved_version = NULL;
-  if (saved_version) {
-    api_("%s() return '%s' <= (saved)", method, saved_version);
-    return saved_version;
-  }
-
-  struct DriverConnection *conn = CreateConnection();
-  DBusMessage *msg = ConnectionNewRequest(conn, method);
+/* Read the next argument of a reply, which must be an array of the given
+ * fixed type; *value is left pointing into the message */
+static int IterGetFixedArray(DBusMessageIter *it, int type, void *value, int *count) {
+  DBusMessageIter arr_it;
+  if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(it) != type) return 0;
+  dbus_message_iter_recurse(it, &arr_it);
+  dbus_message_iter_get_fixed_array(&arr_it, value, count);
+  dbus_message_iter_next(it);
+  return 1;
+}
 
-  DBusError err;
-  dbus_error_init(&err);
-  api_("%s() =>", method);
-  DBusMessage *rsp = ConnectionBlockingSendReply(conn, msg, &err);
-  assert (rsp != NULL);
+/*****************************************************************************/
+/* Everything above here is generic, and would be useful for any remoted API */
+/*****************************************************************************/
 
-  DBusMessageIter rsp_it;
-  dbus_message_iter_init(rsp, &rsp_it);
-  assert (dbus_message_iter_get_arg_type(&rsp_it) == DBUS_TYPE_STRING);
-  const char *retval;
-  dbus_message_iter_get_basic(&rsp_it, &retval);
-  dbus_message_iter_next(&rsp_it);
-  api_("%s() return '%s' <=", method, retval);
-  saved_version = strdup(retval);
-  dbus_message_unref(rsp);
-  DestroyConnection(conn);
-  return saved_version;
+/* RPC-Forwarding versions of libbz2 entrypoints, generated by idolize.py */
+#include "bz2-stub-dbus.inc"
+
+/* D-Bus sends all of a message's fds in one sendmsg(), so a batch may need
+ * several calls. */
+#define STREAMS_PER_CALL (MAX_FDS_PER_MSG / 2)
+
+int BZ2_bzCompressStreams(int nstreams, const int *ifds, const int *ofds, int *results,
+                          int blockSize100k, int verbosity, int workFactor) {
+  if (nstreams < 0) return BZ_PARAM_ERROR;
+  if (nstreams > 0 && (ifds == NULL || ofds == NULL || results == NULL)) return BZ_PARAM_ERROR;
+  int retval = BZ_OK;
+  int done;
+  for (done = 0; done < nstreams; done += STREAMS_PER_CALL) {
+    int count = nstreams - done;
+    if (count > STREAMS_PER_CALL) count = STREAMS_PER_CALL;
+    int rc = BZ2_bzCompressStreamsCall(count, ifds + done, ofds + done, results + done,
+                                       blockSize100k, verbosity, workFactor);
+    if (rc != BZ_OK && retval == BZ_OK) retval = rc;
+  }
+  return retval;
 }
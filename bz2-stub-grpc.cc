@@ -18,86 +18,299 @@
 
 #include "rpc-util.h"
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <grpc++/grpc++.h>
+#include <grpc++/create_channel_posix.h>
 
 #include "bzlib.grpc.pb.h"
+#include "bzlib.h"
 
+#ifndef RPC_TRANSPORT  // else one of several, in libbz2-remote.a
 int _rpc_verbose = 4;  // smaller number => more verbose
 int _rpc_indent = 0;
+#endif
 
 static const char *g_exe_file = "./bz2-driver-grpc";
 static int g_exe_fd = -1;  // File descriptor to driver executable
 /* Before main(), get an FD for the driver program, so that it is still
    accessible even if the application enters a sandbox. */
-void __attribute__((constructor)) _stub_construct(void) {
+extern "C" void RPC_STUB_INIT _stub_construct(void) {
   g_exe_fd = OpenDriver(g_exe_file);
 }
 
+// Local to this file, as libbz2-remote.a links other stubs alongside it.
+namespace {
+
 class DriverConnection {
 public:
-  DriverConnection() : pid_(-1), server_address_(nullptr), stub_() {
+  // On failure, stub() is null.
+  DriverConnection() : pid_(-1), sock_fd_(-1), stub_() {
     // Create socket for bootstrap communication with child.
     int socket_fds[2] = {-1, -1};
-    int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, socket_fds);
+    int rc = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, socket_fds);
+    if (rc < 0) {
+      error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+      return;
+    }
+    // and a second connected pair to carry the gRPC channel itself (gRPC
+    // needs non-blocking sockets).
+    int channel_fds[2] = {-1, -1};
+    rc = socketpair(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, channel_fds);
     if (rc < 0) {
-      fatal_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+      error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+      close(socket_fds[0]);
+      close(socket_fds[1]);
+      return;
     }
     api_("DriverConnection(g_exe_fd=%d, '%s')", g_exe_fd, g_exe_file);
 
-    pid_ = fork();
+    sock_fd_ = socket_fds[0];
+    pid_ = SpawnDriver(g_exe_fd, g_exe_file, socket_fds[1]);
+    close(socket_fds[1]);
     if (pid_ < 0) {
-      fatal_("failed to fork, errno=%d (%s)", errno, strerror(errno));
+      error_("failed to start driver, errno=%d (%s)", errno, strerror(errno));
+      close(channel_fds[0]);
+      close(channel_fds[1]);
+      return;
     }
+    uint64_t start = RpcNow();
 
-    if (pid_ == 0) {
-      close(socket_fds[0]);
-      // Child process: run the driver
-      RunDriver(g_exe_fd, g_exe_file, socket_fds[1]);
+    // Hand the driver its end of the channel, and use ours as a ready-made
+    // connection (no listening socket, no connect).
+    rc = SendBootstrapFd(sock_fd_, channel_fds[1]);
+    close(channel_fds[1]);
+    if (rc < 0) {
+      error_("failed to pass channel to driver, errno=%d (%s)", errno, strerror(errno));
+      close(channel_fds[0]);
+      return;
     }
-    sock_fd_ = socket_fds[0];
-    close(socket_fds[1]);
-
-    // Read bootstrap information back from the child:
-    // uint32_t len, char server_addr[len]
-    uint32_t len;
-    rc = read(sock_fd_, &len, sizeof(len));
-    assert (rc == sizeof(len));
-    server_address_ = (char *)malloc(len);
-    rc = read(sock_fd_, server_address_, len);
-    assert (len == (uint32_t)rc);
-
-    std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(
-      server_address_, grpc::InsecureChannelCredentials());
+    std::shared_ptr<grpc::Channel> channel = grpc::CreateInsecureChannelFromFd("bz2-driver", channel_fds[0]);
     stub_ = bz2::Bz2::NewStub(channel);
+    RpcPhaseAdd(RPC_PHASE_BOOTSTRAP, start);
   }
 
   ~DriverConnection() {
     api_("~DriverConnection({pid=%d})", pid_);
-    close(sock_fd_);
+    stub_.reset();  // closes the channel
+    if (sock_fd_ >= 0) close(sock_fd_);
     if (pid_ > 0) {
       TerminateChild(pid_);
       pid_ = 0;
     }
-    if (server_address_) {
-      char *filename = server_address_;
-      if (strncmp(filename, "unix:", 5) == 0) filename += 5;
-      log_("remove socket file '%s'", filename);
-      unlink(filename);
-      free(server_address_);
-    }
   }
 
   bz2::Bz2::Stub *stub() {return stub_.get();}
   int sock_fd() {return sock_fd_;}
+  pid_t pid() {return pid_;}
+
+  // Close a forked child's copy of the socket that keeps the driver alive,
+  // leaving the driver to the parent.
+  void Disown() {
+    if (sock_fd_ >= 0) close(sock_fd_);
+    sock_fd_ = -1;
+    pid_ = 0;
+  }
 
 private:
   pid_t pid_;  // Child process ID.
   int sock_fd_;
-  char* server_address_;
   std::unique_ptr<bz2::Bz2::Stub> stub_;
 };
 
+static void *CreateConnection(pid_t *pid) {
+  DriverConnection *conn = new DriverConnection();
+  if (conn->stub() == nullptr) {
+    delete conn;
+    return nullptr;
+  }
+  *pid = conn->pid();
+  return conn;
+}
+
+static void DestroyConnection(void *conn) {
+  delete static_cast<DriverConnection *>(conn);
+}
+
+// gRPC state can't be torn down in a forked child (its threads stayed
+// in the parent), so the rest of the connection is leaked.
+static void DisownConnection(void *conn) {
+  static_cast<DriverConnection *>(conn)->Disown();
+}
+
+// Drivers shared by all threads; each call checks one out for its duration.
+static DriverPool g_pool;
+
+static void __attribute__((constructor)) _pool_construct(void) {
+  DriverPoolInit(&g_pool, CreateConnection, DestroyConnection);
+  g_pool.disown = DisownConnection;
+}
+
+static void __attribute__((destructor)) _pool_destruct(void) {
+  DriverPoolDrain(&g_pool);
+}
+
+// Checks a driver out of the pool for the lifetime of this object.
+class PooledConnection {
+public:
+  PooledConnection() : slot_(DriverPoolAcquire(&g_pool)), reusable_(true) {
+    if (slot_ == nullptr) error_("failed to get a driver connection");
+  }
+  ~PooledConnection() {
+    if (slot_ != nullptr) DriverPoolRelease(&g_pool, slot_, reusable_);
+  }
+  bool ok() {return slot_ != nullptr;}
+  // The call failed, and the driver may have gone with it: don't reuse it.
+  void Broken() {reusable_ = false;}
+  DriverConnection *operator->() {return static_cast<DriverConnection *>(slot_->conn);}
+
+private:
+  DriverPoolSlot *slot_;
+  bool reusable_;
+};
+
+// With BZ2_GRPC_TARGET set, calls go to the stand-alone service at that
+// address rather than to a local driver; fds can't be passed to it, so the
+// stream entrypoints send the data in-band.
+static bz2::Bz2::Stub *RemoteStub() {
+  static std::unique_ptr<bz2::Bz2::Stub> stub = []() {
+    std::unique_ptr<bz2::Bz2::Stub> remote;
+    const char *target = getenv("BZ2_GRPC_TARGET");
+    if (target && *target) {
+      log_("using remote service at %s", target);
+      remote = bz2::Bz2::NewStub(grpc::CreateChannel(target, grpc::InsecureChannelCredentials()));
+    }
+    return remote;
+  }();
+  return stub.get();
+}
+
+// Whether to send data in-band rather than passing fds.  BZ2_GRPC_CHUNKS=1
+// does this for local drivers too.
+static bool UseChunks() {
+  static const bool chunks = (RemoteStub() != nullptr ||
+                              (getenv("BZ2_GRPC_CHUNKS") && atoi(getenv("BZ2_GRPC_CHUNKS"))));
+  return chunks;
+}
+
+// The remote service if there is one, otherwise a pooled local driver.
+class ServiceStub {
+public:
+  ServiceStub() : stub_(RemoteStub()) {
+    if (stub_ == nullptr) {
+      conn_.reset(new PooledConnection);
+      if (conn_->ok()) stub_ = (*conn_)->stub();
+    }
+  }
+  bool ok() {return stub_ != nullptr;}
+  void Broken() {if (conn_) conn_->Broken();}
+  bz2::Bz2::Stub *operator->() {return stub_;}
+
+private:
+  std::unique_ptr<PooledConnection> conn_;
+  bz2::Bz2::Stub *stub_;
+};
+
+// Sizes for in-band data: each message carries up to kChunkSize bytes, and at
+// most kWindowSize bytes of input are sent ahead of the service's acks.
+static const size_t kChunkSize = 64 * 1024;
+static const uint64_t kWindowSize = 1024 * 1024;
+
+static bool ReadAll(int fd, std::string *buf, size_t *len) {
+  *len = 0;
+  while (*len < buf->size()) {
+    ssize_t rc = read(fd, &(*buf)[*len], buf->size() - *len);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) return false;
+    if (rc == 0) break;
+    *len += rc;
+  }
+  return true;
+}
+
+static bool WriteAll(int fd, const std::string &buf) {
+  size_t done = 0;
+  while (done < buf.size()) {
+    ssize_t rc = write(fd, buf.data() + done, buf.size() - done);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) return false;
+    done += rc;
+  }
+  return true;
+}
+
+// Send the contents of ifd over a chunked call, starting with the parameters
+// in *msg, and write the output to ofd (if >= 0).  Output is collected on a
+// separate thread, so the service never blocks on a full connection.  If the
+// call itself fails, the service is marked broken.
+template <typename Request>
+static int StreamChunks(ServiceStub *service, grpc::ClientContext *context,
+                        grpc::ClientReaderWriter<Request, bz2::DataChunk> *stream,
+                        Request *msg, int ifd, int ofd) {
+  std::mutex mu;
+  std::condition_variable cv;
+  uint64_t acked = 0;
+  bool finished = false;
+  int retval = BZ_IO_ERROR;  // Unless the service says otherwise
+
+  std::thread reader([&]() {
+    bz2::DataChunk rsp;
+    bool write_ok = true;
+    while (stream->Read(&rsp)) {
+      if (ofd >= 0 && write_ok && !WriteAll(ofd, rsp.data())) {
+        error_("failed to write output, errno=%d (%s)", errno, strerror(errno));
+        write_ok = false;
+      }
+      std::lock_guard<std::mutex> lock(mu);
+      acked = rsp.acked();
+      if (rsp.done()) retval = write_ok ? rsp.result() : BZ_IO_ERROR;
+      cv.notify_one();
+    }
+    std::lock_guard<std::mutex> lock(mu);
+    finished = true;
+    cv.notify_one();
+  });
+
+  std::string buf(kChunkSize, '\0');
+  uint64_t sent = 0;
+  bool read_ok = true;
+  while (true) {
+    size_t len;
+    read_ok = ReadAll(ifd, &buf, &len);
+    if (!read_ok) {
+      error_("failed to read input, errno=%d (%s)", errno, strerror(errno));
+      context->TryCancel();
+      break;
+    }
+    if (len == 0 && sent > 0) break;
+    msg->mutable_data()->assign(buf.data(), len);
+    {
+      std::unique_lock<std::mutex> lock(mu);
+      cv.wait(lock, [&]() {return finished || sent - acked < kWindowSize;});
+      if (finished) break;
+    }
+    if (!stream->Write(*msg)) break;
+    sent += len;
+    if (len < kChunkSize) break;
+    msg->Clear();
+  }
+  stream->WritesDone();
+  reader.join();
+  grpc::Status status = stream->Finish();
+  if (!status.ok()) {
+    error_("chunked call failed: %s", status.error_message().c_str());
+    service->Broken();
+    return BZ_IO_ERROR;
+  }
+  return read_ok ? retval : BZ_IO_ERROR;
+}
+
+}  // namespace
+
 //***************************************************************************
 //* Everything above here is generic, and would be useful for any remoted API
 //***************************************************************************
@@ -109,62 +322,216 @@ private:
 extern "C"
 int BZ2_bzCompressStream(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
   static const char *method = "BZ2_bzCompressStream";
-  DriverConnection conn;
+  if (UseChunks()) {
+    ServiceStub stub;
+    if (!stub.ok()) return BZ_IO_ERROR;
+    bz2::CompressChunk msg;
+    grpc::ClientContext context;
+    msg.set_blocksize100k(blockSize100k);
+    msg.set_verbosity(verbosity);
+    msg.set_workfactor(workFactor);
+    api_("%s(%d, %d, %d, %d, %d) => (chunked)", method, ifd, ofd, blockSize100k, verbosity, workFactor);
+    auto stream = stub->CompressChunks(&context);
+    int retval = StreamChunks(&stub, &context, stream.get(), &msg, ifd, ofd);
+    api_("%s(%d, %d, %d, %d, %d) return %d <=", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+    return retval;
+  }
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   bz2::CompressStreamRequest msg;
   bz2::CompressStreamReply rsp;
   grpc::ClientContext context;
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
+  int ofd_nonce = TransferFd(conn->sock_fd(), ofd);
+  uint64_t start = RpcNow();
   msg.set_ifd(ifd_nonce);
-  int ofd_nonce = TransferFd(conn.sock_fd(), ofd);
   msg.set_ofd(ofd_nonce);
   msg.set_blocksize100k(blockSize100k);
   msg.set_verbosity(verbosity);
   msg.set_workfactor(workFactor);
   api_("%s(%d, %d, %d, %d, %d) =>", method, ifd, ofd, blockSize100k, verbosity, workFactor);
-  grpc::Status status = conn.stub()->CompressStream(&context, msg, &rsp);
-  assert(status.ok());
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  grpc::Status status = conn->stub()->CompressStream(&context, msg, &rsp);
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
+  if (!status.ok()) {
+    error_("%s failed: %s", method, status.error_message().c_str());
+    conn.Broken();
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   int retval = rsp.result();
   api_("%s(%d, %d, %d, %d, %d) return %d <=", method, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(msg.ByteSizeLong(), rsp.ByteSizeLong());
+  return retval;
+}
+
+extern "C"
+int BZ2_bzCompressStreams(int nstreams, const int *ifds, const int *ofds, int *results,
+                          int blockSize100k, int verbosity, int workFactor) {
+  static const char *method = "BZ2_bzCompressStreams";
+  if (nstreams < 0) return BZ_PARAM_ERROR;
+  if (nstreams == 0) return BZ_OK;
+  if (ifds == nullptr || ofds == nullptr || results == nullptr) return BZ_PARAM_ERROR;
+  if (UseChunks()) {
+    // No fds to batch up; each stream has to go in-band separately.
+    int retval = BZ_OK;
+    for (int ii = 0; ii < nstreams; ii++) {
+      results[ii] = BZ2_bzCompressStream(ifds[ii], ofds[ii], blockSize100k, verbosity, workFactor);
+      if (results[ii] != BZ_OK && retval == BZ_OK) retval = results[ii];
+    }
+    return retval;
+  }
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    for (int ii = 0; ii < nstreams; ii++) results[ii] = BZ_IO_ERROR;
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  bz2::CompressStreamsRequest msg;
+  bz2::CompressStreamsReply rsp;
+  grpc::ClientContext context;
+  std::vector<int> fds(ifds, ifds + nstreams);
+  fds.insert(fds.end(), ofds, ofds + nstreams);
+  int nonce = TransferFds(conn->sock_fd(), fds.size(), fds.data());
+  uint64_t start = RpcNow();
+  msg.set_nonce(nonce);
+  msg.set_count(nstreams);
+  msg.set_blocksize100k(blockSize100k);
+  msg.set_verbosity(verbosity);
+  msg.set_workfactor(workFactor);
+  api_("%s(%d, ..., %d, %d, %d) =>", method, nstreams, blockSize100k, verbosity, workFactor);
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  grpc::Status status = conn->stub()->CompressStreams(&context, msg, &rsp);
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
+  if (!status.ok()) {
+    error_("%s failed: %s", method, status.error_message().c_str());
+    conn.Broken();
+    for (int ii = 0; ii < nstreams; ii++) results[ii] = BZ_IO_ERROR;
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
+  int retval = rsp.result();
+  for (int ii = 0; ii < nstreams; ii++) {
+    results[ii] = (ii < rsp.results_size()) ? rsp.results(ii) : BZ_IO_ERROR;
+  }
+  api_("%s(%d, ..., %d, %d, %d) return %d <=", method, nstreams, blockSize100k, verbosity, workFactor, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(msg.ByteSizeLong(), rsp.ByteSizeLong());
   return retval;
 }
 
 extern "C"
 int BZ2_bzDecompressStream(int ifd, int ofd, int verbosity, int small) {
   static const char *method = "BZ2_bzDecompressStream";
-  DriverConnection conn;
+  if (UseChunks()) {
+    ServiceStub stub;
+    if (!stub.ok()) return BZ_IO_ERROR;
+    bz2::DecompressChunk msg;
+    grpc::ClientContext context;
+    msg.set_verbosity(verbosity);
+    msg.set_small(small);
+    api_("%s(%d, %d, %d, %d) => (chunked)", method, ifd, ofd, verbosity, small);
+    auto stream = stub->DecompressChunks(&context);
+    int retval = StreamChunks(&stub, &context, stream.get(), &msg, ifd, ofd);
+    api_("%s(%d, %d, %d, %d) return %d <=", method, ifd, ofd, verbosity, small, retval);
+    return retval;
+  }
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   bz2::DecompressStreamRequest msg;
   bz2::DecompressStreamReply rsp;
   grpc::ClientContext context;
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
+  int ofd_nonce = TransferFd(conn->sock_fd(), ofd);
+  uint64_t start = RpcNow();
   msg.set_ifd(ifd_nonce);
-  int ofd_nonce = TransferFd(conn.sock_fd(), ofd);
   msg.set_ofd(ofd_nonce);
   msg.set_verbosity(verbosity);
   msg.set_small(small);
   api_("%s(%d, %d, %d, %d) =>", method, ifd, ofd, verbosity, small);
-  grpc::Status status = conn.stub()->DecompressStream(&context, msg, &rsp);
-  assert(status.ok());
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  grpc::Status status = conn->stub()->DecompressStream(&context, msg, &rsp);
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
+  if (!status.ok()) {
+    error_("%s failed: %s", method, status.error_message().c_str());
+    conn.Broken();
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   int retval = rsp.result();
   api_("%s(%d, %d, %d, %d) return %d <=", method, ifd, ofd, verbosity, small, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(msg.ByteSizeLong(), rsp.ByteSizeLong());
   return retval;
 }
 
 extern "C"
 int BZ2_bzTestStream(int ifd, int verbosity, int small) {
   static const char *method = "BZ2_bzTestStream";
-  DriverConnection conn;
+  if (UseChunks()) {
+    ServiceStub stub;
+    if (!stub.ok()) return BZ_IO_ERROR;
+    bz2::DecompressChunk msg;
+    grpc::ClientContext context;
+    msg.set_verbosity(verbosity);
+    msg.set_small(small);
+    msg.set_discard(true);
+    api_("%s(%d, %d, %d) => (chunked)", method, ifd, verbosity, small);
+    auto stream = stub->DecompressChunks(&context);
+    int retval = StreamChunks(&stub, &context, stream.get(), &msg, ifd, -1);
+    api_("%s(%d, %d, %d) return %d <=", method, ifd, verbosity, small, retval);
+    return retval;
+  }
+  RpcTraceBegin(method);
+  PooledConnection conn;
+  if (!conn.ok()) {
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   bz2::TestStreamRequest msg;
   bz2::TestStreamReply rsp;
   grpc::ClientContext context;
-  int ifd_nonce = TransferFd(conn.sock_fd(), ifd);
+  int ifd_nonce = TransferFd(conn->sock_fd(), ifd);
+  uint64_t start = RpcNow();
   msg.set_ifd(ifd_nonce);
   msg.set_verbosity(verbosity);
   msg.set_small(small);
   api_("%s(%d, %d, %d) =>", method, ifd, verbosity, small);
-  grpc::Status status = conn.stub()->TestStream(&context, msg, &rsp);
-  assert(status.ok());
+  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);
+  grpc::Status status = conn->stub()->TestStream(&context, msg, &rsp);
+  start = RpcPhaseAdd(RPC_PHASE_CALL, start);
+  if (!status.ok()) {
+    error_("%s failed: %s", method, status.error_message().c_str());
+    conn.Broken();
+    RpcTraceResult(BZ_IO_ERROR);
+    RpcTraceEnd(0, 0);
+    return BZ_IO_ERROR;
+  }
   int retval = rsp.result();
   api_("%s(%d, %d, %d) return %d <=", method, ifd, verbosity, small, retval);
+  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);
+  RpcTraceResult(retval);
+  if (RpcTracing()) RpcTraceEnd(msg.ByteSizeLong(), rsp.ByteSizeLong());
   return retval;
 }
 
@@ -176,13 +543,18 @@ const char *BZ2_bzlibVersion(void) {
     api_("%s() return '%s' <= (saved)", method, saved_version);
     return saved_version;
   }
-  DriverConnection conn;
+  ServiceStub stub;
+  if (!stub.ok()) return NULL;
   bz2::LibVersionRequest msg;
   bz2::LibVersionReply rsp;
   grpc::ClientContext context;
   api_("%s() =>", method);
-  grpc::Status status = conn.stub()->LibVersion(&context, msg, &rsp);
-  assert(status.ok());
+  grpc::Status status = stub->LibVersion(&context, msg, &rsp);
+  if (!status.ok()) {
+    error_("%s failed: %s", method, status.error_message().c_str());
+    stub.Broken();
+    return NULL;
+  }
   std::string version(rsp.version());
   api_("%s() return '%s' <=", method, version.c_str());
   saved_version = strdup(version.c_str());
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
@@ -14,18 +15,23 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <dnv.h>
 #include <nv.h>
 
 #include "rpc-util.h"
+#include "bzlib.h"
+#include "bz2-idl.h"
 
+#ifndef RPC_TRANSPORT  /* else one of several, in libbz2-remote.a */
 int _rpc_verbose = 4;  /* smaller number => more verbose */
 int _rpc_indent = 0;
+#endif
 
 static const char *g_exe_file = "./bz2-driver-libnv";
 static int g_exe_fd = -1;  /* File descriptor to driver executable */
 /* Before main(), get an FD for the driver program, so that it is still
    accessible even if the application enters a sandbox. */
-void __attribute__((constructor)) _stub_construct(void) {
+void RPC_STUB_INIT _stub_construct(void) {
   g_exe_fd = OpenDriver(g_exe_file);
 }
 
@@ -34,51 +40,81 @@ struct DriverConnection {
   pid_t pid;
   /* Socket pair for communcation with driver process */
   int socket_fds[2];
-} g_conn;
+  /* Backs the nvlists for calls made over this connection */
+  nv_arena_t *arena;
+};
 
+static void DestroyConnection(void *data) {
+  struct DriverConnection *conn = (struct DriverConnection *)data;
+  int ii;
+  api_("DestroyConnection(conn=%p {pid=%d })", conn, conn->pid);
+
+  for (ii = 0; ii < 2; ii ++) {
+    if (conn->socket_fds[ii] >= 0) {
+      verbose_("close socket_fds[%d]= %d", ii, conn->socket_fds[ii]);
+      close(conn->socket_fds[ii]);
+      conn->socket_fds[ii] = -1;
+    }
+  }
+  if (conn->pid > 0) {
+    TerminateChild(conn->pid);
+    conn->pid = 0;
+  }
+  nv_arena_destroy(conn->arena);
+  free(conn);
+}
 
-static struct DriverConnection *CreateConnection(void) {
-  struct DriverConnection *conn = &g_conn;
+static void *CreateConnection(pid_t *pid) {
+  struct DriverConnection *conn = malloc(sizeof(*conn));
+  if (conn == NULL) {
+    error_("failed to allocate connection");
+    return NULL;
+  }
   /* Create socket for communication with child */
+  conn->pid = 0;
   conn->socket_fds[0] = -1;
   conn->socket_fds[1] = -1;
-  int rc = socketpair(AF_UNIX, SOCK_STREAM, 0, conn->socket_fds);
+  conn->arena = nv_arena_create(0);
+  if (conn->arena == NULL) {
+    error_("failed to allocate arena");
+    free(conn);
+    return NULL;
+  }
+  int rc = socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, conn->socket_fds);
   if (rc < 0) {
     error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+    nv_arena_destroy(conn->arena);
+    free(conn);
     return NULL;
   }
 
   api_("CreateConnection(g_exe_fd=%d, '%s')", g_exe_fd, g_exe_file);
 
-  conn->pid = fork();
+  conn->pid = SpawnDriver(g_exe_fd, g_exe_file, conn->socket_fds[1]);
   if (conn->pid < 0) {
-    error_("failed to fork, errno=%d (%s)", errno, strerror(errno));
+    error_("failed to start driver, errno=%d (%s)", errno, strerror(errno));
+    DestroyConnection(conn);
     return NULL;
   }
+  uint64_t start = RpcNow();
+  /* The driver holds the other end now */
+  close(conn->socket_fds[1]);
+  conn->socket_fds[1] = -1;
+  RpcPhaseAdd(RPC_PHASE_BOOTSTRAP, start);
 
-  if (conn->pid == 0) {
-    /* Child process: run the driver */
-    RunDriver(g_exe_fd, g_exe_file, conn->socket_fds[1]);
-  }
-
+  *pid = conn->pid;
   return conn;
 }
 
-static void DestroyConnection(struct DriverConnection *conn) {
-  int ii;
-  api_("DestroyConnection(conn=%p {pid=%d })", conn, conn->pid);
+/* Drivers shared by all threads; each call checks one out for its duration */
+static struct DriverPool g_pool;
 
-  for (ii = 0; ii < 2; ii ++) {
-    if (conn->socket_fds[ii] >= 0) {
-      verbose_("close socket_fds[%d]= %d", ii, conn->socket_fds[ii]);
-      close(conn->socket_fds[ii]);
-      conn->socket_fds[ii] = -1;
-    }
-  }
-  if (conn->pid > 0) {
-    TerminateChild(conn->pid);
-    conn->pid = 0;
-  }
+static void __attribute__((constructor)) _pool_construct(void) {
+  DriverPoolInit(&g_pool, CreateConnection, DestroyConnection);
+}
+
+static void __attribute__((destructor)) _pool_destruct(void) {
+  DriverPoolDrain(&g_pool);
 }
 
 
@@ -88,99 +124,445 @@ static void DestroyConnection(struct DriverConnection *conn) {
 
 
 
-/* RPC-Forwarding versions of libbz2 entrypoints */
+/* RPC-Forwarding versions of the self-contained libbz2 entrypoints, generated
+ * from the annotations in bzlib.h by idolize.py */
+#include "bz2-stub-libnv.inc"
 
-int BZ2_bzCompressStream(int ifd, int ofd, int blockSize100k, int verbosity, int workFactor) {
-  static const char *cmd = "BZ2_bzCompressStream";
-  struct DriverConnection *conn = CreateConnection();
-  nvlist_t *nvl;
 
-  nvl = nvlist_create(0);
-  nvlist_add_string(nvl, "cmd", cmd);
-  nvlist_add_descriptor(nvl, "ifd", ifd);
-  nvlist_add_descriptor(nvl, "ofd", ofd);
-  nvlist_add_number(nvl, "blockSize100k", (uint64_t)blockSize100k);
-  nvlist_add_number(nvl, "verbosity", (uint64_t)verbosity);
-  nvlist_add_number(nvl, "workFactor", (uint64_t)workFactor);
+/* Low-level bz_stream entrypoints.  Data moves through a pair of rings in
+ * shared memory (stub->driver input, driver->stub output); only small control
+ * messages go over the socket.  A stream keeps the same driver from Init to
+ * End, since the driver holds the real bz_stream. */
 
-  api_("%s(%d, %d, %d, %d, %d) =>", cmd, ifd, ofd, blockSize100k, verbosity, workFactor);
-  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);
+#define STREAM_RING_SIZE (1 << 20)
 
-  assert (nvl != NULL);
+struct RemoteStream {
+  struct DriverPoolSlot *slot;
+  uint64_t handle;  /* Driver's handle for the stream */
+  void *shm;
+  size_t shm_len;
+  struct ShmRingView in;   /* Uncompressed (compress) or compressed (decompress) input */
+  struct ShmRingView out;
+  int driver_done;  /* Driver has returned BZ_STREAM_END */
+  int broken;  /* Lost the driver, so its connection isn't reusable */
+};
+
+static struct RemoteStream *RemoteStreamOpen(nvlist_t *nvl) {
+  struct RemoteStream *rs = calloc(1, sizeof(*rs));
+  if (rs == NULL) {
+    nvlist_destroy(nvl);
+    return NULL;
+  }
+  int shm_fd = ShmRingsCreate(STREAM_RING_SIZE, &rs->shm, &rs->shm_len);
+  if (shm_fd < 0) {
+    nvlist_destroy(nvl);
+    free(rs);
+    return NULL;
+  }
+  ShmRingAttach(&rs->in, rs->shm, STREAM_RING_SIZE, 0, 1);
+  ShmRingAttach(&rs->out, rs->shm, STREAM_RING_SIZE, 1, 0);
+  rs->slot = DriverPoolAcquireNoWait(&g_pool);
+  if (rs->slot == NULL) {
+    nvlist_destroy(nvl);
+    close(shm_fd);
+    munmap(rs->shm, rs->shm_len);
+    free(rs);
+    return NULL;
+  }
+  nvlist_move_descriptor(nvl, "shm", shm_fd);
+  return rs;
+}
+
+static void RemoteStreamClose(struct RemoteStream *rs, int reusable) {
+  DriverPoolRelease(&g_pool, rs->slot, reusable && !rs->broken);
+  munmap(rs->shm, rs->shm_len);
+  free(rs);
+}
+
+/* Send a control message for the stream and return the driver's retval */
+static int RemoteStreamCall(struct RemoteStream *rs, nvlist_t *nvl, uint64_t *handle) {
+  struct DriverConnection *conn = (struct DriverConnection *)rs->slot->conn;
+  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);
+  if (nvl == NULL || !nvlist_exists_number(nvl, "retval")) {
+    error_("stream call: no reply from driver: %s", strerror(errno));
+    if (nvl != NULL) nvlist_destroy(nvl);
+    rs->broken = 1;
+    rs->driver_done = 1;
+    return BZ_IO_ERROR;
+  }
   int retval = nvlist_get_number(nvl, "retval");
-  api_("%s(%d, %d, %d, %d, %d) return %d <=", cmd, ifd, ofd, blockSize100k, verbosity, workFactor, retval);
+  if (handle) *handle = dnvlist_get_number(nvl, "handle", 0);
   nvlist_destroy(nvl);
-  DestroyConnection(conn);
   return retval;
 }
 
-int BZ2_bzDecompressStream(int ifd, int ofd, int verbosity, int small) {
-  static const char *cmd = "BZ2_bzDecompressStream";
-  struct DriverConnection *conn = CreateConnection();
-  nvlist_t *nvl;
+/* Copy pending output from the out ring to the caller's buffer */
+static void RemoteStreamDrain(bz_stream *strm, struct RemoteStream *rs) {
+  size_t len = ShmRingRead(&rs->out, strm->next_out, strm->avail_out);
+  strm->next_out += len;
+  strm->avail_out -= len;
+  uint64_t total = ((uint64_t)strm->total_out_hi32 << 32) + strm->total_out_lo32 + len;
+  strm->total_out_lo32 = (unsigned int)total;
+  strm->total_out_hi32 = (unsigned int)(total >> 32);
+}
 
-  nvl = nvlist_create(0);
-  nvlist_add_string(nvl, "cmd", cmd);
-  nvlist_add_descriptor(nvl, "ifd", ifd);
-  nvlist_add_descriptor(nvl, "ofd", ofd);
+/* Copy as much of the caller's input as fits into the in ring */
+static size_t RemoteStreamFill(bz_stream *strm, struct RemoteStream *rs) {
+  size_t len = ShmRingWrite(&rs->in, strm->next_in, strm->avail_in);
+  strm->next_in += len;
+  strm->avail_in -= len;
+  uint64_t total = ((uint64_t)strm->total_in_hi32 << 32) + strm->total_in_lo32 + len;
+  strm->total_in_lo32 = (unsigned int)total;
+  strm->total_in_hi32 = (unsigned int)(total >> 32);
+  return len;
+}
+
+int BZ2_bzCompressInit(bz_stream *strm, int blockSize100k, int verbosity, int workFactor) {
+  static const char *cmd = "BZ2_bzCompressInit";
+  if (strm == NULL) return BZ_PARAM_ERROR;
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", IDL_BZ2_bzCompressInit);
+  nvlist_add_number(nvl, "blockSize100k", (uint64_t)blockSize100k);
   nvlist_add_number(nvl, "verbosity", (uint64_t)verbosity);
-  nvlist_add_number(nvl, "small", (uint64_t)small);
+  nvlist_add_number(nvl, "workFactor", (uint64_t)workFactor);
+  struct RemoteStream *rs = RemoteStreamOpen(nvl);
+  if (rs == NULL) return BZ_MEM_ERROR;
+
+  api_("%s(%p, %d, %d, %d) =>", cmd, strm, blockSize100k, verbosity, workFactor);
+  int retval = RemoteStreamCall(rs, nvl, &rs->handle);
+  api_("%s(%p, %d, %d, %d) return %d handle=%lu <=", cmd, strm, blockSize100k, verbosity, workFactor,
+       retval, (unsigned long)rs->handle);
+  if (retval != BZ_OK) {
+    RemoteStreamClose(rs, 1);
+    return retval;
+  }
+  strm->state = rs;
+  strm->total_in_lo32 = strm->total_in_hi32 = 0;
+  strm->total_out_lo32 = strm->total_out_hi32 = 0;
+  return retval;
+}
 
-  api_("%s(%d, %d, %d, %d) =>", cmd, ifd, ofd, verbosity, small);
-  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);
+int BZ2_bzCompress(bz_stream *strm, int action) {
+  static const char *cmd = "BZ2_bzCompress";
+  if (strm == NULL || strm->state == NULL) return BZ_PARAM_ERROR;
+  if (action != BZ_RUN && action != BZ_FLUSH && action != BZ_FINISH) return BZ_PARAM_ERROR;
+  struct RemoteStream *rs = (struct RemoteStream *)strm->state;
+
+  RemoteStreamDrain(strm, rs);
+  RemoteStreamFill(strm, rs);
+  /* Only pass on a flush/finish once all of the caller's input is in the ring */
+  int driver_action = (strm->avail_in > 0) ? BZ_RUN : action;
+  int retval = BZ_RUN_OK;
+  if (!rs->driver_done && ShmRingFree(&rs->out) > 0 &&
+      (driver_action != BZ_RUN || ShmRingFree(&rs->in) < rs->in.size / 2)) {
+    /* Plain BZ_RUN calls just accumulate input until the ring is half full */
+    nvlist_t *nvl = nvlist_create(0);
+    nvlist_add_number(nvl, "method", IDL_BZ2_bzCompress);
+    nvlist_add_number(nvl, "handle", rs->handle);
+    nvlist_add_number(nvl, "action", (uint64_t)driver_action);
+    verbose_("%s(%p, %d) => action=%d in=%zu", cmd, strm, action, driver_action, ShmRingUsed(&rs->in));
+    retval = RemoteStreamCall(rs, nvl, NULL);
+    verbose_("%s(%p, %d) return %d out=%zu <=", cmd, strm, action, retval, ShmRingUsed(&rs->out));
+    if (retval < 0) return retval;
+    if (retval == BZ_STREAM_END) rs->driver_done = 1;
+  } else if (rs->driver_done) {
+    retval = BZ_STREAM_END;
+  }
+  RemoteStreamDrain(strm, rs);
+
+  int pending = (ShmRingUsed(&rs->out) > 0);
+  switch (action) {
+  case BZ_FLUSH:
+    return (driver_action == BZ_FLUSH && retval == BZ_RUN_OK && !pending) ? BZ_RUN_OK : BZ_FLUSH_OK;
+  case BZ_FINISH:
+    return (retval == BZ_STREAM_END && !pending) ? BZ_STREAM_END : BZ_FINISH_OK;
+  default:
+    return BZ_RUN_OK;
+  }
+}
 
-  assert (nvl != NULL);
-  int retval = nvlist_get_number(nvl, "retval");
-  api_("%s(%d, %d, %d, %d) return %d <=", cmd, ifd, ofd, verbosity, small, retval);
-  nvlist_destroy(nvl);
-  DestroyConnection(conn);
+int BZ2_bzCompressEnd(bz_stream *strm) {
+  static const char *cmd = "BZ2_bzCompressEnd";
+  if (strm == NULL || strm->state == NULL) return BZ_PARAM_ERROR;
+  struct RemoteStream *rs = (struct RemoteStream *)strm->state;
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", IDL_BZ2_bzCompressEnd);
+  nvlist_add_number(nvl, "handle", rs->handle);
+  api_("%s(%p) =>", cmd, strm);
+  int retval = RemoteStreamCall(rs, nvl, NULL);
+  api_("%s(%p) return %d <=", cmd, strm, retval);
+  RemoteStreamClose(rs, 1);
+  strm->state = NULL;
   return retval;
 }
 
-int BZ2_bzTestStream(int ifd, int verbosity, int small) {
-  static const char *cmd = "BZ2_bzTestStream";
-  struct DriverConnection *conn = CreateConnection();
-  nvlist_t *nvl;
-
-  nvl = nvlist_create(0);
-  nvlist_add_string(nvl, "cmd", cmd);
-  nvlist_add_descriptor(nvl, "ifd", ifd);
+int BZ2_bzDecompressInit(bz_stream *strm, int verbosity, int small) {
+  static const char *cmd = "BZ2_bzDecompressInit";
+  if (strm == NULL) return BZ_PARAM_ERROR;
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", IDL_BZ2_bzDecompressInit);
   nvlist_add_number(nvl, "verbosity", (uint64_t)verbosity);
   nvlist_add_number(nvl, "small", (uint64_t)small);
+  struct RemoteStream *rs = RemoteStreamOpen(nvl);
+  if (rs == NULL) return BZ_MEM_ERROR;
+
+  api_("%s(%p, %d, %d) =>", cmd, strm, verbosity, small);
+  int retval = RemoteStreamCall(rs, nvl, &rs->handle);
+  api_("%s(%p, %d, %d) return %d handle=%lu <=", cmd, strm, verbosity, small,
+       retval, (unsigned long)rs->handle);
+  if (retval != BZ_OK) {
+    RemoteStreamClose(rs, 1);
+    return retval;
+  }
+  strm->state = rs;
+  strm->total_in_lo32 = strm->total_in_hi32 = 0;
+  strm->total_out_lo32 = strm->total_out_hi32 = 0;
+  return retval;
+}
 
-  api_("%s(%d, %d, %d) =>", cmd, ifd, verbosity, small);
-  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);
+int BZ2_bzDecompress(bz_stream *strm) {
+  static const char *cmd = "BZ2_bzDecompress";
+  if (strm == NULL || strm->state == NULL) return BZ_PARAM_ERROR;
+  struct RemoteStream *rs = (struct RemoteStream *)strm->state;
+
+  /* Input is only reported as consumed once the driver has used it, so that
+   * any data after the end of the stream is left with the caller.  Bytes still
+   * sitting in the in ring are the start of the caller's input. */
+  size_t staged = ShmRingUsed(&rs->in);
+  if (staged > strm->avail_in) staged = strm->avail_in;
+  size_t written = ShmRingWrite(&rs->in, strm->next_in + staged, strm->avail_in - staged);
+  RemoteStreamDrain(strm, rs);
+  int retval = BZ_OK;
+  if (!rs->driver_done && strm->avail_out > 0) {
+    nvlist_t *nvl = nvlist_create(0);
+    nvlist_add_number(nvl, "method", IDL_BZ2_bzDecompress);
+    nvlist_add_number(nvl, "handle", rs->handle);
+    verbose_("%s(%p) => in=%zu", cmd, strm, ShmRingUsed(&rs->in));
+    retval = RemoteStreamCall(rs, nvl, NULL);
+    verbose_("%s(%p) return %d out=%zu <=", cmd, strm, retval, ShmRingUsed(&rs->out));
+    if (retval == BZ_STREAM_END) rs->driver_done = 1;
+  } else if (rs->driver_done) {
+    retval = BZ_STREAM_END;
+  }
+  size_t left = ShmRingUsed(&rs->in);
+  if (left > staged + written) left = staged + written;
+  size_t consumed = staged + written - left;
+  strm->next_in += consumed;
+  strm->avail_in -= consumed;
+  uint64_t total = ((uint64_t)strm->total_in_hi32 << 32) + strm->total_in_lo32 + consumed;
+  strm->total_in_lo32 = (unsigned int)total;
+  strm->total_in_hi32 = (unsigned int)(total >> 32);
+  if (retval == BZ_STREAM_END) {
+    /* Anything left over is after the end of the stream */
+    ShmRingConsume(&rs->in, ShmRingUsed(&rs->in));
+  }
+  if (retval < 0) return retval;
+  RemoteStreamDrain(strm, rs);
 
-  assert (nvl != NULL);
-  int retval = nvlist_get_number(nvl, "retval");
-  api_("%s(%d, %d, %d) return %d <=", cmd, ifd, verbosity, small, retval);
-  nvlist_destroy(nvl);
-  DestroyConnection(conn);
+  if (retval == BZ_STREAM_END && ShmRingUsed(&rs->out) > 0) return BZ_OK;
   return retval;
 }
 
-const char *BZ2_bzlibVersion(void) {
-  static const char *cmd = "BZ2_bzlibVersion";
-  static const char *saved_version = NULL;
-  if (saved_version) {
-    api_("%s() return '%s' <= (saved)", cmd, saved_version);
-    return saved_version;
-  }
+int BZ2_bzDecompressEnd(bz_stream *strm) {
+  static const char *cmd = "BZ2_bzDecompressEnd";
+  if (strm == NULL || strm->state == NULL) return BZ_PARAM_ERROR;
+  struct RemoteStream *rs = (struct RemoteStream *)strm->state;
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", IDL_BZ2_bzDecompressEnd);
+  nvlist_add_number(nvl, "handle", rs->handle);
+  api_("%s(%p) =>", cmd, strm);
+  int retval = RemoteStreamCall(rs, nvl, NULL);
+  api_("%s(%p) return %d <=", cmd, strm, retval);
+  RemoteStreamClose(rs, 1);
+  strm->state = NULL;
+  return retval;
+}
 
-  struct DriverConnection *conn = CreateConnection();
-  nvlist_t *nvl;
 
-  nvl = nvlist_create(0);
-  nvlist_add_string(nvl, "cmd", cmd);
+/* BZFILE entrypoints.  The driver holds the real BZFILE, and data moves
+ * through a ring pair as for a bz_stream, so the socket only carries a
+ * handle.  The driver decompresses ahead of bzread() into the out ring, and
+ * bzwrite() collects data in the in ring for the driver to compress behind
+ * it: once a ring is half drained (or half filled) a refill (or drain) is
+ * sent without waiting for its reply, which is picked up by a later call.
+ * So a reader or writer only waits on the driver about once per half ring,
+ * however small its calls, and errors from write-behind are reported by the
+ * next call on the handle. */
+
+struct RemoteFile {
+  struct RemoteStream *rs;
+  int fd;  /* Caller's fd, closed by bzclose() as the local library does */
+  int writing;
+  int outstanding;  /* A refill/drain has been sent and not answered */
+  int last_err;  /* Last BZ_ code from the driver */
+};
+
+/* The driver has gone (crashed on bad input, say): fail from now on */
+static void RemoteFileLost(struct RemoteFile *rf) {
+  error_("lost driver for BZFILE %p, errno=%d", rf, errno);
+  rf->last_err = BZ_IO_ERROR;
+  rf->outstanding = 0;
+  rf->rs->driver_done = 1;
+  rf->rs->broken = 1;
+}
 
-  api_("%s() =>", cmd);
-  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);
+/* Send a refill/drain/close request for the file, without waiting */
+static void RemoteFileSend(struct RemoteFile *rf, int method) {
+  if (rf->rs->broken) return;
+  struct DriverConnection *conn = (struct DriverConnection *)rf->rs->slot->conn;
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", (uint64_t)method);
+  nvlist_add_number(nvl, "handle", rf->rs->handle);
+  int rc = nvlist_send(conn->socket_fds[0], nvl);
+  nvlist_destroy(nvl);
+  if (rc != 0) {
+    RemoteFileLost(rf);
+    return;
+  }
+  rf->outstanding = 1;
+}
 
-  assert (nvl != NULL);
-  const char *retval = nvlist_get_string(nvl, "retval");
-  api_("%s() return '%s' <=", cmd, retval);
-  saved_version = strdup(retval);
+/* Wait for the reply to the outstanding request, if any */
+static void RemoteFileCollect(struct RemoteFile *rf) {
+  if (!rf->outstanding) return;
+  struct DriverConnection *conn = (struct DriverConnection *)rf->rs->slot->conn;
+  nvlist_t *nvl = nvlist_recv(conn->socket_fds[0], 0);
+  if (nvl == NULL || !nvlist_exists_number(nvl, "retval")) {
+    nvlist_destroy(nvl);
+    RemoteFileLost(rf);
+    return;
+  }
+  rf->last_err = nvlist_get_number(nvl, "retval");
   nvlist_destroy(nvl);
-  DestroyConnection(conn);
-  return saved_version;
+  rf->outstanding = 0;
+  if (rf->last_err != BZ_OK) rf->rs->driver_done = 1;
+}
+
+/* Have the driver compress everything in the in ring */
+static void RemoteFileDrain(struct RemoteFile *rf) {
+  RemoteFileCollect(rf);
+  while (!rf->rs->driver_done && ShmRingUsed(&rf->rs->in) > 0) {
+    RemoteFileSend(rf, IDL_BZ2_bzwrite);
+    RemoteFileCollect(rf);
+  }
+}
+
+BZFILE *BZ2_bzdopen(int fd, const char *mode) {
+  static const char *cmd = "BZ2_bzdopen";
+  if (mode == NULL) return NULL;
+  struct RemoteFile *rf = calloc(1, sizeof(*rf));
+  if (rf == NULL) return NULL;
+  const char *m;
+  for (m = mode; *m; m++) {
+    if (*m == 'r') rf->writing = 0;
+    if (*m == 'w') rf->writing = 1;
+  }
+  nvlist_t *nvl = nvlist_create(0);
+  nvlist_add_number(nvl, "method", IDL_BZ2_bzdopen);
+  nvlist_add_descriptor(nvl, "fd", fd);
+  nvlist_add_string(nvl, "mode", mode);
+  rf->rs = RemoteStreamOpen(nvl);
+  if (rf->rs == NULL) {
+    free(rf);
+    return NULL;
+  }
+
+  api_("%s(%d, '%s') =>", cmd, fd, mode);
+  int retval = RemoteStreamCall(rf->rs, nvl, &rf->rs->handle);
+  api_("%s(%d, '%s') return %d handle=%lu <=", cmd, fd, mode, retval, (unsigned long)rf->rs->handle);
+  if (retval != BZ_OK) {
+    RemoteStreamClose(rf->rs, 1);
+    free(rf);
+    return NULL;
+  }
+  rf->fd = fd;
+  return (BZFILE *)rf;
+}
+
+int BZ2_bzread(BZFILE *b, void *buf, int len) {
+  struct RemoteFile *rf = (struct RemoteFile *)b;
+  if (rf == NULL || rf->writing || buf == NULL || len < 0) return -1;
+  struct RemoteStream *rs = rf->rs;
+  size_t done = 0;
+  while (1) {
+    done += ShmRingRead(&rs->out, (char *)buf + done, len - done);
+    if (done == (size_t)len) break;
+    if (rf->outstanding) {
+      /* The read-ahead may have produced more since */
+      RemoteFileCollect(rf);
+      continue;
+    }
+    if (rs->driver_done) break;
+    verbose_("BZ2_bzread(%p, %d) => refill", rf, len);
+    RemoteFileSend(rf, IDL_BZ2_bzread);
+    RemoteFileCollect(rf);
+  }
+  if (!rs->driver_done && !rf->outstanding && ShmRingUsed(&rs->out) < rs->out.size / 2) {
+    RemoteFileSend(rf, IDL_BZ2_bzread);
+  }
+  if (done == 0 && rf->last_err != BZ_OK && rf->last_err != BZ_STREAM_END) return -1;
+  return (int)done;
+}
+
+int BZ2_bzwrite(BZFILE *b, const void *buf, int len) {
+  struct RemoteFile *rf = (struct RemoteFile *)b;
+  if (rf == NULL || !rf->writing || buf == NULL || len < 0) return -1;
+  struct RemoteStream *rs = rf->rs;
+  size_t done = 0;
+  while (!rs->driver_done) {
+    done += ShmRingWrite(&rs->in, (const char *)buf + done, len - done);
+    if (done == (size_t)len) break;
+    /* Ring full: wait for the driver to make room */
+    if (rf->outstanding) {
+      RemoteFileCollect(rf);
+    } else {
+      verbose_("BZ2_bzwrite(%p, %d) => drain", rf, len);
+      RemoteFileSend(rf, IDL_BZ2_bzwrite);
+      RemoteFileCollect(rf);
+    }
+  }
+  if (rs->driver_done) return -1;
+  if (!rf->outstanding && ShmRingUsed(&rs->in) >= rs->in.size / 2) {
+    RemoteFileSend(rf, IDL_BZ2_bzwrite);
+  }
+  return len;
+}
+
+int BZ2_bzflush(BZFILE *b) {
+  struct RemoteFile *rf = (struct RemoteFile *)b;
+  if (rf != NULL && rf->writing) RemoteFileDrain(rf);
+  return 0;
+}
+
+void BZ2_bzclose(BZFILE *b) {
+  static const char *cmd = "BZ2_bzclose";
+  struct RemoteFile *rf = (struct RemoteFile *)b;
+  if (rf == NULL) return;
+  if (rf->writing) {
+    RemoteFileDrain(rf);
+  } else {
+    RemoteFileCollect(rf);
+  }
+  api_("%s(%p) =>", cmd, rf);
+  RemoteFileSend(rf, IDL_BZ2_bzclose);
+  RemoteFileCollect(rf);
+  api_("%s(%p) return %d <=", cmd, rf, rf->last_err);
+  RemoteStreamClose(rf->rs, 1);
+  close(rf->fd);
+  free(rf);
+}
+
+/* As in bzlib.c */
+static const char *bzerrorstrings[] = {
+  "OK", "SEQUENCE_ERROR", "PARAM_ERROR", "MEM_ERROR", "DATA_ERROR",
+  "DATA_ERROR_MAGIC", "IO_ERROR", "UNEXPECTED_EOF", "OUTBUFF_FULL", "CONFIG_ERROR",
+  "???", "???", "???", "???", "???", "???"
+};
+
+const char *BZ2_bzerror(BZFILE *b, int *errnum) {
+  struct RemoteFile *rf = (struct RemoteFile *)b;
+  int err = rf->last_err;
+  if (err > 0) err = 0;
+  *errnum = err;
+  return bzerrorstrings[(err < -15) ? 15 : err * -1];
 }
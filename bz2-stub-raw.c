@@ -0,0 +1,183 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rpc-util.h"
+#include "bzlib.h"
+#include "bz2-idl.h"  /* for IDL_NONE */
+
+#ifndef RPC_TRANSPORT  /* else one of several, in libbz2-remote.a */
+int _rpc_verbose = 4;  /* smaller number => more verbose */
+int _rpc_indent = 0;
+#endif
+
+static const char *g_exe_file = "./bz2-driver-raw";
+static int g_exe_fd = -1;  /* File descriptor to driver executable */
+/* Before main(), get an FD for the driver program, so that it is still
+   accessible even if the application enters a sandbox. */
+void RPC_STUB_INIT _stub_construct(void) {
+  g_exe_fd = OpenDriver(g_exe_file);
+}
+
+struct DriverConnection {
+  /* Child process ID for the driver process */
+  pid_t pid;
+  /* Socket pair for communcation with driver process */
+  int socket_fds[2];
+};
+
+static void DestroyConnection(void *data) {
+  struct DriverConnection *conn = (struct DriverConnection *)data;
+  int ii;
+  api_("DestroyConnection(conn=%p {pid=%d })", conn, conn->pid);
+
+  for (ii = 0; ii < 2; ii ++) {
+    if (conn->socket_fds[ii] >= 0) {
+      verbose_("close socket_fds[%d]= %d", ii, conn->socket_fds[ii]);
+      close(conn->socket_fds[ii]);
+      conn->socket_fds[ii] = -1;
+    }
+  }
+  if (conn->pid > 0) {
+    TerminateChild(conn->pid);
+    conn->pid = 0;
+  }
+  free(conn);
+}
+
+static void *CreateConnection(pid_t *pid) {
+  struct DriverConnection *conn = malloc(sizeof(*conn));
+  if (conn == NULL) {
+    error_("failed to allocate connection");
+    return NULL;
+  }
+  conn->pid = 0;
+  conn->socket_fds[0] = -1;
+  conn->socket_fds[1] = -1;
+  const char *daemon = getenv("RPC_DAEMON");
+  if (daemon && *daemon) {
+    /* A shared driver daemon: nothing to start, and no child to reap */
+    conn->socket_fds[0] = RpcDaemonConnect(daemon);
+    if (conn->socket_fds[0] < 0) {
+      error_("failed to connect to daemon '%s', errno=%d (%s)", daemon, errno, strerror(errno));
+      free(conn);
+      return NULL;
+    }
+    api_("CreateConnection(daemon '%s') socket %d", daemon, conn->socket_fds[0]);
+    *pid = 0;
+    return conn;
+  }
+
+  /* Create socket for communication with child */
+  int rc = socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, conn->socket_fds);
+  if (rc < 0) {
+    error_("failed to open sockets, errno=%d (%s)", errno, strerror(errno));
+    free(conn);
+    return NULL;
+  }
+
+  api_("CreateConnection(g_exe_fd=%d, '%s')", g_exe_fd, g_exe_file);
+
+  conn->pid = SpawnDriver(g_exe_fd, g_exe_file, conn->socket_fds[1]);
+  if (conn->pid < 0) {
+    error_("failed to start driver, errno=%d (%s)", errno, strerror(errno));
+    DestroyConnection(conn);
+    return NULL;
+  }
+  uint64_t start = RpcNow();
+  /* The driver holds the other end now */
+  close(conn->socket_fds[1]);
+  conn->socket_fds[1] = -1;
+  RpcPhaseAdd(RPC_PHASE_BOOTSTRAP, start);
+
+  *pid = conn->pid;
+  return conn;
+}
+
+/* Pauses between attempts at a request a daemon is too busy for */
+#define DAEMON_BACKOFF_MIN_US 1000
+#define DAEMON_BACKOFF_MAX_US 100000
+
+/* How long to keep retrying before giving up, from RPC_DAEMON_RETRY_MS */
+static long DaemonRetryMs(void) {
+  const char *value = getenv("RPC_DAEMON_RETRY_MS");
+  return value ? atol(value) : 10000;
+}
+
+/* Send a request and wait for its reply, scattered into riov.  Returns the
+ * reply's length, or -1 if there was none (or it was for another method). */
+static ssize_t RawCall(struct DriverConnection *conn, uint32_t method,
+                       const struct iovec *iov, int niov, const int *fds, int nfds,
+                       struct iovec *riov, int nriov, int grow) {
+  int sock_fd = conn->socket_fds[0];
+  uint32_t reply_method = IDL_NONE;
+  ssize_t len;
+  long backoff_us = DAEMON_BACKOFF_MIN_US;
+  long waited_us = 0;
+  while (1) {
+    if (SeqPacketSend(sock_fd, method, iov, niov, fds, nfds) < 0) {
+      error_("failed to send request, errno=%d (%s)", errno, strerror(errno));
+      return -1;
+    }
+    int reply_fds[1];
+    int reply_nfds = 0;
+    len = SeqPacketRecv(sock_fd, &reply_method, riov, nriov, grow,
+                        reply_fds, 0, &reply_nfds);
+    if (len < 0) {
+      error_("no reply on socket %d, errno=%d", sock_fd, errno);
+      return -1;
+    }
+    if (reply_method != RPC_METHOD_BUSY) break;
+    /* A shared daemon turned the request away: try again shortly */
+    if (waited_us >= DaemonRetryMs() * 1000) {
+      error_("daemon still busy after %ld ms", DaemonRetryMs());
+      return -1;
+    }
+    usleep(backoff_us);
+    waited_us += backoff_us;
+    backoff_us *= 2;
+    if (backoff_us > DAEMON_BACKOFF_MAX_US) backoff_us = DAEMON_BACKOFF_MAX_US;
+  }
+  if (reply_method != method) {
+    error_("reply for method %u to method %u request", reply_method, method);
+    return -1;
+  }
+  return len;
+}
+
+/* Drivers shared by all threads; each call checks one out for its duration */
+static struct DriverPool g_pool;
+
+static void __attribute__((constructor)) _pool_construct(void) {
+  DriverPoolInit(&g_pool, CreateConnection, DestroyConnection);
+}
+
+static void __attribute__((destructor)) _pool_destruct(void) {
+  DriverPoolDrain(&g_pool);
+}
+
+
+/*****************************************************************************/
+/* Everything above here is generic, and would be useful for any remoted API */
+/*****************************************************************************/
+
+
+
+/* RPC-Forwarding versions of the self-contained libbz2 entrypoints, generated
+ * from the annotations in bzlib.h by idolize.py.  Requests and replies are a
+ * fixed struct followed by the buffers, which go straight between the
+ * caller's memory and the socket. */
+#include "bz2-stub-raw.inc"
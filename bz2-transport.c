@@ -0,0 +1,16 @@
+/* Copyright 2016 Google Inc. All Rights Reserved.
+ *
+ * Use of this source code is governed by the bzip2
+ * license that can be found in the LICENSE file. */
+
+/* One transport's table of entrypoints, for libbz2-remote.a.  Built once for
+ * each transport, with -DRPC_TRANSPORT=<name> and the renaming in
+ * bz2-transport-names.h, and then linked (ld -r) with that transport's stub
+ * (or, for "direct", with libbz2 itself) so that the table pulls it in. */
+#include "bz2-transport.h"
+
+#ifndef RPC_TRANSPORT
+#error "bz2-transport.c must be built with -DRPC_TRANSPORT=<name>"
+#endif
+
+#include "bz2-transport.inc"
@@ -182,6 +182,7 @@ typedef int IntNative;
 
 Int32   verbosity;
 Bool    keepInputFiles, smallMode, deleteOutputOnInterrupt;
+Bool    parallelMode;
 Bool    forceOverwrite, testFailsExist, unzFailsExist, noisy;
 Int32   numFileNames, numFilesProcessed, blockSize100k;
 Int32   exitValue;
@@ -210,6 +211,26 @@ Char    progNameReally[FILE_NAME_LEN];
 FILE    *outputHandleJustInCase;
 Int32   workFactor;
 
+/*-- files queued for a single BZ2_bzCompressStreams call --*/
+#define BZ_MAX_BATCH     64
+
+typedef
+   struct {
+      Char           inName [FILE_NAME_LEN];
+      Char           outName[FILE_NAME_LEN];
+      FILE           *inStr;
+      FILE           *outStr;
+#     if BZ_UNIX
+      struct MY_STAT metaInfo;
+#     endif
+   }
+   BatchEntry;
+
+Bool       batchMode;
+BatchEntry batch[BZ_MAX_BATCH];
+Int32      nBatch;      /* entries queued */
+Int32      batchNext;   /* first entry not yet (being) finished */
+
 static void    panic                 ( const Char* ) NORETURN;
 static void    ioError               ( void )        NORETURN;
 static void    outOfMemory           ( void )        NORETURN;
@@ -240,18 +261,10 @@ Bool myfeof ( FILE* f )
 
 /*---------------------------------------------*/
 static 
-void compressStream ( FILE *stream, FILE *zStream )
+void compressStreamDone ( FILE *stream, FILE *zStream, int bzerr )
 {
-   int bzerr, ret;
+   int ret;
 
-   SET_BINARY_MODE(stream);
-   SET_BINARY_MODE(zStream);
-
-   if (ferror(stream)) goto errhandler_io;
-   if (ferror(zStream)) goto errhandler_io;
-
-   bzerr = BZ2_bzCompressStream( fileno(stream), fileno(zStream),
-                                 blockSize100k, verbosity, workFactor );
    if (bzerr != BZ_OK) goto errhandler;
 
    if (zStream != stdout) {
@@ -287,6 +300,28 @@ errhandler:
 }
 
 
+/*---------------------------------------------*/
+static 
+void compressStream ( FILE *stream, FILE *zStream )
+{
+   int bzerr;
+
+   SET_BINARY_MODE(stream);
+   SET_BINARY_MODE(zStream);
+
+   if (ferror(stream)) ioError();
+   if (ferror(zStream)) ioError();
+
+   if (parallelMode)
+      bzerr = BZ2_bzCompressStreamParallel( fileno(stream), fileno(zStream),
+                                            blockSize100k, verbosity, workFactor );
+   else
+      bzerr = BZ2_bzCompressStream( fileno(stream), fileno(zStream),
+                                    blockSize100k, verbosity, workFactor );
+   compressStreamDone ( stream, zStream, bzerr );
+}
+
+
 
 /*---------------------------------------------*/
 static 
@@ -462,6 +497,16 @@ void cleanUpAndFail ( Int32 ec )
 {
    IntNative      retVal;
    struct MY_STAT statBuf;
+   Int32          i;
+
+   /* Outputs of queued files that haven't been finished yet are
+      incomplete (or empty), and their inputs are still there. */
+   for (i = batchNext; i < nBatch; i++) {
+      retVal = MY_STAT ( batch[i].inName, &statBuf );
+      if (retVal == 0) remove ( batch[i].outName );
+      numFilesProcessed--;
+   }
+   nBatch = batchNext;
 
    if ( srcMode == SM_F2F 
         && opMode != OM_TEST
@@ -902,6 +947,72 @@ Bool mapSuffix ( Char* name,
 }
 
 
+/*---------------------------------------------*/
+/* When compressing several files to files, the opened files are
+   queued up and handed to the library BZ_MAX_BATCH at a time, so
+   that a remoted library needs only one round trip per batch.
+   Each file is then finished off exactly as compress() would. */
+static void compressDone ( void );
+
+static 
+void loadBatchEntry ( Int32 i )
+{
+   copyFileName ( inName, batch[i].inName );
+   copyFileName ( outName, batch[i].outName );
+#  if BZ_UNIX
+   fileMetaInfo = batch[i].metaInfo;
+#  endif
+   batchNext = i + 1;
+   outputHandleJustInCase = batch[i].outStr;
+   deleteOutputOnInterrupt = True;
+}
+
+static 
+void compressBatch ( void )
+{
+   int   ifds[BZ_MAX_BATCH];
+   int   ofds[BZ_MAX_BATCH];
+   int   results[BZ_MAX_BATCH];
+   Int32 i;
+
+   if (nBatch == 0) return;
+   for (i = 0; i < nBatch; i++) {
+      SET_BINARY_MODE(batch[i].inStr);
+      SET_BINARY_MODE(batch[i].outStr);
+      ifds[i] = fileno ( batch[i].inStr );
+      ofds[i] = fileno ( batch[i].outStr );
+   }
+
+   loadBatchEntry ( 0 );
+   BZ2_bzCompressStreams ( nBatch, ifds, ofds, results,
+                           blockSize100k, verbosity, workFactor );
+
+   for (i = 0; i < nBatch; i++) {
+      loadBatchEntry ( i );
+      compressStreamDone ( batch[i].inStr, batch[i].outStr, results[i] );
+      outputHandleJustInCase = NULL;
+      compressDone();
+   }
+   nBatch = 0;
+   batchNext = 0;
+}
+
+static 
+void queueForBatch ( FILE *inStr, FILE *outStr )
+{
+   if (ferror(inStr) || ferror(outStr)) ioError();
+   copyFileName ( batch[nBatch].inName, inName );
+   copyFileName ( batch[nBatch].outName, outName );
+#  if BZ_UNIX
+   batch[nBatch].metaInfo = fileMetaInfo;
+#  endif
+   batch[nBatch].inStr = inStr;
+   batch[nBatch].outStr = outStr;
+   nBatch++;
+   if (nBatch == BZ_MAX_BATCH) compressBatch();
+}
+
+
 /*---------------------------------------------*/
 static 
 void compress ( Char *name )
@@ -1064,11 +1175,22 @@ void compress ( Char *name )
    }
 
    /*--- Now the input and output handles are sane.  Do the Biz. ---*/
+   if ( batchMode && srcMode == SM_F2F ) {
+      queueForBatch ( inStr, outStr );
+      return;
+   }
    outputHandleJustInCase = outStr;
    deleteOutputOnInterrupt = True;
    compressStream ( inStr, outStr );
    outputHandleJustInCase = NULL;
+   compressDone();
+}
+
 
+/*---------------------------------------------*/
+static 
+void compressDone ( void )
+{
    /*--- If there was an I/O error, we won't get here. ---*/
    if ( srcMode == SM_F2F ) {
       applySavedTimeInfoToOutputFile ( outName );
@@ -1420,6 +1542,7 @@ void usage ( Char *fullProgName )
       "   -1 .. -9            set block size to 100k .. 900k\n"
       "   --fast              alias for -1\n"
       "   --best              alias for -9\n"
+      "   --parallel          compress each large file as several streams at once\n"
       "\n"
       "   If invoked as `bzip2', default action is to compress.\n"
       "              as `bunzip2',  default action is to decompress.\n"
@@ -1564,6 +1687,7 @@ IntNative main ( IntNative argc, Char *argv[] )
    /*-- Initialise --*/
    outputHandleJustInCase  = NULL;
    smallMode               = False;
+   parallelMode            = False;
    keepInputFiles          = False;
    forceOverwrite          = False;
    noisy                   = True;
@@ -1689,6 +1813,7 @@ IntNative main ( IntNative argc, Char *argv[] )
       if (ISFLAG("--test"))              opMode           = OM_TEST; else
       if (ISFLAG("--keep"))              keepInputFiles   = True;    else
       if (ISFLAG("--small"))             smallMode        = True;    else
+      if (ISFLAG("--parallel"))          parallelMode     = True;    else
       if (ISFLAG("--quiet"))             noisy            = False;   else
       if (ISFLAG("--version"))           license();                  else
       if (ISFLAG("--license"))           license();                  else
@@ -1734,6 +1859,9 @@ IntNative main ( IntNative argc, Char *argv[] )
      if (srcMode == SM_I2O) {
         compress ( NULL );
      } else {
+        /* Per-file progress output needs the files done one by one. */
+        batchMode = (srcMode == SM_F2F && numFileNames > 1 && verbosity == 0 &&
+                     !parallelMode);
         decode = True;
         for (aa = argList; aa != NULL; aa = aa->link) {
            if (ISFLAG("--")) { decode = False; continue; }
@@ -1741,6 +1869,7 @@ IntNative main ( IntNative argc, Char *argv[] )
            numFilesProcessed++;
            compress ( aa->name );
         }
+        compressBatch();
      }
    } 
    else
@@ -238,6 +238,72 @@ BZ_EXTERN int BZ_API(BZ2_bzTestStream) (
       int        small
     )  __init __term;
 
+/*-- Compress nstreams streams (ifds[i] -> ofds[i]) with the
+     same parameters in one call.  Each stream's result goes in
+     results[i]; the return value is BZ_OK if all of them
+     succeeded, otherwise the first failure. --*/
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressStreams) (
+      int        nstreams,
+      const int* ifds  __count(nstreams) __isfd,
+      const int* ofds  __count(nstreams) __isfd,
+      int*       results  __count(nstreams) __out,
+      int        blockSize100k, 
+      int        verbosity, 
+      int        workFactor 
+    )  __init __term;
+
+/*-- Asynchronous versions of the stream functions.  These return
+     at once with a handle (or NULL with errno set); the handle's
+     eventfd (BZ2_bzAsyncFd) becomes readable when the operation
+     has completed; poll it, but leave reading it to
+     BZ2_bzAsyncFinish, which waits for completion if necessary,
+     releases the handle, and returns the result.  The
+     file descriptors are duplicated, so the caller may close its
+     copies straight away. --*/
+
+struct bzAsync;
+typedef struct bzAsync BZASYNC;
+
+BZ_EXTERN BZASYNC* BZ_API(BZ2_bzCompressStreamAsync) (
+      int        ifd,
+      int        ofd,
+      int        blockSize100k, 
+      int        verbosity, 
+      int        workFactor 
+    )  __client;
+
+BZ_EXTERN BZASYNC* BZ_API(BZ2_bzDecompressStreamAsync) (
+      int        ifd,
+      int        ofd,
+      int        verbosity, 
+      int        small
+    )  __client;
+
+BZ_EXTERN int BZ_API(BZ2_bzAsyncFd) (
+      BZASYNC*   h
+    )  __client;
+
+BZ_EXTERN int BZ_API(BZ2_bzAsyncFinish) (
+      BZASYNC*   h
+    )  __client;
+
+/*-- Compress a regular file using several streams at once: the
+     input, from its current offset, is split into ranges of whole
+     blocks that are compressed concurrently (in separate drivers,
+     when remoted), and written to ofd in order as a multi-stream
+     .bz2.  The number of ranges is at most BZ2_SHARDS (default:
+     the number of CPUs).  Input that is too small, or not a
+     regular file, is compressed as BZ2_bzCompressStream would. --*/
+
+BZ_EXTERN int BZ_API(BZ2_bzCompressStreamParallel) (
+      int        ifd,
+      int        ofd,
+      int        blockSize100k, 
+      int        verbosity, 
+      int        workFactor 
+    )  __client;
+
 #endif
 
 
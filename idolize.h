@@ -15,6 +15,8 @@
 #define __term		__attribute__((annotate("idl:term")))
 /* Don't include this function */
 #define __skip		__attribute__((annotate("idl:skip")))
+/* Implemented in the client library, on top of the remoted functions */
+#define __client	__attribute__((annotate("idl:client")))
 /* Function taking a filename that has an alternative version taking a file descriptor */
 #define __fdalt(f)	__attribute__((annotate("idl:fdalt=" #f)))
 
@@ -44,6 +46,7 @@
 #define __init
 #define __term
 #define __skip
+#define __client
 #define __fdalt(n)
 
 #define __cstring
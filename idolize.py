@@ -0,0 +1,1251 @@
+#!/usr/bin/env python3
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Use of this source code is governed by the bzip2
+# license that can be found in the LICENSE file.
+
+"""Generate remoting code from the idolize.h annotations in a library header.
+
+Usage: idolize.py <output> <header>
+
+where <output> is one of:
+  header        Method IDs plus packed request/reply structs (bz2-idl.h)
+  libnv-stub    Stub entrypoints for the libnv transport
+  libnv-driver  Driver handlers (indexed by method ID) for libnv
+  raw-stub      Stub entrypoints for the raw SOCK_SEQPACKET transport
+  raw-driver    Driver handlers (indexed by method ID) for raw
+  dbus-stub     Stub entrypoints for the D-Bus transport
+  dbus-driver   Driver handlers, and APIMethod() to find them by name, for D-Bus
+  transport-names  Per-transport renaming of the entrypoints (-include'd)
+  transport-header struct Bz2Transport, a transport's table of entrypoints
+  transport-table  The table itself, built once per transport
+  remote        Entrypoints for libbz2-remote.a, dispatching to a transport
+
+Only self-contained calls are generated: those that are both __init and
+__term, or have no state at all, and whose parameters are all plain scalars,
+file descriptors, or pointers that the annotations say how to size.  Calls on
+handles (bz_stream, BZFILE, ...) are left to hand-written code.
+
+For libnv and raw, each call's fixed-size arguments travel as a single packed
+struct, with every field at a known offset; file descriptors travel separately
+(concatenated in parameter order), as does each sized buffer.  D-Bus has its
+own typed arguments, so there each parameter is one argument of the call.
+
+The transport outputs cover every entrypoint except the __client ones (which
+are built on top of the others), whether generated here or hand-written.
+"""
+
+import re
+import sys
+
+ANNOTATIONS = ('init', 'term', 'skip', 'client', 'fdalt', 'cstring', 'size', 'count',
+               'move', 'isfd', 'out', 'handle', 'static')
+
+# C parameter types that can travel in the packed structs
+FIXED_TYPES = {
+    'int': ('int32_t', '%d'),
+    'unsigned int': ('uint32_t', '%u'),
+}
+
+PREFIX = 'BZ2_'
+PARAM_ERROR = 'BZ_PARAM_ERROR'
+IO_ERROR = 'BZ_IO_ERROR'
+CONFIG_ERROR = 'BZ_CONFIG_ERROR'
+OK = 'BZ_OK'
+# Out-parameter for the error code, in calls that have one
+ERROR_PARAM = 'bzerror'
+# Types whose pointers are handles to library state
+HANDLE_TYPES = ('bz_stream', 'BZFILE')
+
+
+def c_decl(ctype, name):
+    """'const int*', 'x' => 'const int *x'"""
+    base = ctype.rstrip('*')
+    if base != ctype:
+        return '%s %s%s' % (base, ctype[len(base):], name)
+    return '%s %s' % (ctype, name)
+
+
+class Param(object):
+    def __init__(self, text):
+        self.annots = {}
+        for match in re.finditer(r'__(\w+)(?:\(([^)]*)\))?', text):
+            if match.group(1) in ANNOTATIONS:
+                self.annots[match.group(1)] = match.group(2)
+        text = re.sub(r'__\w+(\([^)]*\))?', '', text).strip()
+        match = re.match(r'(.*?)(\w+)$', text)
+        self.name = match.group(2)
+        ctype = match.group(1).replace('*', ' * ')
+        self.ctype = ' '.join(ctype.split()).replace(' *', '*')
+        self.is_ptr = '*' in self.ctype
+        self.base = self.ctype.replace('const ', '').replace('*', '').strip()
+        self.kind = self._classify()
+
+    def _classify(self):
+        if not self.is_ptr:
+            if self.base not in FIXED_TYPES:
+                return None
+            return 'fd' if 'isfd' in self.annots else 'scalar'
+        if self.ctype.count('*') > 1:
+            return None
+        if 'count' in self.annots:
+            if 'isfd' in self.annots:
+                return 'fd_array'
+            if self.base not in FIXED_TYPES:
+                return None
+            return 'out_array' if 'out' in self.annots else 'in_array'
+        if 'size' in self.annots:
+            return 'out_buf' if 'out' in self.annots else 'in_buf'
+        if self.base in FIXED_TYPES:
+            return 'inout'  # Plain pointer to a scalar: value in, value out
+        return None
+
+    def decl(self):
+        return c_decl(self.ctype, self.name)
+
+    def fixed_type(self):
+        return FIXED_TYPES[self.base][0]
+
+    def fmt(self):
+        if self.kind in ('scalar', 'fd', 'inout'):
+            return FIXED_TYPES[self.base][1]
+        if self.kind in ('fd_array', 'in_array', 'out_array'):
+            return '...'
+        return '%p'
+
+
+class Function(object):
+    def __init__(self, rtype, name, params, annots):
+        self.short_name = name[len(PREFIX):] if name.startswith(PREFIX) else name
+        self.rtype = ' '.join(rtype.replace('*', ' * ').split()).replace(' *', '*')
+        self.name = name
+        self.params = [Param(p) for p in params]
+        self.annots = set(re.findall(r'__(\w+)', annots))
+        self.byname = dict((p.name, p) for p in self.params)
+        self.reason = self._check()
+
+    def _check(self):
+        """Returns why the function can't be generated, or None if it can."""
+        if 'skip' in self.annots:
+            return 'skipped'
+        if 'client' in self.annots:
+            return 'implemented by the client library'
+        if ('init' in self.annots) != ('term' in self.annots):
+            return 'creates or destroys remote state'
+        for param in self.params:
+            if param.kind is None:
+                return 'parameter %s has no marshalling' % param.name
+            ref = param.annots.get('count') or param.annots.get('size')
+            if ref is not None:
+                if ref.isdigit():
+                    ref = self.params[int(ref) - 1].name
+                    param.annots['count' if 'count' in param.annots else 'size'] = ref
+                if ref not in self.byname or self.byname[ref].kind not in ('scalar', 'inout'):
+                    return 'parameter %s has unknown size %s' % (param.name, ref)
+        if self.rtype.endswith('*'):
+            if 'cstring' not in self.annots or 'static' not in self.annots:
+                return 'returns a pointer'
+        elif self.rtype != 'void' and self.rtype not in FIXED_TYPES:
+            return 'returns %s' % self.rtype
+        return None
+
+    def returns_string(self):
+        return self.rtype.endswith('*')
+
+    def returns_value(self):
+        return self.rtype != 'void' and not self.returns_string()
+
+    def of_kind(self, *kinds):
+        return [p for p in self.params if p.kind in kinds]
+
+    def request_fields(self):
+        return self.of_kind('scalar', 'inout')
+
+    def reply_fields(self):
+        fields = []
+        if self.returns_value():
+            fields.append((FIXED_TYPES[self.rtype][0], 'retval'))
+        for param in self.of_kind('inout'):
+            fields.append((param.fixed_type(), param.name))
+        return fields
+
+    def has_fds(self):
+        return bool(self.of_kind('fd', 'fd_array'))
+
+    def size_expr(self, param, where):
+        """Bytes behind a sized/counted pointer.  where is 'stub' (caller's
+        values), 'req' (values in the request) or 'driver' (local copies)."""
+        ref = param.annots.get('count') or param.annots.get('size')
+        if where == 'stub':
+            value = ('*%s' % ref) if self.byname[ref].kind == 'inout' else ref
+        elif where == 'req':
+            value = 'req->%s' % ref
+        else:
+            value = ref
+        if 'count' in param.annots:
+            return '(size_t)%s * sizeof(%s)' % (value, param.base)
+        return '(size_t)%s' % value
+
+    def handle(self):
+        """The parameter that is a handle, if any."""
+        for param in self.params:
+            if param.ctype.count('*') == 1 and param.base in HANDLE_TYPES:
+                return param
+        return None
+
+    def returns_handle(self):
+        return self.rtype.replace('*', '').strip() in HANDLE_TYPES
+
+    def signature(self, name=None):
+        params = ', '.join(p.decl() for p in self.params) or 'void'
+        return '%s(%s)' % (c_decl(self.rtype, name or self.name), params)
+
+
+def parse(text):
+    text = re.sub(r'/\*.*?\*/', '', text, flags=re.S)
+    text = re.sub(r'^\s*#.*$', '', text, flags=re.M)
+    decls = re.finditer(r'BZ_EXTERN\s+([^;]*?)\s*BZ_API\((\w+)\)\s*\((.*?)\)\s*([^;()]*);', text, re.S)
+    functions = []
+    for decl in decls:
+        params = [p.strip() for p in decl.group(3).split(',')]
+        if params == ['void']:
+            params = []
+        functions.append(Function(decl.group(1), decl.group(2), params, decl.group(4)))
+        functions[-1].index = len(functions)
+    return functions
+
+
+def struct_name(fn, suffix):
+    return 'struct %s%s' % (fn.name, suffix)
+
+
+def log_args(fn, values):
+    """Format string and arguments for logging a call."""
+    fmts = []
+    args = []
+    for param in fn.params:
+        if param.fmt() != '...':
+            args.append(values(param))
+        elif fmts and fmts[-1] == '...':
+            continue
+        fmts.append(param.fmt())
+    return ', '.join(fmts), ''.join(', ' + a for a in args)
+
+
+def retval_fmt(fn):
+    if fn.returns_string():
+        return " return '%s'"
+    if fn.returns_value():
+        return ' return ' + FIXED_TYPES[fn.rtype][1]
+    return ''
+
+
+# --------------------------------------------------------------------------
+# header: method IDs and packed structs
+
+def hand_written(skipped):
+    """Entrypoints that are remoted, but by hand rather than generated."""
+    return [fn for fn in skipped if not fn.annots & set(['skip', 'client'])]
+
+
+def emit_header(functions, out, skipped):
+    out.append('#ifndef _BZ2_IDL_H')
+    out.append('#define _BZ2_IDL_H')
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    out.append('')
+    out.append('#include <stddef.h>')
+    out.append('#include <stdint.h>')
+    out.append('')
+    for fn in skipped:
+        out.append('/* Not generated: %s (%s) */' % (fn.name, fn.reason))
+    out.append('')
+    out.append('enum IdlMethod {')
+    out.append('  IDL_NONE,')
+    for fn in functions:
+        out.append('  IDL_%s,' % fn.name)
+    out.append('  /* Hand-written, where a transport remotes them */')
+    for fn in hand_written(skipped):
+        out.append('  IDL_%s,' % fn.name)
+    out.append('  IDL_METHOD_COUNT')
+    out.append('};')
+    out.append('')
+    out.append('static inline const char *IdlMethodName(int method) {')
+    out.append('  switch (method) {')
+    for fn in functions + hand_written(skipped):
+        out.append('  case IDL_%s: return "%s";' % (fn.name, fn.name))
+    out.append('  default: return NULL;')
+    out.append('  }')
+    out.append('}')
+    for fn in functions:
+        out.append('')
+        out.append('/* %s */' % fn.signature())
+        for suffix, fields in (('Request', [(p.fixed_type(), p.name) for p in fn.request_fields()]),
+                               ('Reply', fn.reply_fields())):
+            if not fields:
+                continue
+            out.append('%s {' % struct_name(fn, suffix))
+            for ftype, fname in fields:
+                out.append('  %s %s;' % (ftype, fname))
+            out.append('};')
+            offset = 0
+            for ftype, fname in fields:
+                out.append('_Static_assert(offsetof(%s, %s) == %d, "layout");' % (
+                    struct_name(fn, suffix), fname, offset))
+                offset += 4
+            out.append('_Static_assert(sizeof(%s) == %d, "layout");' % (struct_name(fn, suffix), offset))
+    out.append('')
+    out.append('#endif')
+
+
+# --------------------------------------------------------------------------
+# libnv: the packed request as one binary field, fds as one descriptor array,
+# and each buffer as its own binary field (in0, in1, ... / out0, out1, ...).
+
+def emit_libnv_stub(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_libnv_stub_function(fn, out)
+
+
+def emit_stub_prologue(fn, out, fmt, args, signature=None):
+    """Start of a stub entrypoint: argument checks and driver checkout."""
+    out.append((signature or fn.signature()) + ' {')
+    out.append('  static const char *cmd = "%s";' % fn.name)
+    if fn.returns_string():
+        # __static: the result is fixed, so only ask the driver once
+        out.append('  static const char *saved_retval = NULL;')
+        out.append('  if (saved_retval) {')
+        out.append('    api_("%%s(%s) return \'%%s\' <= (saved)", cmd%s, saved_retval);' % (fmt, args))
+        out.append('    return saved_retval;')
+        out.append('  }')
+    # Local checks, as the library itself would make them
+    counts = []
+    for param in fn.of_kind('fd_array', 'in_array', 'out_array'):
+        if param.annots['count'] not in counts:
+            counts.append(param.annots['count'])
+    for count in counts:
+        out.append('  if (%s < 0) return %s;' % (count, PARAM_ERROR))
+        arrays = [p.name for p in fn.params if p.annots.get('count') == count]
+        out.append('  if (%s > 0 && (%s)) return %s;' % (
+            count, ' || '.join('%s == NULL' % a for a in arrays), PARAM_ERROR))
+    pointers = [p.name for p in fn.of_kind('in_buf', 'out_buf', 'inout')]
+    if pointers:
+        out.append('  if (%s) return %s;' % (' || '.join('%s == NULL' % p for p in pointers), PARAM_ERROR))
+    out.append('  RpcTraceBegin(cmd);')
+    out.append('  struct DriverPoolSlot *slot = DriverPoolAcquire(&g_pool);')
+    out.append('  if (slot == NULL) {')
+    out.append('    error_("%s: no driver", cmd);')
+    emit_stub_failure(fn, out, '0')
+    out.append('  }')
+    out.append('  struct DriverConnection *conn = (struct DriverConnection *)slot->conn;')
+
+
+def emit_stub_failure(fn, out, request_bytes):
+    """Return from a stub, inside an if block, when there was no driver to
+    make the call or no reply from it."""
+    if fn.returns_value() and not fn.returns_string():
+        for param in fn.of_kind('out_array'):
+            # Results the driver didn't give us count as failures
+            out.append('    for (int ii = 0; ii < %s; ii++) %s[ii] = %s;' % (
+                param.annots['count'], param.name, IO_ERROR))
+        out.append('    RpcTraceResult(%s);' % IO_ERROR)
+    out.append('    RpcTraceEnd(%s, 0);' % request_bytes)
+    if fn.returns_string():
+        out.append('    return NULL;')
+    elif fn.returns_value():
+        out.append('    return %s;' % IO_ERROR)
+    else:
+        out.append('    return;')
+
+
+def emit_trace_end(fn, out, request_bytes, reply_bytes):
+    if fn.returns_value():
+        out.append('  RpcTraceResult(rsp.retval);')
+    out.append('  RpcTraceEnd(%s, %s);' % (request_bytes, reply_bytes))
+
+
+def emit_request_struct(fn, out):
+    if fn.request_fields():
+        out.append('  %s req;' % struct_name(fn, 'Request'))
+        for param in fn.request_fields():
+            value = ('*' + param.name) if param.kind == 'inout' else param.name
+            out.append('  req.%s = %s;' % (param.name, value))
+
+
+def stub_log_args(fn):
+    return log_args(fn, lambda p: ('*' + p.name) if p.kind == 'inout' else p.name)
+
+
+def emit_libnv_stub_function(fn, out):
+    fmt, args = stub_log_args(fn)
+    fail = IO_ERROR if fn.returns_value() else None
+    emit_stub_prologue(fn, out, fmt, args)
+    out.append('  nvlist_t *nvl;')
+    out.append('  nv_arena_t *prev_arena = nv_arena_use(conn->arena);')
+    out.append('')
+    out.append('  uint64_t start = RpcNow();')
+    out.append('  nvl = nvlist_create(0);')
+    out.append('  nvlist_add_number(nvl, "method", IDL_%s);' % fn.name)
+    emit_request_struct(fn, out)
+    if fn.request_fields():
+        out.append('  nvlist_add_binary(nvl, "req", &req, sizeof(req));')
+    if fn.has_fds():
+        emit_libnv_stub_fds(fn, out)
+    for ii, param in enumerate(fn.of_kind('in_buf', 'in_array')):
+        size = fn.size_expr(param, 'stub')
+        out.append('  if (%s > 0) nvlist_add_binary(nvl, "in%d", %s, %s);' % (size, ii, param.name, size))
+    out.append('')
+    out.append('  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);')
+    out.append('  api_("%%s(%s) =>", cmd%s);' % (fmt, args))
+    out.append('  uint64_t request_bytes = RpcTracing() ? nvlist_size(nvl) : 0;')
+    out.append('  nvl = nvlist_xfer(conn->socket_fds[0], nvl, 0);')
+    out.append('  start = RpcPhaseAdd(RPC_PHASE_CALL, start);')
+    out.append('')
+    out.append('  if (nvl == NULL) {')
+    out.append('    /* The driver has gone, or the connection is out of step with it */')
+    out.append('    error_("%s: no reply from driver: %s", cmd, strerror(errno));')
+    out.append('    nv_arena_use(prev_arena);')
+    out.append('    nv_arena_reset(conn->arena);')
+    out.append('    DriverPoolRelease(&g_pool, slot, 0);')
+    emit_stub_failure(fn, out, 'request_bytes')
+    out.append('  }')
+    out.append('  uint64_t reply_bytes = RpcTracing() ? nvlist_size(nvl) : 0;')
+    if fn.returns_string():
+        out.append('  const char *retval = dnvlist_get_string(nvl, "retval", NULL);')
+        out.append('  if (retval != NULL) saved_retval = strdup(retval);')
+        out.append('  api_("%%s(%s) return \'%%s\' <=", cmd%s, saved_retval ? saved_retval : "(none)");' % (fmt, args))
+    else:
+        emit_libnv_stub_reply(fn, out, fail)
+        if fn.returns_value():
+            out.append('  api_("%%s(%s)%s <=", cmd%s, rsp.retval);' % (fmt, retval_fmt(fn), args))
+        else:
+            out.append('  api_("%%s(%s) <=", cmd%s);' % (fmt, args))
+    out.append('  nvlist_destroy(nvl);')
+    out.append('  nv_arena_use(prev_arena);')
+    out.append('  nv_arena_reset(conn->arena);')
+    out.append('  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);')
+    # A driver whose reply made no sense is not trusted with another call
+    out.append('  DriverPoolRelease(&g_pool, slot, %s);' % ('saved_retval != NULL' if fn.returns_string() else 'ok'))
+    emit_trace_end(fn, out, 'request_bytes', 'reply_bytes')
+    if fn.returns_string():
+        out.append('  return saved_retval;')
+    elif fn.returns_value():
+        out.append('  return rsp.retval;')
+    out.append('}')
+
+
+def emit_libnv_stub_fds(fn, out):
+    singles = fn.of_kind('fd')
+    arrays = fn.of_kind('fd_array')
+    if not arrays:
+        out.append('  int fds[%d] = { %s };' % (len(singles), ', '.join(p.name for p in singles)))
+        out.append('  nvlist_add_descriptor_array(nvl, "fds", fds, %d);' % len(singles))
+        return
+    terms = ([str(len(singles))] if singles else []) + [p.annots['count'] for p in arrays]
+    out.append('  size_t nfds = %s;' % ' + '.join(terms))
+    out.append('  if (nfds > 0) {')
+    out.append('    int *fds = malloc(nfds * sizeof(int));')
+    out.append('    if (fds != NULL) {')
+    out.append('      int *next = fds;')
+    for param in fn.params:
+        if param.kind == 'fd':
+            out.append('      *next++ = %s;' % param.name)
+        elif param.kind == 'fd_array':
+            out.append('      memcpy(next, %s, %s * sizeof(int));' % (param.name, param.annots['count']))
+            out.append('      next += %s;' % param.annots['count'])
+    out.append('      nvlist_add_descriptor_array(nvl, "fds", fds, nfds);')
+    out.append('      free(fds);')
+    out.append('    } else {')
+    out.append('      nvlist_set_error(nvl, ENOMEM);')
+    out.append('    }')
+    out.append('  }')
+
+
+def emit_libnv_stub_reply(fn, out, fail):
+    """Unpack the reply into rsp and the caller's out parameters.  A reply
+    that doesn't match the request is treated as an I/O error."""
+    fields = fn.reply_fields()
+    fail_lines = []
+    if fields:
+        out.append('  %s rsp;' % struct_name(fn, 'Reply'))
+        for ftype, fname in fields:
+            value = fail if fname == 'retval' else '*' + fname
+            out.append('  rsp.%s = %s;' % (fname, value))
+    out.append('  size_t len = 0;')
+    if fields:
+        out.append('  const void *data = dnvlist_get_binary(nvl, "rsp", &len, NULL, 0);')
+        out.append('  int ok = (data != NULL && len == sizeof(rsp));')
+        out.append('  if (ok) memcpy(&rsp, data, sizeof(rsp));')
+    else:
+        out.append('  int ok = 1;')
+    for ii, param in enumerate(fn.of_kind('out_buf', 'out_array')):
+        ref = param.annots.get('count') or param.annots.get('size')
+        if fn.byname[ref].kind == 'inout':
+            # The size parameter gives the capacity on the way in and the
+            # amount used on the way out.
+            out.append('  size_t out%d_len = 0;' % ii)
+            out.append('  const void *out%d = dnvlist_get_binary(nvl, "out%d", &out%d_len, NULL, 0);' % (ii, ii, ii))
+            out.append('  if (ok && out%d_len > %s) out%d_len = %s;' % (ii, fn.size_expr(param, 'stub'), ii, fn.size_expr(param, 'stub')))
+            out.append('  if (ok && out%d_len > 0) memcpy(%s, out%d, out%d_len);' % (ii, param.name, ii, ii))
+        else:
+            size = fn.size_expr(param, 'stub')
+            out.append('  const void *out%d = dnvlist_get_binary(nvl, "out%d", &len, NULL, 0);' % (ii, ii))
+            out.append('  if (%s > 0 && (out%d == NULL || len != %s)) ok = 0;' % (size, ii, size))
+            out.append('  if (ok && %s > 0) memcpy(%s, out%d, %s);' % (size, param.name, ii, size))
+            if param.kind == 'out_array' and fail is not None:
+                # Results the driver didn't give us count as failures
+                fail_lines.append('    for (int ii = 0; ii < %s; ii++) %s[ii] = %s;' % (
+                    param.annots['count'], param.name, fail))
+    out.append('  if (!ok) {')
+    out.append('    error_("bad reply to %s", cmd);')
+    if fn.returns_value():
+        out.append('    rsp.retval = %s;' % fail)
+    out.extend(fail_lines)
+    out.append('  }')
+    for param in fn.of_kind('inout'):
+        out.append('  *%s = rsp.%s;' % (param.name, param.name))
+
+
+def emit_libnv_driver(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_libnv_driver_function(fn, out)
+    out.append('')
+    out.append('typedef int (*IdlHandler)(const nvlist_t *msg, nvlist_t *rsp);')
+    out.append('')
+    out.append('static const IdlHandler idl_handlers[IDL_METHOD_COUNT] = {')
+    for fn in functions:
+        out.append('  [IDL_%s] = proxied_%s,' % (fn.name, fn.name))
+    out.append('};')
+
+
+def expected_fds(fn):
+    singles = fn.of_kind('fd')
+    terms = ([str(len(singles))] if singles else []) + \
+            ['(size_t)req->%s' % p.annots['count'] for p in fn.of_kind('fd_array')]
+    return ' + '.join(terms)
+
+
+def emit_driver_locals(fn, out):
+    """Arguments from req and fds into locals named as the parameters."""
+    for param in fn.of_kind('scalar'):
+        out.append('  %s %s = req->%s;' % (param.ctype, param.name, param.name))
+    for param in fn.of_kind('inout'):
+        out.append('  %s %s = req->%s;' % (param.base, param.name, param.name))
+    offset = []
+    for param in fn.params:
+        if param.kind == 'fd':
+            out.append('  int %s = fds[%s];' % (param.name, ' + '.join(offset) or '0'))
+            offset.append('1')
+        elif param.kind == 'fd_array':
+            out.append('  const int *%s = fds ? fds + %s : NULL;' % (param.name, ' + '.join(offset) or '0'))
+            offset.append(param.annots['count'])
+
+
+def emit_driver_outs(fn, out):
+    """Buffers for out parameters, zeroed so nothing stale goes back."""
+    outs = fn.of_kind('out_buf', 'out_array')
+    for param in outs:
+        size = fn.size_expr(param, 'driver')
+        out.append('  %s *%s = calloc(%s + 1, 1);' % (param.base, param.name, size))
+    if len(outs) == 1:
+        out.append('  if (%s == NULL) return -1;' % outs[0].name)
+    elif outs:
+        out.append('  if (%s) {' % ' || '.join('%s == NULL' % p.name for p in outs))
+        for param in outs:
+            out.append('    free(%s);' % param.name)
+        out.append('    return -1;')
+        out.append('  }')
+    return outs
+
+
+def emit_driver_call(fn, out, reply_struct=True):
+    fmt, args = log_args(fn, lambda p: p.name)
+    out.append('')
+    out.append('  api_("=> %%s(%s)", method%s);' % (fmt, args))
+    call_args = ', '.join(('&' + p.name) if p.kind == 'inout' else p.name for p in fn.params)
+    if fn.returns_string():
+        out.append('  const char *retval = %s(%s);' % (fn.name, call_args))
+    elif fn.returns_value():
+        out.append('  %s retval = %s(%s);' % (fn.rtype, fn.name, call_args))
+    else:
+        out.append('  %s(%s);' % (fn.name, call_args))
+    if fn.returns_value():
+        out.append('  RpcTraceResult(retval);')
+    if fn.returns_value() or fn.returns_string():
+        out.append('  api_("=> %%s(%s)%s", method%s, retval);' % (fmt, retval_fmt(fn), args))
+    else:
+        out.append('  api_("=> %%s(%s)", method%s);' % (fmt, args))
+    if reply_struct and fn.reply_fields():
+        out.append('  %s reply;' % struct_name(fn, 'Reply'))
+        for ftype, fname in fn.reply_fields():
+            out.append('  reply.%s = %s;' % (fname, fname))
+
+
+def emit_driver_out_len(fn, out, ii, param):
+    size = fn.size_expr(param, 'driver')
+    ref = param.annots.get('count') or param.annots.get('size')
+    out.append('  size_t out%d_len = %s;' % (ii, size))
+    if fn.byname[ref].kind == 'inout':
+        # Only as much as the call says it used, within the capacity
+        out.append('  if (out%d_len > (size_t)req->%s) out%d_len = req->%s;' % (ii, ref, ii, ref))
+
+
+def emit_libnv_driver_function(fn, out):
+    out.append('static int proxied_%s(const nvlist_t *msg, nvlist_t *rsp) {' % fn.name)
+    out.append('  static const char *method = "%s";' % fn.name)
+    if fn.of_kind('in_buf', 'in_array'):
+        out.append('  static const char empty[1];')
+    if fn.request_fields():
+        out.append('  size_t len = 0;')
+        out.append('  const %s *req = dnvlist_get_binary(msg, "req", &len, NULL, 0);' % struct_name(fn, 'Request'))
+        out.append('  if (req == NULL || len != sizeof(*req)) return -1;')
+    if fn.has_fds():
+        out.append('  size_t nfds = 0;')
+        out.append('  const int *fds = nvlist_exists_descriptor_array(msg, "fds") ?')
+        out.append('                   nvlist_get_descriptor_array(msg, "fds", &nfds) : NULL;')
+        out.append('  if (nfds != %s) return -1;' % expected_fds(fn))
+    emit_driver_locals(fn, out)
+    for ii, param in enumerate(fn.of_kind('in_buf', 'in_array')):
+        size = fn.size_expr(param, 'driver')
+        out.append('  size_t in%d_len = 0;' % ii)
+        out.append('  const void *in%d = dnvlist_get_binary(msg, "in%d", &in%d_len, empty, 0);' % (ii, ii, ii))
+        out.append('  if (in%d_len != %s) return -1;' % (ii, size))
+        out.append('  %s = in%d;' % (param.decl(), ii))
+    outs = emit_driver_outs(fn, out)
+    emit_driver_call(fn, out)
+
+    if fn.returns_string():
+        out.append('  nvlist_add_string(rsp, "retval", retval);')
+    if fn.reply_fields():
+        out.append('  nvlist_add_binary(rsp, "rsp", &reply, sizeof(reply));')
+    for ii, param in enumerate(outs):
+        emit_driver_out_len(fn, out, ii, param)
+        out.append('  if (out%d_len > 0) {' % ii)
+        out.append('    nvlist_move_binary(rsp, "out%d", %s, out%d_len);' % (ii, param.name, ii))
+        out.append('  } else {')
+        out.append('    free(%s);' % param.name)
+        out.append('  }')
+    out.append('  return 0;')
+    out.append('}')
+
+
+# --------------------------------------------------------------------------
+# raw: one SeqPacketSend() per message, whose payload is the packed request
+# (or reply) struct followed by the buffers, gathered straight from (and
+# scattered straight into) the caller's memory.  fds go as SCM_RIGHTS.
+
+def emit_raw_stub(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_raw_stub_function(fn, out)
+
+
+def emit_raw_stub_function(fn, out):
+    fmt, args = stub_log_args(fn)
+    fail = IO_ERROR if fn.returns_value() else None
+    emit_stub_prologue(fn, out, fmt, args)
+    out.append('')
+    out.append('  uint64_t start = RpcNow();')
+    emit_request_struct(fn, out)
+    iov = []
+    if fn.request_fields():
+        iov.append(('&req', 'sizeof(req)'))
+    for param in fn.of_kind('in_buf', 'in_array'):
+        iov.append(('(void *)' + param.name, fn.size_expr(param, 'stub')))
+    emit_iovec(out, 'iov', iov)
+    nfds, copied = emit_raw_stub_fds(fn, out)
+    if fn.returns_string():
+        out.append('  struct iovec riov[1] = {{ NULL, 0 }};')
+        grow = 1
+    else:
+        riov = []
+        if fn.reply_fields():
+            out.append('  %s rsp;' % struct_name(fn, 'Reply'))
+            riov.append(('&rsp', 'sizeof(rsp)'))
+        for param in fn.of_kind('out_buf', 'out_array'):
+            riov.append((param.name, fn.size_expr(param, 'stub')))
+        emit_iovec(out, 'riov', riov)
+        grow = 0
+    out.append('')
+    out.append('  start = RpcPhaseAdd(RPC_PHASE_MARSHAL, start);')
+    out.append('  api_("%%s(%s) =>", cmd%s);' % (fmt, args))
+    nriov = 1 if grow else len(riov)
+    out.append('  ssize_t len = RawCall(conn, IDL_%s, %s, %d, %s, %s, %d, %d);' % (
+        fn.name, 'iov' if iov else 'NULL', len(iov), nfds, 'riov' if nriov else 'NULL', nriov, grow))
+    out.append('  start = RpcPhaseAdd(RPC_PHASE_CALL, start);')
+    if copied:
+        out.append('  free(fds);')
+    out.append('')
+    if fn.returns_string():
+        out.append('  char *retval = riov[0].iov_base;')
+        out.append('  if (len > 0 && retval[len - 1] == \'\\0\') {')
+        out.append('    saved_retval = strdup(retval);')
+        out.append('  } else {')
+        out.append('    error_("bad reply to %s", cmd);')
+        out.append('  }')
+        out.append('  free(retval);')
+        out.append('  api_("%%s(%s) return \'%%s\' <=", cmd%s, saved_retval ? saved_retval : "(none)");' % (fmt, args))
+    else:
+        emit_raw_stub_reply(fn, out, fail)
+        if fn.returns_value():
+            out.append('  api_("%%s(%s)%s <=", cmd%s, rsp.retval);' % (fmt, retval_fmt(fn), args))
+        else:
+            out.append('  api_("%%s(%s) <=", cmd%s);' % (fmt, args))
+    out.append('  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, start);')
+    out.append('  DriverPoolRelease(&g_pool, slot, len >= 0);')
+    request_bytes = ' + '.join(size for base, size in iov) or '0'
+    emit_trace_end(fn, out, request_bytes, '(len > 0) ? len : 0')
+    if fn.returns_string():
+        out.append('  return saved_retval;')
+    elif fn.returns_value():
+        out.append('  return rsp.retval;')
+    out.append('}')
+
+
+def emit_iovec(out, name, entries):
+    if not entries:
+        return
+    out.append('  struct iovec %s[%d];' % (name, len(entries)))
+    for ii, (base, size) in enumerate(entries):
+        out.append('  %s[%d].iov_base = %s;' % (name, ii, base))
+        out.append('  %s[%d].iov_len = %s;' % (name, ii, size))
+
+
+def emit_raw_stub_fds(fn, out):
+    """Returns the 'fds, count' arguments for RawCall(), and whether fds
+    is a copy to free afterwards."""
+    singles = fn.of_kind('fd')
+    arrays = fn.of_kind('fd_array')
+    if not singles and not arrays:
+        return 'NULL, 0', False
+    if not arrays:
+        out.append('  int fds[%d] = { %s };' % (len(singles), ', '.join(p.name for p in singles)))
+        return 'fds, %d' % len(singles), False
+    if len(arrays) == 1 and not singles:
+        return '%s, %s' % (arrays[0].name, arrays[0].annots['count']), False
+    terms = ([str(len(singles))] if singles else []) + [p.annots['count'] for p in arrays]
+    out.append('  int nfds = %s;' % ' + '.join(terms))
+    out.append('  int *fds = malloc(nfds * sizeof(int) + 1);')
+    out.append('  if (fds == NULL) {')
+    out.append('    DriverPoolRelease(&g_pool, slot, 1);')
+    if fn.returns_value():
+        out.append('    RpcTraceResult(%s);' % IO_ERROR)
+    out.append('    RpcTraceEnd(0, 0);')
+    out.append('    return %s;' % ('NULL' if fn.returns_string() else IO_ERROR))
+    out.append('  }')
+    out.append('  int *next = fds;')
+    for param in fn.params:
+        if param.kind == 'fd':
+            out.append('  *next++ = %s;' % param.name)
+        elif param.kind == 'fd_array':
+            out.append('  memcpy(next, %s, %s * sizeof(int));' % (param.name, param.annots['count']))
+            out.append('  next += %s;' % param.annots['count'])
+    return 'fds, nfds', True
+
+
+def emit_raw_stub_reply(fn, out, fail):
+    """Check the reply, already scattered into rsp and the caller's out
+    buffers.  A reply that doesn't match the request is an I/O error."""
+    expect = ['sizeof(rsp)'] if fn.reply_fields() else []
+    for param in fn.of_kind('out_buf', 'out_array'):
+        ref = param.annots.get('count') or param.annots.get('size')
+        if fn.byname[ref].kind == 'inout':
+            # The driver sends as much as was used, up to the capacity
+            out.append('  size_t used = (len >= (ssize_t)sizeof(rsp) && rsp.%s < req.%s) ? rsp.%s : req.%s;' % (
+                ref, ref, ref, ref))
+            expect.append('used')
+        else:
+            expect.append(fn.size_expr(param, 'stub'))
+    out.append('  if (len < 0 || (size_t)len != %s) {' % (' + '.join(expect) or '0'))
+    out.append('    error_("bad reply to %s", cmd);')
+    if fn.returns_value():
+        out.append('    rsp.retval = %s;' % fail)
+    for param in fn.of_kind('inout'):
+        out.append('    rsp.%s = req.%s;' % (param.name, param.name))
+    for param in fn.of_kind('out_array'):
+        if fail is not None:
+            # Results the driver didn't give us count as failures
+            out.append('    for (int ii = 0; ii < %s; ii++) %s[ii] = %s;' % (
+                param.annots['count'], param.name, fail))
+    out.append('  }')
+    for param in fn.of_kind('inout'):
+        out.append('  *%s = rsp.%s;' % (param.name, param.name))
+
+
+def emit_raw_driver(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_raw_driver_function(fn, out)
+    out.append('')
+    out.append('typedef ssize_t (*RawHandler)(int sock_fd, const char *data, size_t len, const int *fds, int nfds);')
+    out.append('')
+    out.append('static const RawHandler raw_handlers[IDL_METHOD_COUNT] = {')
+    for fn in functions:
+        out.append('  [IDL_%s] = raw_%s,' % (fn.name, fn.name))
+    out.append('};')
+
+
+def emit_raw_driver_function(fn, out):
+    out.append('static ssize_t raw_%s(int sock_fd, const char *data, size_t len, const int *fds, int nfds) {' % fn.name)
+    out.append('  static const char *method = "%s";' % fn.name)
+    if fn.request_fields():
+        out.append('  const %s *req = (const void *)data;' % struct_name(fn, 'Request'))
+        out.append('  if (len < sizeof(*req)) return -1;')
+        out.append('  data += sizeof(*req);')
+        out.append('  len -= sizeof(*req);')
+    if fn.has_fds():
+        out.append('  if ((size_t)nfds != %s) return -1;' % expected_fds(fn))
+    else:
+        out.append('  if (nfds != 0) return -1;')
+    emit_driver_locals(fn, out)
+    for param in fn.of_kind('in_buf', 'in_array'):
+        size = fn.size_expr(param, 'driver')
+        out.append('  if (len < %s) return -1;' % size)
+        out.append('  %s = (const void *)data;' % param.decl())
+        out.append('  data += %s;' % size)
+        out.append('  len -= %s;' % size)
+    out.append('  if (len != 0) return -1;')
+    outs = emit_driver_outs(fn, out)
+    emit_driver_call(fn, out)
+
+    iov = []
+    if fn.returns_string():
+        iov.append(('(void *)retval', 'strlen(retval) + 1'))
+    if fn.reply_fields():
+        iov.append(('&reply', 'sizeof(reply)'))
+    for ii, param in enumerate(outs):
+        emit_driver_out_len(fn, out, ii, param)
+        iov.append((param.name, 'out%d_len' % ii))
+    emit_iovec(out, 'iov', iov)
+    out.append('  if (SeqPacketSend(sock_fd, IDL_%s, iov, %d, NULL, 0) < 0) {' % (fn.name, len(iov)))
+    out.append('    error_("failed to send %s reply, errno=%d", method, errno);')
+    out.append('  }')
+    for param in outs:
+        out.append('  free(%s);' % param.name)
+    out.append('  return %s;' % (' + '.join(size for base, size in iov) or '0'))
+    out.append('}')
+
+
+# --------------------------------------------------------------------------
+# D-Bus: a method call named after the entrypoint, with one argument per
+# parameter in order: scalars as INT32/UINT32, fds as UNIX_FD, fd arrays as
+# arrays of UNIX_FD, and input buffers as arrays of BYTE (or of the element
+# type).  The reply holds the return value, then the inout values, then each
+# out buffer as an array.
+
+DBUS_TYPES = {
+    'int': ('DBUS_TYPE_INT32', 'vx', 'dbus_int32_t'),
+    'unsigned int': ('DBUS_TYPE_UINT32', 'ux', 'dbus_uint32_t'),
+}
+
+
+def dbus_type(param):
+    """The D-Bus type of a parameter (of its elements, for arrays)."""
+    if param.kind in ('fd', 'fd_array'):
+        return 'DBUS_TYPE_UNIX_FD'
+    if param.kind in ('in_buf', 'out_buf'):
+        return 'DBUS_TYPE_BYTE'
+    return DBUS_TYPES[param.base][0]
+
+
+def dbus_var(param):
+    """The local that a stub marshals a scalar or fd through."""
+    if param.kind in ('fd', 'fd_array'):
+        return 'vx'
+    return DBUS_TYPES[param.base][1]
+
+
+def dbus_elements(fn, param, where):
+    """Elements in the array for a sized/counted pointer."""
+    ref = param.annots.get('count') or param.annots.get('size')
+    if where == 'stub' and fn.byname[ref].kind == 'inout':
+        return '*' + ref
+    return ref
+
+
+def dbus_bytes(param, elements):
+    if param.kind in ('in_buf', 'out_buf'):
+        return '(size_t)%s' % elements
+    return '(size_t)%s * sizeof(%s)' % (elements, param.base)
+
+
+def emit_dbus_stub(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_dbus_stub_function(fn, out)
+
+
+def emit_dbus_stub_function(fn, out):
+    fmt, args = stub_log_args(fn)
+    signature = None
+    if fn.of_kind('fd_array'):
+        # A message's fds all go in one sendmsg(), so the entrypoint itself is
+        # hand-written, to split up calls with more than MAX_FDS_PER_MSG.
+        out.append('/* Carries at most MAX_FDS_PER_MSG descriptors */')
+        signature = 'static ' + fn.signature(fn.name + 'Call')
+    emit_stub_prologue(fn, out, fmt, args, signature)
+    out.append('  DBusMessage *msg = ConnectionNewRequest(conn, cmd);')
+    if fn.params:
+        emit_dbus_stub_args(fn, out)
+    out.append('')
+    out.append('  DBusError err;')
+    out.append('  dbus_error_init(&err);')
+    out.append('  api_("%%s(%s) =>", cmd%s);' % (fmt, args))
+    out.append('  DBusMessage *rsp = ConnectionBlockingSendReply(conn, msg, &err);')
+    emit_dbus_stub_reply(fn, out)
+    out.append('  dbus_message_unref(rsp);')
+    out.append('  RpcPhaseAdd(RPC_PHASE_UNMARSHAL, conn->phase_start);')
+    if fn.returns_value():
+        out.append('  RpcTraceResult(retval);')
+    out.append('  RpcTraceEnd(conn->request_bytes, conn->reply_bytes);')
+    out.append('  DriverPoolRelease(&g_pool, slot, 1);')
+    if fn.returns_string():
+        out.append('  return saved_retval;')
+    elif fn.returns_value():
+        out.append('  return retval;')
+    out.append('}')
+
+
+def emit_dbus_stub_args(fn, out):
+    out.append('')
+    out.append('  DBusMessageIter msg_it;')
+    if fn.of_kind('fd_array', 'in_buf', 'in_array'):
+        out.append('  DBusMessageIter arr_it;')
+    out.append('  dbus_message_iter_init_append(msg, &msg_it);')
+    scalars = fn.of_kind('scalar', 'inout', 'fd', 'fd_array')
+    for var, ctype in sorted(set((dbus_var(p), DBUS_TYPES.get(p.base, DBUS_TYPES['int'])[2])
+                                 for p in scalars)):
+        out.append('  %s %s;' % (ctype, var))
+    for ii, param in enumerate(fn.of_kind('in_buf', 'in_array')):
+        out.append('  const void *in%d = %s;' % (ii, param.name))
+    ins = 0
+    for param in fn.params:
+        dtype = dbus_type(param)
+        if param.kind in ('scalar', 'inout', 'fd'):
+            value = ('*' + param.name) if param.kind == 'inout' else param.name
+            out.append('  %s = %s;' % (dbus_var(param), value))
+            out.append('  dbus_message_iter_append_basic(&msg_it, %s, &%s);' % (dtype, dbus_var(param)))
+        elif param.kind == 'fd_array':
+            out.append('  dbus_message_iter_open_container(&msg_it, DBUS_TYPE_ARRAY, %s_AS_STRING, &arr_it);' % dtype)
+            out.append('  for (int ii = 0; ii < %s; ii++) {' % param.annots['count'])
+            out.append('    vx = %s[ii];' % param.name)
+            out.append('    dbus_message_iter_append_basic(&arr_it, %s, &vx);' % dtype)
+            out.append('  }')
+            out.append('  dbus_message_iter_close_container(&msg_it, &arr_it);')
+        elif param.kind in ('in_buf', 'in_array'):
+            out.append('  dbus_message_iter_open_container(&msg_it, DBUS_TYPE_ARRAY, %s_AS_STRING, &arr_it);' % dtype)
+            out.append('  dbus_message_iter_append_fixed_array(&arr_it, %s, &in%d, %s);' % (
+                dtype, ins, dbus_elements(fn, param, 'stub')))
+            out.append('  dbus_message_iter_close_container(&msg_it, &arr_it);')
+            ins += 1
+
+
+def emit_dbus_stub_reply(fn, out):
+    """Unpack the reply into retval and the caller's out parameters.  A reply
+    that doesn't match the request is treated as an I/O error."""
+    fmt, args = stub_log_args(fn)
+    outs = fn.of_kind('out_buf', 'out_array')
+    reads = []
+    if fn.returns_string():
+        out.append('  const char *retval = NULL;')
+        reads.append('IterGetBasic(&rsp_it, DBUS_TYPE_STRING, &retval)')
+    elif fn.returns_value():
+        out.append('  %s retval = %s;' % (fn.rtype, IO_ERROR))
+        reads.append('IterGetBasic(&rsp_it, %s, &retval)' % DBUS_TYPES[fn.rtype][0])
+    for param in fn.of_kind('inout'):
+        out.append('  %s rsp_%s = *%s;' % (param.base, param.name, param.name))
+        reads.append('IterGetBasic(&rsp_it, %s, &rsp_%s)' % (dbus_type(param), param.name))
+    for ii, param in enumerate(outs):
+        out.append('  const void *out%d = NULL;' % ii)
+        out.append('  int out%d_len = 0;' % ii)
+        reads.append('IterGetFixedArray(&rsp_it, %s, &out%d, &out%d_len)' % (dbus_type(param), ii, ii))
+    out.append('  DBusMessageIter rsp_it;')
+    if reads:
+        out.append('  int ok = (rsp != NULL && dbus_message_iter_init(rsp, &rsp_it) &&')
+        for read in reads[:-1]:
+            out.append('            %s &&' % read)
+        out.append('            %s);' % reads[-1])
+    else:
+        out.append('  int ok = (rsp != NULL);')
+    for ii, param in enumerate(outs):
+        ref = param.annots.get('count') or param.annots.get('size')
+        elements = dbus_elements(fn, param, 'stub')
+        if fn.byname[ref].kind == 'inout':
+            # The driver sends as much as was used, up to the capacity
+            out.append('  if (ok && (size_t)out%d_len > (size_t)%s) out%d_len = %s;' % (ii, elements, ii, elements))
+        else:
+            out.append('  if ((size_t)out%d_len != (size_t)%s) ok = 0;' % (ii, elements))
+    out.append('  if (!ok) {')
+    if fn.returns_value():
+        for param in fn.of_kind('out_array'):
+            # Results the driver didn't give us count as failures
+            out.append('    for (int ii = 0; ii < %s; ii++) %s[ii] = %s;' % (
+                param.annots['count'], param.name, IO_ERROR))
+        out.append('    RpcTraceResult(%s);' % IO_ERROR)
+    out.append('    ConnectionCallFailed(cmd, slot, rsp);')
+    if fn.returns_string():
+        out.append('    return NULL;')
+    elif fn.returns_value():
+        out.append('    return %s;' % IO_ERROR)
+    else:
+        out.append('    return;')
+    out.append('  }')
+    for ii, param in enumerate(outs):
+        out.append('  if (out%d_len > 0) memcpy(%s, out%d, %s);' % (ii, param.name, ii, dbus_bytes(param, 'out%d_len' % ii)))
+    for param in fn.of_kind('inout'):
+        out.append('  *%s = rsp_%s;' % (param.name, param.name))
+    if fn.returns_string():
+        out.append('  saved_retval = strdup(retval);')
+        out.append('  api_("%%s(%s) return \'%%s\' <=", cmd%s, saved_retval ? saved_retval : "(none)");' % (fmt, args))
+    elif fn.returns_value():
+        out.append('  api_("%%s(%s)%s <=", cmd%s, retval);' % (fmt, retval_fmt(fn), args))
+    else:
+        out.append('  api_("%%s(%s) <=", cmd%s);' % (fmt, args))
+
+
+def emit_dbus_driver(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in functions:
+        out.append('')
+        emit_dbus_driver_function(fn, out)
+    out.append('')
+    out.append('/* This is the general entrypoint for this specific API */')
+    out.append('ProxiedCall APIMethod(const char *method) {')
+    for fn in functions:
+        out.append('  if (strcmp(method, "%s") == 0) return proxied_%s;' % (fn.name, fn.name))
+    out.append('  return NULL;')
+    out.append('}')
+
+
+def emit_dbus_driver_function(fn, out):
+    out.append('static DBusMessage *proxied_%s(DBusMessage *msg) {' % fn.name)
+    out.append('  static const char *method = "%s";' % fn.name)
+    out.append('  DBusMessage *rsp = NULL;')
+    if fn.params:
+        out.append('  DBusMessageIter msg_it;')
+        out.append('  dbus_message_iter_init(msg, &msg_it);')
+    reads = []
+    for param in fn.params:
+        if param.kind in ('scalar', 'inout'):
+            out.append('  %s %s = 0;' % (param.base, param.name))
+            reads.append('IterGetBasic(&msg_it, %s, &%s)' % (dbus_type(param), param.name))
+        elif param.kind == 'fd':
+            out.append('  int %s = -1;' % param.name)
+            reads.append('IterGetBasic(&msg_it, %s, &%s)' % (dbus_type(param), param.name))
+        elif param.kind == 'fd_array':
+            out.append('  int *%s = NULL;' % param.name)
+            out.append('  int n%s = 0;' % param.name)
+            reads.append('IterGetFdArray(&msg_it, &%s, &n%s)' % (param.name, param.name))
+        elif param.kind in ('in_buf', 'in_array'):
+            out.append('  const void *%s = NULL;' % param.name)
+            out.append('  int n%s = 0;' % param.name)
+            reads.append('IterGetFixedArray(&msg_it, %s, &%s, &n%s)' % (dbus_type(param), param.name, param.name))
+    if len(reads) == 1:
+        out.append('  int ok = %s;' % reads[0])
+    elif reads:
+        out.append('  int ok = (%s &&' % reads[0])
+        for read in reads[1:-1]:
+            out.append('            %s &&' % read)
+        out.append('            %s);' % reads[-1])
+    for param in fn.of_kind('fd_array', 'in_buf', 'in_array'):
+        out.append('  if ((size_t)n%s != (size_t)%s) ok = 0;' % (param.name, dbus_elements(fn, param, 'driver')))
+    outs = fn.of_kind('out_buf', 'out_array')
+    for ii, param in enumerate(outs):
+        # Zeroed, so nothing stale goes back
+        out.append('  size_t out%d_cap = %s;' % (ii, dbus_elements(fn, param, 'driver')))
+        out.append('  %s *%s = ok ? calloc(%s + 1, 1) : NULL;' % (param.base, param.name, dbus_bytes(param, 'out%d_cap' % ii)))
+        out.append('  if (%s == NULL) ok = 0;' % param.name)
+    if reads:
+        out.append('  if (!ok) {')
+        out.append('    warning_("bad %s request", method);')
+        out.append('  } else if ((rsp = dbus_message_new_method_return(msg)) == NULL) {')
+    else:
+        out.append('  if ((rsp = dbus_message_new_method_return(msg)) == NULL) {')
+    out.append('    warning_("failed to get response message");')
+    out.append('  } else {')
+    body = []
+    emit_driver_call(fn, body, reply_struct=False)
+    del body[0]  # The blank line before the call
+    body.append('  DBusMessageIter rsp_it;')
+    if outs:
+        body.append('  DBusMessageIter arr_it;')
+    body.append('  dbus_message_iter_init_append(rsp, &rsp_it);')
+    if fn.returns_string():
+        body.append('  dbus_message_iter_append_basic(&rsp_it, DBUS_TYPE_STRING, &retval);')
+    elif fn.returns_value():
+        body.append('  dbus_message_iter_append_basic(&rsp_it, %s, &retval);' % DBUS_TYPES[fn.rtype][0])
+    for param in fn.of_kind('inout'):
+        body.append('  dbus_message_iter_append_basic(&rsp_it, %s, &%s);' % (dbus_type(param), param.name))
+    for ii, param in enumerate(outs):
+        ref = param.annots.get('count') or param.annots.get('size')
+        body.append('  size_t out%d_len = %s;' % (ii, dbus_elements(fn, param, 'driver')))
+        if fn.byname[ref].kind == 'inout':
+            # Only as much as the call says it used, within the capacity
+            body.append('  if (out%d_len > out%d_cap) out%d_len = out%d_cap;' % (ii, ii, ii, ii))
+        body.append('  const void *out%d = %s;' % (ii, param.name))
+        body.append('  dbus_message_iter_open_container(&rsp_it, DBUS_TYPE_ARRAY, %s_AS_STRING, &arr_it);' % dbus_type(param))
+        body.append('  dbus_message_iter_append_fixed_array(&arr_it, %s, &out%d, (int)out%d_len);' % (dbus_type(param), ii, ii))
+        body.append('  dbus_message_iter_close_container(&rsp_it, &arr_it);')
+    out.extend(('  ' + line) if line else line for line in body)
+    out.append('  }')
+    for param in fn.of_kind('fd'):
+        out.append('  if (%s >= 0) close(%s);' % (param.name, param.name))
+    for param in fn.of_kind('fd_array'):
+        out.append('  for (int ii = 0; ii < n%s; ii++) close(%s[ii]);' % (param.name, param.name))
+        out.append('  free(%s);' % param.name)
+    for param in outs:
+        out.append('  free(%s);' % param.name)
+    out.append('  return rsp;')
+    out.append('}')
+
+
+# --------------------------------------------------------------------------
+# Transports: the same entrypoints from several stubs (and the library
+# itself) in one client library.  Each is built with -DRPC_TRANSPORT=<name>
+# and bz2-transport-names.h, which gives its entrypoints a per-transport
+# name; its table (struct Bz2Transport) points at whichever of them it has,
+# and the real entrypoints dispatch through the current transport's table.
+
+def transported(functions, skipped):
+    return sorted([fn for fn in functions + skipped if 'client' not in fn.annots],
+                  key=lambda fn: fn.index)
+
+
+def emit_transport_names(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    out.append('#ifndef _BZ2_TRANSPORT_NAMES_H')
+    out.append('#define _BZ2_TRANSPORT_NAMES_H')
+    out.append('')
+    out.append('#define BZ2_TRANSPORT_NAME_(t, fn) bz2_##t##_##fn')
+    out.append('#define BZ2_TRANSPORT_NAME(t, fn) BZ2_TRANSPORT_NAME_(t, fn)')
+    out.append('#define BZ2_TRANSPORT_STRING_(t) #t')
+    out.append('#define BZ2_TRANSPORT_STRING(t) BZ2_TRANSPORT_STRING_(t)')
+    out.append('')
+    out.append('#ifdef RPC_TRANSPORT')
+    for fn in transported(functions, skipped):
+        out.append('#define %s BZ2_TRANSPORT_NAME(RPC_TRANSPORT, %s)' % (fn.name, fn.short_name))
+    out.append('#define _stub_construct BZ2_TRANSPORT_NAME(RPC_TRANSPORT, init)')
+    out.append('#endif')
+    out.append('')
+    out.append('#endif')
+
+
+def emit_transport_header(functions, out, skipped):
+    out.append('#ifndef _BZ2_TRANSPORT_H')
+    out.append('#define _BZ2_TRANSPORT_H')
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    out.append('')
+    out.append('#include "bz2-transport-names.h"')
+    out.append('#include "rpc-util.h"')
+    out.append('#include "bzlib.h"')
+    out.append('')
+    out.append('/* One transport\'s entrypoints; NULL for any it doesn\'t have */')
+    out.append('struct Bz2Transport {')
+    out.append('  struct RpcTransport rpc;')
+    for fn in transported(functions, skipped):
+        out.append('  %s;' % fn.signature('(*%s)' % fn.short_name))
+    out.append('};')
+    out.append('')
+    out.append('#endif')
+
+
+def emit_transport_table(functions, out, skipped):
+    fns = transported(functions, skipped)
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    out.append('')
+    out.append('/* Weak, so that entries the transport doesn\'t have are NULL */')
+    for fn in fns:
+        out.append('extern __typeof__(%s) %s __attribute__((weak));' % (fn.name, fn.name))
+    out.append('extern void _stub_construct(void) __attribute__((weak));')
+    out.append('')
+    out.append('const struct Bz2Transport BZ2_TRANSPORT_NAME(RPC_TRANSPORT, transport) = {')
+    out.append('  {BZ2_TRANSPORT_STRING(RPC_TRANSPORT), _stub_construct},')
+    for fn in fns:
+        out.append('  %s,' % fn.name)
+    out.append('};')
+
+
+def emit_remote(functions, out, skipped):
+    out.append('/* Generated by idolize.py from bzlib.h; do not edit. */')
+    for fn in transported(functions, skipped):
+        out.append('')
+        emit_remote_function(fn, out)
+
+
+def emit_remote_function(fn, out):
+    handle = fn.handle()
+    args = ', '.join(p.name for p in fn.params)
+    out.append(fn.signature() + ' {')
+    if handle is not None and not ('init' in fn.annots and 'term' not in fn.annots):
+        out.append('  const struct Bz2Transport *transport = HandleTransport(%s);' % handle.name)
+    else:
+        out.append('  const struct Bz2Transport *transport = CurrentTransport();')
+    out.append('  if (transport->%s == NULL) {' % fn.short_name)
+    out.append('    Unsupported(transport, "%s");' % fn.name)
+    if ERROR_PARAM in fn.byname:
+        out.append('    if (%s) *%s = %s;' % (ERROR_PARAM, ERROR_PARAM, CONFIG_ERROR))
+    if fn.rtype.endswith('*'):
+        out.append('    return NULL;')
+    elif fn.rtype != 'void':
+        out.append('    return %s;' % CONFIG_ERROR)
+    else:
+        out.append('    return;')
+    out.append('  }')
+    call = 'transport->%s(%s);' % (fn.short_name, args)
+    after = None
+    if fn.returns_handle():
+        after = 'if (retval != NULL) RpcHandleBind(retval, &transport->rpc);'
+    elif handle is not None and 'init' in fn.annots and 'term' not in fn.annots:
+        after = 'if (retval == %s) RpcHandleBind(%s, &transport->rpc);' % (OK, handle.name)
+    elif handle is not None and 'term' in fn.annots and 'init' not in fn.annots:
+        after = 'RpcHandleUnbind(%s);' % handle.name
+    if after is None:
+        out.append('  %s%s' % ('' if fn.rtype == 'void' else 'return ', call))
+    elif fn.rtype == 'void':
+        out.append('  ' + call)
+        out.append('  ' + after)
+    else:
+        out.append('  %s = %s' % (c_decl(fn.rtype, 'retval'), call))
+        out.append('  ' + after)
+        out.append('  return retval;')
+    out.append('}')
+
+
+EMITTERS = {
+    'header': emit_header,
+    'libnv-stub': emit_libnv_stub,
+    'libnv-driver': emit_libnv_driver,
+    'raw-stub': emit_raw_stub,
+    'raw-driver': emit_raw_driver,
+    'dbus-stub': emit_dbus_stub,
+    'dbus-driver': emit_dbus_driver,
+    'transport-names': emit_transport_names,
+    'transport-header': emit_transport_header,
+    'transport-table': emit_transport_table,
+    'remote': emit_remote,
+}
+
+
+def main(argv):
+    if len(argv) != 3 or argv[1] not in EMITTERS:
+        sys.stderr.write('Usage: %s {%s} <header>\n' % (argv[0], '|'.join(sorted(EMITTERS))))
+        return 1
+    with open(argv[2]) as f:
+        functions = parse(f.read())
+    functions = [fn for fn in functions if fn.name.startswith(PREFIX)]
+    remoted = [fn for fn in functions if fn.reason is None]
+    skipped = [fn for fn in functions if fn.reason is not None]
+    out = []
+    EMITTERS[argv[1]](remoted, out, skipped)
+    sys.stdout.write('\n'.join(out) + '\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -3,20 +3,36 @@
  * Use of this source code is governed by the bzip2
  * license that can be found in the LICENSE file. */
 
+#define _GNU_SOURCE  /* for POLLRDHUP, clone() */
 #include "rpc-util.h"
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #include <sys/wait.h>
+#include <linux/futex.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <execinfo.h>
 #include <unistd.h>
 
+static int RecvFdWithValue(int sock_fd, int *value);
+static int SendFdWithValue(int sock_fd, int fd, int value);
+
 void _log_at(int level, const char *filename, int lineno, const char *format, ...) {
   if (level < _rpc_verbose) return;
   va_list args;
@@ -48,6 +64,337 @@ void CrashHandler(int sig) {
   exit(1);
 }
 
+/* Timing is on for either of stats and tracing */
+#define TIMING_STATS 1
+#define TIMING_TRACE 2
+static int g_timing = 0;
+static struct RpcPhaseTotal g_phase_totals[RPC_PHASE_COUNT];
+
+void RpcStatsEnable(void) {
+  __atomic_or_fetch(&g_timing, TIMING_STATS, __ATOMIC_RELAXED);
+}
+
+const char *RpcPhaseName(int phase) {
+  static const char *names[RPC_PHASE_COUNT] = {
+    "fork", "exec", "bootstrap", "fd-pass", "marshal", "call", "unmarshal", "teardown"
+  };
+  return (phase >= 0 && phase < RPC_PHASE_COUNT) ? names[phase] : "<unknown>";
+}
+
+uint64_t RpcNow(void) {
+  if (!__atomic_load_n(&g_timing, __ATOMIC_RELAXED)) return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void TracePhase(int phase, uint64_t ns);
+
+static void PhaseAccount(int phase, uint64_t start, uint64_t end) {
+  if (start == 0 || end == 0) return;
+  TracePhase(phase, end - start);
+  if (!(__atomic_load_n(&g_timing, __ATOMIC_RELAXED) & TIMING_STATS)) return;
+  __atomic_add_fetch(&g_phase_totals[phase].count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&g_phase_totals[phase].ns, end - start, __ATOMIC_RELAXED);
+}
+
+uint64_t RpcPhaseAdd(int phase, uint64_t start) {
+  uint64_t now = RpcNow();
+  PhaseAccount(phase, start, now);
+  return now;
+}
+
+void RpcStatsGet(struct RpcPhaseTotal totals[RPC_PHASE_COUNT]) {
+  int ii;
+  for (ii = 0; ii < RPC_PHASE_COUNT; ii++) {
+    totals[ii].count = __atomic_load_n(&g_phase_totals[ii].count, __ATOMIC_RELAXED);
+    totals[ii].ns = __atomic_load_n(&g_phase_totals[ii].ns, __ATOMIC_RELAXED);
+  }
+}
+
+/* Latency histograms are log-linear (as HdrHistogram): values below
+ * 2^HIST_SUB_BITS ns get a bucket each, and above that each power of two is
+ * split into 2^HIST_SUB_BITS buckets, so a bucket is within 1/16 of its
+ * values. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct TraceMethod {
+  char name[RPC_TRACE_NAME_LEN];
+  int state;  /* 0 empty, 1 being named, 2 ready */
+  uint64_t count;
+  uint64_t max_ns;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+static const char *g_trace_side = "stub";
+static const char *g_trace_dump = NULL;  /* File to dump to, "-" for stderr */
+static struct TraceMethod g_trace_methods[RPC_TRACE_MAX_METHODS];
+static struct RpcTraceRecord g_trace_ring[RPC_TRACE_RING_SIZE];
+static uint64_t g_trace_head = 0;  /* Records ever written */
+static __thread struct RpcTraceRecord t_trace;
+static __thread int t_tracing = 0;
+
+static int HistBucket(uint64_t value) {
+  if (value < HIST_SUB_COUNT) return (int)value;
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) - HIST_SUB_COUNT);
+}
+
+/* Highest value that lands in bucket */
+static uint64_t HistBucketTop(int bucket) {
+  if (bucket < HIST_SUB_COUNT) return bucket;
+  int shift = (bucket >> HIST_SUB_BITS) - 1;
+  uint64_t mantissa = (bucket & (HIST_SUB_COUNT - 1)) + HIST_SUB_COUNT;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+static int TraceMethodIndex(const char *name) {
+  int ii;
+  if (name == NULL) name = "?";
+  for (ii = 0; ii < RPC_TRACE_MAX_METHODS; ii++) {
+    struct TraceMethod *m = &g_trace_methods[ii];
+    int state = __atomic_load_n(&m->state, __ATOMIC_ACQUIRE);
+    if (state == 0) {
+      int expected = 0;
+      if (__atomic_compare_exchange_n(&m->state, &expected, 1, 0,
+                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        snprintf(m->name, sizeof(m->name), "%s", name);
+        __atomic_store_n(&m->state, 2, __ATOMIC_RELEASE);
+        return ii;
+      }
+      state = expected;
+    }
+    while (state == 1) state = __atomic_load_n(&m->state, __ATOMIC_ACQUIRE);
+    if (strncmp(m->name, name, sizeof(m->name) - 1) == 0) return ii;
+  }
+  return -1;  /* Table full: calls are traced but not histogrammed */
+}
+
+static void TraceDumpSignal(int sig);
+static void TraceDumpAtExit(void);
+
+void RpcTraceEnable(void) {
+  __atomic_or_fetch(&g_timing, TIMING_TRACE, __ATOMIC_RELAXED);
+}
+
+int RpcTracing(void) {
+  return (__atomic_load_n(&g_timing, __ATOMIC_RELAXED) & TIMING_TRACE) != 0;
+}
+
+static void __attribute__((constructor)) _trace_init(void) {
+  const char *value = getenv("RPC_TRACE");
+  if (!value || !atoi(value)) return;
+  RpcTraceEnable();
+  g_trace_dump = getenv("RPC_TRACE_DUMP");
+  if (g_trace_dump && *g_trace_dump) atexit(TraceDumpAtExit);
+  /* Don't take the signal from an application that wants it */
+  struct sigaction old;
+  if (sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = TraceDumpSignal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+}
+
+void RpcTraceBegin(const char *method) {
+  if (!RpcTracing()) return;
+  memset(&t_trace, 0, sizeof(t_trace));
+  t_trace.method = TraceMethodIndex(method);
+  t_trace.start_ns = RpcNow();
+  t_tracing = 1;
+}
+
+void RpcTraceResult(int result) {
+  if (t_tracing) t_trace.result = result;
+}
+
+static void TracePhase(int phase, uint64_t ns) {
+  if (t_tracing) t_trace.phase_ns[phase] += ns;
+}
+
+void RpcTraceEnd(uint64_t request_bytes, uint64_t reply_bytes) {
+  if (!t_tracing) return;
+  t_tracing = 0;
+  t_trace.total_ns = RpcNow() - t_trace.start_ns;
+  t_trace.request_bytes = request_bytes;
+  t_trace.reply_bytes = reply_bytes;
+
+  if (t_trace.method >= 0) {
+    struct TraceMethod *m = &g_trace_methods[t_trace.method];
+    __atomic_add_fetch(&m->buckets[HistBucket(t_trace.total_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+    while (t_trace.total_ns > max &&
+           !__atomic_compare_exchange_n(&m->max_ns, &max, t_trace.total_ns, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+
+  /* Sequence lock per slot: odd while being written */
+  uint64_t ticket = __atomic_fetch_add(&g_trace_head, 1, __ATOMIC_RELAXED);
+  struct RpcTraceRecord *slot = &g_trace_ring[ticket % RPC_TRACE_RING_SIZE];
+  __atomic_store_n(&slot->seq, 2 * ticket + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  t_trace.seq = 2 * ticket + 2;
+  memcpy((char *)slot + sizeof(slot->seq), (char *)&t_trace + sizeof(t_trace.seq),
+         sizeof(t_trace) - sizeof(t_trace.seq));
+  __atomic_store_n(&slot->seq, t_trace.seq, __ATOMIC_RELEASE);
+}
+
+int RpcTraceRead(struct RpcTraceRecord *records, int max) {
+  uint64_t head = __atomic_load_n(&g_trace_head, __ATOMIC_ACQUIRE);
+  uint64_t first = (head > (uint64_t)max) ? head - max : 0;
+  if (head - first > RPC_TRACE_RING_SIZE) first = head - RPC_TRACE_RING_SIZE;
+  int count = 0;
+  uint64_t ticket;
+  for (ticket = first; ticket < head; ticket++) {
+    struct RpcTraceRecord *slot = &g_trace_ring[ticket % RPC_TRACE_RING_SIZE];
+    uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq != 2 * ticket + 2) continue;  /* Not written yet, or overwritten */
+    memcpy(&records[count], slot, sizeof(*slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) continue;
+    count++;
+  }
+  return count;
+}
+
+const char *RpcTraceMethodName(int method) {
+  if (method < 0 || method >= RPC_TRACE_MAX_METHODS ||
+      __atomic_load_n(&g_trace_methods[method].state, __ATOMIC_ACQUIRE) != 2) {
+    return "?";
+  }
+  return g_trace_methods[method].name;
+}
+
+uint64_t RpcTraceQuantile(int method, double q, uint64_t *count) {
+  uint64_t buckets[HIST_BUCKETS];
+  uint64_t total = 0;
+  int ii;
+  if (count) *count = 0;
+  if (method < 0 || method >= RPC_TRACE_MAX_METHODS) return 0;
+  struct TraceMethod *m = &g_trace_methods[method];
+  for (ii = 0; ii < HIST_BUCKETS; ii++) {
+    buckets[ii] = __atomic_load_n(&m->buckets[ii], __ATOMIC_RELAXED);
+    total += buckets[ii];
+  }
+  if (count) *count = total;
+  if (total == 0) return 0;
+  uint64_t max = __atomic_load_n(&m->max_ns, __ATOMIC_RELAXED);
+  if (q >= 1.0) return max;
+  uint64_t rank = (uint64_t)(q * total);
+  uint64_t seen = 0;
+  for (ii = 0; ii < HIST_BUCKETS; ii++) {
+    seen += buckets[ii];
+    if (seen > rank) break;
+  }
+  uint64_t value = (ii < HIST_BUCKETS) ? HistBucketTop(ii) : max;
+  return (value < max) ? value : max;
+}
+
+/* Formatting into a fixed buffer and write(), so that a dump can be made
+ * from a signal handler (stdio is avoided; snprintf is safe in practice). */
+struct DumpBuffer {
+  int fd;
+  size_t len;
+  char data[4096];
+};
+
+static void DumpFlush(struct DumpBuffer *buf) {
+  size_t done = 0;
+  while (done < buf->len) {
+    ssize_t rc = write(buf->fd, buf->data + done, buf->len - done);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) break;
+    done += rc;
+  }
+  buf->len = 0;
+}
+
+static void DumpLine(struct DumpBuffer *buf, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+static void DumpLine(struct DumpBuffer *buf, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (len < 0) return;
+  if ((size_t)len >= sizeof(line)) len = sizeof(line) - 1;
+  if (buf->len + len > sizeof(buf->data)) DumpFlush(buf);
+  memcpy(buf->data + buf->len, line, len);
+  buf->len += len;
+}
+
+/* Number of recent calls listed by RpcTraceDump() */
+#define TRACE_DUMP_RECENT 32
+
+void RpcTraceDump(int fd) {
+  static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+  struct DumpBuffer buf;
+  int ii, jj;
+  buf.fd = fd;
+  buf.len = 0;
+  DumpLine(&buf, "# rpc trace: pid %d (%s), %lu calls\n", (int)getpid(), g_trace_side,
+           (unsigned long)__atomic_load_n(&g_trace_head, __ATOMIC_RELAXED));
+  DumpLine(&buf, "%-28s %8s %10s %10s %10s %10s %10s\n",
+           "method", "calls", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  for (ii = 0; ii < RPC_TRACE_MAX_METHODS; ii++) {
+    uint64_t count;
+    uint64_t values[5];
+    for (jj = 0; jj < 5; jj++) values[jj] = RpcTraceQuantile(ii, quantiles[jj], &count);
+    if (count == 0) continue;
+    DumpLine(&buf, "%-28s %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+             RpcTraceMethodName(ii), (unsigned long)count,
+             values[0] / 1e3, values[1] / 1e3, values[2] / 1e3, values[3] / 1e3, values[4] / 1e3);
+  }
+  struct RpcTraceRecord recent[TRACE_DUMP_RECENT];
+  int count = RpcTraceRead(recent, TRACE_DUMP_RECENT);
+  if (count > 0) {
+    DumpLine(&buf, "# last %d calls: start us, method, total us, request/reply bytes, result, phase us\n",
+             count);
+  }
+  for (ii = 0; ii < count; ii++) {
+    struct RpcTraceRecord *r = &recent[ii];
+    char phases[160];
+    size_t len = 0;
+    phases[0] = '\0';
+    for (jj = 0; jj < RPC_PHASE_COUNT && len < sizeof(phases); jj++) {
+      if (r->phase_ns[jj] == 0) continue;
+      len += snprintf(phases + len, sizeof(phases) - len, " %s=%.1f",
+                      RpcPhaseName(jj), r->phase_ns[jj] / 1e3);
+    }
+    DumpLine(&buf, "%14.1f %-28s %10.1f %8lu %8lu %4d%s\n",
+             r->start_ns / 1e3, RpcTraceMethodName(r->method), r->total_ns / 1e3,
+             (unsigned long)r->request_bytes, (unsigned long)r->reply_bytes, r->result, phases);
+  }
+  DumpFlush(&buf);
+}
+
+static int TraceDumpOpen(void) {
+  if (g_trace_dump == NULL || strcmp(g_trace_dump, "-") == 0) return dup(2);
+  return open(g_trace_dump, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+}
+
+static void TraceDumpSignal(int sig) {
+  int saved_errno = errno;
+  int fd = TraceDumpOpen();
+  if (fd >= 0) {
+    RpcTraceDump(fd);
+    close(fd);
+  }
+  errno = saved_errno;
+}
+
+static void TraceDumpAtExit(void) {
+  if (RpcTracing() && g_trace_dump && *g_trace_dump) TraceDumpSignal(0);
+}
+
 int OpenDriver(const char* filename) {
   int fd = open(filename, O_RDONLY|O_CLOEXEC);
   if (fd < 0) {
@@ -57,93 +404,1868 @@ int OpenDriver(const char* filename) {
   return fd;
 }
 
-void RunDriver(int xfd, const char *filename, int sock_fd) {
+/* Drivers trace if we do; returns the number of envp entries added */
+static int TraceEnv(char **envp) {
+  extern char **environ;
+  int count = 0;
+  char **env;
+  if (!RpcTracing()) return 0;
+  for (env = environ; env && *env && count < 2; env++) {
+    if (strncmp(*env, "RPC_TRACE=", 10) == 0 || strncmp(*env, "RPC_TRACE_DUMP=", 15) == 0) {
+      envp[count++] = *env;
+    }
+  }
+  return count;
+}
+
+static void ExecDriver(int xfd, const char *filename, const char *fd_var, int sock_fd) {
   /* Child process: store the socket FD in the environment */
   char *argv[] = {(char *)filename, NULL};
-  char nonce_buffer[] = "API_NONCE_FD=xxxxxxxx";
+  char fd_buffer[64];
   char debug_buffer[] = "RPC_DEBUG=xxxxxxx";
-  char * envp[] = {nonce_buffer, debug_buffer, NULL};
-  sprintf(nonce_buffer, "API_NONCE_FD=%d", sock_fd);
+  char * envp[] = {fd_buffer, debug_buffer, NULL, NULL, NULL};
+  TraceEnv(envp + 2);
+  snprintf(fd_buffer, sizeof(fd_buffer), "%s=%d", fd_var, sock_fd);
   sprintf(debug_buffer, "RPC_DEBUG=%d", _rpc_verbose);
-  verbose_("in child process, about to fexecve(fd=%d ('%s'), API_NONCE_FD=%d)",
-           xfd, filename, sock_fd);
+  verbose_("in child process, about to fexecve(fd=%d ('%s'), %s)",
+           xfd, filename, fd_buffer);
+  /* Stub-side sockets are close-on-exec so that long-lived drivers do not hold
+     each other's connections open; only this driver's end is inherited. */
+  fcntl(sock_fd, F_SETFD, 0);
   /* Execute the driver program. */
   fexecve(xfd, argv, envp);
   fatal_("!!! in child process, failed to fexecve, errno=%d (%s)", errno, strerror(errno));
 }
 
+void RunDriver(int xfd, const char *filename, int sock_fd) {
+  ExecDriver(xfd, filename, "API_NONCE_FD", sock_fd);
+}
+
+/* Launching a driver without fork(): the child shares our address space
+ * (clone(CLONE_VM|CLONE_VFORK)) until it execs, so the cost doesn't grow with
+ * the client's memory footprint.  The parent prepares everything the child
+ * needs, so that the child makes only raw system calls, touches nothing of
+ * ours but this struct, and never returns or runs exit handlers. */
+#define LAUNCH_STACK_SIZE (64 * 1024)
+struct DriverLaunch {
+  int xfd;
+  int sock_fd;
+  char *argv[2];
+  char *envp[5];
+  char fd_buffer[64];
+  char debug_buffer[32];
+  sigset_t mask;     /* Parent's signal mask, for the child to restore */
+  uint64_t started;  /* Set by the child when it starts running */
+  int err;           /* Set by the child if it fails to exec */
+};
+
+static int LaunchChild(void *arg) {
+  struct DriverLaunch *launch = (struct DriverLaunch *)arg;
+  launch->started = RpcNow();
+  /* Handlers are code in the parent's memory, which a signal would run on
+     the parent's behalf; only default/ignored dispositions are safe here. */
+  struct sigaction dfl;
+  memset(&dfl, 0, sizeof(dfl));
+  dfl.sa_handler = SIG_DFL;
+  int sig;
+  for (sig = 1; sig < NSIG; sig++) {
+    struct sigaction old;
+    if (sigaction(sig, NULL, &old) == 0 &&
+        old.sa_handler != SIG_DFL && old.sa_handler != SIG_IGN) {
+      sigaction(sig, &dfl, NULL);
+    }
+  }
+  sigprocmask(SIG_SETMASK, &launch->mask, NULL);
+  fcntl(launch->sock_fd, F_SETFD, 0);
+#ifdef SYS_execveat
+  syscall(SYS_execveat, launch->xfd, "", launch->argv, launch->envp, AT_EMPTY_PATH);
+  if (errno == ENOSYS)
+#endif
+    fexecve(launch->xfd, launch->argv, launch->envp);
+  launch->err = errno;
+  _exit(127);
+}
+
+/* Returns the driver's pid once it has exec'd, or -1 with errno set */
+static pid_t LaunchDriver(int xfd, const char *filename, const char *fd_var, int sock_fd,
+                          uint64_t start) {
+  struct DriverLaunch launch;
+  memset(&launch, 0, sizeof(launch));
+  launch.xfd = xfd;
+  launch.sock_fd = sock_fd;
+  launch.argv[0] = (char *)filename;
+  launch.envp[0] = launch.fd_buffer;
+  launch.envp[1] = launch.debug_buffer;
+  TraceEnv(launch.envp + 2);
+  snprintf(launch.fd_buffer, sizeof(launch.fd_buffer), "%s=%d", fd_var, sock_fd);
+  snprintf(launch.debug_buffer, sizeof(launch.debug_buffer), "RPC_DEBUG=%d", _rpc_verbose);
+  verbose_("about to launch fd=%d ('%s'), %s", xfd, filename, launch.fd_buffer);
+
+  void *stack = mmap(NULL, LAUNCH_STACK_SIZE, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) return -1;
+  sigset_t all;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &launch.mask);
+  pid_t pid = clone(LaunchChild, (char *)stack + LAUNCH_STACK_SIZE,
+                    CLONE_VM|CLONE_VFORK|SIGCHLD, &launch);
+  int saved_errno = errno;
+  pthread_sigmask(SIG_SETMASK, &launch.mask, NULL);
+  munmap(stack, LAUNCH_STACK_SIZE);
+  if (pid < 0) {
+    errno = saved_errno;
+    return -1;
+  }
+  /* The child has exec'd (or given up) by the time clone() returns */
+  if (launch.err != 0) {
+    waitpid(pid, NULL, 0);
+    errno = launch.err;
+    return -1;
+  }
+  PhaseAccount(RPC_PHASE_FORK, start, launch.started);
+  RpcPhaseAdd(RPC_PHASE_EXEC, launch.started);
+  return pid;
+}
+
+/* RPC_SPAWN=fork gives the original fork()+fexecve() launch */
+static int UseFork(void) {
+  static int use_fork = -1;
+  if (use_fork < 0) {
+    const char *value = getenv("RPC_SPAWN");
+    use_fork = (value && strcmp(value, "fork") == 0);
+  }
+  return use_fork;
+}
+
+/* Zygote: a pre-exec'd, initialized driver process that forks off a fresh
+ * driver for each socket sent to it, replying with the new driver's pid.
+ * Enabled with RPC_ZYGOTE=1; there is one zygote per driver executable. */
+#define MAX_ZYGOTES 8
+struct Zygote {
+  int xfd;  /* Driver executable */
+  pid_t owner;  /* Client process that started the zygote */
+  pid_t pid;
+  int sock_fd;  /* Stub end of the zygote's socket */
+};
+static struct Zygote g_zygotes[MAX_ZYGOTES];
+static pthread_mutex_t g_zygote_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct Zygote *StartZygote(int xfd, const char *filename) {
+  struct Zygote *zygote = NULL;
+  int ii;
+  for (ii = 0; ii < MAX_ZYGOTES; ii++) {
+    if (g_zygotes[ii].owner != getpid()) {
+      zygote = &g_zygotes[ii];
+      break;
+    }
+  }
+  if (zygote == NULL) {
+    warning_("no room for another zygote");
+    return NULL;
+  }
+  int socket_fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, socket_fds) < 0) {
+    error_("failed to open zygote sockets, errno=%d (%s)", errno, strerror(errno));
+    return NULL;
+  }
+  pid_t pid;
+  if (UseFork()) {
+    pid = fork();
+    if (pid == 0) {
+      ExecDriver(xfd, filename, "API_ZYGOTE_FD", socket_fds[1]);
+    }
+  } else {
+    pid = LaunchDriver(xfd, filename, "API_ZYGOTE_FD", socket_fds[1], 0);
+  }
+  if (pid < 0) {
+    error_("failed to start zygote, errno=%d (%s)", errno, strerror(errno));
+    close(socket_fds[0]);
+    close(socket_fds[1]);
+    return NULL;
+  }
+  close(socket_fds[1]);
+  zygote->xfd = xfd;
+  zygote->owner = getpid();
+  zygote->pid = pid;
+  zygote->sock_fd = socket_fds[0];
+  log_("started zygote pid=%d for '%s'", pid, filename);
+  return zygote;
+}
+
+static pid_t ZygoteSpawn(int xfd, const char *filename, int sock_fd) {
+  struct Zygote *zygote = NULL;
+  pid_t pid = -1;
+  int ii;
+  pthread_mutex_lock(&g_zygote_lock);
+  for (ii = 0; ii < MAX_ZYGOTES; ii++) {
+    if (g_zygotes[ii].owner == getpid() && g_zygotes[ii].xfd == xfd) {
+      zygote = &g_zygotes[ii];
+      break;
+    }
+  }
+  if (zygote == NULL) zygote = StartZygote(xfd, filename);
+  if (zygote != NULL) {
+    if (SendFdWithValue(zygote->sock_fd, sock_fd, 0) < 0 ||
+        read(zygote->sock_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+      warning_("zygote pid=%d failed, errno=%d; dropping it", zygote->pid, errno);
+      close(zygote->sock_fd);
+      TerminateChild(zygote->pid);
+      zygote->owner = 0;
+      pid = -1;
+    }
+  }
+  pthread_mutex_unlock(&g_zygote_lock);
+  return pid;
+}
+
+pid_t SpawnDriver(int xfd, const char *filename, int sock_fd) {
+  static int use_zygote = -1;
+  if (use_zygote < 0) {
+    const char *value = getenv("RPC_ZYGOTE");
+    use_zygote = (value && atoi(value));
+  }
+  uint64_t start = RpcNow();
+  if (use_zygote) {
+    pid_t pid = ZygoteSpawn(xfd, filename, sock_fd);
+    RpcPhaseAdd(RPC_PHASE_FORK, start);
+    if (pid > 0) {
+      verbose_("zygote started driver pid=%d on socket %d", pid, sock_fd);
+      return pid;
+    }
+    warning_("falling back to launching '%s' directly", filename);
+    start = RpcNow();
+  }
+  if (!UseFork()) {
+    pid_t pid = LaunchDriver(xfd, filename, "API_NONCE_FD", sock_fd, start);
+    if (pid < 0) {
+      error_("failed to launch '%s', errno=%d (%s)", filename, errno, strerror(errno));
+    }
+    return pid;
+  }
+  /* When timing the exec, wait for it to close the write end of this pipe */
+  int exec_fds[2] = {-1, -1};
+  if (start != 0 && pipe2(exec_fds, O_CLOEXEC) < 0) exec_fds[0] = exec_fds[1] = -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* Child process: run the driver */
+    RunDriver(xfd, filename, sock_fd);
+  }
+  start = RpcPhaseAdd(RPC_PHASE_FORK, start);
+  if (exec_fds[0] >= 0) {
+    char c;
+    close(exec_fds[1]);
+    if (pid > 0) {
+      while (read(exec_fds[0], &c, 1) < 0 && errno == EINTR)
+        ;
+      RpcPhaseAdd(RPC_PHASE_EXEC, start);
+    }
+    close(exec_fds[0]);
+  }
+  return pid;
+}
+
+/* Zygote side: serve spawn requests until the stub goes away; returns (in a
+ * freshly-forked driver) the socket for that driver's stub. */
+static int ZygoteLoop(int zygote_fd) {
+  /* Drivers get reaped automatically; they are killed by the stub */
+  signal(SIGCHLD, SIG_IGN);
+  log_("zygote ready on socket %d", zygote_fd);
+  while (1) {
+    int value;
+    int sock_fd = RecvFdWithValue(zygote_fd, &value);
+    if (sock_fd < 0) {
+      log_("zygote socket %d closed; exiting", zygote_fd);
+      exit(0);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+      signal(SIGCHLD, SIG_DFL);
+      close(zygote_fd);
+      return sock_fd;
+    }
+    if (pid < 0) {
+      error_("zygote failed to fork, errno=%d (%s)", errno, strerror(errno));
+    }
+    close(sock_fd);
+    if (write(zygote_fd, &pid, sizeof(pid)) != sizeof(pid)) {
+      error_("zygote failed to reply, errno=%d; exiting", errno);
+      exit(1);
+    }
+  }
+}
+
+int DriverSocket(void) {
+  g_trace_side = "driver";
+  const char *fd_str = getenv("API_ZYGOTE_FD");
+  if (fd_str != NULL) {
+    return ZygoteLoop(atoi(fd_str));
+  }
+  fd_str = getenv("API_NONCE_FD");
+  if (fd_str == NULL) {
+    fatal_("no API_NONCE_FD in environment");
+  }
+  return atoi(fd_str);
+}
+
+/* How long a traced driver gets to exit by itself */
+#define TRACE_EXIT_GRACE_MS 1000
+
+/* Set while a forked child closes the connections it inherited: the drivers
+   behind them belong to the parent, which is still using them. */
+static __thread int t_disowning = 0;
+
 void TerminateChild(pid_t child) {
+  if (child > 0 && t_disowning) {
+    verbose_("leave child %d to its parent", child);
+    return;
+  }
   if (child > 0) {
-    int status;
-    log_("kill child %d", child);
-    kill(child, SIGKILL);
-    log_("reap child %d", child);
-    pid_t rc = waitpid(child, &status, 0);
-    log_("reaped child %d, rc=%d, status=%x", child, rc, status);
+    int status = 0;
+    uint64_t start = RpcNow();
+    pid_t rc = 0;
+    /* A driver forked by the zygote is the zygote's child, not ours, and the
+       zygote reaps it; we can only watch for it to disappear. */
+    int ours = 1;
+    if (RpcTracing()) {
+      /* Its socket is closed, so give it time to exit and dump its trace */
+      struct timespec tick = {0, 1000000};
+      int ii;
+      for (ii = 0; ii < TRACE_EXIT_GRACE_MS && rc == 0; ii++) {
+        if (ours) {
+          rc = waitpid(child, &status, WNOHANG);
+          if (rc < 0 && errno == ECHILD) {
+            ours = 0;
+            rc = 0;
+          }
+        }
+        if (!ours && kill(child, 0) < 0) rc = -1;
+        if (rc == 0) nanosleep(&tick, NULL);
+      }
+    }
+    if (rc == 0) {
+      log_("kill child %d", child);
+      kill(child, SIGKILL);
+      if (ours) {
+        log_("reap child %d", child);
+        rc = waitpid(child, &status, 0);
+        if (rc < 0 && errno == ECHILD) ours = 0;
+      }
+    }
+    if (ours) {
+      log_("reaped child %d, rc=%d, status=%x", child, rc, status);
+    } else {
+      log_("child %d left to the zygote to reap", child);
+    }
+    RpcPhaseAdd(RPC_PHASE_TEARDOWN, start);
     child = 0;
   }
 }
 
-int GetTransferredFd(int sock_fd, int nonce) {
-  int value = -1;
+static void *HangupWatcher(void *arg) {
+  struct pollfd pfd;
+  pfd.fd = (int)(intptr_t)arg;
+  pfd.events = POLLRDHUP;
+  while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+    ;
+  log_("parent socket %d hung up; exiting", pfd.fd);
+  TraceDumpAtExit();  /* _exit() skips it */
+  _exit(0);
+  return NULL;
+}
+
+void ExitOnHangup(int sock_fd) {
+  pthread_t thread;
+  int rc = pthread_create(&thread, NULL, HangupWatcher, (void *)(intptr_t)sock_fd);
+  if (rc != 0) {
+    warning_("failed to start hangup watcher, rc=%d", rc);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+/* Receive up to max fds sent by SendFdsWithValue() in a single message;
+ * returns the number received, or -1 if no message arrived */
+static int RecvFdsWithValue(int sock_fd, int *fds, int max, int *value) {
+  struct iovec iov;
+  iov.iov_base = value;
+  iov.iov_len = sizeof(*value);
+  union {
+    struct cmsghdr align;
+    unsigned char buf[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+  } data;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_controllen = CMSG_SPACE(max * sizeof(int));
+  msg.msg_control = data.buf;
+
+  int rc;
+  do {
+    rc = recvmsg(sock_fd, &msg, 0);
+  } while (rc == -1 && errno == EINTR);
+  if (rc <= 0) {
+    log_("no message on socket %d, rc=%d errno=%d", sock_fd, rc, errno);
+    return -1;
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL) {
+    error_("no cmsghdr received");
+    return -1;
+  }
+  if (cmsg->cmsg_level != SOL_SOCKET) {
+    error_("unexpected cmsg_level %d", cmsg->cmsg_level);
+    return -1;
+  }
+  if (cmsg->cmsg_type != SCM_RIGHTS) {
+    error_("unexpected cmsg_type %d", cmsg->cmsg_type);
+    return -1;
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    error_("too many fds received (max %d)", max);
+  }
+  int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), count * sizeof(int));
+  return count;
+}
+
+static int SendFdsWithValue(int sock_fd, const int *fds, int count, int value) {
   struct iovec iov;
   iov.iov_base = &value;
-  iov.iov_len = sizeof(nonce);
-  unsigned char data[CMSG_SPACE(sizeof(int))];
+  iov.iov_len = sizeof(value);
+  union {
+    struct cmsghdr align;
+    unsigned char buf[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+  } data;
   struct msghdr msg;
   memset(&msg, 0, sizeof(msg));
   msg.msg_iov = &iov;
   msg.msg_iovlen = 1;
-  msg.msg_controllen = sizeof(data);
-  msg.msg_control = data;
+  msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+  msg.msg_control = data.buf;
 
   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
   cmsg->cmsg_level = SOL_SOCKET;
   cmsg->cmsg_type = SCM_RIGHTS;
+  memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
 
   int rc;
   do {
-    rc = recvmsg(sock_fd, &msg, 0);
+    rc = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
   } while (rc == -1 && errno == EINTR);
-  cmsg = CMSG_FIRSTHDR(&msg);
-  if (cmsg == NULL)
-    fatal_("no cmsghdr received");
-  if (cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
-    fatal_("unexpected cmsg_len %d", cmsg->cmsg_len);
-  if (cmsg->cmsg_level != SOL_SOCKET)
-    fatal_("unexpected cmsg_level %d", cmsg->cmsg_level);
-  if (cmsg->cmsg_type != SCM_RIGHTS)
-    fatal_("unexpected cmsg_type %d", cmsg->cmsg_type);
+  return rc;
+}
+
+/* Receive a single fd sent by SendFdWithValue(); returns -1 if none arrived */
+static int RecvFdWithValue(int sock_fd, int *value) {
+  int fd;
+  int count = RecvFdsWithValue(sock_fd, &fd, 1, value);
+  if (count != 1) {
+    if (count >= 0) error_("expected 1 fd, received %d", count);
+    return -1;
+  }
+  return fd;
+}
+
+static int SendFdWithValue(int sock_fd, int fd, int value) {
+  return SendFdsWithValue(sock_fd, &fd, 1, value);
+}
+
+int GetTransferredFd(int sock_fd, int nonce) {
+  int value = -1;
+  int fd = RecvFdWithValue(sock_fd, &value);
+  if (fd < 0)
+    fatal_("no fd received across socket %d", sock_fd);
   if (value != nonce)
     fatal_("unexpected nonce value %d not %d", value, nonce);
-
-  int fd = *((int *) CMSG_DATA(cmsg));
-  log_("received fd %d across socket %d nonce=%d rc=%d", fd, sock_fd, nonce, rc);
+  log_("received fd %d across socket %d nonce=%d", fd, sock_fd, nonce);
   return fd;
 }
 
 /* Returns nonce to be sent instead */
 int TransferFd(int sock_fd, int fd) {
+  uint64_t start = RpcNow();
   int nonce = rand();
-  struct iovec iov;
-  iov.iov_base = &nonce;
-  iov.iov_len = sizeof(nonce);
-  unsigned char data[CMSG_SPACE(sizeof(int))];
-  struct msghdr msg;
-  memset(&msg, 0, sizeof(msg));
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_controllen = sizeof(data);
-  msg.msg_control = data;
+  int rc = SendFdWithValue(sock_fd, fd, nonce);
+  RpcPhaseAdd(RPC_PHASE_FD_PASS, start);
+  log_("sent fd %d across socket %d with nonce=%d rc=%d", fd, sock_fd, nonce, rc);
+  return nonce;
+}
 
-  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
-  cmsg->cmsg_level = SOL_SOCKET;
-  cmsg->cmsg_type = SCM_RIGHTS;
-  *((int*)CMSG_DATA(cmsg)) = fd;
+int RecvTransferredFds(int sock_fd, int *fds, int max, int *nonce) {
+  return RecvFdsWithValue(sock_fd, fds, max, nonce);
+}
 
-  int rc = sendmsg(sock_fd, &msg, 0);
-  log_("sent fd %d across socket %d with nonce=%d rc=%d", fd, sock_fd, nonce, rc);
+/* Bootstrap fds always carry the value 0 */
+int GetBootstrapFd(int sock_fd) {
+  return GetTransferredFd(sock_fd, 0);
+}
+
+int SendBootstrapFd(int sock_fd, int fd) {
+  int rc = SendFdWithValue(sock_fd, fd, 0);
+  log_("sent bootstrap fd %d across socket %d rc=%d", fd, sock_fd, rc);
+  return rc;
+}
+
+int GetTransferredFds(int sock_fd, int nonce, int count, int *fds) {
+  int received = 0;
+  while (received < count) {
+    int value = -1;
+    int max = count - received;
+    if (max > MAX_FDS_PER_MSG) max = MAX_FDS_PER_MSG;
+    int rc = RecvFdsWithValue(sock_fd, fds + received, max, &value);
+    if (rc <= 0)
+      fatal_("no fds received across socket %d", sock_fd);
+    if (value != nonce)
+      fatal_("unexpected nonce value %d not %d", value, nonce);
+    received += rc;
+  }
+  log_("received %d fds across socket %d nonce=%d", count, sock_fd, nonce);
+  return 0;
+}
+
+int TransferFds(int sock_fd, int count, const int *fds) {
+  uint64_t start = RpcNow();
+  int nonce = rand();
+  int sent = 0;
+  while (sent < count) {
+    int batch = count - sent;
+    if (batch > MAX_FDS_PER_MSG) batch = MAX_FDS_PER_MSG;
+    int rc = SendFdsWithValue(sock_fd, fds + sent, batch, nonce);
+    if (rc < 0) {
+      error_("failed to send fds across socket %d, errno=%d (%s)", sock_fd, errno, strerror(errno));
+      break;
+    }
+    sent += batch;
+  }
+  RpcPhaseAdd(RPC_PHASE_FD_PASS, start);
+  log_("sent %d fds across socket %d with nonce=%d", count, sock_fd, nonce);
   return nonce;
 }
+
+/* The first packet of a message starts with a header; any more start with
+ * their sequence number (so that none is ever empty, which would read as
+ * end of file). */
+struct SeqPacketHeader {
+  uint32_t method;
+  uint32_t nfds;
+  uint64_t len;
+};
+
+static uint32_t SeqPacketCount(uint64_t len, uint32_t nfds) {
+  uint64_t by_len = (len + SEQPACKET_FRAGMENT - 1) / SEQPACKET_FRAGMENT;
+  uint64_t by_fds = (nfds + MAX_FDS_PER_MSG - 1) / MAX_FDS_PER_MSG;
+  uint64_t count = (by_len > by_fds) ? by_len : by_fds;
+  return (count > 0) ? count : 1;
+}
+
+static size_t IovTotal(const struct iovec *iov, int niov) {
+  size_t total = 0;
+  for (int ii = 0; ii < niov; ii++) total += iov[ii].iov_len;
+  return total;
+}
+
+/* Describe len bytes of iov, starting offset bytes in, as entries of out;
+ * returns the number of entries used */
+static int IovWindow(const struct iovec *iov, int niov, size_t offset, size_t len,
+                     struct iovec *out) {
+  int count = 0;
+  for (int ii = 0; ii < niov && len > 0; ii++) {
+    if (offset >= iov[ii].iov_len) {
+      offset -= iov[ii].iov_len;
+      continue;
+    }
+    size_t span = iov[ii].iov_len - offset;
+    if (span > len) span = len;
+    out[count].iov_base = (char *)iov[ii].iov_base + offset;
+    out[count].iov_len = span;
+    count++;
+    len -= span;
+    offset = 0;
+  }
+  return count;
+}
+
+int SeqPacketSend(int sock_fd, uint32_t method, const struct iovec *iov, int niov,
+                  const int *fds, int nfds) {
+  if (niov < 0 || niov > SEQPACKET_MAX_IOV || nfds < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct SeqPacketHeader hdr;
+  hdr.method = method;
+  hdr.nfds = nfds;
+  hdr.len = IovTotal(iov, niov);
+  uint32_t count = SeqPacketCount(hdr.len, hdr.nfds);
+  size_t offset = 0;
+  int fds_sent = 0;
+  for (uint32_t seq = 0; seq < count; seq++) {
+    struct iovec frag[SEQPACKET_MAX_IOV + 1];
+    if (seq == 0) {
+      frag[0].iov_base = &hdr;
+      frag[0].iov_len = sizeof(hdr);
+    } else {
+      frag[0].iov_base = &seq;
+      frag[0].iov_len = sizeof(seq);
+    }
+    size_t chunk = hdr.len - offset;
+    if (chunk > SEQPACKET_FRAGMENT) chunk = SEQPACKET_FRAGMENT;
+    int batch = nfds - fds_sent;
+    if (batch > MAX_FDS_PER_MSG) batch = MAX_FDS_PER_MSG;
+
+    union {
+      struct cmsghdr align;
+      unsigned char buf[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+    } data;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = frag;
+    msg.msg_iovlen = 1 + IovWindow(iov, niov, offset, chunk, frag + 1);
+    if (batch > 0) {
+      msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+      msg.msg_control = data.buf;
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      memcpy(CMSG_DATA(cmsg), fds + fds_sent, batch * sizeof(int));
+    }
+
+    ssize_t rc;
+    do {
+      rc = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+    } while (rc == -1 && errno == EINTR);
+    if (rc < 0) {
+      log_("failed to send packet %u/%u on socket %d, errno=%d", seq, count, sock_fd, errno);
+      return -1;
+    }
+    offset += chunk;
+    fds_sent += batch;
+  }
+  return 0;
+}
+
+/* Append the fds of an SCM_RIGHTS message to fds[*nfds..max); any beyond
+ * max are closed.  Returns -1 if there were too many, or not SCM_RIGHTS. */
+static int TakeFds(struct msghdr *msg, int *fds, int max, int *nfds) {
+  int rc = 0;
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      error_("unexpected cmsg level=%d type=%d", cmsg->cmsg_level, cmsg->cmsg_type);
+      rc = -1;
+      continue;
+    }
+    int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int received[MAX_FDS_PER_MSG];
+    if (count > MAX_FDS_PER_MSG) count = MAX_FDS_PER_MSG;
+    memcpy(received, CMSG_DATA(cmsg), count * sizeof(int));
+    for (int ii = 0; ii < count; ii++) {
+      if (*nfds < max) {
+        fds[(*nfds)++] = received[ii];
+      } else {
+        close(received[ii]);
+        rc = -1;
+      }
+    }
+  }
+  return rc;
+}
+
+ssize_t SeqPacketRecv(int sock_fd, uint32_t *method, struct iovec *iov, int niov, int grow,
+                      int *fds, int maxfds, int *nfds) {
+  *nfds = 0;
+  if (niov < 1 || niov > SEQPACKET_MAX_IOV) {
+    errno = EINVAL;
+    return -1;
+  }
+  struct iovec *last = &iov[niov - 1];
+  size_t capacity = IovTotal(iov, niov);
+  if (grow && capacity < SEQPACKET_FRAGMENT) {
+    /* Room for a whole first packet, before we know the total */
+    size_t want = last->iov_len + (SEQPACKET_FRAGMENT - capacity);
+    void *buf = realloc(last->iov_base, want);
+    if (buf == NULL) return -1;
+    last->iov_base = buf;
+    last->iov_len = want;
+    capacity = SEQPACKET_FRAGMENT;
+  }
+
+  struct SeqPacketHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  uint32_t count = 1;
+  size_t offset = 0;
+  for (uint32_t seq = 0; seq < count; seq++) {
+    uint32_t seq_received = 0;
+    struct iovec frag[SEQPACKET_MAX_IOV + 1];
+    if (seq == 0) {
+      frag[0].iov_base = &hdr;
+      frag[0].iov_len = sizeof(hdr);
+    } else {
+      frag[0].iov_base = &seq_received;
+      frag[0].iov_len = sizeof(seq_received);
+    }
+    size_t chunk = (seq == 0) ? SEQPACKET_FRAGMENT : hdr.len - offset;
+    if (chunk > SEQPACKET_FRAGMENT) chunk = SEQPACKET_FRAGMENT;
+    if (chunk > capacity - offset) chunk = capacity - offset;
+
+    union {
+      struct cmsghdr align;
+      unsigned char buf[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+    } data;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = frag;
+    msg.msg_iovlen = 1 + IovWindow(iov, niov, offset, chunk, frag + 1);
+    msg.msg_controllen = sizeof(data.buf);
+    msg.msg_control = data.buf;
+
+    ssize_t rc;
+    do {
+      rc = recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc == 0) {
+      if (seq > 0) error_("end of file within message on socket %d", sock_fd);
+      errno = 0;
+      goto fail;
+    }
+    if (rc < 0) {
+      log_("no packet on socket %d, errno=%d", sock_fd, errno);
+      goto fail;
+    }
+    if (TakeFds(&msg, fds, maxfds, nfds) < 0 || (msg.msg_flags & MSG_CTRUNC)) {
+      error_("too many fds received on socket %d (max %d)", sock_fd, maxfds);
+      goto fail;
+    }
+    if ((msg.msg_flags & MSG_TRUNC) || (size_t)rc < frag[0].iov_len) {
+      error_("packet %u of %zd bytes doesn't fit on socket %d", seq, rc, sock_fd);
+      goto fail;
+    }
+    rc -= frag[0].iov_len;
+
+    if (seq == 0) {
+      count = SeqPacketCount(hdr.len, hdr.nfds);
+      if (hdr.nfds > (uint32_t)maxfds) {
+        error_("message with %u fds on socket %d (max %d)", hdr.nfds, sock_fd, maxfds);
+        goto fail;
+      }
+      if (hdr.len > capacity) {
+        if (!grow || hdr.len > SSIZE_MAX) {
+          error_("message of %lu bytes on socket %d (max %zu)", (unsigned long)hdr.len, sock_fd, capacity);
+          goto fail;
+        }
+        size_t want = last->iov_len + (hdr.len - capacity);
+        void *buf = realloc(last->iov_base, want);
+        if (buf == NULL) goto fail;
+        last->iov_base = buf;
+        last->iov_len = want;
+        capacity = hdr.len;
+      }
+      chunk = hdr.len;
+      if (chunk > SEQPACKET_FRAGMENT) chunk = SEQPACKET_FRAGMENT;
+    } else if (seq_received != seq) {
+      error_("packet %u received on socket %d, expected %u", seq_received, sock_fd, seq);
+      goto fail;
+    }
+    if ((size_t)rc != chunk) {
+      error_("packet %u of %zd bytes on socket %d, expected %zu", seq, rc, sock_fd, chunk);
+      goto fail;
+    }
+    offset += chunk;
+  }
+  if ((uint32_t)*nfds != hdr.nfds) {
+    error_("%d fds received on socket %d, expected %u", *nfds, sock_fd, hdr.nfds);
+    goto fail;
+  }
+  *method = hdr.method;
+  return hdr.len;
+
+fail:
+  {
+    int saved_errno = errno;
+    for (int ii = 0; ii < *nfds; ii++) close(fds[ii]);
+    *nfds = 0;
+    errno = saved_errno;
+  }
+  return -1;
+}
+
+enum {
+  DRIVER_SLOT_EMPTY = 0,  /* No driver */
+  DRIVER_SLOT_IDLE,       /* Driver available for checkout */
+  DRIVER_SLOT_BUSY,       /* Driver checked out (or being started) */
+  DRIVER_SLOT_TRANSIENT   /* Unpooled one-shot driver */
+};
+
+static long EnvNumber(const char *name, long dflt) {
+  const char *value = getenv(name);
+  return value ? atol(value) : dflt;
+}
+
+static int SlotClaim(struct DriverPoolSlot *slot, int from) {
+  return __atomic_compare_exchange_n(&slot->state, &from, DRIVER_SLOT_BUSY, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void SlotSet(struct DriverPoolSlot *slot, int state) {
+  __atomic_store_n(&slot->state, state, __ATOMIC_RELEASE);
+}
+
+/* Sleep until pool->released moves on from seen */
+static void PoolWait(struct DriverPool *pool, int seen) {
+  __atomic_add_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->released, __ATOMIC_SEQ_CST) == seen) {
+    syscall(SYS_futex, &pool->released, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+  }
+  __atomic_sub_fetch(&pool->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Return a pooled slot in the given state and wake a caller waiting for one */
+static void PoolPut(struct DriverPool *pool, struct DriverPoolSlot *slot, int state) {
+  SlotSet(slot, state);
+  __atomic_add_fetch(&pool->released, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->waiters, __ATOMIC_SEQ_CST) > 0) {
+    syscall(SYS_futex, &pool->released, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/* Peak resident set size of a driver process, in kB (-1 if unknown) */
+static long DriverHighWaterKb(pid_t pid) {
+  char filename[64];
+  char line[128];
+  long kb = -1;
+  sprintf(filename, "/proc/%d/status", pid);
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) return -1;
+  while (fgets(line, sizeof(line), f)) {
+    if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+void DriverPoolInit(struct DriverPool *pool,
+                    void *(*create)(pid_t *pid), void (*destroy)(void *conn)) {
+  memset(pool, 0, sizeof(*pool));
+  pool->create = create;
+  pool->destroy = destroy;
+  pool->owner = getpid();
+  pool->size = EnvNumber("RPC_POOL_SIZE", sysconf(_SC_NPROCESSORS_ONLN));
+  if (pool->size < 0) pool->size = 0;
+  if (pool->size > DRIVER_POOL_MAX_SIZE) pool->size = DRIVER_POOL_MAX_SIZE;
+  pool->max_calls = EnvNumber("RPC_POOL_MAX_CALLS", 0);
+  pool->max_hwm_kb = EnvNumber("RPC_POOL_MAX_HWM_KB", 0);
+  verbose_("DriverPoolInit(pool=%p) size=%d max_calls=%u max_hwm_kb=%ld",
+           pool, pool->size, pool->max_calls, pool->max_hwm_kb);
+}
+
+static struct DriverPoolSlot *TransientSlot(struct DriverPool *pool) {
+  struct DriverPoolSlot *slot = calloc(1, sizeof(*slot));
+  if (slot == NULL) return NULL;
+  slot->state = DRIVER_SLOT_TRANSIENT;
+  slot->conn = pool->create(&slot->pid);
+  if (slot->conn == NULL) {
+    free(slot);
+    return NULL;
+  }
+  return slot;
+}
+
+static struct DriverPoolSlot *PoolAcquire(struct DriverPool *pool, int wait) {
+  int ii;
+  pid_t owner = pool->owner;
+  pid_t self = getpid();
+  if (owner != self &&
+      __atomic_compare_exchange_n(&pool->owner, &owner, self, 0,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    /* Forked since the drivers were started: they belong to the parent, so
+       close our copies of their connections but leave the processes be. */
+    log_("DriverPoolAcquire(pool=%p) in forked child, dropping parent drivers", pool);
+    t_disowning = 1;
+    for (ii = 0; ii < DRIVER_POOL_MAX_SIZE; ii++) {
+      void *conn = pool->slots[ii].conn;
+      if (conn != NULL) {
+        if (pool->disown) pool->disown(conn);
+        else pool->destroy(conn);
+      }
+      pool->slots[ii].conn = NULL;
+      pool->slots[ii].pid = 0;
+      pool->slots[ii].calls = 0;
+      SlotSet(&pool->slots[ii], DRIVER_SLOT_EMPTY);
+    }
+    t_disowning = 0;
+    pool->waiters = 0;
+  }
+
+  if (pool->size == 0) {
+    return TransientSlot(pool);
+  }
+
+  while (1) {
+    int seen = __atomic_load_n(&pool->released, __ATOMIC_SEQ_CST);
+    /* Prefer a warm driver... */
+    for (ii = 0; ii < pool->size; ii++) {
+      struct DriverPoolSlot *slot = &pool->slots[ii];
+      if (slot->state == DRIVER_SLOT_IDLE && SlotClaim(slot, DRIVER_SLOT_IDLE)) {
+        verbose_("DriverPoolAcquire(pool=%p) reuse [%d] pid=%d calls=%u",
+                 pool, ii, slot->pid, slot->calls);
+        return slot;
+      }
+    }
+    /* ...then start a new one if there is room... */
+    for (ii = 0; ii < pool->size; ii++) {
+      struct DriverPoolSlot *slot = &pool->slots[ii];
+      if (slot->state == DRIVER_SLOT_EMPTY && SlotClaim(slot, DRIVER_SLOT_EMPTY)) {
+        slot->calls = 0;
+        slot->conn = pool->create(&slot->pid);
+        if (slot->conn == NULL) {
+          PoolPut(pool, slot, DRIVER_SLOT_EMPTY);
+          return NULL;
+        }
+        log_("DriverPoolAcquire(pool=%p) started [%d] pid=%d", pool, ii, slot->pid);
+        return slot;
+      }
+    }
+    /* ...otherwise wait for a driver to come back. */
+    if (!wait) {
+      return TransientSlot(pool);
+    }
+    PoolWait(pool, seen);
+  }
+}
+
+struct DriverPoolSlot *DriverPoolAcquire(struct DriverPool *pool) {
+  return PoolAcquire(pool, 1);
+}
+
+struct DriverPoolSlot *DriverPoolAcquireNoWait(struct DriverPool *pool) {
+  return PoolAcquire(pool, 0);
+}
+
+void DriverPoolRelease(struct DriverPool *pool, struct DriverPoolSlot *slot, int reusable) {
+  if (slot->state == DRIVER_SLOT_TRANSIENT) {
+    pool->destroy(slot->conn);
+    free(slot);
+    return;
+  }
+  slot->calls++;
+  if (reusable && pool->max_calls > 0 && slot->calls >= pool->max_calls) {
+    log_("recycle driver pid=%d after %u calls", slot->pid, slot->calls);
+    reusable = 0;
+  }
+  if (reusable && pool->max_hwm_kb > 0) {
+    long hwm_kb = DriverHighWaterKb(slot->pid);
+    if (hwm_kb > pool->max_hwm_kb) {
+      log_("recycle driver pid=%d with VmHWM=%ldkB", slot->pid, hwm_kb);
+      reusable = 0;
+    }
+  }
+  if (!reusable) {
+    pool->destroy(slot->conn);
+    slot->conn = NULL;
+    slot->pid = 0;
+    PoolPut(pool, slot, DRIVER_SLOT_EMPTY);
+    return;
+  }
+  PoolPut(pool, slot, DRIVER_SLOT_IDLE);
+}
+
+void DriverPoolDrain(struct DriverPool *pool) {
+  int ii;
+  if (pool->owner != getpid()) return;
+  for (ii = 0; ii < DRIVER_POOL_MAX_SIZE; ii++) {
+    struct DriverPoolSlot *slot = &pool->slots[ii];
+    if (slot->state == DRIVER_SLOT_IDLE && SlotClaim(slot, DRIVER_SLOT_IDLE)) {
+      pool->destroy(slot->conn);
+      slot->conn = NULL;
+      slot->pid = 0;
+      PoolPut(pool, slot, DRIVER_SLOT_EMPTY);
+    }
+  }
+}
+
+/* Transports */
+
+static const struct RpcTransport *g_transports[RPC_TRANSPORT_MAX];
+static int g_transport_inited[RPC_TRANSPORT_MAX];
+static int g_transport_count = 0;
+static const struct RpcTransport *g_transport = NULL;
+static int g_transport_switched = 0;  /* Handles may be on another transport */
+static pthread_mutex_t g_transport_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void RpcTransportRegister(const struct RpcTransport *transport) {
+  pthread_mutex_lock(&g_transport_lock);
+  if (g_transport_count < RPC_TRANSPORT_MAX) {
+    verbose_("RpcTransportRegister('%s')", transport->name);
+    g_transports[g_transport_count++] = transport;
+  } else {
+    error_("too many transports, dropping '%s'", transport->name);
+  }
+  pthread_mutex_unlock(&g_transport_lock);
+}
+
+static int TransportIndex(const char *name) {
+  int ii;
+  for (ii = 0; ii < g_transport_count; ii++) {
+    if (strcmp(g_transports[ii]->name, name) == 0) return ii;
+  }
+  return -1;
+}
+
+const struct RpcTransport *RpcTransportFind(const char *name) {
+  pthread_mutex_lock(&g_transport_lock);
+  int index = TransportIndex(name);
+  pthread_mutex_unlock(&g_transport_lock);
+  return (index >= 0) ? g_transports[index] : NULL;
+}
+
+/* Make transport index current; called with g_transport_lock held */
+static void TransportSelect(int index) {
+  const struct RpcTransport *transport = g_transports[index];
+  if (!g_transport_inited[index]) {
+    api_("init transport '%s'", transport->name);
+    if (transport->init) transport->init();
+    g_transport_inited[index] = 1;
+  }
+  const struct RpcTransport *old = __atomic_load_n(&g_transport, __ATOMIC_RELAXED);
+  if (old != NULL && old != transport) {
+    __atomic_store_n(&g_transport_switched, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&g_transport, transport, __ATOMIC_RELEASE);
+}
+
+int RpcTransportUse(const char *name) {
+  pthread_mutex_lock(&g_transport_lock);
+  int index = TransportIndex(name);
+  if (index >= 0) TransportSelect(index);
+  pthread_mutex_unlock(&g_transport_lock);
+  if (index < 0) {
+    error_("no transport '%s'", name);
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+const struct RpcTransport *RpcTransportCurrent(void) {
+  const struct RpcTransport *transport = __atomic_load_n(&g_transport, __ATOMIC_ACQUIRE);
+  if (transport != NULL) return transport;
+  pthread_mutex_lock(&g_transport_lock);
+  if (g_transport == NULL && g_transport_count > 0) {
+    const char *name = getenv("RPC_TRANSPORT");
+    int index = (name && *name) ? TransportIndex(name) : 0;
+    if (index < 0) {
+      error_("no transport '%s', using '%s'", name, g_transports[0]->name);
+      index = 0;
+    }
+    TransportSelect(index);
+  }
+  transport = g_transport;
+  pthread_mutex_unlock(&g_transport_lock);
+  return transport;
+}
+
+/* Handle bindings, in a small chained hash table */
+#define HANDLE_BUCKETS 256
+
+struct HandleBinding {
+  const void *handle;
+  const struct RpcTransport *transport;
+  struct HandleBinding *next;
+};
+
+static struct HandleBinding *g_handles[HANDLE_BUCKETS];
+static pthread_mutex_t g_handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct HandleBinding **HandleBucket(const void *handle) {
+  uintptr_t key = (uintptr_t)handle;
+  key ^= key >> 17;
+  key *= 0x9e3779b97f4a7c15ull;
+  return &g_handles[(key >> 24) % HANDLE_BUCKETS];
+}
+
+void RpcHandleBind(const void *handle, const struct RpcTransport *transport) {
+  pthread_mutex_lock(&g_handle_lock);
+  struct HandleBinding **bucket = HandleBucket(handle);
+  struct HandleBinding *binding;
+  for (binding = *bucket; binding; binding = binding->next) {
+    if (binding->handle == handle) break;
+  }
+  if (binding == NULL && (binding = malloc(sizeof(*binding))) != NULL) {
+    binding->handle = handle;
+    binding->next = *bucket;
+    *bucket = binding;
+  }
+  if (binding) {
+    binding->transport = transport;
+  } else {
+    error_("failed to allocate binding for handle %p", handle);
+  }
+  pthread_mutex_unlock(&g_handle_lock);
+}
+
+const struct RpcTransport *RpcHandleTransport(const void *handle) {
+  /* Until the transport changes, every handle is on the current one */
+  if (!__atomic_load_n(&g_transport_switched, __ATOMIC_ACQUIRE)) return RpcTransportCurrent();
+  const struct RpcTransport *transport = NULL;
+  pthread_mutex_lock(&g_handle_lock);
+  struct HandleBinding *binding;
+  for (binding = *HandleBucket(handle); binding; binding = binding->next) {
+    if (binding->handle == handle) {
+      transport = binding->transport;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_handle_lock);
+  return transport ? transport : RpcTransportCurrent();
+}
+
+void RpcHandleUnbind(const void *handle) {
+  pthread_mutex_lock(&g_handle_lock);
+  struct HandleBinding **link;
+  for (link = HandleBucket(handle); *link; link = &(*link)->next) {
+    if ((*link)->handle == handle) {
+      struct HandleBinding *binding = *link;
+      *link = binding->next;
+      free(binding);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&g_handle_lock);
+}
+
+/* Shared-memory rings */
+
+static size_t ShmRingSpan(uint32_t ring_size) {
+  return sizeof(struct ShmRing) + ring_size;
+}
+
+int ShmRingsCreate(uint32_t ring_size, void **base, size_t *len) {
+  if (ring_size == 0 || (ring_size & (ring_size - 1)) != 0) {
+    error_("ring size %u is not a power of two", ring_size);
+    return -1;
+  }
+  int fd = memfd_create("bz2-rings", MFD_CLOEXEC);
+  if (fd < 0) {
+    error_("memfd_create failed, errno=%d (%s)", errno, strerror(errno));
+    return -1;
+  }
+  *len = 2 * ShmRingSpan(ring_size);
+  if (ftruncate(fd, *len) < 0) {
+    error_("ftruncate(%d, %zu) failed, errno=%d (%s)", fd, *len, errno, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  *base = mmap(NULL, *len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (*base == MAP_FAILED) {
+    error_("mmap failed, errno=%d (%s)", errno, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  ((struct ShmRing *)*base)->size = ring_size;
+  ((struct ShmRing *)((unsigned char *)*base + ShmRingSpan(ring_size)))->size = ring_size;
+  verbose_("created rings memfd=%d of %zu bytes at %p", fd, *len, *base);
+  return fd;
+}
+
+void *ShmRingsMap(int fd, size_t *len, uint32_t *ring_size) {
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    error_("fstat(%d) failed, errno=%d (%s)", fd, errno, strerror(errno));
+    return NULL;
+  }
+  *len = st.st_size;
+  if (*len < sizeof(struct ShmRing)) {
+    error_("rings memfd %d has size %zu", fd, *len);
+    return NULL;
+  }
+  void *base = mmap(NULL, *len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    error_("mmap failed, errno=%d (%s)", errno, strerror(errno));
+    return NULL;
+  }
+  /* Read once: the peer can change it afterwards */
+  *ring_size = __atomic_load_n(&((struct ShmRing *)base)->size, __ATOMIC_RELAXED);
+  if (*ring_size == 0 || (*ring_size & (*ring_size - 1)) != 0 ||
+      *len != 2 * ShmRingSpan(*ring_size)) {
+    error_("rings memfd %d has size %zu, not 2x%u", fd, *len, *ring_size);
+    munmap(base, *len);
+    return NULL;
+  }
+  return base;
+}
+
+void ShmRingAttach(struct ShmRingView *ring, void *base, uint32_t ring_size, int index,
+                   int producer) {
+  ring->shared = (struct ShmRing *)((unsigned char *)base + index * ShmRingSpan(ring_size));
+  ring->data = ring->shared->data;
+  ring->size = ring_size;
+  ring->producer = producer;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/* Pick up the peer's counter, unless it would put the ring out of bounds */
+static void ShmRingSync(struct ShmRingView *ring) {
+  if (ring->producer) {
+    uint64_t tail = __atomic_load_n(&ring->shared->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - tail <= ring->size) {
+      ring->tail = tail;
+    } else {
+      error_("ring %p: bad tail %lu for head %lu", ring->shared,
+             (unsigned long)tail, (unsigned long)ring->head);
+    }
+  } else {
+    uint64_t head = __atomic_load_n(&ring->shared->head, __ATOMIC_ACQUIRE);
+    if (head - ring->tail <= ring->size) {
+      ring->head = head;
+    } else {
+      error_("ring %p: bad head %lu for tail %lu", ring->shared,
+             (unsigned long)head, (unsigned long)ring->tail);
+    }
+  }
+}
+
+size_t ShmRingUsed(struct ShmRingView *ring) {
+  ShmRingSync(ring);
+  return ring->head - ring->tail;
+}
+
+size_t ShmRingFree(struct ShmRingView *ring) {
+  return ring->size - ShmRingUsed(ring);
+}
+
+size_t ShmRingReadable(struct ShmRingView *ring, unsigned char **ptr) {
+  size_t len = ShmRingUsed(ring);
+  size_t offset = ring->tail & (ring->size - 1);
+  if (len > ring->size - offset) len = ring->size - offset;
+  *ptr = ring->data + offset;
+  return len;
+}
+
+size_t ShmRingWritable(struct ShmRingView *ring, unsigned char **ptr) {
+  size_t len = ShmRingFree(ring);
+  size_t offset = ring->head & (ring->size - 1);
+  if (len > ring->size - offset) len = ring->size - offset;
+  *ptr = ring->data + offset;
+  return len;
+}
+
+void ShmRingConsume(struct ShmRingView *ring, size_t len) {
+  ring->tail += len;
+  __atomic_store_n(&ring->shared->tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+void ShmRingProduce(struct ShmRingView *ring, size_t len) {
+  ring->head += len;
+  __atomic_store_n(&ring->shared->head, ring->head, __ATOMIC_RELEASE);
+}
+
+size_t ShmRingWrite(struct ShmRingView *ring, const void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    unsigned char *ptr;
+    size_t span = ShmRingWritable(ring, &ptr);
+    if (span == 0) break;
+    if (span > len - done) span = len - done;
+    memcpy(ptr, (const unsigned char *)buf + done, span);
+    ShmRingProduce(ring, span);
+    done += span;
+  }
+  return done;
+}
+
+size_t ShmRingRead(struct ShmRingView *ring, void *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    unsigned char *ptr;
+    size_t span = ShmRingReadable(ring, &ptr);
+    if (span == 0) break;
+    if (span > len - done) span = len - done;
+    memcpy((unsigned char *)buf + done, ptr, span);
+    ShmRingConsume(ring, span);
+    done += span;
+  }
+  return done;
+}
+
+/* Multi-tenant driver daemon */
+
+/* Most fds accepted in one request */
+#define DAEMON_MAX_FDS 1024
+/* How long a client may stall partway through sending a request */
+#define DAEMON_RECV_TIMEOUT_S 5
+
+struct DaemonJob {
+  struct DaemonConn *conn;
+  uint32_t method;
+  struct iovec buf;  /* malloc()ed request */
+  size_t len;
+  int *fds;
+  int nfds;
+  /* While the request is still arriving */
+  size_t received;
+  uint32_t seq, count;  /* Next packet expected, and packets in all */
+  uint32_t expect_fds;
+  size_t charged;  /* Bytes of buf counted in g_daemon.buffered */
+  int refused;  /* Too big for now: drain it, then reply busy */
+  struct timespec last_packet;
+  struct RpcDaemonCost cost;
+  uint64_t start;  /* Virtual start time */
+  struct DaemonJob *next;
+};
+
+struct DaemonTenant {
+  pid_t pid;
+  uid_t uid;
+  unsigned long weight;
+  uint64_t finish;  /* Virtual finish time of its last queued job */
+  int nconns;
+  int queued;  /* Jobs waiting for a worker */
+  struct DaemonJob *head, *tail;
+  struct DaemonTenant *next;
+};
+
+struct DaemonConn {
+  int fd;
+  int busy;  /* A request is queued or running, so don't read another */
+  struct DaemonJob *job;  /* Request partly received, if any */
+  struct DaemonTenant *tenant;
+  struct DaemonConn *next;
+};
+
+/* Dispatcher-owned, except where noted as under lock */
+static struct {
+  const struct RpcDaemonOps *ops;
+  int wake_fd;  /* eventfd: a connection is no longer busy */
+  long workers;
+  long max_queue;
+  long max_client_queue;
+  size_t memory_budget;
+  size_t max_request;
+  struct DaemonConn *conns;
+  unsigned char *scratch;  /* First packet of a request, or one being drained */
+  size_t buffered;  /* Request bytes held, atomic: charged before allocation */
+  /* Under lock */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  struct DaemonTenant *tenants;
+  long queued;
+  long running;
+  size_t memory_in_use;
+  uint64_t vtime;  /* Start tag of the job last dispatched */
+} g_daemon = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+/* Weight for a uid from RPC_DAEMON_WEIGHTS="uid=weight,...", default 1 */
+static unsigned long DaemonWeight(uid_t uid) {
+  const char *spec = getenv("RPC_DAEMON_WEIGHTS");
+  while (spec && *spec) {
+    char *end;
+    unsigned long id = strtoul(spec, &end, 10);
+    if (*end != '=') break;
+    unsigned long weight = strtoul(end + 1, &end, 10);
+    if (id == uid && weight > 0) return weight;
+    spec = (*end == ',') ? end + 1 : NULL;
+  }
+  return 1;
+}
+
+static int DaemonAddress(const char *path, struct sockaddr_un *addr, socklen_t *addrlen) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  size_t len = strlen(path);
+  if (len == 0 || len >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(addr->sun_path, path, len);
+  if (path[0] == '@') addr->sun_path[0] = '\0';  /* Abstract namespace */
+  *addrlen = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+  return 0;
+}
+
+int RpcDaemonConnect(const char *path) {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  if (DaemonAddress(path, &addr, &addrlen) < 0) return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (struct sockaddr *)&addr, addrlen) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+static void DaemonJobFree(struct DaemonJob *job) {
+  __atomic_sub_fetch(&g_daemon.buffered, job->charged, __ATOMIC_RELAXED);
+  for (int ii = 0; ii < job->nfds; ii++) close(job->fds[ii]);
+  free(job->fds);
+  free(job->buf.iov_base);
+  free(job);
+}
+
+/* The queued job with the earliest start tag, if it fits in the memory
+ * budget now; called under lock */
+static struct DaemonJob *DaemonPick(void) {
+  struct DaemonTenant *best = NULL;
+  struct DaemonTenant *tenant;
+  for (tenant = g_daemon.tenants; tenant; tenant = tenant->next) {
+    if (tenant->head && (best == NULL || tenant->head->start < best->head->start)) best = tenant;
+  }
+  if (best == NULL) return NULL;
+  struct DaemonJob *job = best->head;
+  /* An oversized job still runs, but only on its own */
+  if (g_daemon.running > 0 &&
+      g_daemon.memory_in_use + job->cost.memory > g_daemon.memory_budget) {
+    return NULL;
+  }
+  best->head = job->next;
+  if (best->head == NULL) best->tail = NULL;
+  best->queued--;
+  g_daemon.queued--;
+  g_daemon.running++;
+  g_daemon.memory_in_use += job->cost.memory;
+  if (job->start > g_daemon.vtime) g_daemon.vtime = job->start;
+  return job;
+}
+
+static void *DaemonWorker(void *arg) {
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&g_daemon.lock);
+    struct DaemonJob *job;
+    while ((job = DaemonPick()) == NULL) pthread_cond_wait(&g_daemon.ready, &g_daemon.lock);
+    pthread_mutex_unlock(&g_daemon.lock);
+
+    struct DaemonConn *conn = job->conn;
+    verbose_("worker runs method %u for pid %d on fd %d", job->method, conn->tenant->pid, conn->fd);
+    g_daemon.ops->handle(conn->fd, job->method, job->buf.iov_base, job->len, job->fds, job->nfds);
+
+    pthread_mutex_lock(&g_daemon.lock);
+    g_daemon.running--;
+    g_daemon.memory_in_use -= job->cost.memory;
+    conn->busy = 0;
+    pthread_cond_broadcast(&g_daemon.ready);
+    pthread_mutex_unlock(&g_daemon.lock);
+    DaemonJobFree(job);
+    uint64_t one = 1;
+    if (write(g_daemon.wake_fd, &one, sizeof(one)) < 0) {
+      error_("failed to wake dispatcher, errno=%d", errno);
+    }
+  }
+  return NULL;
+}
+
+static void DaemonAccept(int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno != EAGAIN && errno != EINTR) error_("accept failed, errno=%d (%s)", errno, strerror(errno));
+    return;
+  }
+  struct ucred cred;
+  socklen_t credlen = sizeof(cred);
+  struct DaemonConn *conn = calloc(1, sizeof(*conn));
+  if (conn == NULL || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0) {
+    error_("failed to set up connection on fd %d, errno=%d", fd, errno);
+    free(conn);
+    close(fd);
+    return;
+  }
+  /* Requests are read without blocking; replies come from the workers */
+  struct timeval timeout = { DAEMON_RECV_TIMEOUT_S, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  pthread_mutex_lock(&g_daemon.lock);
+  struct DaemonTenant *tenant;
+  for (tenant = g_daemon.tenants; tenant; tenant = tenant->next) {
+    if (tenant->pid == cred.pid) break;
+  }
+  if (tenant == NULL && (tenant = calloc(1, sizeof(*tenant))) != NULL) {
+    tenant->pid = cred.pid;
+    tenant->uid = cred.uid;
+    tenant->weight = DaemonWeight(cred.uid);
+    tenant->finish = g_daemon.vtime;
+    tenant->next = g_daemon.tenants;
+    g_daemon.tenants = tenant;
+    log_("new tenant pid=%d uid=%d weight=%lu", tenant->pid, tenant->uid, tenant->weight);
+  }
+  if (tenant) tenant->nconns++;
+  pthread_mutex_unlock(&g_daemon.lock);
+  if (tenant == NULL) {
+    error_("failed to allocate tenant for pid %d", cred.pid);
+    free(conn);
+    close(fd);
+    return;
+  }
+  conn->fd = fd;
+  conn->tenant = tenant;
+  conn->next = g_daemon.conns;
+  g_daemon.conns = conn;
+  verbose_("accepted fd %d from pid %d", fd, cred.pid);
+}
+
+static void DaemonClose(struct DaemonConn *conn) {
+  struct DaemonConn **link;
+  for (link = &g_daemon.conns; *link != conn; link = &(*link)->next)
+    ;
+  *link = conn->next;
+  verbose_("close fd %d from pid %d", conn->fd, conn->tenant->pid);
+  close(conn->fd);
+  if (conn->job) DaemonJobFree(conn->job);
+
+  /* Not busy, so nothing of this connection's is queued or running */
+  pthread_mutex_lock(&g_daemon.lock);
+  struct DaemonTenant *tenant = conn->tenant;
+  if (--tenant->nconns == 0 && tenant->queued == 0) {
+    struct DaemonTenant **tlink;
+    for (tlink = &g_daemon.tenants; *tlink != tenant; tlink = &(*tlink)->next)
+      ;
+    *tlink = tenant->next;
+    log_("tenant pid=%d gone", tenant->pid);
+    free(tenant);
+  }
+  pthread_mutex_unlock(&g_daemon.lock);
+  free(conn);
+}
+
+/* Stop buffering a request that can't be taken: the rest of it is drained,
+ * and then refused */
+static void DaemonJobRefuse(struct DaemonJob *job) {
+  __atomic_sub_fetch(&g_daemon.buffered, job->charged, __ATOMIC_RELAXED);
+  job->charged = 0;
+  free(job->buf.iov_base);
+  job->buf.iov_base = NULL;
+  job->buf.iov_len = 0;
+  job->refused = 1;
+}
+
+/* Make room for the next chunk bytes of a request, charging the memory
+ * budget before the buffer grows; refuses the request if that doesn't fit.
+ * As for running jobs, an oversized request is only taken on its own. */
+static void DaemonJobGrow(struct DaemonJob *job, size_t chunk) {
+  if (job->refused || job->received + chunk <= job->buf.iov_len) return;
+  size_t want = 2 * job->buf.iov_len;
+  if (want < job->received + chunk) want = job->received + chunk;
+  if (want > job->len) want = job->len;
+  size_t extra = want - job->buf.iov_len;
+  size_t buffered = __atomic_load_n(&g_daemon.buffered, __ATOMIC_RELAXED);
+  if (buffered > job->charged && buffered + extra > g_daemon.memory_budget) {
+    DaemonJobRefuse(job);
+    return;
+  }
+  __atomic_add_fetch(&g_daemon.buffered, extra, __ATOMIC_RELAXED);
+  job->charged += extra;
+  void *buf = realloc(job->buf.iov_base, want);
+  if (buf == NULL) {
+    error_("failed to allocate %zu byte request", want);
+    DaemonJobRefuse(job);
+    return;
+  }
+  job->buf.iov_base = buf;
+  job->buf.iov_len = want;
+}
+
+/* Start reassembling a request from its header; one that is too big is
+ * drained and refused */
+static struct DaemonJob *DaemonJobStart(struct DaemonConn *conn, const struct SeqPacketHeader *hdr) {
+  if (hdr->nfds > DAEMON_MAX_FDS) {
+    error_("request with %u fds on fd %d (max %d)", hdr->nfds, conn->fd, DAEMON_MAX_FDS);
+    return NULL;
+  }
+  struct DaemonJob *job = calloc(1, sizeof(*job));
+  if (job == NULL) {
+    error_("failed to allocate job");
+    return NULL;
+  }
+  job->conn = conn;
+  job->method = hdr->method;
+  job->len = hdr->len;
+  job->count = SeqPacketCount(hdr->len, hdr->nfds);
+  job->expect_fds = hdr->nfds;
+  if (hdr->nfds > 0 && (job->fds = malloc(hdr->nfds * sizeof(int))) == NULL) {
+    error_("failed to allocate %u fds", hdr->nfds);
+    free(job);
+    return NULL;
+  }
+
+  if (hdr->len > g_daemon.max_request) {
+    warning_("request of %lu bytes from pid %d over the %zu byte limit",
+             (unsigned long)hdr->len, conn->tenant->pid, g_daemon.max_request);
+    job->refused = 1;
+  }
+  return job;
+}
+
+/* Receive whatever packets of a request conn has ready, without blocking.
+ * Returns 1 once the request is complete, 0 if more is to come, or -1 if
+ * the connection has gone or is out of step. */
+static int DaemonRecv(struct DaemonConn *conn) {
+  while (1) {
+    struct DaemonJob *job = conn->job;
+    struct SeqPacketHeader hdr;
+    uint32_t seq_received = 0;
+    struct iovec frag[2];
+    size_t chunk;
+    if (job == NULL) {
+      frag[0].iov_base = &hdr;
+      frag[0].iov_len = sizeof(hdr);
+      frag[1].iov_base = g_daemon.scratch;
+      chunk = SEQPACKET_FRAGMENT;
+    } else {
+      frag[0].iov_base = &seq_received;
+      frag[0].iov_len = sizeof(seq_received);
+      chunk = job->len - job->received;
+      if (chunk > SEQPACKET_FRAGMENT) chunk = SEQPACKET_FRAGMENT;
+      DaemonJobGrow(job, chunk);
+      frag[1].iov_base = job->refused ? (void *)g_daemon.scratch : (char *)job->buf.iov_base + job->received;
+    }
+    frag[1].iov_len = chunk;
+
+    union {
+      struct cmsghdr align;
+      unsigned char buf[CMSG_SPACE(MAX_FDS_PER_MSG * sizeof(int))];
+    } data;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = frag;
+    msg.msg_iovlen = 2;
+    msg.msg_controllen = sizeof(data.buf);
+    msg.msg_control = data.buf;
+
+    ssize_t rc;
+    do {
+      rc = recvmsg(conn->fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+    } while (rc == -1 && errno == EINTR);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (rc <= 0) {
+      if (job) error_("end of request on fd %d, errno=%d", conn->fd, rc ? errno : 0);
+      return -1;
+    }
+    int fds[MAX_FDS_PER_MSG];
+    int nfds = 0;
+    int fds_ok = (TakeFds(&msg, fds, MAX_FDS_PER_MSG, &nfds) == 0 && !(msg.msg_flags & MSG_CTRUNC));
+    if (job == NULL && fds_ok && !(msg.msg_flags & MSG_TRUNC) && (size_t)rc >= sizeof(hdr)) {
+      job = conn->job = DaemonJobStart(conn, &hdr);
+      if (job != NULL) {
+        chunk = (hdr.len < SEQPACKET_FRAGMENT) ? hdr.len : SEQPACKET_FRAGMENT;
+        DaemonJobGrow(job, chunk);
+        if (!job->refused && (size_t)rc - sizeof(hdr) == chunk) {
+          memcpy(job->buf.iov_base, g_daemon.scratch, chunk);
+        }
+      }
+    } else if (job && seq_received != job->seq) {
+      error_("packet %u received on fd %d, expected %u", seq_received, conn->fd, job->seq);
+      job = NULL;
+    }
+    if (job == NULL || !fds_ok || (msg.msg_flags & MSG_TRUNC) ||
+        (size_t)rc != frag[0].iov_len + chunk ||
+        job->nfds + nfds > (int)job->expect_fds) {
+      if (job) error_("bad packet %u of %zd bytes on fd %d", job->seq, rc, conn->fd);
+      for (int ii = 0; ii < nfds; ii++) close(fds[ii]);
+      return -1;
+    }
+    if (nfds > 0) memcpy(job->fds + job->nfds, fds, nfds * sizeof(int));
+    job->nfds += nfds;
+    job->received += chunk;
+    job->seq++;
+    clock_gettime(CLOCK_MONOTONIC, &job->last_packet);
+    if (job->seq == job->count) {
+      if ((uint32_t)job->nfds != job->expect_fds) {
+        error_("%d fds received on fd %d, expected %u", job->nfds, conn->fd, job->expect_fds);
+        return -1;
+      }
+      return 1;
+    }
+  }
+}
+
+/* Turn a request away, without waiting on a client that isn't reading */
+static int DaemonSendBusy(struct DaemonConn *conn) {
+  struct SeqPacketHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.method = RPC_METHOD_BUSY;
+  if (send(conn->fd, &hdr, sizeof(hdr), MSG_DONTWAIT|MSG_NOSIGNAL) < 0) {
+    log_("failed to send busy reply on fd %d, errno=%d", conn->fd, errno);
+    return -1;
+  }
+  return 0;
+}
+
+/* Read what has arrived on an idle connection; queue a complete request,
+ * or refuse it */
+static void DaemonRead(struct DaemonConn *conn) {
+  int rc = DaemonRecv(conn);
+  if (rc < 0) {
+    log_("no request on fd %d; closing", conn->fd);
+    DaemonClose(conn);
+    return;
+  }
+  if (rc == 0) return;
+  struct DaemonJob *job = conn->job;
+  conn->job = NULL;
+  if (!job->refused) {
+    g_daemon.ops->cost(job->method, job->buf.iov_base, job->len, job->fds, job->nfds, &job->cost);
+  }
+
+  pthread_mutex_lock(&g_daemon.lock);
+  struct DaemonTenant *tenant = conn->tenant;
+  int admit = (!job->refused && g_daemon.queued < g_daemon.max_queue &&
+               tenant->queued < g_daemon.max_client_queue);
+  if (admit) {
+    uint64_t work = job->cost.work / tenant->weight;
+    job->start = (tenant->finish > g_daemon.vtime) ? tenant->finish : g_daemon.vtime;
+    tenant->finish = job->start + (work ? work : 1);
+    if (tenant->tail) {
+      tenant->tail->next = job;
+    } else {
+      tenant->head = job;
+    }
+    tenant->tail = job;
+    tenant->queued++;
+    g_daemon.queued++;
+    conn->busy = 1;
+    pthread_cond_broadcast(&g_daemon.ready);
+  }
+  long queued = g_daemon.queued;
+  int tenant_queued = tenant->queued;
+  pthread_mutex_unlock(&g_daemon.lock);
+  if (admit) return;
+
+  warning_("busy: refused method %u from pid %d (%ld queued, %d from it, %zu bytes buffered)",
+           job->method, tenant->pid, queued, tenant_queued,
+           __atomic_load_n(&g_daemon.buffered, __ATOMIC_RELAXED));
+  DaemonJobFree(job);
+  if (DaemonSendBusy(conn) < 0) DaemonClose(conn);
+}
+
+/* Drop connections that have stalled partway through a request; returns
+ * the poll timeout to use while any request is still arriving */
+static int DaemonExpire(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int timeout_ms = -1;
+  struct DaemonConn *conn = g_daemon.conns;
+  while (conn) {
+    struct DaemonConn *next = conn->next;
+    if (conn->job) {
+      if (now.tv_sec - conn->job->last_packet.tv_sec >= DAEMON_RECV_TIMEOUT_S) {
+        log_("request on fd %d stalled at packet %u/%u; closing",
+             conn->fd, conn->job->seq, conn->job->count);
+        DaemonClose(conn);
+      } else {
+        timeout_ms = 1000;
+      }
+    }
+    conn = next;
+  }
+  return timeout_ms;
+}
+
+static int DaemonListen(const char *path) {
+  struct sockaddr_un addr;
+  socklen_t addrlen;
+  if (DaemonAddress(path, &addr, &addrlen) < 0) return -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+  if (fd < 0) return -1;
+  if (path[0] != '@') unlink(path);  /* Left over from a previous daemon */
+  if (bind(fd, (struct sockaddr *)&addr, addrlen) < 0 || listen(fd, SOMAXCONN) < 0) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
+
+int RpcDaemonRun(const char *path, const struct RpcDaemonOps *ops) {
+  g_trace_side = "driver";
+  signal(SIGPIPE, SIG_IGN);  /* A client may go before its output is done */
+  g_daemon.ops = ops;
+  g_daemon.workers = EnvNumber("RPC_DAEMON_WORKERS", sysconf(_SC_NPROCESSORS_ONLN));
+  if (g_daemon.workers < 1) g_daemon.workers = 1;
+  g_daemon.max_queue = EnvNumber("RPC_DAEMON_QUEUE", 4 * g_daemon.workers);
+  g_daemon.max_client_queue = EnvNumber("RPC_DAEMON_CLIENT_QUEUE", g_daemon.workers);
+  g_daemon.memory_budget = (size_t)EnvNumber("RPC_DAEMON_MEMORY_MB", 8 * g_daemon.workers) << 20;
+  g_daemon.max_request = (size_t)EnvNumber("RPC_DAEMON_MAX_REQUEST_MB", 64) << 20;
+  g_daemon.scratch = malloc(SEQPACKET_FRAGMENT);
+  if (g_daemon.scratch == NULL) {
+    error_("failed to allocate receive buffer");
+    return -1;
+  }
+
+  int listen_fd = DaemonListen(path);
+  if (listen_fd < 0) {
+    error_("failed to listen on '%s', errno=%d (%s)", path, errno, strerror(errno));
+    return -1;
+  }
+  g_daemon.wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+  if (g_daemon.wake_fd < 0) {
+    error_("eventfd failed, errno=%d (%s)", errno, strerror(errno));
+    close(listen_fd);
+    return -1;
+  }
+  for (long ii = 0; ii < g_daemon.workers; ii++) {
+    pthread_t thread;
+    int rc = pthread_create(&thread, NULL, DaemonWorker, NULL);
+    if (rc != 0) fatal_("failed to start worker %ld, error %d", ii, rc);
+    pthread_detach(thread);
+  }
+  api_("daemon on '%s': %ld workers, queue %ld (%ld per client), memory %zu MB, requests to %zu MB",
+       path, g_daemon.workers, g_daemon.max_queue, g_daemon.max_client_queue,
+       g_daemon.memory_budget >> 20, g_daemon.max_request >> 20);
+
+  struct pollfd *pfds = NULL;
+  struct DaemonConn **polled = NULL;
+  size_t capacity = 0;
+  int timeout_ms = -1;
+  while (1) {
+    size_t count = 2;
+    struct DaemonConn *conn;
+    pthread_mutex_lock(&g_daemon.lock);
+    for (conn = g_daemon.conns; conn; conn = conn->next) count++;
+    if (count > capacity) {
+      capacity = 2 * count;
+      pfds = realloc(pfds, capacity * sizeof(*pfds));
+      polled = realloc(polled, capacity * sizeof(*polled));
+      if (pfds == NULL || polled == NULL) fatal_("failed to allocate %zu pollfds", capacity);
+    }
+    pfds[0].fd = listen_fd;
+    pfds[1].fd = g_daemon.wake_fd;
+    count = 2;
+    for (conn = g_daemon.conns; conn; conn = conn->next) {
+      if (conn->busy) continue;
+      polled[count] = conn;
+      pfds[count++].fd = conn->fd;
+    }
+    pthread_mutex_unlock(&g_daemon.lock);
+    for (size_t ii = 0; ii < count; ii++) {
+      pfds[ii].events = POLLIN;
+      pfds[ii].revents = 0;
+    }
+
+    if (poll(pfds, count, timeout_ms) < 0) {
+      if (errno == EINTR) continue;
+      error_("poll failed, errno=%d (%s)", errno, strerror(errno));
+      break;
+    }
+    if (pfds[1].revents & POLLIN) {
+      uint64_t value;
+      if (read(g_daemon.wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        error_("failed to read wake eventfd, errno=%d", errno);
+      }
+    }
+    for (size_t ii = 2; ii < count; ii++) {
+      if (pfds[ii].revents) DaemonRead(polled[ii]);
+    }
+    if (pfds[0].revents & POLLIN) DaemonAccept(listen_fd);
+    timeout_ms = DaemonExpire();
+  }
+  free(pfds);
+  free(polled);
+  close(listen_fd);
+  return -1;
+}
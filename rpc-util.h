@@ -7,7 +7,10 @@
 
 /* Logging & other utilities */
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 extern int _rpc_verbose;
 extern int _rpc_indent;
@@ -20,19 +23,282 @@ void _log_at(int level, const char *filename, int lineno, const char *format, ..
 void CrashHandler(int sig);
 int OpenDriver(const char* filename);
 void RunDriver(int xfd, const char *filename, int sock_fd);
+/* Start a driver serving sock_fd: fork+fexecve, or a fork of the driver's
+ * zygote if RPC_ZYGOTE=1.  Returns the driver's pid, or -1. */
+pid_t SpawnDriver(int xfd, const char *filename, int sock_fd);
+/* In a driver: the socket connected to the stub (may run the zygote loop) */
+int DriverSocket(void);
 void TerminateChild(pid_t child);
+/* In a driver: exit as soon as the stub closes its end of sock_fd */
+void ExitOnHangup(int sock_fd);
 int GetTransferredFd(int sock_fd, int nonce);
 int TransferFd(int sock_fd, int fd);
+/* The next message of fds (at most max), whatever its nonce; returns the
+ * count, or -1 */
+int RecvTransferredFds(int sock_fd, int *fds, int max, int *nonce);
+/* An extra fd for a newly-started driver, sent before any calls */
+int GetBootstrapFd(int sock_fd);
+int SendBootstrapFd(int sock_fd, int fd);
+/* Most fds sent in one message; SCM_MAX_FD in the kernel is 253 */
+#define MAX_FDS_PER_MSG 250
+/* Multiple fds in as few sendmsg() calls as possible, under a single nonce */
+int GetTransferredFds(int sock_fd, int nonce, int count, int *fds);
+int TransferFds(int sock_fd, int count, const int *fds);
+
+/* Whole messages over a SOCK_SEQPACKET socket, each tagged with a method ID
+ * and carrying any number of bytes and fds.  A message that won't fit in one
+ * packet goes as several, of at most SEQPACKET_FRAGMENT bytes and
+ * MAX_FDS_PER_MSG fds each.  Data is gathered straight from iov on send and
+ * scattered straight into it on receive. */
+#define SEQPACKET_FRAGMENT (128 * 1024)
+#define SEQPACKET_MAX_IOV 16
+/* Returns 0, or -1 with errno set */
+int SeqPacketSend(int sock_fd, uint32_t method, const struct iovec *iov, int niov,
+                  const int *fds, int nfds);
+/* Receive a message into the buffers of iov (iov_len giving their capacity)
+ * and up to maxfds fds.  If grow is set, iov[niov-1] is a malloc()ed buffer
+ * (or NULL) that is enlarged as needed; it is left for the caller to free.
+ * Returns the bytes received, or -1 (with errno 0 at end of file). */
+ssize_t SeqPacketRecv(int sock_fd, uint32_t *method, struct iovec *iov, int niov, int grow,
+                      int *fds, int maxfds, int *nfds);
+
+/* Time spent in each phase of remoted calls, summed over the process, for
+ * benchmarking.  Nothing is recorded until RpcStatsEnable() is called, and
+ * then RPC_PHASE_EXEC also makes SpawnDriver() wait for the driver's exec. */
+enum RpcPhase {
+  RPC_PHASE_FORK,       /* fork() of a new driver (or zygote request) */
+  RPC_PHASE_EXEC,       /* fork() return to fexecve() done */
+  RPC_PHASE_BOOTSTRAP,  /* driver started to connection usable */
+  RPC_PHASE_FD_PASS,    /* TransferFd()/TransferFds() */
+  RPC_PHASE_MARSHAL,    /* building the request */
+  RPC_PHASE_CALL,       /* request sent to reply received */
+  RPC_PHASE_UNMARSHAL,  /* decoding the reply */
+  RPC_PHASE_TEARDOWN,   /* TerminateChild() */
+  RPC_PHASE_COUNT
+};
+
+struct RpcPhaseTotal {
+  uint64_t count;
+  uint64_t ns;
+};
+
+void RpcStatsEnable(void);
+const char *RpcPhaseName(int phase);
+/* Monotonic time in ns, or 0 if neither stats nor tracing are on */
+uint64_t RpcNow(void);
+/* Account the time since start to phase; returns the time now (as RpcNow) */
+uint64_t RpcPhaseAdd(int phase, uint64_t start);
+void RpcStatsGet(struct RpcPhaseTotal totals[RPC_PHASE_COUNT]);
+
+/* Per-call tracing, on when RPC_TRACE=1 (which drivers inherit) or after
+ * RpcTraceEnable().  Each call between RpcTraceBegin() and RpcTraceEnd() on a
+ * thread is recorded, with its phases, into a lock-free ring of the latest
+ * RPC_TRACE_RING_SIZE calls and into a latency histogram for its method.
+ * RpcTraceDump() writes the per-method percentiles and recent calls; it is
+ * run at exit if RPC_TRACE_DUMP is set (a file to append to, or "-" for
+ * stderr), and on SIGUSR2 unless the application handles that itself. */
+#define RPC_TRACE_RING_SIZE 4096
+#define RPC_TRACE_MAX_METHODS 32
+#define RPC_TRACE_NAME_LEN 40
+
+struct RpcTraceRecord {
+  uint64_t seq;  /* Even once written */
+  uint64_t start_ns;
+  uint64_t total_ns;
+  uint64_t phase_ns[RPC_PHASE_COUNT];
+  uint64_t request_bytes;
+  uint64_t reply_bytes;
+  int32_t result;
+  int32_t method;  /* For RpcTraceMethodName() */
+};
+
+void RpcTraceEnable(void);
+int RpcTracing(void);
+void RpcTraceBegin(const char *method);
+void RpcTraceResult(int result);
+void RpcTraceEnd(uint64_t request_bytes, uint64_t reply_bytes);
+/* Copy out up to max of the most recent records, oldest first */
+int RpcTraceRead(struct RpcTraceRecord *records, int max);
+const char *RpcTraceMethodName(int method);
+/* Latency in ns at quantile q (1.0 for the max) of a method's calls */
+uint64_t RpcTraceQuantile(int method, double q, uint64_t *count);
+void RpcTraceDump(int fd);
+
+/* Pool of long-lived driver connections, shared by all threads of a client.
+ * Checkout and return are lock-free (a CAS on the slot state); a caller that
+ * finds every slot busy sleeps on a futex until a return bumps the pool's
+ * release count.  A driver is recycled after max_calls calls or once its peak
+ * RSS exceeds max_hwm_kb.  Limits come from RPC_POOL_SIZE, RPC_POOL_MAX_CALLS
+ * and RPC_POOL_MAX_HWM_KB; a pool size of 0 gives a fresh driver for every
+ * call. */
+#define DRIVER_POOL_MAX_SIZE 64
+
+struct DriverPoolSlot {
+  int state;          /* DRIVER_SLOT_* value, only changed atomically */
+  void *conn;         /* Transport-specific connection object */
+  pid_t pid;          /* Driver process behind conn */
+  unsigned int calls; /* Calls made over conn so far */
+};
+
+struct DriverPool {
+  /* Start a new driver and return a connection to it (NULL on failure) */
+  void *(*create)(pid_t *pid);
+  /* Close the connection and terminate its driver */
+  void (*destroy)(void *conn);
+  /* Optional: close a forked child's copy of a connection, leaving the
+     driver to the parent.  Without it the child calls destroy, which then
+     skips terminating the driver. */
+  void (*disown)(void *conn);
+  pid_t owner;  /* Process that started the pooled drivers */
+  int size;  /* Upper bound on pooled drivers */
+  unsigned int max_calls;  /* 0 => unlimited */
+  long max_hwm_kb;  /* 0 => unlimited */
+  int released;  /* Futex word: bumped by every return of a pooled slot */
+  int waiters;   /* Callers asleep on released */
+  struct DriverPoolSlot slots[DRIVER_POOL_MAX_SIZE];
+};
+
+void DriverPoolInit(struct DriverPool *pool,
+                    void *(*create)(pid_t *pid), void (*destroy)(void *conn));
+struct DriverPoolSlot *DriverPoolAcquire(struct DriverPool *pool);
+/* As DriverPoolAcquire, but use a one-shot driver rather than wait for one */
+struct DriverPoolSlot *DriverPoolAcquireNoWait(struct DriverPool *pool);
+void DriverPoolRelease(struct DriverPool *pool, struct DriverPoolSlot *slot, int reusable);
+void DriverPoolDrain(struct DriverPool *pool);
+
+/* Choice of remoting mechanism at run time, for a client library holding
+ * several of them (libbz2-remote.a).  Each transport registers a table that
+ * starts with a struct RpcTransport.  The current one is whichever
+ * RpcTransportUse() last picked, else the one named by RPC_TRANSPORT, else
+ * the first registered; its init runs, once, when it is first picked. */
+#define RPC_TRANSPORT_MAX 8
+
+struct RpcTransport {
+  const char *name;
+  void (*init)(void);  /* May be NULL */
+};
+
+void RpcTransportRegister(const struct RpcTransport *transport);
+const struct RpcTransport *RpcTransportFind(const char *name);
+/* Returns 0, or -1 with errno ENOENT if no transport has that name */
+int RpcTransportUse(const char *name);
+/* Never NULL once a transport is registered */
+const struct RpcTransport *RpcTransportCurrent(void);
+
+/* Handles (a bz_stream, a BZFILE, ...) stay with the transport that created
+ * them, however the current one changes before they are finished with. */
+void RpcHandleBind(const void *handle, const struct RpcTransport *transport);
+/* The transport handle is bound to, or the current one if none */
+const struct RpcTransport *RpcHandleTransport(const void *handle);
+void RpcHandleUnbind(const void *handle);
+
+/* Marks a stub's setup function: run before main() when the stub is the
+ * whole library, or as its transport's init when built with RPC_TRANSPORT. */
+#ifdef RPC_TRANSPORT
+#define RPC_STUB_INIT
+#else
+#define RPC_STUB_INIT __attribute__((constructor))
+#endif
+
+/* Pair of single-producer single-consumer byte rings in a memfd mapping
+ * shared between stub and driver.  Counters only ever increase; each side
+ * writes just one of them, so no locking is needed. */
+struct ShmRing {
+  uint64_t head;  /* Bytes produced so far (written by producer) */
+  uint64_t tail;  /* Bytes consumed so far (written by consumer) */
+  uint32_t size;  /* Capacity in bytes, a power of two */
+  char pad[64 - 2*sizeof(uint64_t) - sizeof(uint32_t)];
+  unsigned char data[];
+};
+
+/* One side's handle on a ring.  The peer can write the whole mapping, so the
+ * size, the data pointer and this side's own counter are kept here, and the
+ * peer's counter is only taken when it leaves 0 <= head - tail <= size. */
+struct ShmRingView {
+  struct ShmRing *shared;
+  unsigned char *data;
+  uint32_t size;
+  int producer;  /* This side writes head (else tail) */
+  uint64_t head;
+  uint64_t tail;
+};
+
+/* Create a memfd holding two rings of ring_size bytes each, mapped at
+ * *base; returns the memfd (or -1). */
+int ShmRingsCreate(uint32_t ring_size, void **base, size_t *len);
+/* Map rings created by ShmRingsCreate() from the memfd; NULL on failure. */
+void *ShmRingsMap(int fd, size_t *len, uint32_t *ring_size);
+/* Set up a view of ring index (0 or 1) of a fresh mapping */
+void ShmRingAttach(struct ShmRingView *ring, void *base, uint32_t ring_size, int index,
+                   int producer);
+/* Contiguous span that can be read/written right now */
+size_t ShmRingReadable(struct ShmRingView *ring, unsigned char **ptr);
+size_t ShmRingWritable(struct ShmRingView *ring, unsigned char **ptr);
+void ShmRingConsume(struct ShmRingView *ring, size_t len);
+void ShmRingProduce(struct ShmRingView *ring, size_t len);
+/* Total bytes available to read / space available to write */
+size_t ShmRingUsed(struct ShmRingView *ring);
+size_t ShmRingFree(struct ShmRingView *ring);
+/* Copy into / out of the ring; return the number of bytes copied */
+size_t ShmRingWrite(struct ShmRingView *ring, const void *buf, size_t len);
+size_t ShmRingRead(struct ShmRingView *ring, void *buf, size_t len);
+
+/* Multi-tenant driver daemon: one long-lived driver process listening on a
+ * local SOCK_SEQPACKET socket (a path, or "@name" for the abstract
+ * namespace), serving requests from any number of unrelated clients.  Each
+ * request is read with its fds, as from a spawned driver's socket, and queued
+ * for a fixed pool of worker threads (RPC_DAEMON_WORKERS, default: number of
+ * CPUs).  Clients are tenants, keyed by peer pid and weighted by uid
+ * (RPC_DAEMON_WEIGHTS="uid=weight,..."); the next job to run is picked by
+ * start-time fair queueing on its estimated work.  A request is refused with
+ * a RPC_METHOD_BUSY reply when RPC_DAEMON_QUEUE requests are already queued
+ * (default 4 per worker), or RPC_DAEMON_CLIENT_QUEUE from the same tenant
+ * (default 1 per worker); a queued job only starts while the memory estimates
+ * of running jobs fit in RPC_DAEMON_MEMORY_MB (default 8 per worker).
+ * Requests are reassembled without blocking, their buffers charged against
+ * the same budget as they grow; one over RPC_DAEMON_MAX_REQUEST_MB (default
+ * 64), or that doesn't fit beside the others held, is refused once drained. */
+#define RPC_METHOD_BUSY 0xffffffffu
+
+struct RpcDaemonCost {
+  size_t memory;  /* Peak bytes the call is expected to need */
+  uint64_t work;  /* Relative amount of work, e.g. input bytes */
+};
+
+struct RpcDaemonOps {
+  /* Run a request and send its reply; returns as a raw driver handler */
+  ssize_t (*handle)(int sock_fd, uint32_t method, const char *data, size_t len,
+                    const int *fds, int nfds);
+  /* Estimate what a request will cost before it is queued */
+  void (*cost)(uint32_t method, const char *data, size_t len,
+               const int *fds, int nfds, struct RpcDaemonCost *cost);
+};
+
+/* Serve requests on path until a fatal error; returns -1 with errno set */
+int RpcDaemonRun(const char *path, const struct RpcDaemonOps *ops);
+/* Connect to a daemon; returns the socket, or -1 with errno set */
+int RpcDaemonConnect(const char *path);
 
 #ifdef __cplusplus
 }
 #endif
 
-#define verbose_(...) _log_at(0, __FILE__, __LINE__, __VA_ARGS__)
-#define log_(...)     _log_at(1, __FILE__, __LINE__, __VA_ARGS__)
-#define api_(...)     _log_at(2, __FILE__, __LINE__, __VA_ARGS__)
-#define warning_(...) _log_at(3, __FILE__, __LINE__, __VA_ARGS__)
-#define error_(...)   _log_at(4, __FILE__, __LINE__, __VA_ARGS__)
+/* Messages below RPC_LOG_MIN_LEVEL are compiled out (e.g. -DRPC_LOG_MIN_LEVEL=3
+ * drops verbose_/log_/api_), and the rest cost a compare when not shown. */
+#ifndef RPC_LOG_MIN_LEVEL
+#define RPC_LOG_MIN_LEVEL 0
+#endif
+#define _rpc_log(level, ...)                                         \
+  do {                                                               \
+    if ((level) >= RPC_LOG_MIN_LEVEL && (level) >= _rpc_verbose)     \
+      _log_at((level), __FILE__, __LINE__, __VA_ARGS__);             \
+  } while (0)
+
+#define verbose_(...) _rpc_log(0, __VA_ARGS__)
+#define log_(...)     _rpc_log(1, __VA_ARGS__)
+#define api_(...)     _rpc_log(2, __VA_ARGS__)
+#define warning_(...) _rpc_log(3, __VA_ARGS__)
+#define error_(...)   _rpc_log(4, __VA_ARGS__)
 #define fatal_(...)   _log_at(10,__FILE__, __LINE__, __VA_ARGS__)
 
 #endif
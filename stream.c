@@ -177,6 +177,30 @@ int BZ_API(BZ2_bzCompressStream)( int        ifd,
    return BZ_OK;
 }
 
+/*---------------------------------------------------*/
+int BZ_API(BZ2_bzCompressStreams)( int        nstreams,
+                                   const int* ifds,
+                                   const int* ofds,
+                                   int*       results,
+                                   int        blockSize100k,
+                                   int        verbosity,
+                                   int        workFactor )
+{
+   Int32 i, ret;
+
+   if (nstreams < 0) return BZ_PARAM_ERROR;
+   if (nstreams > 0 && (ifds == NULL || ofds == NULL || results == NULL))
+      return BZ_PARAM_ERROR;
+
+   ret = BZ_OK;
+   for (i = 0; i < nstreams; i++) {
+      results[i] = BZ2_bzCompressStream ( ifds[i], ofds[i], blockSize100k,
+                                          verbosity, workFactor );
+      if (results[i] != BZ_OK && ret == BZ_OK) ret = results[i];
+   }
+   return ret;
+}
+
 /*---------------------------------------------------*/
 int BZ_API(BZ2_bzDecompressStream)( int        ifd,
                                     int        ofd,
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Copyright 2016 Google Inc. All Rights Reserved.
+#
+# Use of this source code is governed by the bzip2
+# license that can be found in the LICENSE file.
+BZIP=$1
+set -e
+# Over two 100k blocks, so --parallel splits it into separate streams
+cat sample1.ref sample2.ref sample3.ref > parallel.tmp
+rm -f parallel.tmp.bz2
+BZ2_SHARDS=4 $BZIP -1 --parallel -k parallel.tmp
+$BZIP -1 < parallel.tmp > parallel.rb2
+if cmp -s parallel.tmp.bz2 parallel.rb2; then
+  echo "$BZIP --parallel wrote a single stream"; exit 1
+fi
+$BZIP -d < parallel.tmp.bz2 > parallel.tst
+cmp parallel.tst parallel.tmp
+./bzip2 -d < parallel.tmp.bz2 > parallel.tst
+cmp parallel.tst parallel.tmp
+rm -f parallel.tmp parallel.tmp.bz2 parallel.rb2 parallel.tst
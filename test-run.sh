@@ -17,3 +17,13 @@ $BZIP -d  < sample2.bz2 > sample2.tst
 cmp sample2.tst sample2.ref
 $BZIP -ds < sample3.bz2 > sample3.tst
 cmp sample3.tst sample3.ref
+# Several files named on one command line go to the library as one batch
+for n in 1 2 3; do
+  rm -f batch$n-a batch$n-b batch$n-c batch$n-?.bz2
+  cp sample$n.ref batch$n-a; cp sample$n.ref batch$n-b; cp sample$n.ref batch$n-c
+  $BZIP -$n batch$n-a batch$n-b batch$n-c
+  cmp sample$n.bz2 batch$n-a.bz2
+  cmp sample$n.bz2 batch$n-b.bz2
+  cmp sample$n.bz2 batch$n-c.bz2
+  rm -f batch$n-?.bz2
+done
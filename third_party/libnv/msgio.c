@@ -32,9 +32,11 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -115,9 +117,10 @@ fd_wait(int fd, bool doread)
 	    NULL, NULL);
 }
 
-static int
+static ssize_t
 msg_recv(int sock, struct msghdr *msg)
 {
+	ssize_t done;
 	int flags;
 
 	PJDLOG_ASSERT(sock >= 0);
@@ -129,16 +132,20 @@ msg_recv(int sock, struct msghdr *msg)
 #endif
 
 	for (;;) {
-		fd_wait(sock, true);
-		if (recvmsg(sock, msg, flags) == -1) {
+		done = recvmsg(sock, msg, flags);
+		if (done == -1) {
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_wait(sock, true);
+				continue;
+			}
 			return (-1);
 		}
 		break;
 	}
 
-	return (0);
+	return (done);
 }
 
 static int
@@ -148,10 +155,13 @@ msg_send(int sock, const struct msghdr *msg)
 	PJDLOG_ASSERT(sock >= 0);
 
 	for (;;) {
-		fd_wait(sock, false);
-		if (sendmsg(sock, msg, 0) == -1) {
+		if (sendmsg(sock, msg, MSG_NOSIGNAL) == -1) {
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_wait(sock, false);
+				continue;
+			}
 			return (-1);
 		}
 		break;
@@ -471,11 +481,14 @@ buf_send(int sock, void *buf, size_t size)
 
 	ptr = buf;
 	do {
-		fd_wait(sock, false);
-		done = send(sock, ptr, size, 0);
+		done = send(sock, ptr, size, MSG_NOSIGNAL);
 		if (done == -1) {
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_wait(sock, false);
+				continue;
+			}
 			return (-1);
 		} else if (done == 0) {
 			errno = ENOTCONN;
@@ -499,11 +512,14 @@ buf_recv(int sock, void *buf, size_t size)
 
 	ptr = buf;
 	while (size > 0) {
-		fd_wait(sock, true);
-		done = recv(sock, ptr, size, 0);
+		done = recv(sock, ptr, size, MSG_WAITALL);
 		if (done == -1) {
 			if (errno == EINTR)
 				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_wait(sock, true);
+				continue;
+			}
 			return (-1);
 		} else if (done == 0) {
 			errno = ENOTCONN;
@@ -515,3 +531,144 @@ buf_recv(int sock, void *buf, size_t size)
 
 	return (0);
 }
+
+/*
+ * Send all of iov (which is updated as it goes) with one sendmsg() where the
+ * socket takes it, the descriptors riding along with the first byte.
+ */
+int
+buf_sendv(int sock, struct iovec *iov, int iovcnt, const int *fds,
+    size_t nfds)
+{
+	unsigned char control[CMSG_SPACE(sizeof(int) * MSGIO_MAX_FDS)];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t done;
+	size_t i;
+
+	PJDLOG_ASSERT(sock >= 0);
+	PJDLOG_ASSERT(iovcnt > 0);
+	PJDLOG_ASSERT(nfds <= MSGIO_MAX_FDS);
+
+	bzero(&msg, sizeof(msg));
+	if (nfds > 0) {
+		for (i = 0; i < nfds; i++) {
+			if (!fd_is_valid(fds[i])) {
+				errno = EBADF;
+				return (-1);
+			}
+		}
+		bzero(control, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		bcopy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+	}
+
+	while (iovcnt > 0) {
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (iovcnt < IOV_MAX) ? iovcnt : IOV_MAX;
+		done = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (done == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				fd_wait(sock, false);
+				continue;
+			}
+			return (-1);
+		}
+		/* The descriptors have gone. */
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+		while (iovcnt > 0 && (size_t)done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (unsigned char *)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Receive exactly size bytes, and up to *nfdsp descriptors sent with them;
+ * *nfdsp is set to the number received.  Usually one recvmsg() call.
+ */
+int
+buf_recvfds(int sock, void *buf, size_t size, int *fds, size_t *nfdsp)
+{
+	unsigned char control[CMSG_SPACE(sizeof(int) * MSGIO_MAX_FDS)];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	size_t i, n, nfds, maxfds;
+	ssize_t done;
+	int fd, serrno;
+	bool lost;
+
+	PJDLOG_ASSERT(sock >= 0);
+	PJDLOG_ASSERT(buf != NULL);
+
+	maxfds = *nfdsp;
+	nfds = 0;
+	lost = false;
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	while (iov.iov_len > 0) {
+		bzero(&msg, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		done = msg_recv(sock, &msg);
+		if (done == -1)
+			goto fail;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET ||
+			    cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (i = 0; i < n; i++) {
+				bcopy(CMSG_DATA(cmsg) + i * sizeof(int), &fd,
+				    sizeof(fd));
+#ifndef MSG_CMSG_CLOEXEC
+				(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+#endif
+				if (nfds < maxfds) {
+					fds[nfds++] = fd;
+				} else {
+					close(fd);
+					lost = true;
+				}
+			}
+		}
+		if (lost || (msg.msg_flags & MSG_CTRUNC) != 0) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (done == 0) {
+			errno = ENOTCONN;
+			goto fail;
+		}
+		iov.iov_base = (unsigned char *)iov.iov_base + done;
+		iov.iov_len -= done;
+	}
+
+	*nfdsp = nfds;
+	return (0);
+fail:
+	serrno = errno;
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	errno = serrno;
+	return (-1);
+}
@@ -39,6 +39,9 @@
 struct iovec;
 struct msghdr;
 
+/* Most descriptors one message can carry (Linux's SCM_MAX_FD). */
+#define	MSGIO_MAX_FDS	253
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -52,6 +55,10 @@ int fd_recv(int sock, int *fds, size_t nfds);
 int buf_send(int sock, void *buf, size_t size);
 int buf_recv(int sock, void *buf, size_t size);
 
+int buf_sendv(int sock, struct iovec *iov, int iovcnt, const int *fds,
+    size_t nfds);
+int buf_recvfds(int sock, void *buf, size_t size, int *fds, size_t *nfdsp);
+
 #ifdef __cplusplus
 }
 #endif
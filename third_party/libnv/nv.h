@@ -50,6 +50,13 @@ struct nvlist;
 typedef struct nvlist nvlist_t;
 #endif
 
+#ifndef	_NV_ARENA_T_DECLARED
+#define	_NV_ARENA_T_DECLARED
+struct nv_arena;
+
+typedef struct nv_arena nv_arena_t;
+#endif
+
 #define	NV_NAME_MAX	2048
 
 #define	NV_TYPE_NONE			0
@@ -87,6 +94,19 @@ bool		 nvlist_empty(const nvlist_t *nvl);
 int		 nvlist_flags(const nvlist_t *nvl);
 void		 nvlist_set_error(nvlist_t *nvl, int error);
 
+/*
+ * Arenas.  While a thread has one in use, everything libnv allocates for it
+ * comes from the arena, by bumping a pointer, and all of it is returned at
+ * once by nv_arena_reset().  nvlists built or received in an arena must be
+ * destroyed, with the arena in use, before it is reset; values taken or
+ * packed from them belong to the arena.
+ */
+nv_arena_t	*nv_arena_create(size_t size);
+void		 nv_arena_destroy(nv_arena_t *arena);
+void		 nv_arena_reset(nv_arena_t *arena);
+/* Returns the arena previously in use (NULL for the heap). */
+nv_arena_t	*nv_arena_use(nv_arena_t *arena);
+
 nvlist_t *nvlist_clone(const nvlist_t *nvl);
 
 void nvlist_dump(const nvlist_t *nvl, int fd);
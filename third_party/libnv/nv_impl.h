@@ -49,12 +49,21 @@ typedef struct nvpair nvpair_t;
 #define	NV_FLAG_BIG_ENDIAN		0x080
 #define	NV_FLAG_IN_ARRAY		0x100
 
-#define	nv_malloc(size)			malloc((size))
-#define	nv_calloc(n, size)		calloc((n), (size))
-#define	nv_realloc(buf, size)		realloc((buf), (size))
-#define	nv_free(buf)			free((buf))
-#define	nv_strdup(buf)			strdup((buf))
-#define	nv_vasprintf(ptr, ...)		vasprintf(ptr, __VA_ARGS__)
+/* Allocation from the thread's arena, if it has one in use, else the heap. */
+void	*nv_arena_malloc(size_t size);
+void	*nv_arena_calloc(size_t n, size_t size);
+void	*nv_arena_realloc(void *buf, size_t size);
+void	 nv_arena_free(void *buf);
+char	*nv_arena_strdup(const char *str);
+int	 nv_arena_vasprintf(char **ptr, const char *fmt, va_list ap);
+bool	 nv_arena_owns(const nv_arena_t *arena, const void *buf);
+
+#define	nv_malloc(size)			nv_arena_malloc((size))
+#define	nv_calloc(n, size)		nv_arena_calloc((n), (size))
+#define	nv_realloc(buf, size)		nv_arena_realloc((buf), (size))
+#define	nv_free(buf)			nv_arena_free((buf))
+#define	nv_strdup(buf)			nv_arena_strdup((buf))
+#define	nv_vasprintf(ptr, ...)		nv_arena_vasprintf(ptr, __VA_ARGS__)
 
 #define	ERRNO_SET(var)			do { errno = (var); } while (0)
 #define	ERRNO_SAVE()			do {				\
@@ -96,6 +105,9 @@ const char *nvpair_name(const nvpair_t *nvp);
 
 nvpair_t *nvpair_clone(const nvpair_t *nvp);
 
+/* Whether freeing nvp releases anything besides memory from arena. */
+bool nvpair_arena_release(const nvpair_t *nvp, const nv_arena_t *arena);
+
 nvpair_t *nvpair_create_null(const char *name);
 nvpair_t *nvpair_create_bool(const char *name, bool value);
 nvpair_t *nvpair_create_number(const char *name, uint64_t value);
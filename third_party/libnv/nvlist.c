@@ -34,8 +34,11 @@
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -82,6 +85,11 @@ struct nvlist {
 	nvpair_t	*nvl_parent;
 	nvpair_t	*nvl_array_next;
 	struct nvl_head	nvl_head;
+	nv_arena_t	*nvl_arena;	/* Arena the nvlist came from, or NULL */
+	bool		nvl_release;	/* Holds more than arena memory */
+	size_t		nvl_npairs;
+	nvpair_t	**nvl_index;	/* Pairs hashed by name, or NULL */
+	size_t		nvl_index_mask;
 };
 
 #define	NVLIST_ASSERT(nvl)	do {					\
@@ -91,6 +99,11 @@ struct nvlist {
 
 #define	NVPAIR_ASSERT(nvp)	nvpair_assert(nvp)
 
+/* Binary values at least this big are sent without being copied. */
+#define	NVLIST_IOV_MIN		4096
+/* nvlist_recv()'s buffer is kept for the next message up to this size. */
+#define	NVLIST_RECVBUF_KEEP	(1024 * 1024)
+
 #define	NVLIST_HEADER_MAGIC	0x6c
 #define	NVLIST_HEADER_VERSION	0x00
 struct nvlist_header {
@@ -101,6 +114,406 @@ struct nvlist_header {
 	uint64_t	nvlh_size;
 } __packed;
 
+/*
+ * Arenas.  Memory comes from a list of chunks, newest first; each allocation
+ * is preceded by its size (for nv_realloc()).  nv_free() of arena memory does
+ * nothing, and nv_arena_reset() makes the arena a single chunk big enough for
+ * everything allocated since the last reset, so that a steady stream of
+ * similar messages settles on one chunk and no other allocator calls.
+ *
+ * An nvlist remembers its arena, and destroying it only has to walk its pairs
+ * if some of them hold descriptors, or memory from elsewhere (e.g. a malloc()ed
+ * buffer given to nvlist_move_binary()); otherwise it is O(1).
+ */
+#define	NV_ARENA_ALIGN		16
+#define	NV_ARENA_DEFAULT_SIZE	(64 * 1024)
+/* Don't keep a chunk bigger than this across a reset. */
+#define	NV_ARENA_KEEP_MAX	(4 * 1024 * 1024)
+
+struct nv_arena_chunk {
+	struct nv_arena_chunk	*nac_next;
+	size_t			 nac_size;
+	size_t			 nac_used;
+	unsigned char		 nac_data[] __attribute__((aligned(NV_ARENA_ALIGN)));
+};
+
+struct nv_arena {
+	struct nv_arena_chunk	*na_chunk;
+	size_t			 na_size;	/* Initial chunk size */
+	size_t			 na_used;	/* Bytes allocated since reset */
+};
+
+static __thread nv_arena_t *nv_arena_current;
+
+static struct nv_arena_chunk *
+nv_arena_chunk_alloc(size_t size)
+{
+	struct nv_arena_chunk *chunk;
+
+	chunk = malloc(sizeof(*chunk) + size);
+	if (chunk == NULL)
+		return (NULL);
+	chunk->nac_next = NULL;
+	chunk->nac_size = size;
+	chunk->nac_used = 0;
+	return (chunk);
+}
+
+nv_arena_t *
+nv_arena_create(size_t size)
+{
+	nv_arena_t *arena;
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return (NULL);
+	arena->na_size = (size > 0) ? roundup(size, NV_ARENA_ALIGN) :
+	    NV_ARENA_DEFAULT_SIZE;
+	arena->na_used = 0;
+	arena->na_chunk = nv_arena_chunk_alloc(arena->na_size);
+	if (arena->na_chunk == NULL) {
+		free(arena);
+		return (NULL);
+	}
+	return (arena);
+}
+
+static void
+nv_arena_free_chunks(nv_arena_t *arena)
+{
+	struct nv_arena_chunk *chunk;
+
+	while ((chunk = arena->na_chunk) != NULL) {
+		arena->na_chunk = chunk->nac_next;
+		free(chunk);
+	}
+}
+
+void
+nv_arena_destroy(nv_arena_t *arena)
+{
+
+	if (arena == NULL)
+		return;
+	if (nv_arena_current == arena)
+		nv_arena_current = NULL;
+	nv_arena_free_chunks(arena);
+	free(arena);
+}
+
+void
+nv_arena_reset(nv_arena_t *arena)
+{
+	size_t size;
+
+	if (arena->na_chunk != NULL && arena->na_chunk->nac_next == NULL &&
+	    arena->na_chunk->nac_size <= NV_ARENA_KEEP_MAX) {
+		arena->na_chunk->nac_used = 0;
+		arena->na_used = 0;
+		return;
+	}
+	size = arena->na_used;
+	if (size < arena->na_size || size > NV_ARENA_KEEP_MAX)
+		size = arena->na_size;
+	nv_arena_free_chunks(arena);
+	/* If this fails, the next allocation tries again. */
+	arena->na_chunk = nv_arena_chunk_alloc(size);
+	arena->na_used = 0;
+}
+
+nv_arena_t *
+nv_arena_use(nv_arena_t *arena)
+{
+	nv_arena_t *prev;
+
+	prev = nv_arena_current;
+	nv_arena_current = arena;
+	return (prev);
+}
+
+bool
+nv_arena_owns(const nv_arena_t *arena, const void *buf)
+{
+	const struct nv_arena_chunk *chunk;
+	const unsigned char *ptr;
+
+	if (arena == NULL)
+		return (false);
+	ptr = buf;
+	for (chunk = arena->na_chunk; chunk != NULL; chunk = chunk->nac_next) {
+		if (ptr >= chunk->nac_data && ptr < chunk->nac_data + chunk->nac_used)
+			return (true);
+	}
+	return (false);
+}
+
+static void *
+nv_arena_alloc(nv_arena_t *arena, size_t size)
+{
+	struct nv_arena_chunk *chunk;
+	unsigned char *ptr;
+	size_t need;
+
+	need = NV_ARENA_ALIGN + roundup(size, NV_ARENA_ALIGN);
+	if (need < size) {
+		ERRNO_SET(ENOMEM);
+		return (NULL);
+	}
+	chunk = arena->na_chunk;
+	if (chunk == NULL || chunk->nac_size - chunk->nac_used < need) {
+		chunk = nv_arena_chunk_alloc(MAX(need,
+		    chunk != NULL ? 2 * chunk->nac_size : arena->na_size));
+		if (chunk == NULL)
+			return (NULL);
+		chunk->nac_next = arena->na_chunk;
+		arena->na_chunk = chunk;
+	}
+	ptr = chunk->nac_data + chunk->nac_used;
+	chunk->nac_used += need;
+	arena->na_used += need;
+	*(size_t *)ptr = size;
+	return (ptr + NV_ARENA_ALIGN);
+}
+
+void *
+nv_arena_malloc(size_t size)
+{
+
+	if (nv_arena_current == NULL)
+		return (malloc(size));
+	return (nv_arena_alloc(nv_arena_current, size));
+}
+
+void *
+nv_arena_calloc(size_t n, size_t size)
+{
+	void *buf;
+
+	if (nv_arena_current == NULL)
+		return (calloc(n, size));
+	if (size != 0 && n > SIZE_MAX / size) {
+		ERRNO_SET(ENOMEM);
+		return (NULL);
+	}
+	buf = nv_arena_alloc(nv_arena_current, n * size);
+	if (buf != NULL)
+		memset(buf, 0, n * size);
+	return (buf);
+}
+
+void *
+nv_arena_realloc(void *buf, size_t size)
+{
+	struct nv_arena_chunk *chunk;
+	unsigned char *ptr;
+	size_t oldsize, need;
+	void *newbuf;
+
+	if (buf == NULL)
+		return (nv_arena_malloc(size));
+	if (!nv_arena_owns(nv_arena_current, buf))
+		return (realloc(buf, size));
+	ptr = (unsigned char *)buf - NV_ARENA_ALIGN;
+	oldsize = *(size_t *)ptr;
+	if (size <= oldsize)
+		return (buf);
+	/* The latest allocation can grow in place. */
+	chunk = nv_arena_current->na_chunk;
+	need = NV_ARENA_ALIGN + roundup(size, NV_ARENA_ALIGN);
+	if (ptr + NV_ARENA_ALIGN + roundup(oldsize, NV_ARENA_ALIGN) ==
+	    chunk->nac_data + chunk->nac_used && need >= size &&
+	    (size_t)(ptr - chunk->nac_data) + need <= chunk->nac_size) {
+		chunk->nac_used = (ptr - chunk->nac_data) + need;
+		nv_arena_current->na_used += roundup(size, NV_ARENA_ALIGN) -
+		    roundup(oldsize, NV_ARENA_ALIGN);
+		*(size_t *)ptr = size;
+		return (buf);
+	}
+	newbuf = nv_arena_alloc(nv_arena_current, size);
+	if (newbuf != NULL)
+		memcpy(newbuf, buf, oldsize);
+	return (newbuf);
+}
+
+void
+nv_arena_free(void *buf)
+{
+
+	if (buf != NULL && !nv_arena_owns(nv_arena_current, buf))
+		free(buf);
+}
+
+char *
+nv_arena_strdup(const char *str)
+{
+	size_t len;
+	char *copy;
+
+	if (nv_arena_current == NULL)
+		return (strdup(str));
+	len = strlen(str) + 1;
+	copy = nv_arena_alloc(nv_arena_current, len);
+	if (copy != NULL)
+		memcpy(copy, str, len);
+	return (copy);
+}
+
+int
+nv_arena_vasprintf(char **ptr, const char *fmt, va_list ap)
+{
+	va_list ap2;
+	int len;
+
+	if (nv_arena_current == NULL)
+		return (vasprintf(ptr, fmt, ap));
+	va_copy(ap2, ap);
+	len = vsnprintf(NULL, 0, fmt, ap2);
+	va_end(ap2);
+	if (len < 0)
+		return (-1);
+	*ptr = nv_arena_alloc(nv_arena_current, (size_t)len + 1);
+	if (*ptr == NULL)
+		return (-1);
+	vsnprintf(*ptr, (size_t)len + 1, fmt, ap);
+	return (len);
+}
+
+bool
+nvlist_arena_release(const nvlist_t *nvl, const nv_arena_t *arena)
+{
+
+	NVLIST_ASSERT(nvl);
+
+	return (nvl->nvl_arena != arena || nvl->nvl_release);
+}
+
+/*
+ * After nvp is added to nvl: note if destroying nvl (and so each nvlist it
+ * is nested in) now needs to walk its pairs.
+ */
+static void
+nvlist_arena_note(nvlist_t *nvl, const nvpair_t *nvp)
+{
+
+	if (nvl->nvl_arena == NULL || nvl->nvl_release ||
+	    !nvpair_arena_release(nvp, nvl->nvl_arena))
+		return;
+	while (nvl != NULL && !nvl->nvl_release) {
+		nvl->nvl_release = true;
+		nvl = (nvl->nvl_parent != NULL) ?
+		    nvpair_nvlist(nvl->nvl_parent) : NULL;
+	}
+}
+
+/*
+ * Name index.  Once a unique-name nvlist has NVLIST_INDEX_MIN pairs, the first
+ * nvlist_find() builds an open-addressed (linear probing) table of its pairs,
+ * kept at most half full; adding a pair updates it, or drops it when it is too
+ * full, and removing one drops it.  As building it changes the nvlist, a
+ * lookup is not a read-only operation, any more than before.
+ *
+ * The table comes from wherever the nvlist's memory does, and is only built
+ * while that is the allocator in use.
+ */
+#define	NVLIST_INDEX_MIN	8
+
+static size_t
+nvlist_index_hash(const nvlist_t *nvl, const char *name)
+{
+	const unsigned char *ptr;
+	size_t hash;
+
+	/* FNV-1a */
+	hash = 2166136261u;
+	ptr = (const unsigned char *)name;
+	if ((nvl->nvl_flags & NV_FLAG_IGNORE_CASE) != 0) {
+		for (; *ptr != '\0'; ptr++)
+			hash = (hash ^ tolower(*ptr)) * 16777619u;
+	} else {
+		for (; *ptr != '\0'; ptr++)
+			hash = (hash ^ *ptr) * 16777619u;
+	}
+	return (hash);
+}
+
+static void
+nvlist_index_add(nvlist_t *nvl, nvpair_t *nvp)
+{
+	size_t slot;
+
+	slot = nvlist_index_hash(nvl, nvpair_name(nvp)) & nvl->nvl_index_mask;
+	while (nvl->nvl_index[slot] != NULL)
+		slot = (slot + 1) & nvl->nvl_index_mask;
+	nvl->nvl_index[slot] = nvp;
+}
+
+static void
+nvlist_index_drop(nvlist_t *nvl)
+{
+
+	if (nvl->nvl_index == NULL)
+		return;
+	if (nvl->nvl_arena == NULL)
+		nv_free(nvl->nvl_index);
+	nvl->nvl_index = NULL;
+	nvl->nvl_index_mask = 0;
+}
+
+static void
+nvlist_index_build(nvlist_t *nvl)
+{
+	nvpair_t *nvp;
+	size_t size;
+
+	if ((nvl->nvl_flags & NV_FLAG_NO_UNIQUE) != 0 ||
+	    nvl->nvl_arena != nv_arena_current)
+		return;
+	for (size = 16; size < 2 * nvl->nvl_npairs; size *= 2)
+		;
+	nvl->nvl_index = nv_calloc(size, sizeof(nvl->nvl_index[0]));
+	if (nvl->nvl_index == NULL)
+		return;
+	nvl->nvl_index_mask = size - 1;
+	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
+	    nvp = nvlist_next_nvpair(nvl, nvp)) {
+		nvlist_index_add(nvl, nvp);
+	}
+}
+
+/* After nvp is added to nvl. */
+static void
+nvlist_index_insert(nvlist_t *nvl, nvpair_t *nvp)
+{
+
+	nvl->nvl_npairs++;
+	if (nvl->nvl_index == NULL)
+		return;
+	if (2 * nvl->nvl_npairs > nvl->nvl_index_mask + 1)
+		nvlist_index_drop(nvl);
+	else
+		nvlist_index_add(nvl, nvp);
+}
+
+static nvpair_t *
+nvlist_index_find(const nvlist_t *nvl, const char *name)
+{
+	nvpair_t *nvp;
+	size_t slot;
+
+	slot = nvlist_index_hash(nvl, name) & nvl->nvl_index_mask;
+	while ((nvp = nvl->nvl_index[slot]) != NULL) {
+		if ((nvl->nvl_flags & NV_FLAG_IGNORE_CASE) != 0) {
+			if (strcasecmp(nvpair_name(nvp), name) == 0)
+				break;
+		} else {
+			if (strcmp(nvpair_name(nvp), name) == 0)
+				break;
+		}
+		slot = (slot + 1) & nvl->nvl_index_mask;
+	}
+	return (nvp);
+}
+
 nvlist_t *
 nvlist_create(int flags)
 {
@@ -116,6 +529,11 @@ nvlist_create(int flags)
 	nvl->nvl_parent = NULL;
 	nvl->nvl_array_next = NULL;
 	TAILQ_INIT(&nvl->nvl_head);
+	nvl->nvl_arena = nv_arena_current;
+	nvl->nvl_release = false;
+	nvl->nvl_npairs = 0;
+	nvl->nvl_index = NULL;
+	nvl->nvl_index_mask = 0;
 	nvl->nvl_magic = NVLIST_MAGIC;
 
 	return (nvl);
@@ -129,10 +547,16 @@ nvlist_destroy(nvlist_t *nvl)
 	if (nvl == NULL)
 		return;
 
-	ERRNO_SAVE();
-
 	NVLIST_ASSERT(nvl);
 
+	if (nvl->nvl_arena != NULL && !nvl->nvl_release) {
+		/* All of it goes back when the arena is reset. */
+		nvl->nvl_magic = 0;
+		return;
+	}
+
+	ERRNO_SAVE();
+
 	while ((nvp = nvlist_first_nvpair(nvl)) != NULL) {
 		nvlist_remove_nvpair(nvl, nvp);
 		nvpair_free(nvp);
@@ -308,6 +732,19 @@ nvlist_find(const nvlist_t *nvl, int type, const char *name)
 	PJDLOG_ASSERT(type == NV_TYPE_NONE ||
 	    (type >= NV_TYPE_FIRST && type <= NV_TYPE_LAST));
 
+	if (nvl->nvl_index == NULL && nvl->nvl_npairs >= NVLIST_INDEX_MIN)
+		nvlist_index_build(__DECONST(nvlist_t *, nvl));
+	if (nvl->nvl_index != NULL) {
+		/* Names are unique, so this is the only candidate. */
+		nvp = nvlist_index_find(nvl, name);
+		if (nvp != NULL && type != NV_TYPE_NONE &&
+		    nvpair_type(nvp) != type)
+			nvp = NULL;
+		if (nvp == NULL)
+			ERRNO_SET(ENOENT);
+		return (nvp);
+	}
+
 	for (nvp = nvlist_first_nvpair(nvl); nvp != NULL;
 	    nvp = nvlist_next_nvpair(nvl, nvp)) {
 		if (type != NV_TYPE_NONE && nvpair_type(nvp) != type)
@@ -601,8 +1038,13 @@ nvlist_fdump(const nvlist_t *nvl, FILE *fp)
 /*
  * The function obtains size of the nvlist after nvlist_pack().
  */
-size_t
-nvlist_size(const nvlist_t *nvl)
+/*
+ * Packed size of nvl.  If extp is not NULL, binary values of NVLIST_IOV_MIN
+ * bytes or more are also counted there, and in *nextp, since nvlist_send()
+ * sends them from where they are rather than packing them.
+ */
+static size_t
+nvlist_xsize(const nvlist_t *nvl, size_t *extp, size_t *nextp)
 {
 	const nvlist_t *tmpnvl;
 	const nvlist_t * const *nvlarray;
@@ -655,6 +1097,11 @@ nvlist_size(const nvlist_t *nvl)
 
 		} else {
 			size += nvpair_size(nvp);
+			if (extp != NULL && nvpair_type(nvp) == NV_TYPE_BINARY &&
+			    nvpair_size(nvp) >= NVLIST_IOV_MIN) {
+				*extp += nvpair_size(nvp);
+				(*nextp)++;
+			}
 		}
 
 		while ((nvp = nvlist_next_nvpair(nvl, nvp)) == NULL) {
@@ -678,6 +1125,13 @@ out:
 	return (size);
 }
 
+size_t
+nvlist_size(const nvlist_t *nvl)
+{
+
+	return (nvlist_xsize(nvl, NULL, NULL));
+}
+
 static int *
 nvlist_xdescriptors(const nvlist_t *nvl, int *descs)
 {
@@ -827,11 +1281,52 @@ nvlist_pack_header(const nvlist_t *nvl, unsigned char *ptr, size_t *leftp)
 	return (ptr);
 }
 
+/*
+ * Where nvlist_xpack() puts a packed nvlist that is to be sent: the packed
+ * buffer, except for large binary values, which the iovec takes from the
+ * nvpairs themselves.
+ */
+struct nvlist_iov {
+	struct iovec	*ni_iov;
+	int		 ni_cnt;
+	unsigned char	*ni_mark;	/* Start of the buffer not yet in ni_iov */
+};
+
+static unsigned char *
+nvlist_iov_binary(struct nvlist_iov *iovp, const nvpair_t *nvp,
+    unsigned char *ptr, size_t *leftp)
+{
+	const void *data;
+	size_t size;
+
+	data = nvpair_get_binary(nvp, &size);
+	PJDLOG_ASSERT(*leftp >= size);
+	if (ptr > iovp->ni_mark) {
+		iovp->ni_iov[iovp->ni_cnt].iov_base = iovp->ni_mark;
+		iovp->ni_iov[iovp->ni_cnt].iov_len = ptr - iovp->ni_mark;
+		iovp->ni_cnt++;
+	}
+	iovp->ni_iov[iovp->ni_cnt].iov_base = (void *)(uintptr_t)data;
+	iovp->ni_iov[iovp->ni_cnt].iov_len = size;
+	iovp->ni_cnt++;
+	iovp->ni_mark = ptr;
+	/* The value takes no room in the buffer, but counts in the sizes. */
+	*leftp -= size;
+
+	return (ptr);
+}
+
+/*
+ * Pack nvl.  If iovp is not NULL, the result is described by iovp->ni_iov
+ * (which is allocated here) rather than by the returned buffer alone, and
+ * *sizep is the total size.
+ */
 static void *
-nvlist_xpack(const nvlist_t *nvl, int64_t *fdidxp, size_t *sizep)
+nvlist_xpack(const nvlist_t *nvl, int64_t *fdidxp, size_t *sizep,
+    struct nvlist_iov *iovp)
 {
 	unsigned char *buf, *ptr;
-	size_t left, size;
+	size_t left, size, ext, next;
 	const nvlist_t *tmpnvl;
 	nvpair_t *nvp, *tmpnvp;
 	void *cookie;
@@ -843,10 +1338,20 @@ nvlist_xpack(const nvlist_t *nvl, int64_t *fdidxp, size_t *sizep)
 		return (NULL);
 	}
 
-	size = nvlist_size(nvl);
-	buf = nv_malloc(size);
+	ext = next = 0;
+	size = nvlist_xsize(nvl, iovp != NULL ? &ext : NULL, &next);
+	buf = nv_malloc(size - ext);
 	if (buf == NULL)
 		return (NULL);
+	if (iovp != NULL) {
+		iovp->ni_iov = nv_malloc((2 * next + 1) * sizeof(struct iovec));
+		if (iovp->ni_iov == NULL) {
+			nv_free(buf);
+			return (NULL);
+		}
+		iovp->ni_cnt = 0;
+		iovp->ni_mark = buf;
+	}
 
 	ptr = buf;
 	left = size;
@@ -895,6 +1400,11 @@ nvlist_xpack(const nvlist_t *nvl, int64_t *fdidxp, size_t *sizep)
 			    &left);
 			break;
 		case NV_TYPE_BINARY:
+			if (iovp != NULL &&
+			    nvpair_size(nvp) >= NVLIST_IOV_MIN) {
+				ptr = nvlist_iov_binary(iovp, nvp, ptr, &left);
+				break;
+			}
 			ptr = nvpair_pack_binary(nvp, ptr, &left);
 			break;
 		case NV_TYPE_BOOL_ARRAY:
@@ -973,10 +1483,20 @@ nvlist_xpack(const nvlist_t *nvl, int64_t *fdidxp, size_t *sizep)
 	}
 
 out:
+	if (iovp != NULL && ptr != NULL) {
+		PJDLOG_ASSERT((size_t)(ptr - buf) == size - ext);
+		if (ptr > iovp->ni_mark) {
+			iovp->ni_iov[iovp->ni_cnt].iov_base = iovp->ni_mark;
+			iovp->ni_iov[iovp->ni_cnt].iov_len = ptr - iovp->ni_mark;
+			iovp->ni_cnt++;
+		}
+	}
 	if (sizep != NULL)
 		*sizep = size;
 	return (buf);
 fail:
+	if (iovp != NULL)
+		nv_free(iovp->ni_iov);
 	nv_free(buf);
 	return (NULL);
 }
@@ -997,7 +1517,7 @@ nvlist_pack(const nvlist_t *nvl, size_t *sizep)
 		return (NULL);
 	}
 
-	return (nvlist_xpack(nvl, NULL, sizep));
+	return (nvlist_xpack(nvl, NULL, sizep, NULL));
 }
 
 static bool
@@ -1203,7 +1723,8 @@ nvlist_unpack(const void *buf, size_t size, int flags)
 int
 nvlist_send(int sock, const nvlist_t *nvl)
 {
-	size_t datasize, nfds;
+	struct nvlist_iov iov;
+	size_t datasize, nfds, nfirst;
 	int *fds;
 	void *data;
 	int64_t fdidx;
@@ -1219,18 +1740,22 @@ nvlist_send(int sock, const nvlist_t *nvl)
 		return (-1);
 
 	ret = -1;
-	data = NULL;
 	fdidx = 0;
 
-	data = nvlist_xpack(nvl, &fdidx, &datasize);
+	data = nvlist_xpack(nvl, &fdidx, &datasize, &iov);
 	if (data == NULL)
 		goto out;
 
-	if (buf_send(sock, data, datasize) == -1)
+	/*
+	 * Header, data and descriptors go in one sendmsg(), unless there are
+	 * more descriptors than one message can carry; the rest follow the
+	 * data, as nvlist_recv() expects.
+	 */
+	nfirst = MIN(nfds, MSGIO_MAX_FDS);
+	if (buf_sendv(sock, iov.ni_iov, iov.ni_cnt, fds, nfirst) == -1)
 		goto out;
-
-	if (nfds > 0) {
-		if (fd_send(sock, fds, nfds) == -1)
+	if (nfds > nfirst) {
+		if (fd_send(sock, fds + nfirst, nfds - nfirst) == -1)
 			goto out;
 	}
 
@@ -1238,62 +1763,124 @@ nvlist_send(int sock, const nvlist_t *nvl)
 out:
 	ERRNO_SAVE();
 	nv_free(fds);
+	if (data != NULL)
+		nv_free(iov.ni_iov);
 	nv_free(data);
 	ERRNO_RESTORE();
 	return (ret);
 }
 
+/*
+ * Each thread keeps the buffer that nvlist_recv() reads into, unless it grew
+ * very large; it is freed when the thread exits.
+ */
+static pthread_key_t nvlist_recvbuf_key;
+static pthread_once_t nvlist_recvbuf_once = PTHREAD_ONCE_INIT;
+static __thread unsigned char *nvlist_recvbuf;
+static __thread size_t nvlist_recvbuf_size;
+
+static void
+nvlist_recvbuf_key_create(void)
+{
+
+	(void)pthread_key_create(&nvlist_recvbuf_key, free);
+}
+
+static unsigned char *
+nvlist_recvbuf_get(size_t size)
+{
+	unsigned char *buf;
+
+	if (size <= nvlist_recvbuf_size)
+		return (nvlist_recvbuf);
+	/* Not nv_realloc(): the buffer outlives any arena. */
+	buf = realloc(nvlist_recvbuf, size);
+	if (buf == NULL)
+		return (NULL);
+	(void)pthread_once(&nvlist_recvbuf_once, nvlist_recvbuf_key_create);
+	(void)pthread_setspecific(nvlist_recvbuf_key, buf);
+	nvlist_recvbuf = buf;
+	nvlist_recvbuf_size = size;
+	return (buf);
+}
+
+static void
+nvlist_recvbuf_put(void)
+{
+
+	if (nvlist_recvbuf_size > NVLIST_RECVBUF_KEEP) {
+		(void)pthread_setspecific(nvlist_recvbuf_key, NULL);
+		free(nvlist_recvbuf);
+		nvlist_recvbuf = NULL;
+		nvlist_recvbuf_size = 0;
+	}
+}
+
 nvlist_t *
 nvlist_recv(int sock, int flags)
 {
 	struct nvlist_header nvlhdr;
 	nvlist_t *nvl, *ret;
 	unsigned char *buf;
-	size_t nfds, size, i;
+	size_t nfds, nrecv, size, i;
+	int hdrfds[MSGIO_MAX_FDS];
 	int *fds;
 
-	if (buf_recv(sock, &nvlhdr, sizeof(nvlhdr)) == -1)
+	/* The descriptors (or the first MSGIO_MAX_FDS) come with the header. */
+	nrecv = MSGIO_MAX_FDS;
+	if (buf_recvfds(sock, &nvlhdr, sizeof(nvlhdr), hdrfds, &nrecv) == -1)
 		return (NULL);
 
-	if (!nvlist_check_header(&nvlhdr))
-		return (NULL);
+	ret = NULL;
+	fds = NULL;
+	buf = NULL;
 
+	if (!nvlist_check_header(&nvlhdr))
+		goto fail;
 	nfds = (size_t)nvlhdr.nvlh_descriptors;
+	if (nrecv > nfds) {
+		ERRNO_SET(EINVAL);
+		goto fail;
+	}
 	size = sizeof(nvlhdr) + (size_t)nvlhdr.nvlh_size;
 
-	buf = nv_malloc(size);
+	buf = nvlist_recvbuf_get(size);
 	if (buf == NULL)
-		return (NULL);
-
+		goto fail;
 	memcpy(buf, &nvlhdr, sizeof(nvlhdr));
 
-	ret = NULL;
-	fds = NULL;
-
-	if (buf_recv(sock, buf + sizeof(nvlhdr), size - sizeof(nvlhdr)) == -1)
-		goto out;
-
 	if (nfds > 0) {
 		fds = nv_malloc(nfds * sizeof(fds[0]));
 		if (fds == NULL)
-			goto out;
-		if (fd_recv(sock, fds, nfds) == -1)
-			goto out;
+			goto fail;
+		memcpy(fds, hdrfds, nrecv * sizeof(fds[0]));
 	}
 
-	nvl = nvlist_xunpack(buf, size, fds, nfds, flags);
-	if (nvl == NULL) {
-		ERRNO_SAVE();
-		for (i = 0; i < nfds; i++)
-			close(fds[i]);
-		ERRNO_RESTORE();
-		goto out;
+	if (size > sizeof(nvlhdr) &&
+	    buf_recv(sock, buf + sizeof(nvlhdr), size - sizeof(nvlhdr)) == -1)
+		goto fail;
+
+	if (nfds > nrecv) {
+		if (fd_recv(sock, fds + nrecv, nfds - nrecv) == -1)
+			goto fail;
+		nrecv = nfds;
 	}
 
+	nvl = nvlist_xunpack(buf, size, fds, nfds, flags);
+	if (nvl == NULL)
+		goto fail;
+
 	ret = nvl;
+	goto out;
+fail:
+	ERRNO_SAVE();
+	for (i = 0; i < nrecv; i++)
+		close(fds != NULL ? fds[i] : hdrfds[i]);
+	ERRNO_RESTORE();
 out:
 	ERRNO_SAVE();
-	nv_free(buf);
+	if (buf != NULL)
+		nvlist_recvbuf_put();
 	nv_free(fds);
 	ERRNO_RESTORE();
 
@@ -1429,6 +2016,8 @@ nvlist_add_nvpair(nvlist_t *nvl, const nvpair_t *nvp)
 	}
 
 	nvpair_insert(&nvl->nvl_head, newnvp, nvl);
+	nvlist_index_insert(nvl, newnvp);
+	nvlist_arena_note(nvl, newnvp);
 }
 
 void
@@ -1580,6 +2169,8 @@ nvlist_move_nvpair(nvlist_t *nvl, nvpair_t *nvp)
 	}
 
 	nvpair_insert(&nvl->nvl_head, nvp, nvl);
+	nvlist_index_insert(nvl, nvp);
+	nvlist_arena_note(nvl, nvp);
 	return (true);
 }
 
@@ -1919,6 +2510,8 @@ nvlist_remove_nvpair(nvlist_t *nvl, nvpair_t *nvp)
 	PJDLOG_ASSERT(nvpair_nvlist(nvp) == nvl);
 
 	nvpair_remove(&nvl->nvl_head, nvp, nvl);
+	nvl->nvl_npairs--;
+	nvlist_index_drop(nvl);
 }
 
 void
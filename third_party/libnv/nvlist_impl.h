@@ -38,6 +38,8 @@
 #include "nv.h"
 
 nvpair_t *nvlist_get_nvpair_parent(const nvlist_t *nvl);
+/* Whether destroying nvl releases anything besides memory from arena. */
+bool nvlist_arena_release(const nvlist_t *nvl, const nv_arena_t *arena);
 const unsigned char *nvlist_unpack_header(nvlist_t *nvl,
     const unsigned char *ptr, size_t nfds, bool *isbep, size_t *leftp);
 
@@ -206,6 +206,47 @@ nvpair_remove(struct nvl_head *head, nvpair_t *nvp, const nvlist_t *nvl)
 	nvp->nvp_list = NULL;
 }
 
+bool
+nvpair_arena_release(const nvpair_t *nvp, const nv_arena_t *arena)
+{
+	const nvlist_t * const *nvlarray;
+	const char * const *strarray;
+	size_t i;
+
+	NVPAIR_ASSERT(nvp);
+
+	if (!nv_arena_owns(arena, nvp))
+		return (true);
+	switch (nvp->nvp_type) {
+	case NV_TYPE_NULL:
+	case NV_TYPE_BOOL:
+	case NV_TYPE_NUMBER:
+		return (false);
+	case NV_TYPE_DESCRIPTOR:
+	case NV_TYPE_DESCRIPTOR_ARRAY:
+		return (true);
+	case NV_TYPE_NVLIST:
+		return (nvlist_arena_release(
+		    (const nvlist_t *)(intptr_t)nvp->nvp_data, arena));
+	case NV_TYPE_NVLIST_ARRAY:
+		nvlarray = (const nvlist_t * const *)(intptr_t)nvp->nvp_data;
+		for (i = 0; i < nvp->nvp_nitems; i++) {
+			if (nvlist_arena_release(nvlarray[i], arena))
+				return (true);
+		}
+		break;
+	case NV_TYPE_STRING_ARRAY:
+		strarray = (const char * const *)(intptr_t)nvp->nvp_data;
+		for (i = 0; i < nvp->nvp_nitems; i++) {
+			if (!nv_arena_owns(arena, strarray[i]))
+				return (true);
+		}
+		break;
+	}
+	return (nvp->nvp_data != 0 &&
+	    !nv_arena_owns(arena, (const void *)(intptr_t)nvp->nvp_data));
+}
+
 nvpair_t *
 nvpair_clone(const nvpair_t *nvp)
 {